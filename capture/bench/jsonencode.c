@@ -0,0 +1,425 @@
+/* jsonencode.c  -- Session json encoding microbenchmark
+ *
+ * Loads the session documents from the .test files in tests/pcap and encodes
+ * them over and over, once the way db.c used to with sprintf and byte at a
+ * time escaping, and once with jsonwriter.h.  Both outputs are checked to
+ * be identical before timing.
+ *
+ * Usage: bench/jsonencode [test dir] [passes]    defaults to ../tests/pcap 200
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include "moloch.h"
+#include "jsonwriter.h"
+
+unsigned char          moloch_char_to_hexstr[256][3];
+
+/******************************************************************************/
+// Each session doc is flattened into a list of ops so only encoding is timed
+enum { BENCH_OBJ, BENCH_OBJ_END, BENCH_ARR, BENCH_ARR_END, BENCH_KEY, BENCH_INT, BENCH_STR, BENCH_RAW };
+
+typedef struct {
+    uint8_t               type;
+    uint8_t               comma;
+    uint32_t              len;
+    int64_t               i;
+    char                 *str;
+} BenchOp_t;
+
+typedef struct {
+    BenchOp_t            *ops;
+    int                   num;
+    int                   size;
+} BenchDoc_t;
+
+LOCAL BenchDoc_t         *docs;
+LOCAL int                 numDocs;
+LOCAL int                 sizeDocs;
+
+/******************************************************************************/
+LOCAL BenchOp_t *bench_op(BenchDoc_t *doc, int type, int comma)
+{
+    if (doc->num == doc->size) {
+        doc->size = doc->size ? doc->size * 2 : 64;
+        doc->ops = realloc(doc->ops, doc->size * sizeof(BenchOp_t));
+    }
+    BenchOp_t *op = &doc->ops[doc->num++];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->comma = comma;
+    return op;
+}
+/******************************************************************************/
+LOCAL int bench_utf8(char *out, uint32_t c)
+{
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+/******************************************************************************/
+/* Undo json escaping, returning a nul terminated copy */
+LOCAL char *bench_unescape(const unsigned char *in, int len, uint32_t *olen)
+{
+    char *out = malloc(len + 1);
+    int   i, o = 0;
+
+    for (i = 0; i < len; i++) {
+        if (in[i] != '\\' || i + 1 >= len) {
+            out[o++] = in[i];
+            continue;
+        }
+        i++;
+        switch (in[i]) {
+        case 'b': out[o++] = '\b'; break;
+        case 'f': out[o++] = '\f'; break;
+        case 'n': out[o++] = '\n'; break;
+        case 'r': out[o++] = '\r'; break;
+        case 't': out[o++] = '\t'; break;
+        case 'u': {
+            char hex[5] = {0};
+            memcpy(hex, in + i + 1, 4);
+            uint32_t c = strtoul(hex, NULL, 16);
+            i += 4;
+            if (c >= 0xd800 && c < 0xdc00 && i + 6 < len && in[i + 1] == '\\' && in[i + 2] == 'u') {
+                memcpy(hex, in + i + 3, 4);
+                uint32_t lo = strtoul(hex, NULL, 16);
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                i += 6;
+            }
+            o += bench_utf8(out + o, c);
+            break;
+        }
+        default:
+            out[o++] = in[i];
+        }
+    }
+    out[o] = 0;
+    *olen = o;
+    return out;
+}
+/******************************************************************************/
+LOCAL void bench_parse(BenchDoc_t *doc, unsigned char *data, uint32_t len, int isObject)
+{
+    unsigned int *out = calloc(len * 2 + 2, sizeof(unsigned int));
+    int           i, n = 0;
+
+    js0n(data, len, out);
+
+    for (i = 0; out[i]; i += 2, n++) {
+        unsigned char *value = data + out[i];
+        uint32_t       vlen = out[i + 1];
+
+        if (isObject) {
+            BenchOp_t *op = bench_op(doc, BENCH_KEY, n > 0);
+            op->str = bench_unescape(value, vlen, &op->len);
+            i += 2;
+            value = data + out[i];
+            vlen = out[i + 1];
+        }
+
+        const int comma = !isObject && n > 0;
+        if (value[-1] == '"') {
+            BenchOp_t *op = bench_op(doc, BENCH_STR, comma);
+            op->str = bench_unescape(value, vlen, &op->len);
+        } else if (*value == '{' || *value == '[') {
+            bench_op(doc, *value == '{' ? BENCH_OBJ : BENCH_ARR, comma);
+            bench_parse(doc, value, vlen, *value == '{');
+            bench_op(doc, *value == '{' ? BENCH_OBJ_END : BENCH_ARR_END, 0);
+        } else if (memchr(value, '.', vlen) || memchr(value, 'e', vlen) || !(*value == '-' || isdigit(*value))) {
+            BenchOp_t *op = bench_op(doc, BENCH_RAW, comma);
+            op->str = strndup((char *)value, vlen);
+            op->len = vlen;
+        } else {
+            BenchOp_t *op = bench_op(doc, BENCH_INT, comma);
+            op->i = strtoll((char *)value, NULL, 10);
+        }
+    }
+    free(out);
+}
+/******************************************************************************/
+/* Return the value of key in the object at data */
+LOCAL unsigned char *bench_get(unsigned char *data, uint32_t len, const char *key, uint32_t *olen)
+{
+    unsigned int *out = calloc(len * 2 + 2, sizeof(unsigned int));
+    unsigned char *result = NULL;
+    int           i;
+
+    js0n(data, len, out);
+    for (i = 0; out[i]; i += 4) {
+        if (out[i + 1] == strlen(key) && memcmp(data + out[i], key, out[i + 1]) == 0) {
+            result = data + out[i + 2];
+            *olen = out[i + 3];
+            break;
+        }
+    }
+    free(out);
+    return result;
+}
+/******************************************************************************/
+LOCAL void bench_load(const char *dir)
+{
+    DIR           *d = opendir(dir);
+    struct dirent *ent;
+
+    if (!d) {
+        fprintf(stderr, "ERROR - Couldn't open %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+
+    while ((ent = readdir(d))) {
+        const size_t nlen = strlen(ent->d_name);
+        if (nlen < 5 || strcmp(ent->d_name + nlen - 5, ".test") != 0)
+            continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        fseek(fp, 0, SEEK_END);
+        const long len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        char *data = malloc(len + 1);
+        if (fread(data, 1, len, fp) != (size_t)len) {
+            fclose(fp);
+            free(data);
+            continue;
+        }
+        fclose(fp);
+
+        uint32_t       slen;
+        unsigned char *sessions = bench_get((unsigned char *)data, len, "sessions2", &slen);
+        if (sessions) {
+            unsigned int *out = calloc(slen * 2 + 2, sizeof(unsigned int));
+            int           i;
+
+            js0n(sessions, slen, out);
+            for (i = 0; out[i]; i += 2) {
+                uint32_t       blen;
+                unsigned char *body = bench_get(sessions + out[i], out[i + 1], "body", &blen);
+                if (!body)
+                    continue;
+
+                if (numDocs == sizeDocs) {
+                    sizeDocs = sizeDocs ? sizeDocs * 2 : 256;
+                    docs = realloc(docs, sizeDocs * sizeof(BenchDoc_t));
+                }
+                BenchDoc_t *doc = &docs[numDocs++];
+                memset(doc, 0, sizeof(*doc));
+                bench_op(doc, BENCH_OBJ, 0);
+                bench_parse(doc, body, blen, TRUE);
+                bench_op(doc, BENCH_OBJ_END, 0);
+            }
+            free(out);
+        }
+        free(data);
+    }
+    closedir(d);
+}
+/******************************************************************************/
+/* How db.c escaped strings before jsonwriter.h */
+LOCAL void bench_old_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
+{
+    BSB_EXPORT_u08(*bsb, '"');
+    while (*in) {
+        switch(*in) {
+        case '\b':
+            BSB_EXPORT_cstr(*bsb, "\\b");
+            break;
+        case '\n':
+            BSB_EXPORT_cstr(*bsb, "\\n");
+            break;
+        case '\r':
+            BSB_EXPORT_cstr(*bsb, "\\r");
+            break;
+        case '\f':
+            BSB_EXPORT_cstr(*bsb, "\\f");
+            break;
+        case '\t':
+            BSB_EXPORT_cstr(*bsb, "\\t");
+            break;
+        case '"':
+            BSB_EXPORT_cstr(*bsb, "\\\"");
+            break;
+        case '\\':
+            BSB_EXPORT_cstr(*bsb, "\\\\");
+            break;
+        case '/':
+            BSB_EXPORT_cstr(*bsb, "\\/");
+            break;
+        default:
+            if(*in < 32) {
+                BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
+            } else if (utf8) {
+                if ((*in & 0xf0) == 0xf0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xe0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xd0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            } else {
+                if(*in & 0x80) {
+                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
+                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            }
+            break;
+        }
+        in++;
+    }
+
+    BSB_EXPORT_u08(*bsb, '"');
+}
+/******************************************************************************/
+LOCAL int bench_encode_old(BenchDoc_t *doc, char *buf, int size)
+{
+    BSB bsb;
+    int i;
+
+    BSB_INIT(bsb, buf, size);
+    for (i = 0; i < doc->num; i++) {
+        BenchOp_t *op = &doc->ops[i];
+        if (op->comma)
+            BSB_EXPORT_u08(bsb, ',');
+        switch (op->type) {
+        case BENCH_OBJ:     BSB_EXPORT_u08(bsb, '{'); break;
+        case BENCH_OBJ_END: BSB_EXPORT_u08(bsb, '}'); break;
+        case BENCH_ARR:     BSB_EXPORT_u08(bsb, '['); break;
+        case BENCH_ARR_END: BSB_EXPORT_u08(bsb, ']'); break;
+        case BENCH_KEY:     BSB_EXPORT_sprintf(bsb, "\"%s\":", op->str); break;
+        case BENCH_INT:     BSB_EXPORT_sprintf(bsb, "%" PRId64, op->i); break;
+        case BENCH_STR:     bench_old_js0n_str(&bsb, (unsigned char *)op->str, TRUE); break;
+        case BENCH_RAW:     BSB_EXPORT_ptr(bsb, op->str, op->len); break;
+        }
+    }
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+LOCAL int bench_encode_new(BenchDoc_t *doc, char *buf, int size)
+{
+    BSB bsb;
+    int i;
+
+    BSB_INIT(bsb, buf, size);
+    for (i = 0; i < doc->num; i++) {
+        BenchOp_t *op = &doc->ops[i];
+        if (op->comma)
+            BSB_EXPORT_u08(bsb, ',');
+        switch (op->type) {
+        case BENCH_OBJ:     BSB_EXPORT_u08(bsb, '{'); break;
+        case BENCH_OBJ_END: BSB_EXPORT_u08(bsb, '}'); break;
+        case BENCH_ARR:     BSB_EXPORT_u08(bsb, '['); break;
+        case BENCH_ARR_END: BSB_EXPORT_u08(bsb, ']'); break;
+        case BENCH_KEY:
+            // Like MOLOCH_DB_EXPORT_FIELD with its precomputed dbFieldLen
+            BSB_EXPORT_u08(bsb, '"');
+            BSB_EXPORT_ptr(bsb, op->str, op->len);
+            BSB_EXPORT_cstr(bsb, "\":");
+            break;
+        case BENCH_INT:     moloch_db_export_i64(&bsb, op->i); break;
+        case BENCH_STR:     moloch_db_js0n_str(&bsb, (unsigned char *)op->str, TRUE); break;
+        case BENCH_RAW:     BSB_EXPORT_ptr(bsb, op->str, op->len); break;
+        }
+    }
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+LOCAL uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "../tests/pcap";
+    const int   passes = argc > 2 ? atoi(argv[2]) : 200;
+    static char oldBuf[0x100000], newBuf[0x100000];
+    uint64_t    bytes = 0, start, oldNs, newNs;
+    int         i, p;
+
+    for (i = 0; i < 256; i++) {
+        snprintf((char *)moloch_char_to_hexstr[i], 3, "%02x", i);
+    }
+
+    bench_load(dir);
+    if (numDocs == 0) {
+        fprintf(stderr, "ERROR - No sessions found in %s\n", dir);
+        return 1;
+    }
+
+    for (i = 0; i < numDocs; i++) {
+        const int oldLen = bench_encode_old(&docs[i], oldBuf, sizeof(oldBuf));
+        const int newLen = bench_encode_new(&docs[i], newBuf, sizeof(newBuf));
+        if (oldLen != newLen || memcmp(oldBuf, newBuf, oldLen) != 0) {
+            fprintf(stderr, "ERROR - Session %d encodes differently\n%.*s\n%.*s\n", i, oldLen, oldBuf, newLen, newBuf);
+            return 1;
+        }
+        bytes += oldLen;
+    }
+
+    start = bench_now();
+    for (p = 0; p < passes; p++) {
+        for (i = 0; i < numDocs; i++) {
+            bench_encode_old(&docs[i], oldBuf, sizeof(oldBuf));
+        }
+    }
+    oldNs = bench_now() - start;
+
+    start = bench_now();
+    for (p = 0; p < passes; p++) {
+        for (i = 0; i < numDocs; i++) {
+            bench_encode_new(&docs[i], newBuf, sizeof(newBuf));
+        }
+    }
+    newNs = bench_now() - start;
+
+    const double count = (double)numDocs * passes;
+    printf("%d sessions, %" PRIu64 " bytes of json, %d passes\n", numDocs, bytes, passes);
+    printf("  %-8s %8.1f ns/session %8.1f MB/s\n", "sprintf", oldNs / count, bytes * passes * 1000.0 / oldNs);
+    printf("  %-8s %8.1f ns/session %8.1f MB/s\n", "encoder", newNs / count, bytes * passes * 1000.0 / newNs);
+    printf("  speedup  %.2fx\n", (double)oldNs / newNs);
+    return 0;
+}
@@ -0,0 +1,240 @@
+/* sessiontable.c  -- Session table microbenchmark
+ *
+ * Compares the open addressing session table in sessiontable.h with the
+ * chained hash.h table sessions used to live in.  Both tables index the
+ * same session objects, and lookups are done in a shuffled order so most
+ * probes miss the cache like they do with millions of live sessions.
+ *
+ * Usage: bench/sessiontable [count ...]    defaults to 1000000 10000000
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "moloch.h"
+#include "sessiontable.h"
+
+/******************************************************************************/
+// The old chained table needed its own links in every session
+typedef struct bench_session {
+    struct bench_session *h_next, *h_prev;
+    int                   h_bucket;
+    uint32_t              h_hash;
+    MolochSession_t       session;
+} BenchSession_t;
+
+typedef struct {
+    struct bench_session *h_next, *h_prev;
+    int                   h_count;
+} BenchSessionHead_t;
+
+typedef HASHP_VAR(h_, BenchSessionHash_t, BenchSessionHead_t);
+
+/******************************************************************************/
+// Only the table code is used, so these stand in for main.c
+void *moloch_numa_alloc(size_t size, int UNUSED(node))
+{
+    void *mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "ERROR - mmap of %zu failed: %s\n", size, strerror(errno));
+        exit(1);
+    }
+    return mem;
+}
+/******************************************************************************/
+void moloch_numa_free(void *mem, size_t size)
+{
+    munmap(mem, size);
+}
+/******************************************************************************/
+// Same as the non crc32c moloch_session_hash
+SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
+LOCAL uint32_t bench_hash(const void *key)
+{
+    uint32_t *p = (uint32_t *)key;
+    uint32_t *end = (uint32_t *)((unsigned char *)key + ((unsigned char *)key)[0] - 4);
+    uint32_t h = ((uint8_t *)key)[((uint8_t *)key)[0]-1];
+
+    while (p < end) {
+        h = (h + *p) * 0xc6a4a793;
+        h ^= h >> 16;
+        p += 1;
+    }
+
+    return h;
+}
+/******************************************************************************/
+LOCAL int bench_cmp(const void *key, const void *element)
+{
+    return moloch_session_id_cmp(key, &((BenchSession_t *)element)->session);
+}
+/******************************************************************************/
+LOCAL uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/******************************************************************************/
+LOCAL int bench_prime(int n)
+{
+    int p, d;
+    for (p = n | 1; ; p += 2) {
+        for (d = 3; d * d <= p && p % d; d += 2);
+        if (d * d > p)
+            return p;
+    }
+}
+/******************************************************************************/
+LOCAL uint64_t bench_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+/******************************************************************************/
+LOCAL void bench_run(uint32_t count)
+{
+    BenchSession_t *bs = moloch_numa_alloc(count * sizeof(BenchSession_t), -1);
+    uint32_t       *order = malloc(count * sizeof(uint32_t));
+    uint64_t        state = 0x9e3779b97f4a7c15ULL;
+    uint64_t        start;
+    uint32_t        i, found;
+
+    // Random ipv4 tcp session ids, with the same hash the packet threads use
+    for (i = 0; i < count; i++) {
+        char *id = bs[i].session.sessionId;
+        uint64_t r = bench_rand(&state);
+        id[0] = 13;
+        memcpy(id + 1, &r, 8);
+        memcpy(id + 9, &i, 4);
+        bs[i].session.h_hash = bench_hash(id);
+        order[i] = i;
+    }
+
+    for (i = count - 1; i > 0; i--) {
+        uint32_t j = bench_rand(&state) % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    printf("%u sessions of %zu bytes\n", count, sizeof(MolochSession_t));
+
+    // Chained, sized from maxStreams like it was
+    BenchSessionHash_t chained;
+    HASHP_INIT(h_, chained, bench_prime(count), bench_hash, bench_cmp);
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        BenchSession_t *b = &bs[order[i]];
+        HASH_ADD_HASH(h_, chained, b->session.h_hash, b->session.sessionId, b);
+    }
+    const double chainedInsert = (double)(bench_now() - start) / count;
+
+    start = bench_now();
+    for (i = 0, found = 0; i < count; i++) {
+        const MolochSession_t *s = &bs[order[count - 1 - i]].session;
+        BenchSession_t *b;
+        HASH_FIND_HASH(h_, chained, s->h_hash, s->sessionId, b);
+        found += (b != NULL);
+    }
+    const double chainedLookup = (double)(bench_now() - start) / count;
+    if (found != count)
+        printf("ERROR - chained found %u of %u\n", found, count);
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        BenchSession_t *b = &bs[order[i]];
+        HASH_REMOVE(h_, chained, b);
+    }
+    const double chainedRemove = (double)(bench_now() - start) / count;
+
+    free(chained.buckets);
+
+    // Open addressing, presized from maxStreams
+    MolochSessionHash_t table;
+    moloch_session_hash_init(&table, count, -1);
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        moloch_session_hash_add(&table, &bs[order[i]].session);
+    }
+    const double tableInsert = (double)(bench_now() - start) / count;
+
+    start = bench_now();
+    for (i = 0, found = 0; i < count; i++) {
+        const MolochSession_t *s = &bs[order[count - 1 - i]].session;
+        found += (moloch_session_hash_find(&table, s->h_hash, s->sessionId) != NULL);
+    }
+    const double tableLookup = (double)(bench_now() - start) / count;
+    if (found != count)
+        printf("ERROR - table found %u of %u\n", found, count);
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        moloch_session_hash_remove(&table, &bs[order[i]].session);
+    }
+    const double tableRemove = (double)(bench_now() - start) / count;
+    if (moloch_session_hash_count(&table) != 0)
+        printf("ERROR - table still has %u\n", moloch_session_hash_count(&table));
+
+    moloch_session_table_free(&table.cur);
+
+    // Open addressing, starting small so it grows while inserting
+    moloch_session_hash_init(&table, 0x1000, -1);
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        moloch_session_hash_add(&table, &bs[order[i]].session);
+    }
+    const double growInsert = (double)(bench_now() - start) / count;
+
+    start = bench_now();
+    for (i = 0, found = 0; i < count; i++) {
+        const MolochSession_t *s = &bs[order[count - 1 - i]].session;
+        found += (moloch_session_hash_find(&table, s->h_hash, s->sessionId) != NULL);
+    }
+    const double growLookup = (double)(bench_now() - start) / count;
+    if (found != count)
+        printf("ERROR - grown table found %u of %u\n", found, count);
+
+    if (table.old.groups)
+        moloch_session_table_free(&table.old);
+    moloch_session_table_free(&table.cur);
+
+    printf("  %-22s insert %7.1f ns/op  lookup %7.1f ns/op  remove %7.1f ns/op\n", "chained HASH_FIND_HASH", chainedInsert, chainedLookup, chainedRemove);
+    printf("  %-22s insert %7.1f ns/op  lookup %7.1f ns/op  remove %7.1f ns/op\n", "open addressing", tableInsert, tableLookup, tableRemove);
+    printf("  %-22s insert %7.1f ns/op  lookup %7.1f ns/op\n", "open addressing grown", growInsert, growLookup);
+
+    free(order);
+    moloch_numa_free(bs, count * sizeof(BenchSession_t));
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2) {
+        bench_run(1000000);
+        bench_run(10000000);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        bench_run(atoi(argv[i]));
+    }
+    return 0;
+}
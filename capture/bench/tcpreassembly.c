@@ -0,0 +1,582 @@
+/* tcpreassembly.c  -- Tcp reassembly microbenchmark
+ *
+ * Pulls the ipv4 tcp payload segments out of the pcaps in tests/pcap and
+ * feeds each direction of each flow through two reassemblers: a sorted
+ * list that holds on to every out of order segment and is walked from the
+ * tail to insert, like packet.c used to do with whole packets, and the
+ * tcpstream.h stream buffers behind the few held segments packet.c keeps.
+ * Each is run with the segments as captured, reordered within a small
+ * window, scrambled within a large one, and lossy, where a few segments
+ * only show up again much later as retransmits and a few are duplicated.
+ * The same is done for one large synthetic flow so deep holes show up too.
+ * Both reassemblers have to deliver exactly the captured byte stream.
+ *
+ * Usage: bench/tcpreassembly [pcap dir] [passes]    defaults to ../tests/pcap 20
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include "moloch.h"
+#include "tcpstream.h"
+
+#define BENCH_MAX_SPAN  (16 * 1024 * 1024)
+
+typedef struct {
+    uint32_t              seq;
+    uint32_t              len;
+    const uint8_t        *data;
+} BenchSeg_t;
+
+typedef struct {
+    uint32_t              key[3];    // src ip, dst ip, ports
+    uint32_t              isn;       // lowest seq seen
+    uint32_t              span;      // bytes from isn to the highest end
+    BenchSeg_t           *segs;
+    uint32_t              num;
+    uint32_t              size;
+    uint32_t             *order;     // segs indexes in the order to feed them
+    uint32_t              orderNum;
+    uint8_t              *expect;    // the stream as it should come out
+} BenchStream_t;
+
+typedef struct {
+    BenchStream_t        *streams;
+    uint32_t              num;
+    uint32_t              size;
+    uint32_t             *slots;     // open addressing index into streams, +1
+    uint32_t              slotMask;
+} BenchStreams_t;
+
+// The list the old code held segments on
+typedef struct bench_held {
+    struct bench_held    *td_next, *td_prev;
+    uint32_t              seq;
+    uint32_t              len;
+    const uint8_t        *data;
+} BenchHeld_t;
+
+typedef struct {
+    struct bench_held    *td_next, *td_prev;
+    int                   td_count;
+} BenchHeldHead_t;
+
+LOCAL uint8_t            *out;
+LOCAL uint32_t            outSize;
+
+/******************************************************************************/
+LOCAL uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/******************************************************************************/
+LOCAL uint32_t bench_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state >> 32;
+}
+/******************************************************************************/
+LOCAL BenchStream_t *bench_stream_get(BenchStreams_t *ss, const uint32_t key[3])
+{
+    uint32_t h = (key[0] * 0x9e3779b1) ^ (key[1] * 0x85ebca6b) ^ (key[2] * 0xc2b2ae35);
+    uint32_t i;
+
+    for (i = h & ss->slotMask; ss->slots[i]; i = (i + 1) & ss->slotMask) {
+        BenchStream_t *s = &ss->streams[ss->slots[i] - 1];
+        if (memcmp(s->key, key, sizeof(s->key)) == 0)
+            return s;
+    }
+
+    if (ss->num == ss->size) {
+        ss->size = ss->size ? ss->size * 2 : 1024;
+        ss->streams = realloc(ss->streams, ss->size * sizeof(BenchStream_t));
+    }
+
+    // Keep the index at most half full
+    if (ss->num * 2 >= ss->slotMask) {
+        fprintf(stderr, "ERROR - too many flows\n");
+        exit(1);
+    }
+
+    BenchStream_t *s = &ss->streams[ss->num];
+    memset(s, 0, sizeof(*s));
+    memcpy(s->key, key, sizeof(s->key));
+    ss->slots[i] = ++ss->num;
+    return s;
+}
+/******************************************************************************/
+LOCAL void bench_stream_add(BenchStream_t *s, uint32_t seq, uint32_t len, const uint8_t *data)
+{
+    if (s->num == s->size) {
+        s->size = s->size ? s->size * 2 : 16;
+        s->segs = realloc(s->segs, s->size * sizeof(BenchSeg_t));
+    }
+    s->segs[s->num].seq = seq;
+    s->segs[s->num].len = len;
+    s->segs[s->num].data = data;
+    s->num++;
+}
+/******************************************************************************/
+LOCAL uint32_t bench_32(const uint8_t *p, int swap)
+{
+    return swap ? ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) : ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+/******************************************************************************/
+/* Only ethernet ipv4 tcp, with at most one vlan tag, is looked at */
+LOCAL void bench_load_pcap(BenchStreams_t *ss, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "ERROR - Couldn't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *buf = malloc(size);
+    if (fread(buf, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "ERROR - Couldn't read %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+
+    // Never freed, the segments point into it
+    if (size < 24)
+        return;
+
+    int swap;
+    const uint32_t magic = bench_32(buf, 0);
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+        swap = 0;
+    else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+        swap = 1;
+    else
+        return;
+
+    if (bench_32(buf + 20, swap) != 1)
+        return;
+
+    long pos = 24;
+    while (pos + 16 <= size) {
+        const uint32_t caplen = bench_32(buf + pos + 8, swap);
+        const uint8_t *pkt = buf + pos + 16;
+        pos += 16 + caplen;
+        if (pos > size)
+            break;
+
+        uint32_t off = 12;
+        if (caplen < 14)
+            continue;
+        if (pkt[off] == 0x81 && pkt[off + 1] == 0x00)
+            off += 4;
+        if (off + 2 + 20 > caplen || pkt[off] != 0x08 || pkt[off + 1] != 0x00)
+            continue;
+        off += 2;
+
+        const uint8_t *ip = pkt + off;
+        const uint32_t ihl = (ip[0] & 0xf) * 4;
+        const uint32_t ipLen = ip[2] << 8 | ip[3];
+        if ((ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP || ihl < 20 || (ip[6] & 0x3f) || ip[7] || off + ipLen > caplen || ihl + 20 > ipLen)
+            continue;
+
+        const uint8_t *tcp = ip + ihl;
+        const uint32_t thl = (tcp[12] >> 4) * 4;
+        if (thl < 20 || ihl + thl > ipLen || (tcp[13] & 0x02))
+            continue;
+
+        const uint32_t len = ipLen - ihl - thl;
+        if (!len)
+            continue;
+
+        uint32_t key[3];
+        memcpy(&key[0], ip + 12, 4);
+        memcpy(&key[1], ip + 16, 4);
+        memcpy(&key[2], tcp, 4);
+        bench_stream_add(bench_stream_get(ss, key), bench_32(tcp + 4, 1), len, tcp + thl);
+    }
+}
+/******************************************************************************/
+/* Work out where each stream starts and what it should reassemble into, drop
+ * the ones with a span we won't buffer, that never fill their holes, or that
+ * have retransmits with different bytes.
+ */
+LOCAL void bench_prepare(BenchStreams_t *ss)
+{
+    uint32_t i, j, keep = 0;
+
+    for (i = 0; i < ss->num; i++) {
+        BenchStream_t *s = &ss->streams[i];
+
+        s->isn = s->segs[0].seq;
+        uint32_t hi = s->segs[0].seq + s->segs[0].len;
+        for (j = 1; j < s->num; j++) {
+            if (MOLOCH_SEQ_LT(s->segs[j].seq, s->isn))
+                s->isn = s->segs[j].seq;
+            if (MOLOCH_SEQ_LT(hi, s->segs[j].seq + s->segs[j].len))
+                hi = s->segs[j].seq + s->segs[j].len;
+        }
+        s->span = hi - s->isn;
+
+        if (s->span > BENCH_MAX_SPAN) {
+            free(s->segs);
+            continue;
+        }
+
+        // Which copy wins depends on the order, so only keep streams where they all agree
+        uint8_t *have = calloc(s->span, 1);
+        int      differ = 0;
+        s->expect = malloc(s->span);
+        for (j = 0; j < s->num; j++) {
+            const uint32_t o = s->segs[j].seq - s->isn;
+            uint32_t b;
+            for (b = 0; b < s->segs[j].len; b++) {
+                if (!have[o + b]) {
+                    have[o + b] = 1;
+                    s->expect[o + b] = s->segs[j].data[b];
+                } else if (s->expect[o + b] != s->segs[j].data[b]) {
+                    differ = 1;
+                }
+            }
+        }
+        const int holes = memchr(have, 0, s->span) != NULL;
+        free(have);
+
+        if (holes || differ) {
+            free(s->expect);
+            free(s->segs);
+            continue;
+        }
+
+        if (s->span > outSize)
+            outSize = s->span;
+        s->order = malloc(s->num * 2 * sizeof(uint32_t));
+        ss->streams[keep++] = *s;
+    }
+    ss->num = keep;
+}
+/******************************************************************************/
+/* 0 as captured, 1 reordered within 8 segments, 2 scrambled within 1000
+ * segments, 3 lossy: 3% of segments only come back 20 to 60 (or 200 to 400
+ * when wide) segments later and 1% are duplicated
+ */
+LOCAL void bench_order(BenchStream_t *s, int mode, int wide, uint64_t *state)
+{
+    uint32_t i, j;
+
+    s->orderNum = 0;
+    if (mode < 3) {
+        for (i = 0; i < s->num; i++)
+            s->order[s->orderNum++] = i;
+
+        if (mode > 0) {
+            for (i = 0; i < s->num; i++) {
+                j = i + bench_rand(state) % (mode == 1 ? 8 : 1000);
+                if (j >= s->num)
+                    j = s->num - 1;
+                const uint32_t t = s->order[i];
+                s->order[i] = s->order[j];
+                s->order[j] = t;
+            }
+        }
+        return;
+    }
+
+    uint32_t *due = malloc(s->num * sizeof(uint32_t));
+    for (i = 0; i < s->num; i++) {
+        const uint32_t r = bench_rand(state) % 100;
+        due[i] = 0;
+        if (r < 3)
+            due[i] = i + (wide ? 200 + bench_rand(state) % 200 : 20 + bench_rand(state) % 40);
+        else
+            s->order[s->orderNum++] = i;
+        if (r == 3)
+            s->order[s->orderNum++] = i;
+
+        for (j = i > 400 ? i - 400 : 0; j < i; j++) {
+            if (due[j] == i)
+                s->order[s->orderNum++] = j;
+        }
+    }
+    for (j = 0; j < s->num; j++) {
+        if (due[j] >= s->num)
+            s->order[s->orderNum++] = j;
+    }
+    free(due);
+}
+/******************************************************************************/
+LOCAL void bench_deliver(uint32_t isn, uint32_t seq, const uint8_t *data, uint32_t len)
+{
+    memcpy(out + (seq - isn), data, len);
+}
+/******************************************************************************/
+LOCAL void bench_run_list(BenchStream_t *s)
+{
+    BenchHeldHead_t head;
+    BenchHeld_t    *held, *h;
+    uint32_t        next = s->isn;
+    uint32_t        i;
+
+    DLL_INIT(td_, &head);
+
+    for (i = 0; i < s->orderNum; i++) {
+        const BenchSeg_t *seg = &s->segs[s->order[i]];
+
+        if (!MOLOCH_SEQ_LT(next, seg->seq + seg->len))
+            continue;
+
+        held = malloc(sizeof(BenchHeld_t));
+        held->seq = seg->seq;
+        held->len = seg->len;
+        held->data = seg->data;
+
+        // Walk back from the tail to the spot it goes, keep the longer of two copies with the same seq
+        DLL_FOREACH_REVERSE(td_, &head, h) {
+            if (h->seq == held->seq) {
+                if (held->len > h->len) {
+                    DLL_ADD_AFTER(td_, &head, h, held);
+                    DLL_REMOVE(td_, &head, h);
+                    free(h);
+                    h = held;
+                } else {
+                    free(held);
+                }
+                break;
+            }
+            if (MOLOCH_SEQ_LT(h->seq, held->seq)) {
+                DLL_ADD_AFTER(td_, &head, h, held);
+                break;
+            }
+        }
+        if ((void *)h == (void *)&head)
+            DLL_PUSH_HEAD(td_, &head, held);
+
+        while ((h = DLL_PEEK_HEAD(td_, &head)) && !MOLOCH_SEQ_LT(next, h->seq)) {
+            if (MOLOCH_SEQ_LT(next, h->seq + h->len)) {
+                bench_deliver(s->isn, next, h->data + (next - h->seq), h->seq + h->len - next);
+                next = h->seq + h->len;
+            }
+            DLL_REMOVE(td_, &head, h);
+            free(h);
+        }
+    }
+
+    while (DLL_POP_HEAD(td_, &head, h))
+        free(h);
+}
+/******************************************************************************/
+LOCAL void bench_run_stream(BenchStream_t *s, uint64_t *bytes)
+{
+    MolochTcpDir_t dir;
+    BenchSeg_t     held[MOLOCH_TCP_HELD];   // segments packet.c keeps as packets, by seq
+    uint32_t       heldNum = 0;
+    uint32_t       next = s->isn;
+    uint32_t       i, h;
+
+    memset(&dir, 0, sizeof(dir));
+
+    for (i = 0; i < s->orderNum; i++) {
+        const BenchSeg_t *seg = &s->segs[s->order[i]];
+        const uint8_t    *data = seg->data;
+        uint32_t          seq = seg->seq;
+        uint32_t          len = seg->len;
+
+        if (!MOLOCH_SEQ_LT(next, seq + len))
+            continue;
+
+        if (MOLOCH_SEQ_LT(seq, next)) {
+            data += next - seq;
+            len -= next - seq;
+            seq = next;
+        }
+
+        // In order and not overlapping anything waiting, straight from the packet
+        uint32_t first = heldNum ? held[0].seq : seq + len;
+        if (dir.num && MOLOCH_SEQ_LT(dir.ranges[dir.first].start, first))
+            first = dir.ranges[dir.first].start;
+
+        if (seq == next && !MOLOCH_SEQ_LT(first, seq + len)) {
+            bench_deliver(s->isn, seq, data, len);
+            next += len;
+            if (!dir.num && !heldNum)
+                continue;
+        } else {
+            // The lowest segments wait as packets, only the highest gets copied
+            BenchSeg_t seg2 = {seq, len, data};
+            if (heldNum == MOLOCH_TCP_HELD) {
+                BenchSeg_t copy = seg2;
+                if (MOLOCH_SEQ_LT(seq, held[heldNum - 1].seq)) {
+                    copy = held[heldNum - 1];
+                    heldNum--;
+                }
+                if (!moloch_tcp_dir_add(&dir, next, copy.seq, 0, copy.data, copy.len, BENCH_MAX_SPAN, bytes, UINT64_MAX)) {
+                    fprintf(stderr, "ERROR - stream buffer refused a segment\n");
+                    exit(1);
+                }
+            }
+            if (heldNum < MOLOCH_TCP_HELD) {
+                for (h = heldNum; h > 0 && MOLOCH_SEQ_LT(seq, held[h - 1].seq); h--)
+                    held[h] = held[h - 1];
+                held[h] = seg2;
+                heldNum++;
+            }
+        }
+
+        while (1) {
+            moloch_tcp_dir_trim(&dir, next);
+            for (h = 0; h < heldNum && MOLOCH_SEQ_LT(held[h].seq, next);) {
+                if (next - held[h].seq < held[h].len) {
+                    held[h].data += next - held[h].seq;
+                    held[h].len -= next - held[h].seq;
+                    held[h].seq = next;
+                    h++;
+                    continue;
+                }
+                heldNum--;
+                memmove(held + h, held + h + 1, (heldNum - h) * sizeof(BenchSeg_t));
+            }
+
+            if (heldNum && held[0].seq == next) {
+                bench_deliver(s->isn, next, held[0].data, held[0].len);
+                next += held[0].len;
+            } else if (dir.num && dir.ranges[dir.first].start == next) {
+                uint32_t len = dir.ranges[dir.first].end - next;
+                const uint8_t *data = moloch_tcp_dir_data(&dir, next, &len);
+                bench_deliver(s->isn, next, data, len);
+                next += len;
+            } else {
+                break;
+            }
+        }
+
+        // Like packet.c, don't keep a large ring once it is empty
+        if (!dir.num && dir.bufSize > MOLOCH_TCP_KEEP)
+            moloch_tcp_dir_free(&dir, bytes);
+    }
+
+    moloch_tcp_dir_free(&dir, bytes);
+}
+/******************************************************************************/
+LOCAL void bench_check(BenchStream_t *s, const char *name)
+{
+    if (memcmp(out, s->expect, s->span) != 0) {
+        fprintf(stderr, "ERROR - %s reassembled a stream wrong\n", name);
+        exit(1);
+    }
+}
+/******************************************************************************/
+LOCAL void bench_run(BenchStreams_t *ss, const char *name, int passes, int wide)
+{
+    static const char *modes[4] = {"as captured", "reordered", "scrambled", "lossy"};
+    uint64_t           bytes = 0;
+    int                mode, p;
+    uint32_t           i;
+
+    for (mode = 0; mode < 4; mode++) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        uint64_t segs = 0, listNs = 0, streamNs = 0, start;
+
+        for (i = 0; i < ss->num; i++) {
+            BenchStream_t *s = &ss->streams[i];
+            bench_order(s, mode, wide, &state);
+            segs += s->orderNum;
+
+            // Check once, outside of the timing
+            memset(out, 0, s->span);
+            bench_run_list(s);
+            bench_check(s, "list");
+            memset(out, 0, s->span);
+            bench_run_stream(s, &bytes);
+            bench_check(s, "stream buffer");
+
+            start = bench_now();
+            for (p = 0; p < passes; p++)
+                bench_run_list(s);
+            listNs += bench_now() - start;
+
+            start = bench_now();
+            for (p = 0; p < passes; p++)
+                bench_run_stream(s, &bytes);
+            streamNs += bench_now() - start;
+        }
+
+        segs *= passes;
+        printf("  %-16s %-12s %9" PRIu64 " segments  list %7.1f ns/seg  stream buffer %7.1f ns/seg  %.2fx\n",
+               name, modes[mode], segs, (double)listNs / segs, (double)streamNs / segs, (double)listNs / streamNs);
+    }
+}
+/******************************************************************************/
+int main(int argc, char **argv)
+{
+    const char     *dir = argc > 1 ? argv[1] : "../tests/pcap";
+    const int       passes = argc > 2 ? atoi(argv[2]) : 20;
+    BenchStreams_t  ss;
+    DIR            *d = opendir(dir);
+    struct dirent  *ent;
+
+    if (!d) {
+        fprintf(stderr, "ERROR - Couldn't open %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    ss.slotMask = 0x3ffff;
+    ss.slots = calloc(ss.slotMask + 1, sizeof(uint32_t));
+
+    int files = 0;
+    while ((ent = readdir(d))) {
+        const size_t nlen = strlen(ent->d_name);
+        if (nlen < 5 || strcmp(ent->d_name + nlen - 5, ".pcap") != 0)
+            continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        bench_load_pcap(&ss, path);
+        files++;
+    }
+    closedir(d);
+
+    bench_prepare(&ss);
+
+    // One long flow of full size segments, where the lossy holes get deep
+    BenchStreams_t bulk;
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.num = bulk.size = 1;
+    bulk.streams = calloc(1, sizeof(BenchStream_t));
+
+    BenchStream_t *s = &bulk.streams[0];
+    const uint32_t bulkSegs = 8192;
+    uint8_t       *bulkData = malloc(bulkSegs * 1460);
+    uint64_t       state = 1;
+    uint32_t       i;
+
+    for (i = 0; i < bulkSegs * 1460; i++)
+        bulkData[i] = bench_rand(&state);
+    for (i = 0; i < bulkSegs; i++)
+        bench_stream_add(s, 0xfff00000 + i * 1460, 1460, bulkData + i * 1460);
+    bench_prepare(&bulk);
+
+    out = malloc(outSize);
+
+    printf("%d pcaps, %u tcp directions with payload, %d passes\n", files, ss.num, passes);
+    bench_run(&ss, "tests/pcap", passes, 0);
+    bench_run(&bulk, "bulk 12MB", 5, 0);
+    bench_run(&bulk, "bulk 12MB wide", 5, 1);
+
+    return 0;
+}
@@ -29,12 +29,12 @@
 #include "patricia.h"
 
 #include "maxminddb.h"
+#include "jsonwriter.h"
 MMDB_s                  *geoCountry;
 MMDB_s                  *geoASN;
 
 #define MOLOCH_MIN_DB_VERSION 50
 
-extern uint64_t         totalPackets;
 LOCAL  uint64_t         totalSessions = 0;
 LOCAL  uint64_t         totalSessionBytes;
 LOCAL  uint16_t         myPid;
@@ -54,9 +54,21 @@ extern char            *moloch_char_to_hex;
 extern unsigned char    moloch_char_to_hexstr[256][3];
 extern unsigned char    moloch_hex_to_char[256][256];
 
-LOCAL uint32_t          nextFileNum;
+LOCAL uint32_t          nextFileNum;         // next number of the current lease, 0 if none
+LOCAL uint32_t          fileNumLeaseEnd;     // last number of the current lease
+LOCAL uint32_t          fileNumPendingStart; // next lease, fetched ahead of time
+LOCAL uint32_t          fileNumPendingEnd;
+LOCAL uint32_t          fileNumLeaseMax;     // highest number leased so far
+LOCAL uint32_t          fileNumLeaseSize;
+LOCAL int               fileNumLeaseInFlight;
+LOCAL char             *fileNumWatermark;
 LOCAL MOLOCH_LOCK_DEFINE(nextFileNum);
 
+#define MOLOCH_DB_FILES_BULK_SIZE (MOLOCH_HTTP_BUFFER_SIZE*10)
+LOCAL char             *filesBulkJson;
+LOCAL BSB               filesBulkBsb;
+LOCAL MOLOCH_LOCK_DEFINE(filesBulk);
+
 LOCAL struct timespec startHealthCheck;
 LOCAL uint64_t        esHealthMS;
 
@@ -118,69 +130,21 @@ LOCAL MolochIpInfo_t *moloch_db_get_local_ip6(MolochSession_t *session, struct i
 }
 
 /******************************************************************************/
-LOCAL void moloch_db_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
-{
-    BSB_EXPORT_u08(*bsb, '"');
-    while (*in) {
-        switch(*in) {
-        case '\b':
-            BSB_EXPORT_cstr(*bsb, "\\b");
-            break;
-        case '\n':
-            BSB_EXPORT_cstr(*bsb, "\\n");
-            break;
-        case '\r':
-            BSB_EXPORT_cstr(*bsb, "\\r");
-            break;
-        case '\f':
-            BSB_EXPORT_cstr(*bsb, "\\f");
-            break;
-        case '\t':
-            BSB_EXPORT_cstr(*bsb, "\\t");
-            break;
-        case '"':
-            BSB_EXPORT_cstr(*bsb, "\\\"");
-            break;
-        case '\\':
-            BSB_EXPORT_cstr(*bsb, "\\\\");
-            break;
-        case '/':
-            BSB_EXPORT_cstr(*bsb, "\\/");
-            break;
-        default:
-            if(*in < 32) {
-                BSB_EXPORT_sprintf(*bsb, "\\u%04x", *in);
-            } else if (utf8) {
-                if ((*in & 0xf0) == 0xf0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else if ((*in & 0xf0) == 0xe0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else if ((*in & 0xf0) == 0xd0) {
-                    BSB_EXPORT_u08(*bsb, *(in++));
-                    BSB_EXPORT_u08(*bsb, *in);
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
-            } else {
-                if(*in & 0x80) {
-                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
-                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
-                } else {
-                    BSB_EXPORT_u08(*bsb, *in);
-                }
-            }
-            break;
-        }
-        in++;
-    }
-
-    BSB_EXPORT_u08(*bsb, '"');
-}
+/* Exports "<dbField><suffix> */
+#define MOLOCH_DB_EXPORT_FIELD(b, info, suffix)        \
+do {                                                   \
+    BSB_EXPORT_u08(b, '"');                            \
+    BSB_EXPORT_ptr(b, (info)->dbField, (info)->dbFieldLen); \
+    BSB_EXPORT_cstr(b, suffix);                        \
+} while (0)
+
+/* Exports "<dbField minus its 2 character Ip suffix><suffix> */
+#define MOLOCH_DB_EXPORT_FIELD_BASE(b, info, suffix)   \
+do {                                                   \
+    BSB_EXPORT_u08(b, '"');                            \
+    BSB_EXPORT_ptr(b, (info)->dbField, (info)->dbFieldLen - 2); \
+    BSB_EXPORT_cstr(b, suffix);                        \
+} while (0)
 
 /******************************************************************************/
 void moloch_db_geo_lookup6(MolochSession_t *session, struct in6_addr addr, char **g, char **as, char **rir, int *asFree)
@@ -261,20 +225,62 @@ void moloch_db_set_send_bulk(MolochDbSendBulkFunc func)
     sendBulkFunc = func;
 }
 /******************************************************************************/
-LOCAL struct {
+#define MOLOCH_DB_MAX_SERIALIZERS  16
+#define MOLOCH_DB_MAX_SERIALIZE_Q  100000
+
+typedef struct {
     char   *json;
     BSB     bsb;
     time_t  lastSave;
     char    prefix[100];
     time_t  prefixTime;
     MOLOCH_LOCK_EXTERN(lock);
-} dbInfo[MOLOCH_MAX_PACKET_THREADS];
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochDbInfo_t;
+
+// One per packet thread followed by one per serializer thread
+LOCAL MolochDbInfo_t      *dbInfo;
+
+LOCAL int                  numDbInfo;
+
+// Final session saves handed off by packet threads
+LOCAL int                  serializeThreads;
+LOCAL MolochSessionHead_t  serializeQ;
+LOCAL MOLOCH_LOCK_DEFINE(serializeQ);
+LOCAL MOLOCH_COND_DEFINE(serializeQ);
+LOCAL uint32_t             serializeOutstanding;
 
 #define MAX_IPS 2000
 
 LOCAL MOLOCH_LOCK_DEFINE(outputed);
 
-void moloch_db_save_session(MolochSession_t *session, int final)
+/******************************************************************************/
+/* Returns FALSE if the session shouldn't be written */
+LOCAL gboolean moloch_db_save_session_check(MolochSession_t *session, int final)
+{
+    /* Let the plugins finish */
+    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
+        moloch_plugins_cb_save(session, final);
+
+    /* Don't save spi data for session */
+    if (session->stopSPI)
+        return FALSE;
+
+    /* No Packets */
+    if (!config.dryRun && (!session->filePosArray || !session->filePosArray->len))
+        return FALSE;
+
+    /* Not enough packets */
+    if (session->packets[0] + session->packets[1] < session->minSaving) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+/******************************************************************************/
+/* Encode the session into the bulk buffer for thread, which is either the
+ * packet thread or a serializer thread.
+ */
+LOCAL void moloch_db_session_encode(MolochSession_t *session, int final, const int thread)
 {
     uint32_t               i;
     char                   id[100];
@@ -292,25 +298,10 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     int                    pos;
     gpointer               ikey;
 
-    /* Let the plugins finish */
-    if (pluginsCbs & MOLOCH_PLUGIN_SAVE)
-        moloch_plugins_cb_save(session, final);
-
-    /* Don't save spi data for session */
-    if (session->stopSPI)
-        return;
-
-    /* No Packets */
-    if (!config.dryRun && !session->filePosArray->len)
-        return;
-
-    /* Not enough packets */
-    if (session->packets[0] + session->packets[1] < session->minSaving) {
-        return;
-    }
-
     /* jsonSize is an estimate of how much space it will take to encode the session */
-    jsonSize = 1100 + session->filePosArray->len*12 + 10*session->fileNumArray->len + 10*session->fileLenArray->len;
+    jsonSize = 1100;
+    if (session->filePosArray)
+        jsonSize += session->filePosArray->len*12 + 10*session->fileNumArray->len + 10*session->fileLenArray->len;
     for (pos = 0; pos < session->maxFields; pos++) {
         if (session->fields[pos]) {
             jsonSize += session->fields[pos]->jsonSize;
@@ -320,8 +311,6 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     MOLOCH_THREAD_INCR(totalSessions);
     session->segments++;
 
-    const int thread = session->thread;
-
     if (dbInfo[thread].prefixTime != session->lastPacket.tv_sec) {
         dbInfo[thread].prefixTime = session->lastPacket.tv_sec;
 
@@ -410,51 +399,55 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
     startPtr = BSB_WORK_PTR(jbsb);
 
-    if (config.autoGenerateId) {
-        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions2-%s\", \"_type\": \"session\"}}\n", config.prefix, dbInfo[thread].prefix);
-    } else {
-        BSB_EXPORT_sprintf(jbsb, "{\"index\": {\"_index\": \"%ssessions2-%s\", \"_type\": \"session\", \"_id\": \"%s\"}}\n", config.prefix, dbInfo[thread].prefix, id);
+    BSB_EXPORT_cstr(jbsb, "{\"index\": {\"_index\": \"");
+    moloch_db_export_str(&jbsb, config.prefix);
+    BSB_EXPORT_cstr(jbsb, "sessions2-");
+    moloch_db_export_str(&jbsb, dbInfo[thread].prefix);
+    BSB_EXPORT_cstr(jbsb, "\", \"_type\": \"session\"");
+    if (!config.autoGenerateId) {
+        BSB_EXPORT_cstr(jbsb, ", \"_id\": \"");
+        moloch_db_export_str(&jbsb, id);
+        BSB_EXPORT_u08(jbsb, '"');
     }
+    BSB_EXPORT_cstr(jbsb, "}}\n");
 
     dataPtr = BSB_WORK_PTR(jbsb);
 
-    BSB_EXPORT_sprintf(jbsb,
-                      "{\"firstPacket\":%" PRIu64 ","
-                      "\"lastPacket\":%" PRIu64 ","
-                      "\"length\":%u,"
-                      "\"srcPort\":%u,"
-                      "\"dstPort\":%u,"
-                      "\"ipProtocol\":%u,",
-                      ((uint64_t)session->firstPacket.tv_sec)*1000 + ((uint64_t)session->firstPacket.tv_usec)/1000,
-                      ((uint64_t)session->lastPacket.tv_sec)*1000 + ((uint64_t)session->lastPacket.tv_usec)/1000,
-                      timediff,
-                      session->port1,
-                      session->port2,
-                      session->protocol);
+    BSB_EXPORT_cstr(jbsb, "{\"firstPacket\":");
+    moloch_db_export_u64(&jbsb, ((uint64_t)session->firstPacket.tv_sec)*1000 + ((uint64_t)session->firstPacket.tv_usec)/1000);
+    BSB_EXPORT_cstr(jbsb, ",\"lastPacket\":");
+    moloch_db_export_u64(&jbsb, ((uint64_t)session->lastPacket.tv_sec)*1000 + ((uint64_t)session->lastPacket.tv_usec)/1000);
+    BSB_EXPORT_cstr(jbsb, ",\"length\":");
+    moloch_db_export_u64(&jbsb, timediff);
+    BSB_EXPORT_cstr(jbsb, ",\"srcPort\":");
+    moloch_db_export_u64(&jbsb, session->port1);
+    BSB_EXPORT_cstr(jbsb, ",\"dstPort\":");
+    moloch_db_export_u64(&jbsb, session->port2);
+    BSB_EXPORT_cstr(jbsb, ",\"ipProtocol\":");
+    moloch_db_export_u64(&jbsb, session->protocol);
+    BSB_EXPORT_u08(jbsb, ',');
 
     if (session->protocol == IPPROTO_TCP) {
-        BSB_EXPORT_sprintf(jbsb,
-                           "\"tcpflags\":{"
-                           "\"syn\": %d,"
-                           "\"syn-ack\": %d,"
-                           "\"ack\": %d,"
-                           "\"psh\": %d,"
-                           "\"fin\": %d,"
-                           "\"rst\": %d,"
-                           "\"urg\": %d,"
-                           "\"srcZero\": %d,"
-                           "\"dstZero\": %d"
-                           "},",
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_ACK],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_FIN],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_RST],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_URG],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO],
-                           session->tcpFlagCnt[MOLOCH_TCPFLAG_DST_ZERO]
-                           );
+        BSB_EXPORT_cstr(jbsb, "\"tcpflags\":{");
+        BSB_EXPORT_cstr(jbsb, "\"syn\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN]);
+        BSB_EXPORT_cstr(jbsb, ",\"syn-ack\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK]);
+        BSB_EXPORT_cstr(jbsb, ",\"ack\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_ACK]);
+        BSB_EXPORT_cstr(jbsb, ",\"psh\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH]);
+        BSB_EXPORT_cstr(jbsb, ",\"fin\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_FIN]);
+        BSB_EXPORT_cstr(jbsb, ",\"rst\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_RST]);
+        BSB_EXPORT_cstr(jbsb, ",\"urg\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_URG]);
+        BSB_EXPORT_cstr(jbsb, ",\"srcZero\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_SRC_ZERO]);
+        BSB_EXPORT_cstr(jbsb, ",\"dstZero\": ");
+        moloch_db_export_u64(&jbsb, session->tcpFlagCnt[MOLOCH_TCPFLAG_DST_ZERO]);
+        BSB_EXPORT_cstr(jbsb, "},");
     }
 
     if (session->firstBytesLen[0] > 0) {
@@ -478,20 +471,20 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     char ipdst[INET6_ADDRSTRLEN];
     if (IN6_IS_ADDR_V4MAPPED(&session->addr1)) {
         uint32_t ip = MOLOCH_V6_TO_V4(session->addr1);
-        snprintf(ipsrc, sizeof(ipsrc), "%u.%u.%u.%u", ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, (ip >> 24) & 0xff);
+        moloch_db_ip4_str(ipsrc, ip);
         ip = MOLOCH_V6_TO_V4(session->addr2);
-        snprintf(ipdst, sizeof(ipdst), "%u.%u.%u.%u", ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, (ip >> 24) & 0xff);
+        moloch_db_ip4_str(ipdst, ip);
     } else {
         inet_ntop(AF_INET6, &session->addr1, ipsrc, sizeof(ipsrc));
         inet_ntop(AF_INET6, &session->addr2, ipdst, sizeof(ipdst));
     }
-    BSB_EXPORT_sprintf(jbsb,
-                      "\"timestamp\":%" PRIu64 ","
-                      "\"srcIp\":\"%s\","
-                      "\"dstIp\":\"%s\",",
-                      ((uint64_t)currentTime.tv_sec)*1000 + ((uint64_t)currentTime.tv_usec)/1000,
-                      ipsrc,
-                      ipdst);
+    BSB_EXPORT_cstr(jbsb, "\"timestamp\":");
+    moloch_db_export_u64(&jbsb, ((uint64_t)currentTime.tv_sec)*1000 + ((uint64_t)currentTime.tv_usec)/1000);
+    BSB_EXPORT_cstr(jbsb, ",\"srcIp\":\"");
+    moloch_db_export_str(&jbsb, ipsrc);
+    BSB_EXPORT_cstr(jbsb, "\",\"dstIp\":\"");
+    moloch_db_export_str(&jbsb, ipdst);
+    BSB_EXPORT_cstr(jbsb, "\",");
 
 
     char *g1, *g2, *as1, *as2, *rir1, *rir2;
@@ -500,10 +493,16 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     moloch_db_geo_lookup6(session, session->addr1, &g1, &as1, &rir1, &asFree1);
     moloch_db_geo_lookup6(session, session->addr2, &g2, &as2, &rir2, &asFree2);
 
-    if (g1)
-        BSB_EXPORT_sprintf(jbsb, "\"srcGEO\":\"%2.2s\",", g1);
-    if (g2)
-        BSB_EXPORT_sprintf(jbsb, "\"dstGEO\":\"%2.2s\",", g2);
+    if (g1) {
+        BSB_EXPORT_cstr(jbsb, "\"srcGEO\":\"");
+        BSB_EXPORT_ptr(jbsb, g1, strnlen(g1, 2));
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
+    if (g2) {
+        BSB_EXPORT_cstr(jbsb, "\"dstGEO\":\"");
+        BSB_EXPORT_ptr(jbsb, g2, strnlen(g2, 2));
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
 
 
     if (as1) {
@@ -523,61 +522,68 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 
 
-    if (rir1)
-        BSB_EXPORT_sprintf(jbsb, "\"srcRIR\":\"%s\",", rir1);
-
-    if (rir2)
-        BSB_EXPORT_sprintf(jbsb, "\"dstRIR\":\"%s\",", rir2);
-
-    BSB_EXPORT_sprintf(jbsb,
-                      "\"totPackets\":%u,"
-                      "\"srcPackets\":%u,"
-                      "\"dstPackets\":%u,"
-                      "\"totBytes\":%" PRIu64 ","
-                      "\"srcBytes\":%" PRIu64 ","
-                      "\"dstBytes\":%" PRIu64 ","
-                      "\"totDataBytes\":%" PRIu64 ","
-                      "\"srcDataBytes\":%" PRIu64 ","
-                      "\"dstDataBytes\":%" PRIu64 ","
-                      "\"segmentCnt\":%u,"
-                      "\"node\":\"%s\",",
-                      session->packets[0] + session->packets[1],
-                      session->packets[0],
-                      session->packets[1],
-                      session->bytes[0] + session->bytes[1],
-                      session->bytes[0],
-                      session->bytes[1],
-                      session->databytes[0] + session->databytes[1],
-                      session->databytes[0],
-                      session->databytes[1],
-                      session->segments,
-                      config.nodeName);
+    if (rir1) {
+        BSB_EXPORT_cstr(jbsb, "\"srcRIR\":\"");
+        moloch_db_export_str(&jbsb, rir1);
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
+
+    if (rir2) {
+        BSB_EXPORT_cstr(jbsb, "\"dstRIR\":\"");
+        moloch_db_export_str(&jbsb, rir2);
+        BSB_EXPORT_cstr(jbsb, "\",");
+    }
+
+    BSB_EXPORT_cstr(jbsb, "\"totPackets\":");
+    moloch_db_export_u64(&jbsb, session->packets[0] + session->packets[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"srcPackets\":");
+    moloch_db_export_u64(&jbsb, session->packets[0]);
+    BSB_EXPORT_cstr(jbsb, ",\"dstPackets\":");
+    moloch_db_export_u64(&jbsb, session->packets[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"totBytes\":");
+    moloch_db_export_u64(&jbsb, session->bytes[0] + session->bytes[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"srcBytes\":");
+    moloch_db_export_u64(&jbsb, session->bytes[0]);
+    BSB_EXPORT_cstr(jbsb, ",\"dstBytes\":");
+    moloch_db_export_u64(&jbsb, session->bytes[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"totDataBytes\":");
+    moloch_db_export_u64(&jbsb, session->databytes[0] + session->databytes[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"srcDataBytes\":");
+    moloch_db_export_u64(&jbsb, session->databytes[0]);
+    BSB_EXPORT_cstr(jbsb, ",\"dstDataBytes\":");
+    moloch_db_export_u64(&jbsb, session->databytes[1]);
+    BSB_EXPORT_cstr(jbsb, ",\"segmentCnt\":");
+    moloch_db_export_u64(&jbsb, session->segments);
+    BSB_EXPORT_cstr(jbsb, ",\"node\":\"");
+    moloch_db_export_str(&jbsb, config.nodeName);
+    BSB_EXPORT_cstr(jbsb, "\",");
 
     if (session->rootId) {
-        BSB_EXPORT_sprintf(jbsb, "\"rootId\":\"%s\",", session->rootId);
+        BSB_EXPORT_cstr(jbsb, "\"rootId\":\"");
+        moloch_db_export_str(&jbsb, session->rootId);
+        BSB_EXPORT_cstr(jbsb, "\",");
     }
     BSB_EXPORT_cstr(jbsb, "\"packetPos\":[");
-    for(i = 0; i < session->filePosArray->len; i++) {
+    for(i = 0; session->filePosArray && i < session->filePosArray->len; i++) {
         if (i != 0)
             BSB_EXPORT_u08(jbsb, ',');
-        BSB_EXPORT_sprintf(jbsb, "%" PRId64, (uint64_t)g_array_index(session->filePosArray, uint64_t, i));
+        moloch_db_export_i64(&jbsb, (int64_t)g_array_index(session->filePosArray, uint64_t, i));
     }
     BSB_EXPORT_cstr(jbsb, "],");
 
     BSB_EXPORT_cstr(jbsb, "\"packetLen\":[");
-    for(i = 0; i < session->fileLenArray->len; i++) {
+    for(i = 0; session->fileLenArray && i < session->fileLenArray->len; i++) {
         if (i != 0)
             BSB_EXPORT_u08(jbsb, ',');
-        BSB_EXPORT_sprintf(jbsb, "%u", (uint16_t)g_array_index(session->fileLenArray, uint16_t, i));
+        moloch_db_export_u64(&jbsb, g_array_index(session->fileLenArray, uint16_t, i));
     }
     BSB_EXPORT_cstr(jbsb, "],");
 
     BSB_EXPORT_cstr(jbsb, "\"fileId\":[");
-    for(i = 0; i < session->fileNumArray->len; i++) {
-        if (i == 0)
-            BSB_EXPORT_sprintf(jbsb, "%u", (uint32_t)g_array_index(session->fileNumArray, uint32_t, i));
-        else
-            BSB_EXPORT_sprintf(jbsb, ",%u", (uint32_t)g_array_index(session->fileNumArray, uint32_t, i));
+    for(i = 0; session->fileNumArray && i < session->fileNumArray->len; i++) {
+        if (i != 0)
+            BSB_EXPORT_u08(jbsb, ',');
+        moloch_db_export_u64(&jbsb, g_array_index(session->fileNumArray, uint32_t, i));
     }
     BSB_EXPORT_cstr(jbsb, "],");
 
@@ -597,17 +603,20 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             inGroupNum = config.fields[pos]->dbGroupNum;
 
             if (inGroupNum) {
-                BSB_EXPORT_sprintf(jbsb, "\"%.*s\": {", config.fields[pos]->dbGroupLen, config.fields[pos]->dbGroup);
+                BSB_EXPORT_u08(jbsb, '"');
+                BSB_EXPORT_ptr(jbsb, config.fields[pos]->dbGroup, config.fields[pos]->dbGroupLen);
+                BSB_EXPORT_cstr(jbsb, "\": {");
             }
         }
 
         switch(config.fields[pos]->type) {
         case MOLOCH_FIELD_TYPE_INT:
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":%d", config.fields[pos]->dbField, session->fields[pos]->i);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":");
+            moloch_db_export_i64(&jbsb, session->fields[pos]->i);
             BSB_EXPORT_u08(jbsb, ',');
             break;
         case MOLOCH_FIELD_TYPE_STR:
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":");
             moloch_db_js0n_str(&jbsb,
                                (unsigned char *)session->fields[pos]->str,
                                flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
@@ -618,9 +627,11 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             break;
         case MOLOCH_FIELD_TYPE_STR_ARRAY:
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\":%u,", config.fields[pos]->dbField, session->fields[pos]->sarray->len);
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\":");
+                moloch_db_export_u64(&jbsb, session->fields[pos]->sarray->len);
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             for(i = 0; i < session->fields[pos]->sarray->len; i++) {
                 moloch_db_js0n_str(&jbsb,
                                    g_ptr_array_index(session->fields[pos]->sarray, i),
@@ -636,9 +647,11 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_STR_HASH:
             shash = session->fields[pos]->shash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\":%d,", config.fields[pos]->dbField, HASH_COUNT(s_, *shash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\":");
+                moloch_db_export_u64(&jbsb, HASH_COUNT(s_, *shash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             HASH_FORALL(s_, *shash, hstring,
                 moloch_db_js0n_str(&jbsb, (unsigned char *)hstring->str, hstring->utf8 || flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
                 BSB_EXPORT_u08(jbsb, ',');
@@ -656,9 +669,11 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_STR_GHASH:
             ghash = session->fields[pos]->ghash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\": %u,", config.fields[pos]->dbField, g_hash_table_size(ghash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\": ");
+                moloch_db_export_u64(&jbsb, g_hash_table_size(ghash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             g_hash_table_iter_init (&iter, ghash);
             while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
                 moloch_db_js0n_str(&jbsb, ikey, flags & MOLOCH_FIELD_FLAG_FORCE_UTF8);
@@ -674,11 +689,13 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_INT_HASH:
             ihash = session->fields[pos]->ihash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\": %d,", config.fields[pos]->dbField, HASH_COUNT(i_, *ihash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\": ");
+                moloch_db_export_u64(&jbsb, HASH_COUNT(i_, *ihash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             HASH_FORALL(i_, *ihash, hint,
-                BSB_EXPORT_sprintf(jbsb, "%u", hint->i_hash);
+                moloch_db_export_u64(&jbsb, hint->i_hash);
                 BSB_EXPORT_u08(jbsb, ',');
             );
             if (freeField) {
@@ -693,12 +710,14 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_INT_GHASH:
             ghash = session->fields[pos]->ghash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\": %u,", config.fields[pos]->dbField, g_hash_table_size(ghash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\": ");
+                moloch_db_export_u64(&jbsb, g_hash_table_size(ghash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             g_hash_table_iter_init (&iter, ghash);
             while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
-                BSB_EXPORT_sprintf(jbsb, "%u", (unsigned int)(long)ikey);
+                moloch_db_export_u64(&jbsb, (unsigned int)(long)ikey);
                 BSB_EXPORT_u08(jbsb, ',');
             }
 
@@ -717,11 +736,13 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             ikey = session->fields[pos]->ip;
             moloch_db_geo_lookup6(session, *(struct in6_addr *)ikey, &g, &as, &rir, &asFree);
             if (g) {
-                BSB_EXPORT_sprintf(jbsb, "\"%.*sGEO\":\"%2.2s\",", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField, g);
+                MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "GEO\":\"");
+                BSB_EXPORT_ptr(jbsb, g, strnlen(g, 2));
+                BSB_EXPORT_cstr(jbsb, "\",");
             }
 
             if (as) {
-                BSB_EXPORT_sprintf(jbsb, "\"%.*sASN\":", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField);
+                MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "ASN\":");
                 moloch_db_js0n_str(&jbsb, (unsigned char*)as, TRUE);
                 if (asFree) {
                     free(as);
@@ -730,16 +751,20 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             }
 
             if (rir) {
-                BSB_EXPORT_sprintf(jbsb, "\"%.*sRIR\":\"%s\",", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField, rir);
+                MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "RIR\":\"");
+                moloch_db_export_str(&jbsb, rir);
+                BSB_EXPORT_cstr(jbsb, "\",");
             }
 
             if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)ikey)) {
                 uint32_t ip = MOLOCH_V6_TO_V4(*(struct in6_addr *)ikey);
-                snprintf(ipsrc, sizeof(ipsrc), "%u.%u.%u.%u", ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, (ip >> 24) & 0xff);
+                moloch_db_ip4_str(ipsrc, ip);
             } else {
                 inet_ntop(AF_INET6, ikey, ipsrc, sizeof(ipsrc));
             }
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":\"%s\",", config.fields[pos]->dbField, ipsrc);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":\"");
+            moloch_db_export_str(&jbsb, ipsrc);
+            BSB_EXPORT_cstr(jbsb, "\",");
 
             if (freeField) {
                 g_free(session->fields[pos]->ip);
@@ -749,7 +774,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_IP_GHASH: {
             ghash = session->fields[pos]->ghash;
             if (flags & MOLOCH_FIELD_FLAG_CNT) {
-                BSB_EXPORT_sprintf(jbsb, "\"%sCnt\":%u,", config.fields[pos]->dbField, g_hash_table_size(ghash));
+                MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "Cnt\":");
+                moloch_db_export_u64(&jbsb, g_hash_table_size(ghash));
+                BSB_EXPORT_u08(jbsb, ',');
             }
 
             char                 *as[MAX_IPS];
@@ -759,7 +786,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             int                   i;
             int                   cnt = 0;
 
-            BSB_EXPORT_sprintf(jbsb, "\"%s\":[", config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD(jbsb, config.fields[pos], "\":[");
             g_hash_table_iter_init (&iter, ghash);
             while (g_hash_table_iter_next (&iter, &ikey, NULL)) {
                 moloch_db_geo_lookup6(session, *(struct in6_addr *)ikey, &g[cnt], &as[cnt], &rir[cnt], &asFree[cnt]);
@@ -769,20 +796,24 @@ void moloch_db_save_session(MolochSession_t *session, int final)
 
                 if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)ikey)) {
                     uint32_t ip = MOLOCH_V6_TO_V4(*(struct in6_addr *)ikey);
-                    snprintf(ipsrc, sizeof(ipsrc), "%u.%u.%u.%u", ip & 0xff, (ip >> 8) & 0xff, (ip >> 16) & 0xff, (ip >> 24) & 0xff);
+                    moloch_db_ip4_str(ipsrc, ip);
                 } else {
                     inet_ntop(AF_INET6, ikey, ipsrc, sizeof(ipsrc));
                 }
 
-                BSB_EXPORT_sprintf(jbsb, "\"%s\",", ipsrc);
+                BSB_EXPORT_u08(jbsb, '"');
+                moloch_db_export_str(&jbsb, ipsrc);
+                BSB_EXPORT_cstr(jbsb, "\",");
             }
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
 
-            BSB_EXPORT_sprintf(jbsb, "\"%.*sGEO\":[", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "GEO\":[");
             for (i = 0; i < cnt; i++) {
                 if (g[i]) {
-                    BSB_EXPORT_sprintf(jbsb, "\"%2.2s\",", g[i]);
+                    BSB_EXPORT_u08(jbsb, '"');
+                    BSB_EXPORT_ptr(jbsb, g[i], strnlen(g[i], 2));
+                    BSB_EXPORT_cstr(jbsb, "\",");
                 } else {
                     BSB_EXPORT_cstr(jbsb, "\"---\",");
                 }
@@ -790,7 +821,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
 
-            BSB_EXPORT_sprintf(jbsb, "\"%.*sASN\":[", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "ASN\":[");
             for (i = 0; i < cnt; i++) {
                 if (as[i]) {
                     moloch_db_js0n_str(&jbsb, (unsigned char*)as[i], TRUE);
@@ -804,10 +835,12 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
             BSB_EXPORT_cstr(jbsb, "],");
 
-            BSB_EXPORT_sprintf(jbsb, "\"%.*sRIR\":[", config.fields[pos]->dbFieldLen-2, config.fields[pos]->dbField);
+            MOLOCH_DB_EXPORT_FIELD_BASE(jbsb, config.fields[pos], "RIR\":[");
             for (i = 0; i < cnt; i++) {
                 if (rir[i]) {
-                    BSB_EXPORT_sprintf(jbsb, "\"%s\",", rir[i]);
+                    BSB_EXPORT_u08(jbsb, '"');
+                    moloch_db_export_str(&jbsb, rir[i]);
+                    BSB_EXPORT_cstr(jbsb, "\",");
                 } else {
                     BSB_EXPORT_cstr(jbsb, "\"\",");
                 }
@@ -824,7 +857,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         case MOLOCH_FIELD_TYPE_CERTSINFO: {
             MolochCertsInfoHashStd_t *cihash = session->fields[pos]->cihash;
 
-            BSB_EXPORT_sprintf(jbsb, "\"certCnt\":%d,", HASH_COUNT(t_, *cihash));
+            BSB_EXPORT_cstr(jbsb, "\"certCnt\":");
+            moloch_db_export_u64(&jbsb, HASH_COUNT(t_, *cihash));
+            BSB_EXPORT_u08(jbsb, ',');
             BSB_EXPORT_cstr(jbsb, "\"cert\":[");
 
             MolochCertsInfo_t *certs;
@@ -847,7 +882,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
-                BSB_EXPORT_sprintf(jbsb, "\"hash\":\"%s\",", certs->hash);
+                BSB_EXPORT_cstr(jbsb, "\"hash\":\"");
+                moloch_db_export_str(&jbsb, (char *)certs->hash);
+                BSB_EXPORT_cstr(jbsb, "\",");
 
                 if (certs->issuer.orgName) {
                     BSB_EXPORT_cstr(jbsb, "\"issuerON\":");
@@ -879,14 +916,16 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     int k;
                     BSB_EXPORT_cstr(jbsb, "\"serial\":\"");
                     for (k = 0; k < certs->serialNumberLen; k++) {
-                        BSB_EXPORT_sprintf(jbsb, "%02x", certs->serialNumber[k]);
+                        BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[certs->serialNumber[k]], 2);
                     }
                     BSB_EXPORT_u08(jbsb, '"');
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
                 if (certs->alt.s_count) {
-                    BSB_EXPORT_sprintf(jbsb, "\"altCnt\":%d,", certs->alt.s_count);
+                    BSB_EXPORT_cstr(jbsb, "\"altCnt\":");
+                    moloch_db_export_u64(&jbsb, certs->alt.s_count);
+                    BSB_EXPORT_u08(jbsb, ',');
                     BSB_EXPORT_cstr(jbsb, "\"alt\":[");
                     while (certs->alt.s_count > 0) {
                         DLL_POP_HEAD(s_, &certs->alt, string);
@@ -900,10 +939,16 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                     BSB_EXPORT_u08(jbsb, ',');
                 }
 
-                BSB_EXPORT_sprintf(jbsb, "\"notBefore\": %" PRId64 ",", certs->notBefore*1000);
-                BSB_EXPORT_sprintf(jbsb, "\"notAfter\": %" PRId64 ",", certs->notAfter*1000);
-                if (certs->notAfter >= certs->notBefore)
-                    BSB_EXPORT_sprintf(jbsb, "\"validDays\": %" PRId64 ",", (certs->notAfter - certs->notBefore)/(60*60*24));
+                BSB_EXPORT_cstr(jbsb, "\"notBefore\": ");
+                moloch_db_export_i64(&jbsb, certs->notBefore*1000);
+                BSB_EXPORT_cstr(jbsb, ",\"notAfter\": ");
+                moloch_db_export_i64(&jbsb, certs->notAfter*1000);
+                BSB_EXPORT_u08(jbsb, ',');
+                if (certs->notAfter >= certs->notBefore) {
+                    BSB_EXPORT_cstr(jbsb, "\"validDays\": ");
+                    moloch_db_export_i64(&jbsb, (certs->notAfter - certs->notBefore)/(60*60*24));
+                    BSB_EXPORT_u08(jbsb, ',');
+                }
 
                 BSB_EXPORT_rewind(jbsb, 1); // Remove last comma
 
@@ -972,6 +1017,51 @@ cleanup:
     MOLOCH_UNLOCK(dbInfo[thread].lock);
 }
 /******************************************************************************/
+void moloch_db_save_session(MolochSession_t *session, int final)
+{
+    if (!moloch_db_save_session_check(session, final)) {
+        if (final)
+            moloch_session_free(session);
+        return;
+    }
+
+    // Let a serializer thread create the record and free the session
+    if (final && serializeThreads > 0 && serializeOutstanding < MOLOCH_DB_MAX_SERIALIZE_Q) {
+        moloch_session_detach(session);
+        MOLOCH_THREAD_INCR(serializeOutstanding);
+        MOLOCH_LOCK(serializeQ);
+        DLL_PUSH_TAIL(q_, &serializeQ, session);
+        MOLOCH_COND_SIGNAL(serializeQ);
+        MOLOCH_UNLOCK(serializeQ);
+        return;
+    }
+
+    moloch_db_session_encode(session, final, session->thread);
+    if (final)
+        moloch_session_free(session);
+}
+/******************************************************************************/
+LOCAL void *moloch_db_serialize_thread(void *threadp)
+{
+    const int thread = (long)threadp;
+
+    while (1) {
+        MolochSession_t *session;
+
+        MOLOCH_LOCK(serializeQ);
+        while (DLL_COUNT(q_, &serializeQ) == 0) {
+            MOLOCH_COND_WAIT(serializeQ);
+        }
+        DLL_POP_HEAD(q_, &serializeQ, session);
+        MOLOCH_UNLOCK(serializeQ);
+
+        moloch_db_session_encode(session, TRUE, thread);
+        moloch_session_free(session);
+        __sync_sub_and_fetch(&serializeOutstanding, 1);
+    }
+    return NULL;
+}
+/******************************************************************************/
 LOCAL uint64_t zero_atoll(char *v) {
     if (v)
         return atoll(v);
@@ -1134,7 +1224,14 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     static uint64_t       lastDropped[NUMBER_OF_STATS];
     static uint64_t       lastFragsDropped[NUMBER_OF_STATS];
     static uint64_t       lastOverloadDropped[NUMBER_OF_STATS];
+    static uint64_t       lastSpiDonePackets[NUMBER_OF_STATS];
+    static uint64_t       lastShuntedPackets[NUMBER_OF_STATS];
+    static uint64_t       lastSteerMoves[NUMBER_OF_STATS];
+    static uint64_t       lastSteerHandoffs[NUMBER_OF_STATS];
     static uint64_t       lastESDropped[NUMBER_OF_STATS];
+    static uint64_t       lastESCompressIn[NUMBER_OF_STATS];
+    static uint64_t       lastESCompressOut[NUMBER_OF_STATS];
+    static uint64_t       lastESCompressUsec[NUMBER_OF_STATS];
     static struct rusage  lastUsage[NUMBER_OF_STATS];
     static struct timeval lastTime[NUMBER_OF_STATS];
     static int            intervals[NUMBER_OF_STATS] = {1, 5, 60, 600};
@@ -1159,8 +1256,15 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     uint64_t overloadDropped = moloch_packet_dropped_overload();
     uint64_t totalDropped    = moloch_packet_dropped_packets();
     uint64_t fragsDropped    = moloch_packet_dropped_frags();
+    uint64_t spiDonePackets  = moloch_packet_spi_done_packets();
+    uint64_t shuntedPackets  = moloch_packet_shunted_packets();
+    uint64_t steerMoves      = moloch_packet_steer_moves();
+    uint64_t steerHandoffs   = moloch_packet_steer_handoffs();
     uint64_t esDropped       = moloch_http_dropped_count(esServer);
+    uint64_t esCompressIn, esCompressOut, esCompressUsec;
+    moloch_http_compress_stats(esServer, &esCompressIn, &esCompressOut, &esCompressUsec);
     uint64_t totalBytes      = moloch_packet_total_bytes();
+    uint64_t totalPackets    = moloch_packet_total_packets();
 
     for (i = 0; config.pcapDir[i]; i++) {
         struct statvfs vfs;
@@ -1200,85 +1304,121 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     }
 #endif
 
-    int json_len = snprintf(json, MOLOCH_HTTP_BUFFER_SIZE,
-        "{"
-        "\"ver\": \"%s\", "
-        "\"nodeName\": \"%s\", "
-        "\"hostname\": \"%s\", "
-        "\"interval\": %d, "
-        "\"currentTime\": %" PRIu64 ", "
-        "\"usedSpaceM\": %" PRIu64 ", "
-        "\"freeSpaceM\": %" PRIu64 ", "
-        "\"freeSpaceP\": %.2f, "
-        "\"monitoring\": %u, "
-        "\"memory\": %" PRIu64 ", "
-        "\"memoryP\": %.2f, "
-        "\"cpu\": %" PRIu64 ", "
-        "\"diskQueue\": %u, "
-        "\"esQueue\": %u, "
-        "\"packetQueue\": %u, "
-        "\"fragsQueue\": %u, "
-        "\"frags\": %u, "
-        "\"needSave\": %u, "
-        "\"closeQueue\": %u, "
-        "\"totalPackets\": %" PRIu64 ", "
-        "\"totalK\": %" PRIu64 ", "
-        "\"totalSessions\": %" PRIu64 ", "
-        "\"totalDropped\": %" PRIu64 ", "
-        "\"tcpSessions\": %u, "
-        "\"udpSessions\": %u, "
-        "\"icmpSessions\": %u, "
-        "\"sctpSessions\": %u, "
-        "\"espSessions\": %u, "
-        "\"deltaPackets\": %" PRIu64 ", "
-        "\"deltaBytes\": %" PRIu64 ", "
-        "\"deltaSessions\": %" PRIu64 ", "
-        "\"deltaSessionBytes\": %" PRIu64 ", "
-        "\"deltaDropped\": %" PRIu64 ", "
-        "\"deltaFragsDropped\": %" PRIu64 ", "
-        "\"deltaOverloadDropped\": %" PRIu64 ", "
-        "\"deltaESDropped\": %" PRIu64 ", "
-        "\"esHealthMS\": %" PRIu64 ", "
-        "\"deltaMS\": %" PRIu64
-        "}",
-        VERSION,
-        config.nodeName,
-        config.hostName,
-        intervals[n],
-        cursec,
-        lastUsedSpaceM,
-        freeSpaceM,
-        freeSpaceM*100.0/totalSpaceM,
-        moloch_session_monitoring(),
-        moloch_db_memory_size(),
-        memUse,
-        diffusage*10000/diffms,
-        moloch_writer_queue_length?moloch_writer_queue_length():0,
-        moloch_http_queue_length(esServer),
-        moloch_packet_outstanding(),
-        moloch_packet_frags_outstanding(),
-        moloch_packet_frags_size(),
-        moloch_session_need_save_outstanding(),
-        moloch_session_close_outstanding(),
-        dbTotalPackets[n],
-        dbTotalK[n],
-        dbTotalSessions[n],
-        dbTotalDropped[n],
-        moloch_session_watch_count(SESSION_TCP),
-        moloch_session_watch_count(SESSION_UDP),
-        moloch_session_watch_count(SESSION_ICMP),
-        moloch_session_watch_count(SESSION_SCTP),
-        moloch_session_watch_count(SESSION_ESP),
-        (totalPackets - lastPackets[n]),
-        (totalBytes - lastBytes[n]),
-        (totalSessions - lastSessions[n]),
-        (totalSessionBytes - lastSessionBytes[n]),
-        (totalDropped - lastDropped[n]),
-        (fragsDropped - lastFragsDropped[n]),
-        (overloadDropped - lastOverloadDropped[n]),
-        (esDropped - lastESDropped[n]),
-        esHealthMS,
-        diffms);
+    uint32_t monitoring = moloch_session_monitoring();
+    uint64_t sessionBytes = monitoring ? moloch_session_memory()/monitoring : 0;
+
+    char topology[4096];
+    moloch_thread_topology(topology, sizeof(topology));
+
+    BSB jbsb;
+    BSB_INIT(jbsb, json, MOLOCH_HTTP_BUFFER_SIZE);
+
+    BSB_EXPORT_cstr(jbsb, "{\"ver\": \"");
+    moloch_db_export_str(&jbsb, VERSION);
+    BSB_EXPORT_u08(jbsb, '"');
+    BSB_EXPORT_cstr(jbsb, ", \"nodeName\": \"");
+    moloch_db_export_str(&jbsb, config.nodeName);
+    BSB_EXPORT_u08(jbsb, '"');
+    BSB_EXPORT_cstr(jbsb, ", \"hostname\": \"");
+    moloch_db_export_str(&jbsb, config.hostName);
+    BSB_EXPORT_u08(jbsb, '"');
+    BSB_EXPORT_cstr(jbsb, ", \"interval\": ");
+    moloch_db_export_u64(&jbsb, intervals[n]);
+    BSB_EXPORT_cstr(jbsb, ", \"currentTime\": ");
+    moloch_db_export_u64(&jbsb, cursec);
+    BSB_EXPORT_cstr(jbsb, ", \"usedSpaceM\": ");
+    moloch_db_export_u64(&jbsb, lastUsedSpaceM);
+    BSB_EXPORT_cstr(jbsb, ", \"freeSpaceM\": ");
+    moloch_db_export_u64(&jbsb, freeSpaceM);
+    BSB_EXPORT_cstr(jbsb, ", \"freeSpaceP\": ");
+    moloch_db_export_fixed2(&jbsb, freeSpaceM*100.0/totalSpaceM);
+    BSB_EXPORT_cstr(jbsb, ", \"monitoring\": ");
+    moloch_db_export_u64(&jbsb, monitoring);
+    BSB_EXPORT_cstr(jbsb, ", \"memory\": ");
+    moloch_db_export_u64(&jbsb, moloch_db_memory_size());
+    BSB_EXPORT_cstr(jbsb, ", \"memoryP\": ");
+    moloch_db_export_fixed2(&jbsb, memUse);
+    BSB_EXPORT_cstr(jbsb, ", \"cpu\": ");
+    moloch_db_export_u64(&jbsb, diffusage*10000/diffms);
+    BSB_EXPORT_cstr(jbsb, ", \"diskQueue\": ");
+    moloch_db_export_u64(&jbsb, moloch_writer_queue_length?moloch_writer_queue_length():0);
+    BSB_EXPORT_cstr(jbsb, ", \"esQueue\": ");
+    moloch_db_export_u64(&jbsb, moloch_http_queue_length(esServer));
+    BSB_EXPORT_cstr(jbsb, ", \"packetQueue\": ");
+    moloch_db_export_u64(&jbsb, moloch_packet_outstanding());
+    BSB_EXPORT_cstr(jbsb, ", \"fragsQueue\": ");
+    moloch_db_export_u64(&jbsb, moloch_packet_frags_outstanding());
+    BSB_EXPORT_cstr(jbsb, ", \"frags\": ");
+    moloch_db_export_u64(&jbsb, moloch_packet_frags_size());
+    BSB_EXPORT_cstr(jbsb, ", \"needSave\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_need_save_outstanding());
+    BSB_EXPORT_cstr(jbsb, ", \"closeQueue\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_close_outstanding());
+    BSB_EXPORT_cstr(jbsb, ", \"serializeQueue\": ");
+    moloch_db_export_u64(&jbsb, serializeOutstanding);
+    BSB_EXPORT_cstr(jbsb, ", \"timeoutLag\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_timeout_lag());
+    BSB_EXPORT_cstr(jbsb, ", \"totalPackets\": ");
+    moloch_db_export_u64(&jbsb, dbTotalPackets[n]);
+    BSB_EXPORT_cstr(jbsb, ", \"totalK\": ");
+    moloch_db_export_u64(&jbsb, dbTotalK[n]);
+    BSB_EXPORT_cstr(jbsb, ", \"totalSessions\": ");
+    moloch_db_export_u64(&jbsb, dbTotalSessions[n]);
+    BSB_EXPORT_cstr(jbsb, ", \"totalDropped\": ");
+    moloch_db_export_u64(&jbsb, dbTotalDropped[n]);
+    BSB_EXPORT_cstr(jbsb, ", \"tcpSessions\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_watch_count(SESSION_TCP));
+    BSB_EXPORT_cstr(jbsb, ", \"udpSessions\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_watch_count(SESSION_UDP));
+    BSB_EXPORT_cstr(jbsb, ", \"icmpSessions\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_watch_count(SESSION_ICMP));
+    BSB_EXPORT_cstr(jbsb, ", \"sctpSessions\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_watch_count(SESSION_SCTP));
+    BSB_EXPORT_cstr(jbsb, ", \"espSessions\": ");
+    moloch_db_export_u64(&jbsb, moloch_session_watch_count(SESSION_ESP));
+    BSB_EXPORT_cstr(jbsb, ", \"sessionBytes\": ");
+    moloch_db_export_u64(&jbsb, sessionBytes);
+    BSB_EXPORT_cstr(jbsb, ", \"sessionsPerGB\": ");
+    moloch_db_export_u64(&jbsb, sessionBytes ? (1024LL*1024LL*1024LL)/sessionBytes : 0);
+    BSB_EXPORT_cstr(jbsb, ", \"deltaPackets\": ");
+    moloch_db_export_u64(&jbsb, (totalPackets - lastPackets[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaBytes\": ");
+    moloch_db_export_u64(&jbsb, (totalBytes - lastBytes[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaSessions\": ");
+    moloch_db_export_u64(&jbsb, (totalSessions - lastSessions[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaSessionBytes\": ");
+    moloch_db_export_u64(&jbsb, (totalSessionBytes - lastSessionBytes[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaDropped\": ");
+    moloch_db_export_u64(&jbsb, (totalDropped - lastDropped[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaFragsDropped\": ");
+    moloch_db_export_u64(&jbsb, (fragsDropped - lastFragsDropped[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaOverloadDropped\": ");
+    moloch_db_export_u64(&jbsb, (overloadDropped - lastOverloadDropped[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaSpiDonePackets\": ");
+    moloch_db_export_u64(&jbsb, (spiDonePackets - lastSpiDonePackets[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaShuntedPackets\": ");
+    moloch_db_export_u64(&jbsb, (shuntedPackets - lastShuntedPackets[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"packetThreadImbalance\": ");
+    moloch_db_export_fixed2(&jbsb, moloch_packet_steer_imbalance());
+    BSB_EXPORT_cstr(jbsb, ", \"deltaSteerMoves\": ");
+    moloch_db_export_u64(&jbsb, (steerMoves - lastSteerMoves[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaSteerHandoffs\": ");
+    moloch_db_export_u64(&jbsb, (steerHandoffs - lastSteerHandoffs[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"deltaESDropped\": ");
+    moloch_db_export_u64(&jbsb, (esDropped - lastESDropped[n]));
+    BSB_EXPORT_cstr(jbsb, ", \"esCompressRatio\": ");
+    moloch_db_export_fixed2(&jbsb, esCompressOut > lastESCompressOut[n] ? (double)(esCompressIn - lastESCompressIn[n])/(esCompressOut - lastESCompressOut[n]) : 0.0);
+    BSB_EXPORT_cstr(jbsb, ", \"deltaESCompressMS\": ");
+    moloch_db_export_u64(&jbsb, (esCompressUsec - lastESCompressUsec[n])/1000);
+    BSB_EXPORT_cstr(jbsb, ", \"esHealthMS\": ");
+    moloch_db_export_u64(&jbsb, esHealthMS);
+    BSB_EXPORT_cstr(jbsb, ", \"topology\": \"");
+    moloch_db_export_str(&jbsb, topology);
+    BSB_EXPORT_u08(jbsb, '"');
+    BSB_EXPORT_cstr(jbsb, ", \"deltaMS\": ");
+    moloch_db_export_u64(&jbsb, diffms);
+    BSB_EXPORT_u08(jbsb, '}');
+    const int json_len = BSB_LENGTH(jbsb);
 
     lastTime[n]            = currentTime;
     lastBytes[n]           = totalBytes;
@@ -1288,7 +1428,14 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     lastDropped[n]         = totalDropped;
     lastFragsDropped[n]    = fragsDropped;
     lastOverloadDropped[n] = overloadDropped;
+    lastSpiDonePackets[n]  = spiDonePackets;
+    lastShuntedPackets[n]  = shuntedPackets;
+    lastSteerMoves[n]      = steerMoves;
+    lastSteerHandoffs[n]   = steerHandoffs;
     lastESDropped[n]       = esDropped;
+    lastESCompressIn[n]    = esCompressIn;
+    lastESCompressOut[n]   = esCompressOut;
+    lastESCompressUsec[n]  = esCompressUsec;
     lastUsage[n]           = usage;
 
     if (n == 0) {
@@ -1324,6 +1471,7 @@ LOCAL gboolean moloch_db_update_stats_gfunc (gpointer user_data)
     return TRUE;
 }
 /******************************************************************************/
+LOCAL void moloch_db_files_flush();
 // Runs on main thread
 LOCAL gboolean moloch_db_flush_gfunc (gpointer user_data )
 {
@@ -1332,7 +1480,7 @@ LOCAL gboolean moloch_db_flush_gfunc (gpointer user_data )
 
     gettimeofday(&currentTime, NULL);
 
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < numDbInfo; thread++) {
         MOLOCH_LOCK(dbInfo[thread].lock);
         if (dbInfo[thread].json && BSB_LENGTH(dbInfo[thread].bsb) > 0 &&
             ((currentTime.tv_sec - dbInfo[thread].lastSave) >= config.dbFlushTimeout || user_data == (gpointer)1)) {
@@ -1350,6 +1498,10 @@ LOCAL gboolean moloch_db_flush_gfunc (gpointer user_data )
         }
     }
 
+    MOLOCH_LOCK(filesBulk);
+    moloch_db_files_flush();
+    MOLOCH_UNLOCK(filesBulk);
+
     return TRUE;
 }
 /******************************************************************************/
@@ -1457,13 +1609,195 @@ uint32_t moloch_db_get_sequence_number_sync(char *name)
     }
 }
 /******************************************************************************/
-LOCAL void moloch_db_fn_seq_cb(uint32_t newSeq, gpointer UNUSED(uw))
+/* File numbers are leased from the fn-<node> sequence fileNumLease at a time by
+ * setting its external version to the end of the lease, so creating a file
+ * only waits on es if a lease runs out before the next one arrives.  This
+ * relies on only this node bumping its sequence.
+ */
+LOCAL uint32_t moloch_db_file_num_watermark()
+{
+    uint32_t watermark = 0;
+
+    if (!fileNumWatermark)
+        return 0;
+
+    FILE *fp = fopen(fileNumWatermark, "r");
+    if (fp) {
+        if (fscanf(fp, "%u", &watermark) != 1)
+            watermark = 0;
+        fclose(fp);
+    }
+    return watermark;
+}
+/******************************************************************************/
+// nextFileNum lock held
+LOCAL void moloch_db_file_num_leased(uint32_t end)
+{
+    fileNumLeaseMax = end;
+
+    if (!fileNumWatermark)
+        return;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fileNumWatermark);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        LOG("WARNING - Couldn't write file number watermark %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%u\n", end);
+    fclose(fp);
+    if (rename(tmp, fileNumWatermark))
+        LOG("WARNING - Couldn't rename %s: %s", tmp, strerror(errno));
+}
+/******************************************************************************/
+LOCAL uint32_t moloch_db_file_num_version(unsigned char *data, size_t data_len)
+{
+    uint32_t       version_len;
+    unsigned char *version = moloch_js0n_get(data, data_len, "_version", &version_len);
+
+    if (!version_len || !version)
+        return 0;
+    return atoi((char *)version);
+}
+/******************************************************************************/
+// nextFileNum lock held, returns the first number of the new lease
+LOCAL uint32_t moloch_db_file_num_lease_sync()
+{
+    char     key[200];
+    int      key_len;
+    size_t   data_len;
+    uint8_t *data;
+
+    while (1) {
+        key_len = snprintf(key, sizeof(key), "/%ssequence/sequence/fn-%s", config.prefix, config.nodeName);
+        data = moloch_http_get(esServer, key, key_len, &data_len);
+        uint32_t base = MAX(moloch_db_file_num_version(data, data_len), moloch_db_file_num_watermark());
+        base = MAX(base, fileNumLeaseMax);
+        free(data);
+
+        key_len = snprintf(key, sizeof(key), "/%ssequence/sequence/fn-%s?version_type=external&version=%u", config.prefix, config.nodeName, base + fileNumLeaseSize);
+        data = moloch_http_send_sync(esServer, "POST", key, key_len, "{}", 2, NULL, &data_len);
+
+        if (moloch_db_file_num_version(data, data_len) == base + fileNumLeaseSize) {
+            free(data);
+            moloch_db_file_num_leased(base + fileNumLeaseSize);
+            return base + 1;
+        }
+
+        LOG("ERROR - Couldn't lease file numbers: %d %.*s", (int)data_len, (int)data_len, data);
+        free(data);
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_db_file_num_lease(uint32_t base);
+LOCAL void moloch_db_file_num_get_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer UNUSED(uw))
 {
     MOLOCH_LOCK(nextFileNum);
-    nextFileNum = newSeq;
+    uint32_t base = MAX(moloch_db_file_num_version(data, data_len), moloch_db_file_num_watermark());
+    base = MAX(base, fileNumLeaseMax);
+    moloch_db_file_num_lease(base);
     MOLOCH_UNLOCK(nextFileNum);
 }
 /******************************************************************************/
+LOCAL void moloch_db_file_num_lease_cb(int UNUSED(code), unsigned char *data, int data_len, gpointer uw)
+{
+    const uint32_t base = (long)uw;
+
+    MOLOCH_LOCK(nextFileNum);
+    if (moloch_db_file_num_version(data, data_len) == base + fileNumLeaseSize && base >= fileNumLeaseMax) {
+        moloch_db_file_num_leased(base + fileNumLeaseSize);
+        fileNumPendingStart = base + 1;
+        fileNumPendingEnd = base + fileNumLeaseSize;
+        fileNumLeaseInFlight = 0;
+    } else {
+        // Someone else moved the sequence, refetch it and try again
+        char key[200];
+        int  key_len = snprintf(key, sizeof(key), "/%ssequence/sequence/fn-%s", config.prefix, config.nodeName);
+        moloch_http_send(esServer, "GET", key, key_len, NULL, 0, NULL, FALSE, moloch_db_file_num_get_cb, NULL);
+    }
+    MOLOCH_UNLOCK(nextFileNum);
+}
+/******************************************************************************/
+// nextFileNum lock held
+LOCAL void moloch_db_file_num_lease(uint32_t base)
+{
+    char key[200];
+    int  key_len = snprintf(key, sizeof(key), "/%ssequence/sequence/fn-%s?version_type=external&version=%u", config.prefix, config.nodeName, base + fileNumLeaseSize);
+    char *json = moloch_http_get_buffer(3);
+    memcpy(json, "{}", 3);
+
+    fileNumLeaseInFlight = 1;
+    moloch_http_send(esServer, "POST", key, key_len, json, 2, NULL, FALSE, moloch_db_file_num_lease_cb, (gpointer)(long)base);
+}
+/******************************************************************************/
+// nextFileNum lock held
+LOCAL uint32_t moloch_db_file_num_next()
+{
+    if (nextFileNum == 0 || nextFileNum > fileNumLeaseEnd) {
+        if (fileNumPendingStart) {
+            nextFileNum = fileNumPendingStart;
+            fileNumLeaseEnd = fileNumPendingEnd;
+            fileNumPendingStart = 0;
+        } else {
+            // Ran out before the next lease arrived
+            nextFileNum = moloch_db_file_num_lease_sync();
+            fileNumLeaseEnd = fileNumLeaseMax;
+        }
+    }
+
+    const uint32_t num = nextFileNum++;
+
+    // Start fetching the next lease once a quarter of this one is used
+    if (!fileNumPendingStart && !fileNumLeaseInFlight && fileNumLeaseEnd - num < fileNumLeaseSize * 3 / 4)
+        moloch_db_file_num_lease(fileNumLeaseMax);
+
+    return num;
+}
+/******************************************************************************/
+// filesBulk lock held
+LOCAL void moloch_db_files_flush()
+{
+    if (!filesBulkJson)
+        return;
+
+    if (BSB_LENGTH(filesBulkBsb) > 0) {
+        moloch_http_send(esServer, "POST", "/_bulk?refresh=true", -1, filesBulkJson, BSB_LENGTH(filesBulkBsb), NULL, FALSE, NULL, NULL);
+    } else {
+        moloch_http_free_buffer(filesBulkJson);
+    }
+    filesBulkJson = 0;
+}
+/******************************************************************************/
+/* Queue a files index action, they are sent in one bulk by the flush timer.
+ * Creates and filesize updates share the bulk so they stay in order.
+ */
+LOCAL void moloch_db_files_add(const char *action, uint32_t num, const char *doc, int doc_len)
+{
+    MOLOCH_LOCK(filesBulk);
+    if (filesBulkJson && BSB_REMAINING(filesBulkBsb) < doc_len + 200)
+        moloch_db_files_flush();
+
+    if (!filesBulkJson) {
+        const int size = MAX(MOLOCH_DB_FILES_BULK_SIZE, doc_len + 200);
+        filesBulkJson = moloch_http_get_buffer(size);
+        BSB_INIT(filesBulkBsb, filesBulkJson, size);
+    }
+
+    BSB_EXPORT_cstr(filesBulkBsb, "{\"");
+    moloch_db_export_str(&filesBulkBsb, action);
+    BSB_EXPORT_cstr(filesBulkBsb, "\": {\"_index\": \"");
+    moloch_db_export_str(&filesBulkBsb, config.prefix);
+    BSB_EXPORT_cstr(filesBulkBsb, "files\", \"_type\": \"file\", \"_id\": \"");
+    moloch_db_export_str(&filesBulkBsb, config.nodeName);
+    BSB_EXPORT_u08(filesBulkBsb, '-');
+    moloch_db_export_u64(&filesBulkBsb, num);
+    BSB_EXPORT_cstr(filesBulkBsb, "\"}}\n");
+    BSB_EXPORT_ptr(filesBulkBsb, doc, doc_len);
+    BSB_EXPORT_u08(filesBulkBsb, '\n');
+    MOLOCH_UNLOCK(filesBulk);
+}
+/******************************************************************************/
 LOCAL void moloch_db_load_file_num()
 {
     char               key[200];
@@ -1527,11 +1861,11 @@ fetch_file_num:
     if (data)
         free(data);
 
-    if (!config.pcapReadOffline) {
-        /* If doing a live file create a file number now */
-        snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-        nextFileNum = moloch_db_get_sequence_number_sync(key);
-    }
+    /* Lease the first block of file numbers now */
+    MOLOCH_LOCK(nextFileNum);
+    nextFileNum = moloch_db_file_num_lease_sync();
+    fileNumLeaseEnd = fileNumLeaseMax;
+    MOLOCH_UNLOCK(nextFileNum);
 }
 /******************************************************************************/
 // Modified From https://github.com/phaag/nfdump/blob/master/bin/flist.c
@@ -1565,10 +1899,28 @@ LOCAL void moloch_db_mkpath(char *path)
     }
 }
 /******************************************************************************/
+/* Start of a files doc, the caller adds any extra fields and the closing brace */
+LOCAL void moloch_db_file_doc(BSB *bsb, uint32_t num, const char *name, uint64_t fp, gboolean haveSize, uint64_t size, int locked)
+{
+    BSB_EXPORT_cstr(*bsb, "{\"num\":");
+    moloch_db_export_u64(bsb, num);
+    BSB_EXPORT_cstr(*bsb, ", \"name\":\"");
+    moloch_db_export_str(bsb, name);
+    BSB_EXPORT_cstr(*bsb, "\", \"first\":");
+    moloch_db_export_u64(bsb, fp);
+    BSB_EXPORT_cstr(*bsb, ", \"node\":\"");
+    moloch_db_export_str(bsb, config.nodeName);
+    BSB_EXPORT_u08(*bsb, '"');
+    if (haveSize) {
+        BSB_EXPORT_cstr(*bsb, ", \"filesize\":");
+        moloch_db_export_u64(bsb, size);
+    }
+    BSB_EXPORT_cstr(*bsb, ", \"locked\":");
+    moloch_db_export_i64(bsb, locked);
+}
+/******************************************************************************/
 char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t size, int locked, uint32_t *id, ...)
 {
-    char               key[100];
-    int                key_len;
     uint32_t           num;
     char               filename[1024];
     char              *json = moloch_http_get_buffer(MOLOCH_HTTP_BUFFER_SIZE);
@@ -1579,16 +1931,7 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
     BSB_INIT(jbsb, json, MOLOCH_HTTP_BUFFER_SIZE);
 
     MOLOCH_LOCK(nextFileNum);
-    snprintf(key, sizeof(key), "fn-%s", config.nodeName);
-    if (nextFileNum == 0) {
-        /* If doing an offline file OR the last async call hasn't returned, just get a sync filenum */
-        num = moloch_db_get_sequence_number_sync(key);
-    } else {
-        /* If doing a live file, use current file num and schedule the next one */
-        num = nextFileNum;
-        nextFileNum = 0; /* Don't reuse number */
-        moloch_db_get_sequence_number(key, moloch_db_fn_seq_cb, 0);
-    }
+    num = moloch_db_file_num_next();
 
 
     if (name) {
@@ -1605,8 +1948,7 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
         name = g_regex_replace_literal(numHexRegex, name1, -1, 0, (char *)moloch_char_to_hexstr[num%256], 0, NULL);
         g_free(name1);
 
-        BSB_EXPORT_sprintf(jbsb, "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"filesize\":%" PRIu64 ", \"locked\":%d", num, name, fp, config.nodeName, size, locked);
-        key_len = snprintf(key, sizeof(key), "/%sfiles/file/%s-%u?refresh=true", config.prefix, config.nodeName,num);
+        moloch_db_file_doc(&jbsb, num, name, fp, TRUE, size, locked);
     } else {
 
         uint16_t flen = strlen(config.pcapDir[config.pcapDirPos]);
@@ -1686,8 +2028,7 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
 
         snprintf(filename+flen, sizeof(filename) - flen, "/%s-%02d%02d%02d-%08u.pcap", config.nodeName, tmp->tm_year%100, tmp->tm_mon+1, tmp->tm_mday, num);
 
-        BSB_EXPORT_sprintf(jbsb, "{\"num\":%d, \"name\":\"%s\", \"first\":%" PRIu64 ", \"node\":\"%s\", \"locked\":%d", num, filename, fp, config.nodeName, locked);
-        key_len = snprintf(key, sizeof(key), "/%sfiles/file/%s-%u?refresh=true", config.prefix, config.nodeName, num);
+        moloch_db_file_doc(&jbsb, num, filename, fp, FALSE, 0, locked);
     }
 
     va_list  args;
@@ -1701,22 +2042,28 @@ char *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t
         if (!value)
             break;
 
-        BSB_EXPORT_sprintf(jbsb, ", \"%s\": ", field);
-        if (*value == '{' || *value == '[')
-            BSB_EXPORT_sprintf(jbsb, "%s", value);
-        else
-            BSB_EXPORT_sprintf(jbsb, "\"%s\"", value);
+        BSB_EXPORT_cstr(jbsb, ", \"");
+        moloch_db_export_str(&jbsb, field);
+        BSB_EXPORT_cstr(jbsb, "\": ");
+        if (*value == '{' || *value == '[') {
+            moloch_db_export_str(&jbsb, value);
+        } else {
+            BSB_EXPORT_u08(jbsb, '"');
+            moloch_db_export_str(&jbsb, value);
+            BSB_EXPORT_u08(jbsb, '"');
+        }
     }
     va_end(args);
 
     BSB_EXPORT_u08(jbsb, '}');
 
-    moloch_http_send(esServer, "POST", key, key_len, json, BSB_LENGTH(jbsb), NULL, FALSE, NULL, NULL);
+    moloch_db_files_add("index", num, json, BSB_LENGTH(jbsb));
 
     MOLOCH_UNLOCK(nextFileNum);
 
     if (config.logFileCreation)
-        LOG("Creating file %u with key >%s< using >%.*s<", num, key, (int)BSB_LENGTH(jbsb), json);
+        LOG("Creating file %u using >%.*s<", num, (int)BSB_LENGTH(jbsb), json);
+    moloch_http_free_buffer(json);
 
     *id = num;
 
@@ -2096,20 +2443,18 @@ void moloch_db_update_field(char *expression, char *name, char *value)
 /******************************************************************************/
 void moloch_db_update_filesize(uint32_t fileid, uint64_t filesize)
 {
-    char                   key[1000];
-    int                    key_len;
-    int                    json_len;
+    char                   json[100];
+    BSB                    bsb;
 
     if (config.dryRun)
         return;
 
-    char                  *json = moloch_http_get_buffer(1000);
+    BSB_INIT(bsb, json, sizeof(json));
+    BSB_EXPORT_cstr(bsb, "{\"doc\": {\"filesize\": ");
+    moloch_db_export_u64(&bsb, filesize);
+    BSB_EXPORT_cstr(bsb, "}}");
 
-    key_len = snprintf(key, sizeof(key), "/%sfiles/file/%s-%u/_update", config.prefix, config.nodeName, fileid);
-
-    json_len = snprintf(json, 1000, "{\"doc\": {\"filesize\": %" PRIu64 "}}", filesize);
-
-    moloch_http_send(esServer, "POST", key, key_len, json, json_len, NULL, TRUE, NULL, NULL);
+    moloch_db_files_add("update", fileid, json, BSB_LENGTH(bsb));
 }
 /******************************************************************************/
 gboolean moloch_db_file_exists(const char *filename, uint32_t *outputId)
@@ -2172,8 +2517,14 @@ gboolean moloch_db_file_exists(const char *filename, uint32_t *outputId)
 /******************************************************************************/
 int moloch_db_can_quit()
 {
+    if (serializeOutstanding > 0) {
+        if (config.debug)
+            LOG ("Can't quit, serializeOutstanding %u", serializeOutstanding);
+        return 1;
+    }
+
     int thread;
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < numDbInfo; thread++) {
         // Make sure we can lock, that means a save isn't in progress
         MOLOCH_LOCK(dbInfo[thread].lock);
         if (dbInfo[thread].json && BSB_LENGTH(dbInfo[thread].bsb) > 0) {
@@ -2216,6 +2567,8 @@ void moloch_db_init()
     }
     myPid = getpid();
     gettimeofday(&startTime, NULL);
+    fileNumLeaseSize = moloch_config_int(NULL, "fileNumLease", 64, 1, 10000);
+    fileNumWatermark = moloch_config_str(NULL, "fileNumWatermark", NULL);
     if (!config.dryRun) {
         moloch_db_check();
         moloch_db_load_file_num();
@@ -2245,10 +2598,23 @@ void moloch_db_init()
             timers[t++] = g_timeout_add_seconds( 30, moloch_db_health_check, 0);
         }
     }
+    serializeThreads = moloch_config_int(NULL, "dbSerializeThreads", 0, 0, MOLOCH_DB_MAX_SERIALIZERS);
+    numDbInfo = config.packetThreads + serializeThreads;
+    if (posix_memalign((void **)&dbInfo, MOLOCH_CACHE_LINE, numDbInfo * sizeof(MolochDbInfo_t)))
+        LOGEXIT("ERROR - Couldn't allocate dbInfo");
+    memset(dbInfo, 0, numDbInfo * sizeof(MolochDbInfo_t));
+
     int thread;
-    for (thread = 0; thread < config.packetThreads; thread++) {
+    for (thread = 0; thread < numDbInfo; thread++) {
         MOLOCH_LOCK_INIT(dbInfo[thread].lock);
     }
+
+    DLL_INIT(q_, &serializeQ);
+    for (thread = config.packetThreads; thread < numDbInfo; thread++) {
+        char name[100];
+        snprintf(name, sizeof(name), "moloch-ser%d", thread - config.packetThreads);
+        g_thread_new(name, &moloch_db_serialize_thread, (gpointer)(long)thread);
+    }
 }
 /******************************************************************************/
 void moloch_db_exit()
@@ -1,4 +1,4 @@
-/* drophash.c - simple hash that locks on writes but not on reads
+/* drophash.c - open addressed hash that locks on writes but not on reads
  *              used for dropping packets by ip:port before the packet copy
  *
  * Copyright 2018 AOL Inc. All rights reserved.
@@ -17,34 +17,68 @@
  */
 
 #include "moloch.h"
-#include "dll.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 /******************************************************************************/
 extern MolochConfig_t        config;
 
 /******************************************************************************/
+/* Items live in one linear probed table per group.  Writers hold the group
+ * lock and bump an item's seq around changes so it is odd while being
+ * written, readers never lock and skip items whose seq moved under them.
+ * Removed items are left as tombstones until the table is rebuilt, and a
+ * rebuilt table is only freed once readers are done with the old one.
+ */
+#define MOLOCH_DROPHASH_EMPTY    0
+#define MOLOCH_DROPHASH_USED     1
+#define MOLOCH_DROPHASH_DELETED  2
+
+#define MOLOCH_DROPHASH_MIN_SIZE 1024
+#define MOLOCH_DROPHASH_VERSION  3
+
 struct molochdrophashitem_t {
-    MolochDropHashItem_t *dhg_next, *dhg_prev;
-    MolochDropHashItem_t *hnext;
-    uint8_t               key[16];
+    uint32_t              seq;
     uint32_t              last;
     uint32_t              goodFor;
     uint16_t              port;
-    uint16_t              flags;
+    uint8_t               state;
+    uint8_t               flags;
+    uint8_t               key[16];
 };
 
 struct molochdrophash_t {
-    MolochDropHashItem_t **heads;
-    uint32_t               cnt;
-    uint16_t               num;
+    uint32_t              mask;
+    uint32_t              cnt;
+    uint32_t              deleted;
+    MolochDropHashItem_t  items[];
 };
 
+/* Save file, a header followed by cnt fixed size records */
+typedef struct {
+    uint32_t              ver;
+    uint8_t               isIp4;
+    uint8_t               pad[3];
+    uint32_t              cnt;
+    uint32_t              recordSize;
+} MolochDropHashFileHdr_t;
+
+typedef struct {
+    uint32_t              last;
+    uint32_t              goodFor;
+    uint16_t              port;
+    uint16_t              flags;
+    uint8_t               key[16];
+} MolochDropHashFileRec_t;
+
 /******************************************************************************/
-LOCAL inline uint32_t moloch_drophash_hash6 (const void *key)
+LOCAL inline uint32_t moloch_drophash_hash (const MolochDropHashGroup_t *group, int port, const void *key)
 {
-    uint32_t  h = 0;
+    uint32_t  h = port;
     uint32_t *p = (uint32_t *)key;
-    uint32_t *end = p + 4;
+    uint32_t *end = p + (group->isIp4?1:4);
     while (p < end) {
         h = (h + *p) * 0xc6a4a793;
         h ^= h >> 16;
@@ -52,260 +86,395 @@ LOCAL inline uint32_t moloch_drophash_hash6 (const void *key)
     }
     return h;
 }
-
 /******************************************************************************/
-LOCAL void moloch_drophash_make(MolochDropHashGroup_t *group, int port)
+LOCAL inline void moloch_drophash_item_lock(MolochDropHashItem_t *item)
 {
-    int size;
-
-    switch (port) {
-    case 80:
-    case 443:
-    case 25:
-        size = 7919;
-        break;
-    default:
-        size = 409;
-        break;
-    }
+    __atomic_add_fetch(&item->seq, 1, __ATOMIC_ACQ_REL);
+}
+/******************************************************************************/
+LOCAL inline void moloch_drophash_item_unlock(MolochDropHashItem_t *item)
+{
+    __atomic_add_fetch(&item->seq, 1, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+LOCAL void moloch_drophash_free(void *ptr)
+{
+    MOLOCH_SIZE_FREE("drophash", ptr);
+}
+/******************************************************************************/
+LOCAL MolochDropHash_t *moloch_drophash_alloc(uint32_t size)
+{
+    MolochDropHash_t *hash = MOLOCH_SIZE_ALLOC0("drophash", sizeof(MolochDropHash_t) + size * sizeof(MolochDropHashItem_t));
+    hash->mask = size - 1;
+    return hash;
+}
+/******************************************************************************/
+// Must hold the group lock, item must not already be in hash
+LOCAL MolochDropHashItem_t *moloch_drophash_insert(MolochDropHashGroup_t *group, MolochDropHash_t *hash, int port, const void *key)
+{
+    uint32_t h = moloch_drophash_hash(group, port, key) & hash->mask;
 
-    MOLOCH_LOCK(group->lock);
-    if (group->drops[port])
-        goto done;
+    while (hash->items[h].state == MOLOCH_DROPHASH_USED)
+        h = (h + 1) & hash->mask;
 
-    MolochDropHash_t *hash;
+    MolochDropHashItem_t *item = &hash->items[h];
+    if (item->state == MOLOCH_DROPHASH_DELETED)
+        hash->deleted--;
 
-    hash          = MOLOCH_TYPE_ALLOC(MolochDropHash_t);
-    hash->num     = size;
-    hash->heads   = MOLOCH_SIZE_ALLOC0("heads", size * sizeof(MolochDropHashItem_t *));
-    hash->cnt     = 0;
-    group->drops[port] = hash;
-done:
-    MOLOCH_UNLOCK(group->lock);
+    moloch_drophash_item_lock(item);
+    item->port  = port;
+    item->flags = 0;
+    memcpy(item->key, key, group->isIp4?4:16);
+    item->state = MOLOCH_DROPHASH_USED;
+    hash->cnt++;
+    return item;
 }
 /******************************************************************************/
-int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor)
+// Must hold the group lock, readers only look at the new table once it is complete
+LOCAL void moloch_drophash_rebuild(MolochDropHashGroup_t *group, uint32_t size)
 {
-    if (!group->drops[port]) {
-        moloch_drophash_make(group, port);
+    MolochDropHash_t *old = group->hash;
+    MolochDropHash_t *hash = moloch_drophash_alloc(size);
+
+    if (old) {
+        uint32_t i;
+        for (i = 0; i <= old->mask; i++) {
+            MolochDropHashItem_t *oitem = &old->items[i];
+            if (oitem->state != MOLOCH_DROPHASH_USED)
+                continue;
+            MolochDropHashItem_t *item = moloch_drophash_insert(group, hash, oitem->port, oitem->key);
+            item->last    = oitem->last;
+            item->goodFor = oitem->goodFor;
+            item->flags   = oitem->flags;
+            moloch_drophash_item_unlock(item);
+        }
     }
 
-    MolochDropHash_t *hash = group->drops[port];
+    __atomic_store_n(&group->hash, hash, __ATOMIC_RELEASE);
 
-    MolochDropHashItem_t *item;
-    uint32_t              h;
-    if (group->isIp4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash6(key) % hash->num;
+    if (old)
+        moloch_free_later(old, moloch_drophash_free);
+}
+/******************************************************************************/
+// Must hold the group lock
+LOCAL MolochDropHashItem_t *moloch_drophash_find(MolochDropHashGroup_t *group, int port, const void *key)
+{
+    MolochDropHash_t *hash = group->hash;
+    if (!hash)
+        return NULL;
+
+    uint32_t h = moloch_drophash_hash(group, port, key) & hash->mask;
+    for (;; h = (h + 1) & hash->mask) {
+        MolochDropHashItem_t *item = &hash->items[h];
+        if (item->state == MOLOCH_DROPHASH_EMPTY)
+            return NULL;
+        if (item->state == MOLOCH_DROPHASH_USED && item->port == port && memcmp(key, item->key, group->isIp4?4:16) == 0)
+            return item;
+    }
+}
+/******************************************************************************/
+LOCAL int moloch_drophash_add_locked (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor)
+{
+    if (moloch_drophash_find(group, port, key))
+        return 0;
 
-    MOLOCH_LOCK(group->lock);
-    if (hash->heads[h]) {
-        for (item = hash->heads[h]; item; item = item->hnext) {
-            if (memcmp(key, item->key, group->isIp4?4:16) == 0) {
-                MOLOCH_UNLOCK(group->lock);
-                return 0;
-            }
-        }
+    // Keep at least half the table empty so probes stay short
+    MolochDropHash_t *hash = group->hash;
+    if (!hash) {
+        moloch_drophash_rebuild(group, MOLOCH_DROPHASH_MIN_SIZE);
+    } else if ((hash->cnt + hash->deleted + 1) * 2 > hash->mask + 1) {
+        moloch_drophash_rebuild(group, (hash->cnt + 1) * 4 > hash->mask + 1 ? (hash->mask + 1) * 2 : hash->mask + 1);
     }
 
-    item           = MOLOCH_TYPE_ALLOC(MolochDropHashItem_t);
-    item->hnext    = hash->heads[h];
-    item->flags    = 0;
-    item->port     = port;
-    memcpy(item->key, key, group->isIp4?4:16);
-    item->last     = current;
-    item->goodFor  = goodFor;
-    hash->heads[h] = item;
-    hash->cnt++;
+    MolochDropHashItem_t *item = moloch_drophash_insert(group, group->hash, port, key);
+    item->last    = current;
+    item->goodFor = goodFor;
+    moloch_drophash_item_unlock(item);
 
-    DLL_PUSH_TAIL(dhg_, group, item);
+    group->ports[port]++;
+    if (current > group->current)
+        group->current = current;
     group->changed++;
-    MOLOCH_UNLOCK(group->lock);
     return 1;
 }
-
 /******************************************************************************/
+int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor)
+{
+    MOLOCH_LOCK(group->lock);
+    int added = moloch_drophash_add_locked(group, port, key, current, goodFor);
+    MOLOCH_UNLOCK(group->lock);
+    return added;
+}
+/******************************************************************************/
+/* Lock free, expired items are left for moloch_drophash_expire */
 int moloch_drophash_should_drop (MolochDropHashGroup_t *group, int port, void *key, uint32_t current)
 {
-    MolochDropHash_t *hash = group->drops[port];
+    MolochDropHash_t *hash = __atomic_load_n(&group->hash, __ATOMIC_ACQUIRE);
+    if (!hash)
+        return 0;
 
-    uint32_t              h;
-    if (group->isIp4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash6(key) % hash->num;
+    const int keyLen = group->isIp4?4:16;
 
-    if (!hash->heads[h])
-        return 0;
+    uint32_t h = moloch_drophash_hash(group, port, key) & hash->mask;
+    uint32_t probes;
+    for (probes = 0; probes <= hash->mask; probes++, h = (h + 1) & hash->mask) {
+        MolochDropHashItem_t *item = &hash->items[h];
+        const uint32_t seq = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE);
+        const uint8_t state = item->state;
 
-    MolochDropHashItem_t *item;
-    for (item = hash->heads[h]; item; item = item->hnext) {
-        if (memcmp(key, item->key, group->isIp4?4:16) == 0) {
+        if (state == MOLOCH_DROPHASH_EMPTY)
+            return 0;
 
-            // Same time as last time, drop
-            if (likely(item->last == current))
-                return 1;
+        if ((seq & 1) || state != MOLOCH_DROPHASH_USED || item->port != port || memcmp(key, item->key, keyLen) != 0)
+            continue;
 
-            // Check if within the window, drop
-            if (item->last + item->goodFor >= current) {
-                item->last = current;
-                return 1;
-            }
+        const uint32_t last = item->last;
+        const uint32_t goodFor = item->goodFor;
 
-            // Outside the window, need to remove, don't drop
-            moloch_drophash_delete(group, port, key);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&item->seq, __ATOMIC_RELAXED) != seq)
             return 0;
+
+        if (current > group->current)
+            __atomic_store_n(&group->current, current, __ATOMIC_RELAXED);
+
+        // Same time as last time, drop
+        if (likely(last == current))
+            return 1;
+
+        // Check if within the window, drop
+        if (last + goodFor >= current) {
+            __atomic_store_n(&item->last, current, __ATOMIC_RELAXED);
+            return 1;
         }
+
+        // Outside the window, don't drop
+        return 0;
     }
     return 0;
 }
 /******************************************************************************/
-void moloch_drophash_free(void *ptr)
+// Must hold the group lock
+LOCAL void moloch_drophash_remove(MolochDropHashGroup_t *group, MolochDropHashItem_t *item)
 {
-    MOLOCH_TYPE_FREE(MolochDropHashItem_t, ptr);
+    moloch_drophash_item_lock(item);
+    item->state = MOLOCH_DROPHASH_DELETED;
+    moloch_drophash_item_unlock(item);
+
+    group->hash->cnt--;
+    group->hash->deleted++;
+    group->ports[item->port]--;
+    group->changed++;
 }
 /******************************************************************************/
 void moloch_drophash_delete (MolochDropHashGroup_t *group, int port, void *key)
 {
-    MolochDropHash_t *hash = group->drops[port];
+    MOLOCH_LOCK(group->lock);
+    MolochDropHashItem_t *item = moloch_drophash_find(group, port, key);
+    if (item)
+        moloch_drophash_remove(group, item);
+    MOLOCH_UNLOCK(group->lock);
+}
+/******************************************************************************/
+/* Remove everything outside its window in one pass, using the newest packet
+ * time seen so offline files expire the same way live capture does.
+ */
+void moloch_drophash_expire(MolochDropHashGroup_t *group)
+{
+    MOLOCH_LOCK(group->lock);
+    MolochDropHash_t *hash = group->hash;
+    if (!hash) {
+        MOLOCH_UNLOCK(group->lock);
+        return;
+    }
 
-    MolochDropHashItem_t *item, *parent = NULL;
-    uint32_t              h;
-    if (group->isIp4)
-        h = (*(uint32_t *)key) % hash->num;
-    else
-        h = moloch_drophash_hash6(key) % hash->num;
+    const uint32_t current = __atomic_load_n(&group->current, __ATOMIC_RELAXED);
 
-    if (!hash->heads[h])
-        return;
+    uint32_t i;
+    for (i = 0; i <= hash->mask; i++) {
+        MolochDropHashItem_t *item = &hash->items[i];
+        if (item->state == MOLOCH_DROPHASH_USED && item->last + item->goodFor < current)
+            moloch_drophash_remove(group, item);
+    }
 
-    MOLOCH_LOCK(group->lock);
-    for (item = hash->heads[h]; item; parent = item, item = item->hnext) {
-        if (memcmp(key, item->key, group->isIp4?4:16) == 0) {
-            hash->cnt--;
-            if (parent) {
-                parent->hnext = item->hnext;
-            } else {
-                hash->heads[h] = item->hnext;
-            }
-            DLL_REMOVE(dhg_, group, item);
-            moloch_free_later(item, moloch_drophash_free);
-            group->changed++;
-            break;
-        }
+    // Too many tombstones make misses slow, start clean
+    if (hash->deleted > hash->cnt && hash->deleted > (hash->mask + 1) / 8) {
+        uint32_t size = hash->mask + 1;
+        while (size > MOLOCH_DROPHASH_MIN_SIZE && (hash->cnt + 1) * 8 < size)
+            size /= 2;
+        moloch_drophash_rebuild(group, size);
     }
     MOLOCH_UNLOCK(group->lock);
 }
-
 /******************************************************************************/
-void moloch_drophash_init(MolochDropHashGroup_t *group, char *file, int isIp4)
+LOCAL void moloch_drophash_load(MolochDropHashGroup_t *group, const uint8_t *data, size_t size, uint32_t now)
 {
-    group->isIp4 = isIp4;
-    DLL_INIT(dhg_, group);
+    const int keyLen = group->isIp4?4:16;
+    MolochDropHashFileHdr_t hdr;
 
-    if (!file)
+    if (size < 4) {
+        LOG("ERROR - `%s` corrupt", group->file);
         return;
+    }
+    memcpy(&hdr.ver, data, 4);
 
-    group->file = g_strdup(file);
+    // Version 2 was packed variable records, read so drops survive an upgrade
+    if (hdr.ver == 2) {
+        if (size < 9 || data[4] != group->isIp4) {
+            LOG("ERROR - `%s` corrupt or isIp4 mismatch", group->file);
+            return;
+        }
+        memcpy(&hdr.cnt, data + 5, 4);
+        const size_t recordSize = 2 + keyLen + 4 + 4 + 2;
+        if (9 + hdr.cnt * recordSize > size) {
+            LOG("ERROR - `%s` corrupt", group->file);
+            return;
+        }
 
-    if (!g_file_test(file, G_FILE_TEST_EXISTS))
+        const uint8_t *p = data + 9;
+        uint32_t i;
+        for (i = 0; i < hdr.cnt; i++, p += recordSize) {
+            uint16_t port;
+            uint32_t last, goodFor;
+            uint8_t  key[16];
+            memcpy(&port, p, 2);
+            memcpy(key, p + 2, keyLen);
+            memcpy(&last, p + 2 + keyLen, 4);
+            memcpy(&goodFor, p + 6 + keyLen, 4);
+            if (last + goodFor >= now)
+                moloch_drophash_add_locked(group, port, key, last, goodFor);
+        }
         return;
+    }
 
-    struct timespec currentTime;
-    clock_gettime(CLOCK_REALTIME_COARSE, &currentTime);
-
-    int      cnt;
-    int      ver;
-    char     fisIp4;
-    char     key[16];
-    uint32_t last;
-    uint32_t goodFor;
-    uint16_t flags;
-    uint16_t port;
-
-    FILE *fp;
-    if (!(fp = fopen(group->file, "r"))) {
-        LOG("ERROR - Couldn't open `%s` to load drophash", group->file);
+    if (hdr.ver != MOLOCH_DROPHASH_VERSION) {
+        LOG("ERROR - Unknown save file version %u for `%s`", hdr.ver, group->file);
         return;
     }
 
-    if (!fread(&ver, 4, 1, fp)) {
-        fclose(fp);
+    if (size < sizeof(hdr)) {
         LOG("ERROR - `%s` corrupt", group->file);
         return;
     }
+    memcpy(&hdr, data, sizeof(hdr));
 
-    if (ver != 2) {
-        fclose(fp);
-        LOG("ERROR - Unknown save file version %d for `%s`", ver, group->file);
+    if (hdr.isIp4 != group->isIp4) {
+        LOG("ERROR - isIp4 mismatch %d != %d", hdr.isIp4, group->isIp4);
         return;
     }
 
-    if (!fread(&fisIp4, 1, 1, fp)) {
-        fclose(fp);
+    if (hdr.recordSize != sizeof(MolochDropHashFileRec_t) || sizeof(hdr) + (size_t)hdr.cnt * hdr.recordSize > size) {
         LOG("ERROR - `%s` corrupt", group->file);
         return;
     }
 
-    if (fisIp4 != isIp4) {
-        fclose(fp);
-        LOG("ERROR - isIp4 mismatch %d != %d", fisIp4, isIp4);
+    const MolochDropHashFileRec_t *recs = (const MolochDropHashFileRec_t *)(data + sizeof(hdr));
+    uint32_t i;
+    for (i = 0; i < hdr.cnt; i++) {
+        if (recs[i].last + recs[i].goodFor >= now)
+            moloch_drophash_add_locked(group, recs[i].port, recs[i].key, recs[i].last, recs[i].goodFor);
+    }
+}
+/******************************************************************************/
+void moloch_drophash_init(MolochDropHashGroup_t *group, char *file, int isIp4)
+{
+    group->isIp4 = isIp4;
+    MOLOCH_LOCK_INIT(group->lock);
+
+    if (!file)
+        return;
+
+    group->file = g_strdup(file);
+
+    if (!g_file_test(file, G_FILE_TEST_EXISTS))
+        return;
+
+    struct timespec currentTime;
+    clock_gettime(CLOCK_REALTIME_COARSE, &currentTime);
+
+    int fd = open(group->file, O_RDONLY);
+    if (fd < 0) {
+        LOG("ERROR - Couldn't open `%s` to load drophash", group->file);
         return;
     }
 
-    if (!fread(&cnt, 4, 1, fp)) {
-        fclose(fp);
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        close(fd);
         LOG("ERROR - `%s` corrupt", group->file);
         return;
     }
-    for (int i = 0; i < cnt; i++) {
-        int read = 0;
-        read += fread(&port, 2, 1, fp);
-        read += fread(key, isIp4?4:16, 1, fp);
-        read += fread(&last, 4, 1, fp);
-        read += fread(&goodFor, 4, 1, fp);
-        read += fread(&flags, 2, 1, fp);
-
-        if (read != 5) {
-            LOG("ERROR - `%s` corrupt", group->file);
-            break;
-        }
 
-        if (last + goodFor >= currentTime.tv_sec)
-            moloch_drophash_add(group, port, key, last, goodFor);
+    uint8_t *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG("ERROR - Couldn't mmap `%s` error '%s'", group->file, strerror(errno));
+        return;
     }
+
+    MOLOCH_LOCK(group->lock);
+    moloch_drophash_load(group, data, sb.st_size, currentTime.tv_sec);
     group->changed = 0; // Reset changes so we don't save right away
-    fclose(fp);
-}
+    MOLOCH_UNLOCK(group->lock);
 
+    munmap(data, sb.st_size);
+}
 /******************************************************************************/
+/* Write a temp file and rename it so a load never sees a partial file */
 void moloch_drophash_save(MolochDropHashGroup_t *group)
 {
-    FILE *fp;
-    MolochDropHashItem_t *item;
-
     if (!group->file)
         return;
 
-    if (!(fp = fopen(group->file, "w"))) {
-        LOG("ERROR - Couldn't open `%s` to save drophash", group->file);
-        return;
-    }
     MOLOCH_LOCK(group->lock);
     group->changed = 0;
-    int ver = 2;
-
-    fwrite(&ver, 4, 1, fp);
-    fwrite(&group->isIp4, 1, 1, fp);
-    fwrite(&group->dhg_count, 4, 1, fp);
-    DLL_FOREACH(dhg_, group, item) {
-        fwrite(&item->port, 2, 1, fp);
-        fwrite(item->key, group->isIp4?4:16, 1, fp);
-        fwrite(&item->last, 4, 1, fp);
-        fwrite(&item->goodFor, 4, 1, fp);
-        fwrite(&item->flags, 2, 1, fp);
+
+    MolochDropHashFileHdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ver = MOLOCH_DROPHASH_VERSION;
+    hdr.isIp4 = group->isIp4;
+    hdr.recordSize = sizeof(MolochDropHashFileRec_t);
+
+    MolochDropHash_t        *hash = group->hash;
+    MolochDropHashFileRec_t *recs = NULL;
+    if (hash && hash->cnt) {
+        recs = MOLOCH_SIZE_ALLOC0("drophash", hash->cnt * sizeof(MolochDropHashFileRec_t));
+        uint32_t i;
+        for (i = 0; i <= hash->mask; i++) {
+            MolochDropHashItem_t *item = &hash->items[i];
+            if (item->state != MOLOCH_DROPHASH_USED)
+                continue;
+            recs[hdr.cnt].last    = item->last;
+            recs[hdr.cnt].goodFor = item->goodFor;
+            recs[hdr.cnt].port    = item->port;
+            recs[hdr.cnt].flags   = item->flags;
+            memcpy(recs[hdr.cnt].key, item->key, 16);
+            hdr.cnt++;
+        }
     }
     MOLOCH_UNLOCK(group->lock);
-    fclose(fp);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", group->file);
+
+    FILE *fp;
+    if (!(fp = fopen(tmp, "w"))) {
+        LOG("ERROR - Couldn't open `%s` to save drophash", tmp);
+        if (recs)
+            MOLOCH_SIZE_FREE("drophash", recs);
+        return;
+    }
+
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    if (hdr.cnt)
+        ok = ok && fwrite(recs, sizeof(MolochDropHashFileRec_t), hdr.cnt, fp) == hdr.cnt;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp, group->file) != 0) {
+        LOG("ERROR - Couldn't save drophash `%s` error '%s'", group->file, strerror(errno));
+        unlink(tmp);
+    }
+
+    if (recs)
+        MOLOCH_SIZE_FREE("drophash", recs);
 }
@@ -466,7 +466,7 @@ const char *moloch_field_string_add(int pos, MolochSession_t *session, const cha
     MolochString_t                   *hstring;
     const MolochFieldInfo_t          *info = config.fields[pos];
 
-    if (info->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (info->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return NULL;
 
     if (!session->fields[pos]) {
@@ -633,7 +633,7 @@ const char *moloch_field_string_uw_add(int pos, MolochSession_t *session, const
     MolochString_t                   *hstring;
     const MolochFieldInfo_t          *info = config.fields[pos];
 
-    if (info->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (info->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return NULL;
 
     if (!session->fields[pos]) {
@@ -711,7 +711,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
     MolochIntHashStd_t   *hash;
     MolochInt_t          *hint;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return FALSE;
 
     if (!session->fields[pos]) {
@@ -825,7 +825,7 @@ gboolean moloch_field_ip_add_str(int pos, MolochSession_t *session, char *str)
 {
     MolochField_t        *field;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return FALSE;
 
     int len = strlen(str);
@@ -881,7 +881,7 @@ gboolean moloch_field_ip4_add(int pos, MolochSession_t *session, int i)
 {
     MolochField_t        *field;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return FALSE;
 
     struct in6_addr *v = g_malloc(sizeof(struct in6_addr));
@@ -936,7 +936,7 @@ gboolean moloch_field_ip6_add(int pos, MolochSession_t *session, const uint8_t *
 {
     MolochField_t        *field;
 
-    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || pos >= session->maxFields)
+    if (config.fields[pos]->flags & MOLOCH_FIELD_FLAG_DISABLED || (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos)))
         return FALSE;
 
     struct in6_addr *v = g_memdup(val, sizeof(struct in6_addr));
@@ -1040,6 +1040,9 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
     MolochCertsInfoHashStd_t   *hash;
     MolochCertsInfo_t          *hci;
 
+    if (pos >= session->maxFields && !moloch_session_alloc_fields(session, pos))
+        return FALSE;
+
     if (!session->fields[pos]) {
         field = MOLOCH_TYPE_ALLOC(MolochField_t);
         session->fields[pos] = field;
@@ -1147,8 +1150,7 @@ void moloch_field_free(MolochSession_t *session)
         } // switch
         MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
     }
-    MOLOCH_SIZE_FREE(fields, session->fields);
-    session->fields = 0;
+    moloch_session_free_fields(session);
 }
 /******************************************************************************/
 void moloch_field_certsinfo_free (MolochCertsInfo_t *certs)
@@ -80,10 +80,13 @@ typedef struct molochhttpconnhead_t {
 LOCAL HASH_VAR(s_, connections, MolochHttpConnHead_t, 119);
 LOCAL MOLOCH_LOCK_DEFINE(connections);
 
-LOCAL MolochHttpRequestHead_t requests;
-LOCAL int                     requestsTimer;
+// Protects the per server request queues, counters and handle pools
 LOCAL MOLOCH_LOCK_DEFINE(requests);
 
+#define MOLOCH_HTTP_EASY_POOL 64
+
+LOCAL uint32_t                targetLatencyMS;
+
 LOCAL uint64_t connectionsSet[2048];
 
 typedef struct {
@@ -94,6 +97,9 @@ typedef struct {
 
 struct molochhttpserver_t {
     uint64_t                 dropped;
+    uint64_t                 compressIn;
+    uint64_t                 compressOut;
+    uint64_t                 compressUsec;
     GHashTable              *fd2ev;
     char                   **names;
     MolochHttpServerName_t  *snames;
@@ -108,6 +114,20 @@ struct molochhttpserver_t {
     uint16_t                 connections;
     uint16_t                 maxRetries;
 
+    // Requests waiting for room in the send window, the window grows by one
+    // every window of fast responses and halves on errors or slow responses
+    MolochHttpRequestHead_t  requests;
+    guint                    requestsTimer;
+    uint16_t                 inflight;
+    uint16_t                 window;
+    uint16_t                 windowAcks;
+    uint16_t                 sinceDecrease;
+
+    // Easy handles with the constant options already set
+    CURL                    *easyPool[MOLOCH_HTTP_EASY_POOL];
+    int                      easyPoolCnt;
+    struct curl_slist       *defaultHeaderList;
+
     MOLOCH_LOCK_EXTERN(syncRequest);
     MolochHttpRequest_t      syncRequest;
     CURL                    *multi;
@@ -117,8 +137,9 @@ struct molochhttpserver_t {
     MolochHttpHeader_cb      headerCb;
 };
 
-LOCAL z_stream z_strm;
-LOCAL MOLOCH_LOCK_DEFINE(z_strm);
+// Each thread that sends gets its own deflate stream, created on first use
+LOCAL __thread z_stream *z_strm;
+LOCAL int               compressLevel;
 
 LOCAL gboolean moloch_http_send_timer_callback(gpointer);
 LOCAL void moloch_http_add_request(MolochHttpServer_t *server, MolochHttpRequest_t *request, gboolean async);
@@ -322,12 +343,48 @@ LOCAL void moloch_http_add_request(MolochHttpServer_t *server, MolochHttpRequest
 #endif
         server->outstanding++;
 
-        DLL_PUSH_TAIL(rqt_, &requests, request);
+        DLL_PUSH_TAIL(rqt_, &server->requests, request);
 
-        if (!requestsTimer)
-            requestsTimer = g_timeout_add(0, moloch_http_send_timer_callback, NULL);
-        } else {
+        if (!server->requestsTimer)
+            server->requestsTimer = g_timeout_add(0, moloch_http_send_timer_callback, server);
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_http_easy_put(MolochHttpServer_t *server, CURL *easy)
+{
+    MOLOCH_LOCK(requests);
+    if (server->easyPoolCnt < MOLOCH_HTTP_EASY_POOL) {
+        server->easyPool[server->easyPoolCnt++] = easy;
+        easy = NULL;
+    }
+    MOLOCH_UNLOCK(requests);
+
+    if (easy)
+        curl_easy_cleanup(easy);
+}
+/******************************************************************************/
+/* Adjust the send window based on how the last response went */
+LOCAL void moloch_http_window_update(MolochHttpServer_t *server, long responseCode, double totalTime)
+{
+    if (responseCode == 0 || responseCode == 429 || responseCode >= 500 || totalTime*1000 > targetLatencyMS) {
+        // Only back off once per window so a burst of slow responses isn't counted many times
+        if (server->sinceDecrease >= server->window && server->window > 1) {
+            server->window /= 2;
+            server->windowAcks = 0;
+            server->sinceDecrease = 0;
+            if (config.debug)
+                LOG("%s window decreased to %d (code %ld %.0lfms)", server->names[0], server->window, responseCode, totalTime*1000);
+        }
+    } else if (server->window < server->maxConns) {
+        server->windowAcks++;
+        if (server->windowAcks >= server->window) {
+            server->window++;
+            server->windowAcks = 0;
+        }
     }
+
+    if (server->sinceDecrease < 0xffff)
+        server->sinceDecrease++;
 }
 /******************************************************************************/
 LOCAL void moloch_http_curlm_check_multi_info(MolochHttpServer_t *server)
@@ -345,15 +402,17 @@ LOCAL void moloch_http_curlm_check_multi_info(MolochHttpServer_t *server)
             curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &eff_url);
 
             long   responseCode;
+            double totalTime;
             curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &responseCode);
+            curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &totalTime);
+
+            moloch_http_window_update(server, responseCode, totalTime);
 
             if (config.logESRequests || (server->printErrors && responseCode/100 != 2)) {
-                double totalTime;
                 double connectTime;
                 double uploadSize;
                 double downloadSize;
 
-                curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &totalTime);
                 curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connectTime);
                 curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD, &uploadSize);
                 curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD, &downloadSize);
@@ -382,6 +441,7 @@ LOCAL void moloch_http_curlm_check_multi_info(MolochHttpServer_t *server)
                 MOLOCH_LOCK(requests);
                 server->snames[request->namePos].allowedAtSeconds = now.tv_sec + 30;
                 server->outstanding--;
+                server->inflight--;
                 moloch_http_add_request(server, request, TRUE);
                 MOLOCH_UNLOCK(requests);
             } else {
@@ -408,9 +468,12 @@ LOCAL void moloch_http_curlm_check_multi_info(MolochHttpServer_t *server)
                 MOLOCH_TYPE_FREE(MolochHttpRequest_t, request);
 
                 curl_multi_remove_handle(server->multi, easy);
-                curl_easy_cleanup(easy);
+                moloch_http_easy_put(server, easy);
                 MOLOCH_LOCK(requests);
                 server->outstanding--;
+                server->inflight--;
+                if (DLL_COUNT(rqt_, &server->requests) > 0 && !server->requestsTimer)
+                    server->requestsTimer = g_timeout_add(0, moloch_http_send_timer_callback, server);
                 MOLOCH_UNLOCK(requests);
             }
         }
@@ -682,17 +745,22 @@ int moloch_http_curl_close_callback(void *snameV, curl_socket_t fd)
     return 0;
 }
 /******************************************************************************/
-LOCAL gboolean moloch_http_send_timer_callback(gpointer UNUSED(unused))
+LOCAL gboolean moloch_http_send_timer_callback(gpointer serverV)
 {
+    MolochHttpServer_t        *server = serverV;
+
     while (1) {
-        MolochHttpRequest_t *request;
+        MolochHttpRequest_t *request = NULL;
         MOLOCH_LOCK(requests);
-        DLL_POP_HEAD(rqt_, &requests, request);
+        // Requests past the window stay queued until a response comes back
+        if (server->inflight < server->window)
+            DLL_POP_HEAD(rqt_, &server->requests, request);
         if (!request) {
-            requestsTimer = 0;
+            server->requestsTimer = 0;
             MOLOCH_UNLOCK(requests);
             return G_SOURCE_REMOVE;
         }
+        server->inflight++;
         MOLOCH_UNLOCK(requests);
 
 #ifdef MOLOCH_HTTP_DEBUG
@@ -704,6 +772,44 @@ LOCAL gboolean moloch_http_send_timer_callback(gpointer UNUSED(unused))
     return G_SOURCE_REMOVE;
 }
 /******************************************************************************/
+LOCAL CURL *moloch_http_easy_get(MolochHttpServer_t *server)
+{
+    CURL *easy = NULL;
+
+    MOLOCH_LOCK(requests);
+    if (server->easyPoolCnt > 0)
+        easy = server->easyPool[--server->easyPoolCnt];
+    MOLOCH_UNLOCK(requests);
+
+    if (easy)
+        return easy;
+
+    easy = curl_easy_init();
+    if (config.debug >= 2) {
+        curl_easy_setopt(easy, CURLOPT_VERBOSE, 1);
+    }
+
+    if (config.insecure) {
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, moloch_http_curl_write_callback);
+    curl_easy_setopt(easy, CURLOPT_OPENSOCKETFUNCTION, moloch_http_curl_open_callback);
+    curl_easy_setopt(easy, CURLOPT_CLOSESOCKETFUNCTION, moloch_http_curl_close_callback);
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, ""); // https://curl.haxx.se/libcurl/c/CURLOPT_ACCEPT_ENCODING.html
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    if (server->headerCb) {
+        curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, moloch_http_curlm_header_function);
+    }
+
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, 60L);
+
+    return easy;
+}
+/******************************************************************************/
 gboolean moloch_http_send(void *serverV, const char *method, const char *key, int32_t key_len, char *data, uint32_t data_len, char **headers, gboolean dropable, MolochHttpResponse_cb func, gpointer uw)
 {
     MolochHttpServer_t        *server = serverV;
@@ -727,48 +833,44 @@ gboolean moloch_http_send(void *serverV, const char *method, const char *key, in
     }
 
     MolochHttpRequest_t       *request = MOLOCH_TYPE_ALLOC0(MolochHttpRequest_t);
-
-    if (headers) {
-        int i;
-        for (i = 0; headers[i]; i++) {
-            request->headerList = curl_slist_append(request->headerList, headers[i]);
-        }
-    }
+    gboolean                   compressed = FALSE;
 
     if (dropable)
         request->retries = 0;
     else
         request->retries = server->maxRetries;
 
-    if (server->defaultHeaders) {
-        int i;
-        for (i = 0; server->defaultHeaders[i]; i++) {
-            request->headerList = curl_slist_append(request->headerList, server->defaultHeaders[i]);
-        }
-    }
-
     // Do we need to compress item
     if (server->compress && data && data_len > 1000) {
         char            *buf = moloch_http_get_buffer(data_len);
         int              ret;
+        struct timespec  startTime, stopTime;
+
+        if (!z_strm) {
+            z_strm = MOLOCH_TYPE_ALLOC0(z_stream);
+            deflateInit(z_strm, compressLevel);
+        }
 
-        MOLOCH_LOCK(z_strm);
-        z_strm.avail_in   = data_len;
-        z_strm.next_in    = (unsigned char *)data;
-        z_strm.avail_out  = data_len;
-        z_strm.next_out   = (unsigned char *)buf;
-        ret = deflate(&z_strm, Z_FINISH);
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        z_strm->avail_in   = data_len;
+        z_strm->next_in    = (unsigned char *)data;
+        z_strm->avail_out  = data_len;
+        z_strm->next_out   = (unsigned char *)buf;
+        ret = deflate(z_strm, Z_FINISH);
+        MOLOCH_THREAD_INCR_NUM(server->compressIn, data_len);
         if (ret == Z_STREAM_END) {
-            request->headerList = curl_slist_append(request->headerList, "Content-Encoding: deflate");
+            compressed = TRUE;
             MOLOCH_SIZE_FREE(buffer, data);
-            data_len = data_len - z_strm.avail_out;
+            data_len = data_len - z_strm->avail_out;
             data     = buf;
         } else {
             MOLOCH_SIZE_FREE(buffer, buf);
         }
+        MOLOCH_THREAD_INCR_NUM(server->compressOut, data_len);
 
-        deflateReset(&z_strm);
-        MOLOCH_UNLOCK(z_strm);
+        deflateReset(z_strm);
+        clock_gettime(CLOCK_MONOTONIC, &stopTime);
+        MOLOCH_THREAD_INCR_NUM(server->compressUsec, (stopTime.tv_sec - startTime.tv_sec)*1000000 + (stopTime.tv_nsec - startTime.tv_nsec)/1000);
     }
 
     request->server     = server;
@@ -777,27 +879,28 @@ gboolean moloch_http_send(void *serverV, const char *method, const char *key, in
     request->dataOut    = data;
     request->dataOutLen = data_len;
 
-    request->easy = curl_easy_init();
-    if (config.debug >= 2) {
-        curl_easy_setopt(request->easy, CURLOPT_VERBOSE, 1);
-    }
+    // Most requests only need the default headers, which are built once
+    if (headers || compressed) {
+        int i;
+        for (i = 0; headers && headers[i]; i++) {
+            request->headerList = curl_slist_append(request->headerList, headers[i]);
+        }
 
-    if (config.insecure) {
-        curl_easy_setopt(request->easy, CURLOPT_SSL_VERIFYPEER, 0L);
-        curl_easy_setopt(request->easy, CURLOPT_SSL_VERIFYHOST, 0L);
+        for (i = 0; server->defaultHeaders && server->defaultHeaders[i]; i++) {
+            request->headerList = curl_slist_append(request->headerList, server->defaultHeaders[i]);
+        }
+
+        if (compressed) {
+            request->headerList = curl_slist_append(request->headerList, "Content-Encoding: deflate");
+        }
     }
 
-    curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, moloch_http_curl_write_callback);
+    // Only the per request options need setting on a pooled handle
+    request->easy = moloch_http_easy_get(server);
+
     curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, (void *)request);
     curl_easy_setopt(request->easy, CURLOPT_PRIVATE, (void *)request);
-    curl_easy_setopt(request->easy, CURLOPT_OPENSOCKETFUNCTION, moloch_http_curl_open_callback);
-    curl_easy_setopt(request->easy, CURLOPT_CLOSESOCKETFUNCTION, moloch_http_curl_close_callback);
-    curl_easy_setopt(request->easy, CURLOPT_ACCEPT_ENCODING, ""); // https://curl.haxx.se/libcurl/c/CURLOPT_ACCEPT_ENCODING.html
-    curl_easy_setopt(request->easy, CURLOPT_TCP_KEEPALIVE, 1L);
-
-    if (request->headerList) {
-        curl_easy_setopt(request->easy, CURLOPT_HTTPHEADER, request->headerList);
-    }
+    curl_easy_setopt(request->easy, CURLOPT_HTTPHEADER, request->headerList ? request->headerList : server->defaultHeaderList);
 
     if (method[0] != 'G') {
         curl_easy_setopt(request->easy, CURLOPT_CUSTOMREQUEST, method);
@@ -806,18 +909,14 @@ gboolean moloch_http_send(void *serverV, const char *method, const char *key, in
         curl_easy_setopt(request->easy, CURLOPT_POSTFIELDS, data);
     } else {
         curl_easy_setopt(request->easy, CURLOPT_CUSTOMREQUEST, NULL);
+        curl_easy_setopt(request->easy, CURLOPT_POSTFIELDS, NULL);
         curl_easy_setopt(request->easy, CURLOPT_HTTPGET, 1L);
     }
 
-
     if (server->headerCb) {
-        curl_easy_setopt(request->easy, CURLOPT_HEADERFUNCTION, moloch_http_curlm_header_function);
         curl_easy_setopt(request->easy, CURLOPT_HEADERDATA, request);
     }
 
-    curl_easy_setopt(request->easy, CURLOPT_CONNECTTIMEOUT, 10L);
-    curl_easy_setopt(request->easy, CURLOPT_TIMEOUT, 60L);
-
     memcpy(request->key, key, key_len);
     request->key[key_len] = 0;
 
@@ -847,12 +946,36 @@ int moloch_http_queue_length(void *serverV)
     return server?server->outstanding:0;
 }
 /******************************************************************************/
+/* Readers should pause when this is true, more requests are waiting than
+ * the server is currently accepting or we are getting close to dropping.
+ */
+gboolean moloch_http_is_backlogged(void *serverV)
+{
+    MolochHttpServer_t        *server = serverV;
+    if (!server)
+        return FALSE;
+    return DLL_COUNT(rqt_, &server->requests) > server->window ||
+           server->outstanding > server->maxOutstandingRequests/2;
+}
+/******************************************************************************/
 uint64_t moloch_http_dropped_count(void *serverV)
 {
     MolochHttpServer_t        *server = serverV;
     return server?server->dropped:0;
 }
 /******************************************************************************/
+void moloch_http_compress_stats(void *serverV, uint64_t *in, uint64_t *out, uint64_t *usec)
+{
+    MolochHttpServer_t        *server = serverV;
+    if (!server) {
+        *in = *out = *usec = 0;
+        return;
+    }
+    *in   = server->compressIn;
+    *out  = server->compressOut;
+    *usec = server->compressUsec;
+}
+/******************************************************************************/
 void moloch_http_set_header_cb(void *serverV, MolochHttpHeader_cb cb)
 {
     MolochHttpServer_t        *server = serverV;
@@ -885,6 +1008,15 @@ void moloch_http_free_server(void *serverV)
     // Free multi info
     curl_multi_cleanup(server->multi);
 
+    int i;
+    for (i = 0; i < server->easyPoolCnt; i++) {
+        curl_easy_cleanup(server->easyPool[i]);
+    }
+
+    if (server->defaultHeaderList) {
+        curl_slist_free_all(server->defaultHeaderList);
+    }
+
 
     g_strfreev(server->names);
     free(server->snames);
@@ -899,6 +1031,16 @@ void moloch_http_set_headers(void *serverV, char **headers)
     MolochHttpServer_t        *server = serverV;
 
     server->defaultHeaders = headers;
+
+    if (server->defaultHeaderList) {
+        curl_slist_free_all(server->defaultHeaderList);
+        server->defaultHeaderList = NULL;
+    }
+
+    int i;
+    for (i = 0; headers && headers[i]; i++) {
+        server->defaultHeaderList = curl_slist_append(server->defaultHeaderList, headers[i]);
+    }
 }
 /******************************************************************************/
 void moloch_http_set_retries(void *serverV, uint16_t retries)
@@ -940,6 +1082,9 @@ void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOuts
     server->compress = compress;
     server->snames = malloc(server->namesCnt * sizeof(MolochHttpServerName_t));
     server->maxRetries = 3;
+    server->window = maxConns;
+    server->sinceDecrease = maxConns;
+    DLL_INIT(rqt_, &server->requests);
 
     for (i = 0; server->names[i]; i++) {
         server->snames[i].server            = server;
@@ -966,15 +1111,12 @@ void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOuts
 /******************************************************************************/
 void moloch_http_init()
 {
-    z_strm.zalloc = Z_NULL;
-    z_strm.zfree  = Z_NULL;
-    z_strm.opaque = Z_NULL;
-    deflateInit(&z_strm, Z_DEFAULT_COMPRESSION);
+    compressLevel = moloch_config_int(NULL, "compressESLevel", 6, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+    targetLatencyMS = moloch_config_int(NULL, "httpTargetLatencyMS", 5000, 100, 60000);
 
     curl_global_init(CURL_GLOBAL_SSL);
 
     HASH_INIT(h_, connections, moloch_session_hash, moloch_http_conn_cmp);
-    DLL_INIT(rqt_, &requests);
 }
 /******************************************************************************/
 void moloch_http_exit()
@@ -0,0 +1,223 @@
+/* jsonwriter.h  -- Small JSON writer used by db.c, much cheaper than sprintf
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _JSONWRITER_HEADER
+#define _JSONWRITER_HEADER
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern unsigned char    moloch_char_to_hexstr[256][3];
+
+/******************************************************************************/
+/* Integers are written two digits at a time from a table */
+LOCAL const char moloch_db_digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+LOCAL inline void moloch_db_export_u64(BSB *bsb, uint64_t v)
+{
+    char  buf[20];
+    char *p = buf + sizeof(buf);
+
+    while (v >= 100) {
+        const int d = (v % 100) * 2;
+        v /= 100;
+        *--p = moloch_db_digit_pairs[d + 1];
+        *--p = moloch_db_digit_pairs[d];
+    }
+    if (v >= 10) {
+        *--p = moloch_db_digit_pairs[v * 2 + 1];
+        *--p = moloch_db_digit_pairs[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+
+    const int len = buf + sizeof(buf) - p;
+    BSB_EXPORT_ptr(*bsb, p, len);
+}
+/******************************************************************************/
+LOCAL inline void moloch_db_export_i64(BSB *bsb, int64_t v)
+{
+    if (v < 0) {
+        BSB_EXPORT_u08(*bsb, '-');
+        moloch_db_export_u64(bsb, -(uint64_t)v);
+    } else {
+        moloch_db_export_u64(bsb, v);
+    }
+}
+/******************************************************************************/
+/* Exports v with two decimals, like %.2f */
+LOCAL inline void moloch_db_export_fixed2(BSB *bsb, double v)
+{
+    // nan and inf aren't json
+    if (!(v > -1e15 && v < 1e15)) {
+        BSB_EXPORT_cstr(*bsb, "0.00");
+        return;
+    }
+
+    if (v < 0) {
+        BSB_EXPORT_u08(*bsb, '-');
+        v = -v;
+    }
+
+    const uint64_t c = (uint64_t)(v * 100 + 0.5);
+    moloch_db_export_u64(bsb, c / 100);
+    BSB_EXPORT_u08(*bsb, '.');
+    BSB_EXPORT_ptr(*bsb, moloch_db_digit_pairs + (c % 100) * 2, 2);
+}
+/******************************************************************************/
+/* Exports a string that is known not to need escaping */
+LOCAL inline void moloch_db_export_str(BSB *bsb, const char *str)
+{
+    const int len = strlen(str);
+    BSB_EXPORT_ptr(*bsb, str, len);
+}
+/******************************************************************************/
+/* Formats ip (network order) as a dotted quad into buf, which needs 16 bytes */
+LOCAL inline void moloch_db_ip4_str(char *buf, uint32_t ip)
+{
+    int i;
+    for (i = 0; i < 4; i++, ip >>= 8) {
+        const uint32_t o = ip & 0xff;
+        if (o >= 100) {
+            *buf++ = '0' + o / 100;
+            *buf++ = moloch_db_digit_pairs[(o % 100) * 2];
+            *buf++ = moloch_db_digit_pairs[(o % 100) * 2 + 1];
+        } else if (o >= 10) {
+            *buf++ = moloch_db_digit_pairs[o * 2];
+            *buf++ = moloch_db_digit_pairs[o * 2 + 1];
+        } else {
+            *buf++ = '0' + o;
+        }
+        *buf++ = (i == 3) ? 0 : '.';
+    }
+}
+/******************************************************************************/
+/* Characters that can be copied to a json string without escaping */
+#define MOLOCH_DB_JSON_SAFE(c) ((c) >= 0x20 && (c) < 0x80 && (c) != '"' && (c) != '\\' && (c) != '/')
+
+/* Return the first character that needs escaping, or the NUL */
+LOCAL inline unsigned char *moloch_db_js0n_safe(unsigned char *in)
+{
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+    while (((uintptr_t)in & 15) != 0) {
+        if (!MOLOCH_DB_JSON_SAFE(*in))
+            return in;
+        in++;
+    }
+
+    // Aligned loads never cross a page, so reading past the NUL is safe.
+    // Signed compare against space also catches the high bit characters.
+    const __m128i space  = _mm_set1_epi8(0x20);
+    const __m128i quote  = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i slash  = _mm_set1_epi8('/');
+    while (1) {
+        const __m128i v = _mm_load_si128((const __m128i *)in);
+        const __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, bslash), _mm_cmpeq_epi8(v, slash))));
+        const int mask = _mm_movemask_epi8(bad);
+        if (mask)
+            return in + __builtin_ctz(mask);
+        in += 16;
+    }
+#else
+    while (MOLOCH_DB_JSON_SAFE(*in))
+        in++;
+    return in;
+#endif
+}
+/******************************************************************************/
+LOCAL void moloch_db_js0n_str(BSB *bsb, unsigned char *in, gboolean utf8)
+{
+    BSB_EXPORT_u08(*bsb, '"');
+    while (*in) {
+        // Copy runs that don't need escaping in one go
+        unsigned char *end = moloch_db_js0n_safe(in);
+        if (end != in) {
+            const int len = end - in;
+            BSB_EXPORT_ptr(*bsb, in, len);
+            in = end;
+            continue;
+        }
+
+        switch(*in) {
+        case '\b':
+            BSB_EXPORT_cstr(*bsb, "\\b");
+            break;
+        case '\n':
+            BSB_EXPORT_cstr(*bsb, "\\n");
+            break;
+        case '\r':
+            BSB_EXPORT_cstr(*bsb, "\\r");
+            break;
+        case '\f':
+            BSB_EXPORT_cstr(*bsb, "\\f");
+            break;
+        case '\t':
+            BSB_EXPORT_cstr(*bsb, "\\t");
+            break;
+        case '"':
+            BSB_EXPORT_cstr(*bsb, "\\\"");
+            break;
+        case '\\':
+            BSB_EXPORT_cstr(*bsb, "\\\\");
+            break;
+        case '/':
+            BSB_EXPORT_cstr(*bsb, "\\/");
+            break;
+        default:
+            if(*in < 32) {
+                BSB_EXPORT_cstr(*bsb, "\\u00");
+                BSB_EXPORT_ptr(*bsb, moloch_char_to_hexstr[*in], 2);
+            } else if (utf8) {
+                if ((*in & 0xf0) == 0xf0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xe0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else if ((*in & 0xf0) == 0xd0) {
+                    BSB_EXPORT_u08(*bsb, *(in++));
+                    BSB_EXPORT_u08(*bsb, *in);
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            } else {
+                if(*in & 0x80) {
+                    BSB_EXPORT_u08(*bsb, (0xc0 | (*in >> 6)));
+                    BSB_EXPORT_u08(*bsb, (0x80 | (*in & 0x3f)));
+                } else {
+                    BSB_EXPORT_u08(*bsb, *in);
+                }
+            }
+            break;
+        }
+        in++;
+    }
+
+    BSB_EXPORT_u08(*bsb, '"');
+}
+
+#endif
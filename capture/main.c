@@ -20,12 +20,10 @@
 #include <grp.h>
 #include <errno.h>
 #include <sys/resource.h>
-#ifdef _POSIX_MEMLOCK
 #include <sys/mman.h>
-#endif
-#ifdef _POSIX_PRIORITY_SCHEDULING
+#include <sys/syscall.h>
+#include <dirent.h>
 #include <sched.h>
-#endif
 #include "pcap.h"
 #include "molochconfig.h"
 
@@ -620,6 +618,9 @@ gboolean moloch_ready_gfunc (gpointer UNUSED(user_data))
     moloch_reader_start();
     if (!config.pcapReadOffline && (pcapFileHeader.linktype == 0 || pcapFileHeader.snaplen == 0))
         LOGEXIT("Reader didn't call moloch_packet_set_linksnap");
+
+    // Pin last so the other threads don't inherit the main loop cpu
+    moloch_thread_pin("main", 0);
     return FALSE;
 }
 /******************************************************************************/
@@ -641,6 +642,258 @@ void moloch_hex_init()
     }
 }
 
+/******************************************************************************/
+/* Thread topology, each class of thread can be pinned to a list of cpus with
+ * <class>Cpus, thread N of the class gets the Nth cpu in the list.
+ */
+#define MOLOCH_TOPOLOGY_MAX 256
+#define MOLOCH_MAX_CPUS     1024
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE   (1<<1)
+#endif
+
+LOCAL const char *threadClasses[] = {"reader", "packet", "writer", "main", NULL};
+LOCAL int         threadCpus[4][MOLOCH_MAX_CPUS];
+LOCAL int         threadCpusNum[4];
+
+LOCAL struct {
+    char  name[16];
+    int   cpu;
+    int   node;
+} topology[MOLOCH_TOPOLOGY_MAX];
+LOCAL int         topologyNum;
+LOCAL MOLOCH_LOCK_DEFINE(topology);
+
+LOCAL int         numaBind;
+LOCAL int         hugePages;
+LOCAL size_t      hugePageSize = 2*1024*1024;
+
+/******************************************************************************/
+LOCAL int moloch_thread_class(const char *kind)
+{
+    int c;
+    for (c = 0; threadClasses[c]; c++) {
+        if (strcmp(threadClasses[c], kind) == 0)
+            return c;
+    }
+    LOGEXIT("Unknown thread class %s", kind);
+}
+/******************************************************************************/
+/* Parse cpu lists like 0-3,8,10-11 */
+LOCAL void moloch_thread_cpus_parse(int c, char *str)
+{
+    char **parts = g_strsplit(str, ",", 0);
+    int    i;
+
+    for (i = 0; parts[i]; i++) {
+        int start, end;
+        g_strstrip(parts[i]);
+        if (!parts[i][0])
+            continue;
+        switch (sscanf(parts[i], "%d-%d", &start, &end)) {
+        case 1:
+            end = start;
+            break;
+        case 2:
+            break;
+        default:
+            LOGEXIT("Bad cpu list '%s' for %sCpus", str, threadClasses[c]);
+        }
+        if (start < 0 || end < start || end >= MOLOCH_MAX_CPUS)
+            LOGEXIT("Bad cpu range '%s' for %sCpus", parts[i], threadClasses[c]);
+        for (; start <= end && threadCpusNum[c] < MOLOCH_MAX_CPUS; start++) {
+            threadCpus[c][threadCpusNum[c]++] = start;
+        }
+    }
+    g_strfreev(parts);
+}
+/******************************************************************************/
+void moloch_thread_init()
+{
+    int c;
+    char key[100];
+
+    for (c = 0; threadClasses[c]; c++) {
+        snprintf(key, sizeof(key), "%sCpus", threadClasses[c]);
+        char *str = moloch_config_str(NULL, key, NULL);
+        if (str) {
+            moloch_thread_cpus_parse(c, str);
+            g_free(str);
+        }
+    }
+
+    numaBind = moloch_config_boolean(NULL, "numaBind", FALSE);
+    hugePages = moloch_config_boolean(NULL, "hugePages", FALSE);
+}
+/******************************************************************************/
+/* Which cpu thread num of class kind will be pinned to, -1 if not pinned */
+int moloch_thread_cpu(const char *kind, int num)
+{
+    int c = moloch_thread_class(kind);
+    if (threadCpusNum[c] == 0)
+        return -1;
+    return threadCpus[c][num % threadCpusNum[c]];
+}
+/******************************************************************************/
+int moloch_cpu_node(int cpu)
+{
+    if (cpu < 0)
+        return -1;
+
+    char path[100];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+        node = -1;
+    }
+    closedir(dir);
+    return node;
+}
+/******************************************************************************/
+/* The numa node thread num of class kind allocates from, -1 for anywhere */
+int moloch_thread_node(const char *kind, int num)
+{
+    if (!numaBind)
+        return -1;
+    return moloch_cpu_node(moloch_thread_cpu(kind, num));
+}
+/******************************************************************************/
+/* Called by the thread itself, pin it and record where it ended up */
+void moloch_thread_pin(const char *kind, int num)
+{
+    int cpu = moloch_thread_cpu(kind, num);
+    int node = -1;
+
+#ifdef __linux
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) {
+            LOG("WARNING - Couldn't pin %s thread %d to cpu %d: %s", kind, num, cpu, strerror(rc));
+            cpu = -1;
+        } else {
+            node = moloch_cpu_node(cpu);
+        }
+    }
+
+    // New allocations from this thread prefer its own node
+    if (numaBind && node >= 0 && node < 64) {
+        unsigned long mask = 1UL << node;
+        if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, &mask, 64) != 0)
+            LOG("WARNING - Couldn't set memory policy for %s thread %d: %s", kind, num, strerror(errno));
+    }
+#else
+    if (cpu >= 0)
+        LOG("WARNING - %sCpus not supported on this platform", kind);
+    cpu = -1;
+#endif
+
+    MOLOCH_LOCK(topology);
+    if (topologyNum < MOLOCH_TOPOLOGY_MAX) {
+#ifdef __linux
+        pthread_getname_np(pthread_self(), topology[topologyNum].name, sizeof(topology[topologyNum].name));
+#else
+        snprintf(topology[topologyNum].name, sizeof(topology[topologyNum].name), "%s%d", kind, num);
+#endif
+        topology[topologyNum].cpu = cpu;
+        topology[topologyNum].node = node;
+        topologyNum++;
+    }
+    MOLOCH_UNLOCK(topology);
+
+    if (config.debug && cpu >= 0)
+        LOG("Pinned %s thread %d to cpu %d node %d", kind, num, cpu, node);
+}
+/******************************************************************************/
+/* name:cpu:node for each thread that called moloch_thread_pin, - if floating */
+int moloch_thread_topology(char *buf, int len)
+{
+    int i;
+    int pos = 0;
+
+    buf[0] = 0;
+    MOLOCH_LOCK(topology);
+    for (i = 0; i < topologyNum && pos < len; i++) {
+        if (topology[i].cpu >= 0)
+            pos += snprintf(buf + pos, len - pos, "%s%s:%d:%d", i ? " " : "", topology[i].name, topology[i].cpu, topology[i].node);
+        else
+            pos += snprintf(buf + pos, len - pos, "%s%s:-:-", i ? " " : "", topology[i].name);
+    }
+    MOLOCH_UNLOCK(topology);
+    return MIN(pos, len - 1);
+}
+/******************************************************************************/
+LOCAL size_t moloch_numa_size(size_t size)
+{
+    if (hugePages && size >= hugePageSize)
+        return (size + hugePageSize - 1) & ~(hugePageSize - 1);
+    return (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+}
+/******************************************************************************/
+/* Large zeroed allocation placed on node (-1 for any), huge pages if enabled */
+void *moloch_numa_alloc(size_t size, int node)
+{
+    void *mem = MAP_FAILED;
+
+    size = moloch_numa_size(size);
+
+#ifdef MAP_HUGETLB
+    if (hugePages && size >= hugePageSize)
+        mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_HUGETLB, -1, 0);
+#endif
+
+    if (mem == MAP_FAILED) {
+        mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+        if (unlikely(mem == MAP_FAILED)) {
+            LOGEXIT("ERROR - MMap failure in moloch_numa_alloc, %d: %s", errno, strerror(errno));
+        }
+#ifdef MADV_HUGEPAGE
+        // No reserved huge pages, let transparent huge pages try
+        if (hugePages)
+            madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    }
+
+#ifdef __linux
+    // Move is needed since mlockall may have already faulted the pages in
+    if (node >= 0 && node < 64) {
+        unsigned long mask = 1UL << node;
+        if (syscall(__NR_mbind, mem, size, MPOL_PREFERRED, &mask, 64, MPOL_MF_MOVE) != 0 && config.debug)
+            LOG("WARNING - Couldn't bind memory to node %d: %s", node, strerror(errno));
+    }
+#endif
+    return mem;
+}
+/******************************************************************************/
+void moloch_numa_free(void *mem, size_t size)
+{
+    munmap(mem, moloch_numa_size(size));
+}
+/******************************************************************************/
+/* Zeroed array of config.packetThreads elements, cache line aligned so
+ * elements padded to a cache line never share one.
+ */
+void *moloch_thread_array_alloc(size_t size)
+{
+    void *mem;
+    if (posix_memalign(&mem, MOLOCH_CACHE_LINE, size * config.packetThreads))
+        LOGEXIT("ERROR - Couldn't allocate per thread array of %d * %zu", config.packetThreads, size);
+    memset(mem, 0, size * config.packetThreads);
+    return mem;
+}
 /*
 void moloch_sched_init()
 {
@@ -702,12 +955,13 @@ int main(int argc, char **argv)
     moloch_free_later_init();
     moloch_hex_init();
     moloch_config_init();
+    moloch_thread_init();
     moloch_writers_init();
     moloch_readers_init();
     moloch_plugins_init();
     moloch_plugins_load(config.rootPlugins);
     if (config.pcapReadOffline)
-        moloch_readers_set("libpcap-file");
+        moloch_readers_set(moloch_config_str(NULL, "pcapReadOfflineMethod", "libpcap-file"));
     else
         moloch_readers_set(NULL);
     if (!config.pcapReadOffline) {
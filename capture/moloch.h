@@ -53,7 +53,7 @@
 #define SUPPRESS_ALIGNMENT
 #endif
 
-#define MOLOCH_API_VERSION 160
+#define MOLOCH_API_VERSION 175
 
 #define MOLOCH_SESSIONID_LEN 37
 
@@ -260,13 +260,15 @@ typedef struct {
 #define MOLOCH_THREAD_INCROLD(var)       __sync_fetch_and_add(&var, 1);
 #define MOLOCH_THREAD_INCR_NUM(var, num) __sync_fetch_and_add(&var, num);
 
-/* You are probably looking here because you think 24 is too low, really it isn't.
- * Instead, increase the number of threads used for reading packets.
+/* Upper bound on packetThreads, per thread state is sized from config.packetThreads
+ * at startup so this only costs plugins that keep static per thread arrays.
  * https://github.com/aol/moloch/wiki/FAQ#why-am-i-dropping-packets
  */
-#define MOLOCH_MAX_PACKET_THREADS 24
+#define MOLOCH_MAX_PACKET_THREADS 256
 
-#define MAX_INTERFACES 32
+#define MAX_INTERFACES 128
+
+#define MOLOCH_CACHE_LINE 64
 
 #ifndef LOCAL
 #define LOCAL static
@@ -476,11 +478,27 @@ struct moloch_pcap_sf_pkthdr {
 #define MOLOCH_PACKET_TUNNEL_PPP    0x08
 #define MOLOCH_PACKET_TUNNEL_GTP    0x10
 
+/* A reader owned buffer that uncopied packets point into.  The reader sets
+ * refs to the number of packets it hands out plus one for itself, and
+ * freeFunc is called once the last packet using the block has been freed.
+ */
+typedef struct molochpacketblock_t MolochPacketBlock_t;
+typedef void (*MolochPacketBlockFreeFunc)(MolochPacketBlock_t *block);
+
+struct molochpacketblock_t
+{
+    MolochPacketBlockFreeFunc  freeFunc;
+    void                      *uw;
+    uint32_t                   refs;
+};
+
 typedef struct molochpacket_t
 {
     struct molochpacket_t   *packet_next, *packet_prev;
     struct timeval ts;             // timestamp
     uint8_t       *pkt;            // full packet
+    MolochPacketBlock_t *block;    // reader block pkt points into, if not copied
+    char           sessionId[MOLOCH_SESSIONID_LEN]; // Saved session id, built by the reader
     uint64_t       writerFilePos;  // where in output file
     uint64_t       readerFilePos;  // where in input file
     uint32_t       writerFileNum;  // file number in db
@@ -499,6 +517,7 @@ typedef struct molochpacket_t
     uint8_t        copied:1;       // don't need to copy
     uint8_t        wasfrag:1;      // was a fragment
     uint8_t        tunnel:5;       // tunnel type
+    uint8_t        steered:1;      // thread picked from the steering table
 } MolochPacket_t;
 
 typedef struct
@@ -511,25 +530,18 @@ typedef struct
 
 typedef struct
 {
-    MolochPacketHead_t    packetQ[MOLOCH_MAX_PACKET_THREADS];
+    MolochPacketHead_t   *packetQ;        // one per packet thread
+    uint32_t             *queued;         // packet thread queue sizes as of last flush
+    uint32_t             *ringUsed;       // how full our ring to each packet thread was as of last flush
     int                   count;
+    int                   ringNum;        // which ring of each packet thread this batch feeds
     uint8_t               readerPos;
+    uint16_t              threadFirst;    // if threadCount, only feed packet threads [threadFirst, threadFirst+threadCount)
+    uint16_t              threadCount;
 } MolochPacketBatch_t;
 /******************************************************************************/
-typedef struct moloch_tcp_data {
-    struct moloch_tcp_data *td_next, *td_prev;
-
-    MolochPacket_t *packet;
-    uint32_t        seq;
-    uint32_t        ack;
-    uint16_t        len;
-    uint16_t        dataOffset;
-} MolochTcpData_t;
-
-typedef struct {
-    struct moloch_tcp_data *td_next, *td_prev;
-    int td_count;
-} MolochTcpDataHead_t;
+// Out of order tcp data waiting to be processed, private to packet.c
+typedef struct moloch_tcp_stream MolochTcpStream_t;
 
 #define MOLOCH_TCP_STATE_FIN     1
 #define MOLOCH_TCP_STATE_FIN_ACK 2
@@ -554,58 +566,51 @@ typedef enum {
 typedef struct moloch_session {
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
+    struct moloch_session *w_next, *w_prev;
     uint32_t               h_hash;
+    uint32_t               h_slot:30;      // where it is in the session table
+    uint32_t               h_gen:1;        // which session table, while growing
+    uint32_t               inHash:1;
 
     char                   sessionId[MOLOCH_SESSIONID_LEN];
 
+    /* Hot - used on most packets */
+    struct timeval         lastPacket;
+    uint64_t               bytes[2];
+    uint64_t               databytes[2];
+    uint64_t               totalDatabytes[2];
+    uint32_t               packets[2];
+    uint32_t               lastFileNum;
+
+    GArray                *filePosArray;
+    GArray                *fileLenArray;
+    GArray                *fileNumArray;
+
     MolochField_t        **fields;
 
     void                  **pluginData;
 
     MolochParserInfo_t    *parserInfo;
 
-    MolochTcpDataHead_t   tcpData;
+    MolochTcpStream_t    *tcpStream;
     uint32_t              tcpSeq[2];
     char                  tcpState[2];
 
-    GArray                *filePosArray;
-    GArray                *fileLenArray;
-    GArray                *fileNumArray;
-    char                  *rootId;
-
-    struct timeval         firstPacket;
-    struct timeval         lastPacket;
-    struct in6_addr        addr1;
-    struct in6_addr        addr2;
-    char                   firstBytes[2][8];
-
-    uint64_t               bytes[2];
-    uint64_t               databytes[2];
-    uint64_t               totalDatabytes[2];
-
-    uint32_t               lastFileNum;
-    uint32_t               saveTime;
-    uint32_t               packets[2];
-
-    uint16_t               port1;
-    uint16_t               port2;
-    uint16_t               outstandingQueries;
-    uint16_t               segments;
     uint16_t               stopSaving;
+    uint16_t               wheelSlot;
     uint16_t               tcpFlagCnt[MOLOCH_TCPFLAG_MAX];
     uint16_t               maxFields;
 
     uint8_t                consumed[2];
     uint8_t                protocol;
-    uint8_t                firstBytesLen[2];
-    uint8_t                ip_tos;
     uint8_t                tcp_flags;
     uint8_t                parserLen;
     uint8_t                parserNum;
-    uint8_t                minSaving;
     uint8_t                thread;
+    uint8_t                spiDone:1;      // nothing left that needs payload
+    uint8_t                spiCheck:1;     // a parser unregistered, see if done
+    uint8_t                shunted:1;      // readers may be dropping packets for us
+    uint8_t                steered:1;      // counted in its steering bucket
 
     uint16_t               haveTcpSession:1;
     uint16_t               needSave:1;
@@ -617,16 +622,34 @@ typedef struct moloch_session {
     uint16_t               outOfOrder:2;
     uint16_t               ackedUnseenSegment:2;
     uint16_t               stopYara:1;
+    uint16_t               detached:1;
+
+    /* Cold - set once or used when saving */
+    char                  *rootId;
+    struct timeval         firstPacket;
+    struct in6_addr        addr1;
+    struct in6_addr        addr2;
+    char                   firstBytes[2][8];
+
+    uint32_t               saveTime;
+
+    uint16_t               port1;
+    uint16_t               port2;
+    uint16_t               outstandingQueries;
+    uint16_t               segments;
+
+    uint8_t                firstBytesLen[2];
+    uint8_t                ip_tos;
+    uint8_t                minSaving;
 } MolochSession_t;
 
 typedef struct moloch_session_head {
     struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
+    struct moloch_session *w_next, *w_prev;
     int                    tcp_count;
     int                    q_count;
-    int                    h_count;
+    int                    w_count;
 } MolochSessionHead_t;
 
 
@@ -743,6 +766,16 @@ void moloch_add_can_quit(MolochCanQuitFunc func, const char *name);
 
 void moloch_quit();
 
+void moloch_thread_init();
+int moloch_thread_cpu(const char *kind, int num);
+int moloch_thread_node(const char *kind, int num);
+int moloch_cpu_node(int cpu);
+void moloch_thread_pin(const char *kind, int num);
+int moloch_thread_topology(char *buf, int len);
+void *moloch_numa_alloc(size_t size, int node);
+void moloch_numa_free(void *mem, size_t size);
+void *moloch_thread_array_alloc(size_t size);
+
 
 /******************************************************************************/
 /*
@@ -780,6 +813,7 @@ void moloch_config_monitor_files(char *desc, char **names, MolochFilesChange_cb
 void     moloch_db_init();
 char    *moloch_db_create_file(time_t firstPacket, const char *name, uint64_t size, int locked, uint32_t *id);
 char    *moloch_db_create_file_full(time_t firstPacket, const char *name, uint64_t size, int locked, uint32_t *id, ...);
+// A final save also frees the session
 void     moloch_db_save_session(MolochSession_t *session, int final);
 void     moloch_db_add_local_ip(char *str, MolochIpInfo_t *ii);
 void     moloch_db_add_field(char *group, char *kind, char *expression, char *friendlyName, char *dbField, char *help, int haveap, va_list ap);
@@ -804,12 +838,12 @@ typedef struct molochdrophashitem_t  MolochDropHashItem_t;
 typedef struct molochdrophash_t      MolochDropHash_t;
 typedef struct molochdrophashgroup_t MolochDropHashGroup_t;
 struct molochdrophashgroup_t {
-    MolochDropHashItem_t *dhg_next, *dhg_prev;
-    int                   dhg_count;
+    MolochDropHash_t     *hash;
     int                   changed;
+    uint32_t              current;           // newest packet time seen
     char                 *file;
     char                  isIp4;
-    MolochDropHash_t     *drops[0x10000];
+    uint32_t              ports[0x10000];    // items per port, checked before hashing
     MOLOCH_LOCK_EXTERN(lock);
 };
 
@@ -818,6 +852,7 @@ void moloch_drophash_init(MolochDropHashGroup_t *group, char *file, int isIp4);
 int moloch_drophash_add (MolochDropHashGroup_t *group, int port, const void *key, uint32_t current, uint32_t goodFor);
 int moloch_drophash_should_drop (MolochDropHashGroup_t *group, int port, void *key, uint32_t current);
 void moloch_drophash_delete (MolochDropHashGroup_t *group, int port, void *key);
+void moloch_drophash_expire(MolochDropHashGroup_t *group);
 void moloch_drophash_save(MolochDropHashGroup_t *group);
 
 /******************************************************************************/
@@ -844,6 +879,7 @@ const char *moloch_parsers_magic(MolochSession_t *session, int field, const char
 typedef void (* MolochClassifyFunc) (MolochSession_t *session, const unsigned char *data, int remaining, int which, void *uw);
 
 void  moloch_parsers_unregister(MolochSession_t *session, void *uw);
+void  moloch_parsers_spi_done(MolochSession_t *session);
 void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc);
 #define moloch_parsers_register(session, func, uw, ffunc) moloch_parsers_register2(session, func, uw, ffunc, NULL)
 
@@ -888,7 +924,9 @@ unsigned char *moloch_http_get(void *server, char *key, int key_len, size_t *mle
 #define moloch_http_free_buffer(b) MOLOCH_SIZE_FREE(buffer, b)
 void moloch_http_exit();
 int moloch_http_queue_length(void *server);
+gboolean moloch_http_is_backlogged(void *server);
 uint64_t moloch_http_dropped_count(void *server);
+void moloch_http_compress_stats(void *server, uint64_t *in, uint64_t *out, uint64_t *usec);
 
 void *moloch_http_create_server(const char *hostnames, int maxConns, int maxOutstandingRequests, int compress);
 void moloch_http_set_retries(void *server, uint16_t retries);
@@ -913,9 +951,18 @@ uint32_t moloch_session_hash(const void *key);
 int      moloch_session_cmp(const void *keyv, const void *elementv);
 
 MolochSession_t *moloch_session_find(int ses, char *sessionId);
-MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, char *sessionId, int *isNew);
+MolochSession_t *moloch_session_find_thread(int ses, int thread, uint32_t hash, char *sessionId);
+MolochSession_t *moloch_session_find_or_create(int ses, int thread, uint32_t hash, char *sessionId, int *isNew);
+void     moloch_session_prefetch(int ses, int thread, uint32_t hash, int stage);
+gboolean moloch_session_alloc_fields(MolochSession_t *session, int pos);
+void     moloch_session_free_fields(MolochSession_t *session);
+uint64_t moloch_session_memory();
+uint32_t moloch_session_timeout_lag();
+void     moloch_session_detach(MolochSession_t *session);
+void     moloch_session_free(MolochSession_t *session);
 
 void     moloch_session_init();
+void     moloch_session_threads_init();
 void     moloch_session_exit();
 void     moloch_session_add_protocol(MolochSession_t *session, const char *protocol);
 gboolean moloch_session_has_protocol(MolochSession_t *session, const char *protocol);
@@ -953,6 +1000,12 @@ void moloch_session_add_cmd_thread(int thread, gpointer uw1, gpointer uw2, Moloc
  * packet.c
  */
 
+/* State a packet thread shares with session.c, each thread on its own cache lines */
+typedef struct {
+    time_t                lastPacketSecs;  // timestamp of the last packet processed
+    MolochSessionHead_t   tcpWriteQ;       // sessions with tcp data to process
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochPacketThreadState_t;
+
 void     moloch_packet_init();
 uint64_t moloch_packet_dropped_packets();
 void     moloch_packet_exit();
@@ -963,6 +1016,15 @@ int      moloch_packet_frags_size();
 uint64_t moloch_packet_dropped_frags();
 uint64_t moloch_packet_dropped_overload();
 uint64_t moloch_packet_total_bytes();
+uint64_t moloch_packet_total_packets();
+uint64_t moloch_packet_spi_done_packets();
+uint64_t moloch_packet_shunted_packets();
+void     moloch_packet_shunt_fold(MolochSession_t *session, int release);
+void     moloch_packet_shunt_last(MolochSession_t *session);
+void     moloch_packet_steer_release(MolochSession_t *session);
+double   moloch_packet_steer_imbalance();
+uint64_t moloch_packet_steer_moves();
+uint64_t moloch_packet_steer_handoffs();
 void     moloch_packet_thread_wake(int thread);
 void     moloch_packet_flush();
 void     moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, int len, int which);
@@ -970,8 +1032,11 @@ void     moloch_packet_add_packet_ip(char *ipstr, int mode);
 
 void     moloch_packet_batch_init(MolochPacketBatch_t *batch);
 void     moloch_packet_batch_flush(MolochPacketBatch_t *batch);
+void     moloch_packet_batch_affinity(MolochPacketBatch_t *batch, int reader, int numReaders);
 void     moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const packet);
 
+void     moloch_packet_block_release(MolochPacketBlock_t *block);
+
 void     moloch_packet_set_linksnap(int linktype, int snaplen);
 void     moloch_packet_drophash_add(MolochSession_t *session, int which, int min);
 
@@ -17,6 +17,7 @@
 
 #include "moloch.h"
 #include "patricia.h"
+#include "tcpstream.h"
 #include <inttypes.h>
 #include <arpa/inet.h>
 
@@ -27,10 +28,9 @@ extern MolochConfig_t        config;
 
 MolochPcapFileHdr_t          pcapFileHeader;
 
-uint64_t                     totalPackets;
-LOCAL uint64_t               totalBytes[MOLOCH_MAX_PACKET_THREADS];
-
 LOCAL uint32_t               initialDropped = 0;
+LOCAL int                    initialLogged;
+LOCAL uint64_t               nextLogPackets;
 struct timeval               initialPacket; // Don't make LOCAL for now because of netflow plugin
 
 extern void                 *esServer;
@@ -45,15 +45,30 @@ LOCAL int                    greIpField;
 LOCAL int                    icmpTypeField;
 LOCAL int                    icmpCodeField;
 
-LOCAL uint64_t               droppedFrags;
+MolochPacketThreadState_t   *packetThreadState;
 
-time_t                       lastPacketSecs[MOLOCH_MAX_PACKET_THREADS];
-LOCAL int                    inProgress[MOLOCH_MAX_PACKET_THREADS];
+/* Per packet thread counters, one cache line each */
+typedef struct {
+    int                      inProgress;
+    uint64_t                 benchPackets;
+    uint64_t                 benchNanos;
+    uint64_t                 tcpBytes;       // tcp stream buffer memory
+    uint64_t                 tcpBuffered;    // segments that had to be buffered
+    uint64_t                 tcpIncomplete;  // sessions that hit a reassembly limit
+    uint64_t                 spiDonePackets; // packets that skipped payload processing
+    uint64_t                 shuntFull;      // flows that couldn't be shunted
+    uint64_t                 steerHandoffs;  // packets passed to the bucket's thread
+    uint64_t                 steerUncounted;     // sessions too many for their bucket to count
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochPacketThreadCounters_t;
+
+LOCAL MolochPacketThreadCounters_t *threadCounters;
 
 LOCAL patricia_tree_t       *ipTree4 = 0;
 LOCAL patricia_tree_t       *ipTree6 = 0;
 
 LOCAL int                    maxTcpOutOfOrderPackets;
+LOCAL uint32_t               maxTcpOutOfOrderBytes;
+LOCAL uint64_t               maxTcpReassemblyThreadBytes;
 
 extern MolochFieldOps_t      readerFieldOps[256];
 
@@ -65,23 +80,108 @@ extern MolochFieldOps_t      readerFieldOps[256];
 #define MOLOCH_PACKET_CORRUPT          3
 #define MOLOCH_PACKET_UNKNOWN          4
 #define MOLOCH_PACKET_IPPORT_DROPPED   5
-#define MOLOCH_PACKET_MAX              6
+#define MOLOCH_PACKET_SHUNTED          6
+#define MOLOCH_PACKET_MAX              7
 
-LOCAL uint64_t               packetStats[MOLOCH_PACKET_MAX];
 
 /******************************************************************************/
-extern MolochSessionHead_t   tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
+/* Each packet batch (one per reader thread) gets its own single producer,
+ * single consumer ring into every packet thread, so moving packets from the
+ * readers to the packet threads never takes a lock.  The lock/cond are only
+ * used when a packet thread has run out of work and goes to sleep.
+ */
+#define MOLOCH_PACKET_MAX_RINGS 256
+#define MOLOCH_PACKET_BURST     64
+// How many packets ahead of the one being processed to prefetch sessions
+#define MOLOCH_PACKET_PREFETCH  4
 
-LOCAL  MolochPacketHead_t    packetQ[MOLOCH_MAX_PACKET_THREADS];
-LOCAL  uint32_t              overloadDrops[MOLOCH_MAX_PACKET_THREADS];
+/* Reader side counters, one block per batch so the hot path never shares a
+ * cache line with another reader.  Only summed when stats are needed.
+ */
+typedef struct {
+    uint64_t                 totalPackets;
+    uint64_t                 totalBytes;
+    uint64_t                 overloadDrops;
+    uint64_t                 packetStats[MOLOCH_PACKET_MAX];
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochPacketReaderCounters_t;
+
+LOCAL MolochPacketReaderCounters_t readerCounters[MOLOCH_PACKET_MAX_RINGS];
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOLOCH_CPU_RELAX()      __builtin_ia32_pause()
+#else
+#define MOLOCH_CPU_RELAX()      __asm__ __volatile__("" ::: "memory")
+#endif
 
-LOCAL  MOLOCH_LOCK_DEFINE(frags);
+typedef struct {
+    MolochPacket_t      **packets;
+    uint32_t              mask;
+
+    // Consumer side
+    volatile uint32_t     head __attribute__((aligned(64)));
+    uint32_t              tailCache;
+
+    // Producer side
+    volatile uint32_t     tail __attribute__((aligned(64)));
+    uint32_t              headCache;
+} MolochPacketRing_t;
+
+typedef struct {
+    struct moloch_tcp_stream *held_next, *held_prev;
+    int                       held_count;
+} MolochTcpStreamHead_t;
+
+typedef struct {
+    MolochPacketRing_t   *rings[MOLOCH_PACKET_MAX_RINGS];
+    MolochPacketHead_t    handoffQ;       // steered packets from other packet threads
+    MolochTcpStreamHead_t heldQ;          // tcp streams holding a packet in a reader block
+    int                   nextRing;
+    volatile int          sleeping;
+    MOLOCH_LOCK_EXTERN(lock);
+    MOLOCH_COND_EXTERN(lock);
+} __attribute__((aligned(64))) MolochPacketQ_t;
+
+LOCAL  MolochPacketQ_t      *packetQ;
+LOCAL  int                   numRings;
+LOCAL  uint32_t              packetRingSize;
+LOCAL  int                   packetThreadSpin;
+LOCAL  gboolean              packetPrefetch;
+LOCAL  gboolean              packetBenchmark;
+
+/* Readers pick a packet thread through a table of hash buckets so load can
+ * be moved off a busy thread.  Each bucket packs the owning thread with how
+ * many live sessions it has there and how many packets readers have queued
+ * for it that the packet thread hasn't looked at yet.  A reader takes the
+ * owner and bumps the queued count in one atomic add, and a bucket only moves
+ * when both counts are 0, so every packet of a session is processed on one
+ * thread and in order.  A packet thread that still gets a packet for a bucket
+ * that isn't its own hands it over.
+ * Off unless packetSteerBuckets is set: the queued count costs every packet
+ * an atomic add on a line the packet thread writes too, and a bucket that
+ * is never idle, like one elephant flow, never moves.
+ */
+#define MOLOCH_STEER_THREAD_SHIFT 48
+#define MOLOCH_STEER_QUEUED       (1ULL << 24)
+#define MOLOCH_STEER_COUNT_MASK   (MOLOCH_STEER_QUEUED - 1)
+
+LOCAL  uint64_t             *steerBuckets;
+LOCAL  uint32_t              steerMask;
+LOCAL  uint32_t              steerThreshold;
+LOCAL  uint32_t              steerMaxMoves;
+LOCAL  uint32_t              steerPos;
+LOCAL  double               *steerLoad;
+LOCAL  double                steerImbalance = 1.0;
+LOCAL  uint64_t              steerMoves;
 
 LOCAL int moloch_packet_ip4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL int moloch_packet_frame_relay(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL int moloch_packet_ppp(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL int moloch_packet_ether(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
+LOCAL void moloch_packet_stats(uint64_t *packetStats);
+
+#define MOLOCH_FRAGS_KEY_LEN   37
+#define MOLOCH_FRAGS_WHEEL     256
 
 typedef struct molochfrags_t {
     struct molochfrags_t  *fragh_next, *fragh_prev;
@@ -89,8 +189,9 @@ typedef struct molochfrags_t {
     uint32_t               fragh_bucket;
     uint32_t               fragh_hash;
     MolochPacketHead_t     packets;
-    char                   key[10];
-    uint32_t               secs;
+    char                   key[MOLOCH_FRAGS_KEY_LEN]; // version, src, dst, id
+    uint32_t               bytes;
+    uint16_t               wheelSlot;
     char                   haveNoFlags;
 } MolochFrags_t;
 
@@ -102,10 +203,56 @@ typedef struct {
     uint32_t               fragl_count;
 } MolochFragsHead_t;
 
-typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 199337);
+typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 12289);
+
+// Fragment state is sharded by (src, dst, id) so readers only contend on the same shard.
+// Each shard expires with a timing wheel, slots are fragsWheelGran seconds wide.
+typedef struct {
+    MolochFragsHash_t      hash;
+    MolochFragsHead_t      wheel[MOLOCH_FRAGS_WHEEL];
+    uint32_t               wheelPos;
+    uint32_t               count;
+    uint64_t               bytes;
+    uint64_t               dropped;
+    MOLOCH_LOCK_EXTERN(lock);
+} __attribute__((aligned(64))) MolochFragsShard_t;
+
+LOCAL MolochFragsShard_t  *fragsShards;
+LOCAL int                  numFragsShards;
+LOCAL uint32_t             fragsShardMax;
+LOCAL uint64_t             fragsShardMaxBytes;
+LOCAL uint32_t             fragsWheelGran;
+
+/* Flows that no longer need their packets are published here by the packet
+ * threads so the readers can drop them before they are copied or queued.
+ * A slot's seq is odd while a packet thread is changing it and readers skip
+ * it then.  Readers never wait, they bump the slot's readers count while
+ * they check and count a packet, and a packet thread that locks the slot
+ * waits for that to drain first, so counts can't land in a slot after it
+ * was folded, released or given to another flow.  Entries only last
+ * shuntTimeout packet seconds, then a packet reaches the packet thread again
+ * which folds the counts into the session and renews the entry.
+ */
+#define MOLOCH_SHUNT_PROBE 4
 
-MolochFragsHash_t          fragsHash;
-MolochFragsHead_t          fragsList;
+typedef struct {
+    uint32_t               seq;
+    uint32_t               readers;        // readers checking or counting right now
+    uint32_t               expire;         // packet seconds, 0 when free
+    uint32_t               hash;
+    uint32_t               lastSec;
+    uint64_t               packets[2];
+    uint64_t               bytes[2];
+    uint64_t               databytes[2];
+    struct in6_addr        addr1;
+    uint16_t               port1;
+    uint8_t                ses;
+    char                   sessionId[MOLOCH_SESSIONID_LEN];
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochShunt_t;
+
+LOCAL MolochShunt_t       *shunts;
+LOCAL uint32_t             shuntMask;
+LOCAL uint32_t             shuntTimeout;
 
 // These are in network byte order
 MolochDropHashGroup_t      packetDrop4;
@@ -115,33 +262,180 @@ MolochDropHashGroup_t      packetDrop6;
 #define IPPROTO_IPV4            4
 #endif
 
+/******************************************************************************/
+void moloch_packet_block_release(MolochPacketBlock_t *block)
+{
+    if (__sync_sub_and_fetch(&block->refs, 1) == 0) {
+        block->freeFunc(block);
+    }
+}
+/******************************************************************************/
+/* The packet is no longer queued, either its thread has a counted session for
+ * it now or it is being dropped
+ */
+LOCAL inline void moloch_packet_steer_done(MolochPacket_t * const packet)
+{
+    __atomic_sub_fetch(&steerBuckets[packet->hash & steerMask], MOLOCH_STEER_QUEUED, __ATOMIC_RELEASE);
+    packet->steered = 0;
+}
 /******************************************************************************/
 LOCAL void moloch_packet_free(MolochPacket_t *packet)
 {
+    if (packet->steered)
+        moloch_packet_steer_done(packet);
+
     if (packet->copied) {
         free(packet->pkt);
+    } else if (packet->block) {
+        moloch_packet_block_release(packet->block);
     }
     packet->pkt = 0;
     MOLOCH_TYPE_FREE(MolochPacket_t, packet);
 }
 /******************************************************************************/
+/* Give the packet its own copy of the data, letting go of any reader block */
+LOCAL void moloch_packet_copy(MolochPacket_t *packet)
+{
+    uint8_t *pkt = malloc(packet->pktlen);
+    memcpy(pkt, packet->pkt, packet->pktlen);
+    packet->pkt = pkt;
+    packet->copied = 1;
+
+    if (packet->block) {
+        moloch_packet_block_release(packet->block);
+        packet->block = NULL;
+    }
+}
+/******************************************************************************/
+/* The lowest MOLOCH_TCP_HELD out of order segments of a direction are kept
+ * as the packets themselves, sorted by seq, so a shallow hole costs no copy.
+ * Past that the highest segment is copied into the direction's stream buffer,
+ * which only fills up for deep holes.  Held packets still in a reader block
+ * are copied at the end of the burst so the block isn't held up, their
+ * stream is on the thread's heldQ until then.
+ */
+typedef struct {
+    MolochPacket_t           *packet;
+    uint32_t                  seq;
+    uint32_t                  ack;
+    uint32_t                  len;
+    uint32_t                  off;           // where seq is in the packet
+} MolochTcpHeld_t;
+
+struct moloch_tcp_stream {
+    struct moloch_tcp_stream *held_next, *held_prev;
+    MolochTcpDir_t            dir[2];
+    MolochTcpHeld_t           held[2][MOLOCH_TCP_HELD];
+    uint8_t                   heldNum[2];
+    uint8_t                   heldBlocks;    // held packets still in a reader block
+};
+
+/******************************************************************************/
+LOCAL inline uint32_t moloch_packet_tcp_waiting(const MolochTcpStream_t *stream)
+{
+    return stream->dir[0].num + stream->dir[1].num + stream->heldNum[0] + stream->heldNum[1];
+}
+/******************************************************************************/
+/* Does the first data waiting in a direction come from a held packet */
+LOCAL inline int moloch_packet_tcp_first_held(const MolochTcpStream_t *stream, int which)
+{
+    const MolochTcpDir_t *dir = &stream->dir[which];
+
+    return stream->heldNum[which] &&
+           (!dir->num || !MOLOCH_SEQ_LT(dir->ranges[dir->first].start, stream->held[which][0].seq));
+}
+/******************************************************************************/
+/* Where the first data waiting in a direction starts, returns 0 if none */
+LOCAL inline int moloch_packet_tcp_first(const MolochTcpStream_t *stream, int which, uint32_t *start, uint32_t *ack)
+{
+    const MolochTcpDir_t *dir = &stream->dir[which];
+
+    if (moloch_packet_tcp_first_held(stream, which)) {
+        *start = stream->held[which][0].seq;
+        *ack = stream->held[which][0].ack;
+        return 1;
+    }
+    if (!dir->num)
+        return 0;
+    *start = dir->ranges[dir->first].start;
+    *ack = dir->ranges[dir->first].ack;
+    return 1;
+}
+/******************************************************************************/
+/* The first data waiting in a direction, len is cut short where the ring wraps */
+LOCAL inline const uint8_t *moloch_packet_tcp_first_data(const MolochTcpStream_t *stream, int which, uint32_t *len)
+{
+    const MolochTcpDir_t *dir = &stream->dir[which];
+
+    if (moloch_packet_tcp_first_held(stream, which)) {
+        *len = stream->held[which][0].len;
+        return stream->held[which][0].packet->pkt + stream->held[which][0].off;
+    }
+    *len = dir->ranges[dir->first].end - dir->ranges[dir->first].start;
+    return moloch_tcp_dir_data(dir, dir->ranges[dir->first].start, len);
+}
+/******************************************************************************/
+LOCAL void moloch_packet_tcp_release(MolochSession_t *session, int which, int h)
+{
+    MolochTcpStream_t *stream = session->tcpStream;
+
+    if (stream->held[which][h].packet->block)
+        stream->heldBlocks--;
+    moloch_packet_free(stream->held[which][h].packet);
+
+    stream->heldNum[which]--;
+    memmove(&stream->held[which][h], &stream->held[which][h + 1], (stream->heldNum[which] - h) * sizeof(MolochTcpHeld_t));
+
+    if (stream->held_next && !stream->heldBlocks)
+        DLL_REMOVE(held_, &packetQ[session->thread].heldQ, stream);
+}
+/******************************************************************************/
+/* Held packets still in a reader block get their own copy of the data so the
+ * reader can have the block back, called between bursts.
+ */
+LOCAL void moloch_packet_tcp_copy_held(int thread)
+{
+    MolochTcpStream_t *stream;
+    int                which, h;
+
+    while (DLL_POP_HEAD(held_, &packetQ[thread].heldQ, stream)) {
+        for (which = 0; which < 2; which++) {
+            for (h = 0; h < stream->heldNum[which]; h++) {
+                if (stream->held[which][h].packet->block)
+                    moloch_packet_copy(stream->held[which][h].packet);
+            }
+        }
+        stream->heldBlocks = 0;
+    }
+}
+/******************************************************************************/
 void moloch_packet_tcp_free(MolochSession_t *session)
 {
-    if (session->tcpData.td_count == 1 && session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
-        MolochTcpData_t *ftd = DLL_PEEK_HEAD(td_, &session->tcpData);
-        const int which = ftd->packet->direction;
-        const uint8_t *data = ftd->packet->pkt + ftd->dataOffset;
-        const int len = ftd->len;
+    MolochTcpStream_t *stream = session->tcpStream;
+    int                which, h;
+
+    if (!stream)
+        return;
+
+    if (moloch_packet_tcp_waiting(stream) == 1 &&
+        session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
+        which = (stream->dir[0].num || stream->heldNum[0]) ? 0 : 1;
+        uint32_t len;
+        const uint8_t *data = moloch_packet_tcp_first_data(stream, which, &len);
 
         moloch_parsers_classify_tcp(session, data, len, which);
         moloch_packet_process_data(session, data, len, which);
     }
 
-    MolochTcpData_t *td;
-    while (DLL_POP_HEAD(td_, &session->tcpData, td)) {
-        moloch_packet_free(td->packet);
-        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+    for (which = 0; which < 2; which++) {
+        for (h = 0; h < stream->heldNum[which]; h++)
+            moloch_packet_free(stream->held[which][h].packet);
+        moloch_tcp_dir_free(&stream->dir[which], &threadCounters[session->thread].tcpBytes);
     }
+    if (stream->held_next)
+        DLL_REMOVE(held_, &packetQ[session->thread].heldQ, stream);
+    MOLOCH_TYPE_FREE(MolochTcpStream_t, stream);
+    session->tcpStream = 0;
 }
 /******************************************************************************/
 // Idea from gopacket tcpassembly/assemply.go
@@ -176,57 +470,215 @@ void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, i
     }
 }
 /******************************************************************************/
-LOCAL void moloch_packet_tcp_finish(MolochSession_t *session)
+/* After a parser unregisters see if anything can still use the payload,
+ * either a parser, a later classify, or yara.
+ */
+LOCAL void moloch_packet_spi_check(MolochSession_t *session)
+{
+    int i;
+    for (i = 0; i < session->parserNum; i++) {
+        if (session->parserInfo[i].parserFunc) {
+            session->spiCheck = 0;
+            return;
+        }
+    }
+
+    if (config.yara && config.yaraEveryPacket && !session->stopYara) {
+        session->spiCheck = 0;
+        return;
+    }
+
+    // Wait for both sides to be classified, tcp classifies again while parsers consume everything
+    for (i = 0; i < 2; i++) {
+        if (session->firstBytesLen[i] == 0)
+            return;
+        if (session->protocol == IPPROTO_TCP && session->totalDatabytes[i] == session->consumed[i])
+            return;
+    }
+
+    session->spiCheck = 0;
+    session->spiDone = 1;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_tcp_deliver(MolochSession_t *session, const uint8_t *data, int len, int which)
 {
-    MolochTcpData_t            *ftd;
-    MolochTcpData_t            *next;
+    if (session->firstBytesLen[which] < 8) {
+        int copy = MIN(8 - session->firstBytesLen[which], len);
+        memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
+        session->firstBytesLen[which] += copy;
+    }
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
+    if (session->totalDatabytes[which] == session->consumed[which])  {
+        moloch_parsers_classify_tcp(session, data, len, which);
+    }
 
-#ifdef DEBUG_PACKET
-    LOG("START");
-    DLL_FOREACH(td_, tcpData, ftd) {
-        LOG("dir: %d seq: %8u ack: %8u len: %4u", ftd->packet->direction, ftd->seq, ftd->ack, ftd->len);
+    moloch_packet_process_data(session, data, len, which);
+    session->tcpSeq[which] += len;
+    session->databytes[which] += len;
+    session->totalDatabytes[which] += len;
+
+    if (config.yara && config.yaraEveryPacket && !session->stopYara) {
+        moloch_yara_execute(session, data, len, 0);
     }
-#endif
 
-    DLL_FOREACH_REMOVABLE(td_, tcpData, ftd, next) {
-        const int which = ftd->packet->direction;
-        const uint32_t tcpSeq = session->tcpSeq[which];
+    if (session->spiCheck)
+        moloch_packet_spi_check(session);
+}
+/******************************************************************************/
+/* Copy the parts of [seq, seq+len) not already held into the direction's
+ * stream buffer, returns 0 if over the session or thread limits.
+ */
+LOCAL int moloch_packet_tcp_buffer(MolochSession_t *session, int which, uint32_t seq, uint32_t ack, const uint8_t *data, uint32_t len)
+{
+    if (!session->tcpStream)
+        session->tcpStream = MOLOCH_TYPE_ALLOC0(MolochTcpStream_t);
 
-        if (tcpSeq >= ftd->seq && tcpSeq < (ftd->seq + ftd->len)) {
-            const int offset = tcpSeq - ftd->seq;
-            const uint8_t *data = ftd->packet->pkt + ftd->dataOffset + offset;
-            const int len = ftd->len - offset;
+    MolochTcpStream_t *stream = session->tcpStream;
 
-            if (session->firstBytesLen[which] < 8) {
-                int copy = MIN(8 - session->firstBytesLen[which], len);
-                memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
-                session->firstBytesLen[which] += copy;
-            }
+    if (moloch_packet_tcp_waiting(stream) >= (uint32_t)maxTcpOutOfOrderPackets)
+        return 0;
 
-            if (session->totalDatabytes[which] == session->consumed[which])  {
-                moloch_parsers_classify_tcp(session, data, len, which);
-            }
+    return moloch_tcp_dir_add(&stream->dir[which], session->haveTcpSession ? session->tcpSeq[which] : seq, seq, ack, data, len,
+                              maxTcpOutOfOrderBytes, &threadCounters[session->thread].tcpBytes, maxTcpReassemblyThreadBytes);
+}
+/******************************************************************************/
+/* Keep the packet as one of the direction's waiting segments, the stream owns
+ * it now.  When the direction already holds its max the highest segment is
+ * copied into the stream buffer instead, returns 0 if over the limits.
+ */
+LOCAL int moloch_packet_tcp_hold(MolochSession_t *session, MolochPacket_t *packet, int which, uint32_t seq, uint32_t ack, const uint8_t *data, uint32_t len, int *held)
+{
+    if (!session->tcpStream)
+        session->tcpStream = MOLOCH_TYPE_ALLOC0(MolochTcpStream_t);
+
+    MolochTcpStream_t *stream = session->tcpStream;
+    MolochTcpHeld_t   *list = stream->held[which];
+    int                h;
+
+    if (stream->heldNum[which] == MOLOCH_TCP_HELD) {
+        MolochTcpHeld_t *last = &list[MOLOCH_TCP_HELD - 1];
+        if (!MOLOCH_SEQ_LT(seq, last->seq))
+            return moloch_packet_tcp_buffer(session, which, seq, ack, data, len);
+
+        const int ok = moloch_packet_tcp_buffer(session, which, last->seq, last->ack, last->packet->pkt + last->off, last->len);
+        moloch_packet_tcp_release(session, which, MOLOCH_TCP_HELD - 1);
+        if (!ok)
+            return 0;
+    } else if (moloch_packet_tcp_waiting(stream) >= (uint32_t)maxTcpOutOfOrderPackets) {
+        return 0;
+    }
 
-            moloch_packet_process_data(session, data, len, which);
-            session->tcpSeq[which] += len;
-            session->databytes[which] += len;
-            session->totalDatabytes[which] += len;
+    for (h = stream->heldNum[which]; h > 0 && MOLOCH_SEQ_LT(seq, list[h - 1].seq); h--)
+        list[h] = list[h - 1];
 
-            if (config.yara && config.yaraEveryPacket && !session->stopYara) {
-                moloch_yara_execute(session, data, len, 0);
-            }
+    list[h].packet = packet;
+    list[h].seq = seq;
+    list[h].ack = ack;
+    list[h].len = len;
+    list[h].off = data - packet->pkt;
+    stream->heldNum[which]++;
+    *held = 1;
+
+    if (packet->block) {
+        stream->heldBlocks++;
+        if (!stream->held_next)
+            DLL_PUSH_TAIL(held_, &packetQ[session->thread].heldQ, stream);
+    }
+    return 1;
+}
+/******************************************************************************/
+/* Drop whatever is waiting in the direction that has already been delivered */
+LOCAL void moloch_packet_tcp_trim(MolochSession_t *session, int which)
+{
+    MolochTcpStream_t *stream = session->tcpStream;
+    MolochTcpHeld_t   *list = stream->held[which];
+    const uint32_t     next = session->tcpSeq[which];
+    int                h;
+
+    moloch_tcp_dir_trim(&stream->dir[which], next);
 
-            DLL_REMOVE(td_, tcpData, ftd);
-            moloch_packet_free(ftd->packet);
-            MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
+    for (h = 0; h < stream->heldNum[which] && MOLOCH_SEQ_LT(list[h].seq, next);) {
+        const uint32_t skip = next - list[h].seq;
+        if (skip >= list[h].len) {
+            moloch_packet_tcp_release(session, which, h);
         } else {
-            return;
+            list[h].seq = next;
+            list[h].off += skip;
+            list[h].len -= skip;
+            h++;
         }
     }
 }
+/******************************************************************************/
+LOCAL void moloch_packet_tcp_incomplete(MolochSession_t *session)
+{
+    threadCounters[session->thread].tcpIncomplete++;
+    moloch_packet_tcp_free(session);
+    moloch_session_add_tag(session, "incomplete-tcp");
+    session->stopTCP = 1;
+}
+/******************************************************************************/
+/* Can the first data waiting in this direction go, or does the other
+ * direction have data waiting that this segment had already acked.
+ */
+LOCAL inline int moloch_packet_tcp_ready(MolochSession_t *session, int which, int *blocked)
+{
+    const MolochTcpStream_t *stream = session->tcpStream;
+    uint32_t                 start, ack, ostart, oack;
+
+    if (!moloch_packet_tcp_first(stream, which, &start, &ack) || start != session->tcpSeq[which])
+        return 0;
 
+    *blocked = moloch_packet_tcp_first(stream, which ^ 1, &ostart, &oack) && MOLOCH_SEQ_LT(ostart, ack);
+    return 1;
+}
+/******************************************************************************/
+/* Hand the parsers whatever buffered data is now in order */
+LOCAL void moloch_packet_tcp_drain(MolochSession_t *session)
+{
+    MolochTcpStream_t *stream = session->tcpStream;
+    int                which;
+
+    while (1) {
+        moloch_packet_tcp_trim(session, 0);
+        moloch_packet_tcp_trim(session, 1);
+
+        int blocked0 = 0, blocked1 = 0;
+        int ready0 = moloch_packet_tcp_ready(session, 0, &blocked0);
+        int ready1 = moloch_packet_tcp_ready(session, 1, &blocked1);
+
+        if (ready0 && ready1)
+            which = blocked0 ? 1 : 0;
+        else if (ready0 && !blocked0)
+            which = 0;
+        else if (ready1 && !blocked1)
+            which = 1;
+        else
+            break;
+
+        // Trimmed once tcpSeq moves past it, a range that wraps the ring goes in two parts
+        uint32_t len;
+        const uint8_t *data = moloch_packet_tcp_first_data(stream, which, &len);
+
+        moloch_packet_tcp_deliver(session, data, len, which);
+
+        // A parser may have stopped tcp processing
+        if (!session->tcpStream)
+            return;
+    }
+
+    // Nothing left waiting, give the memory back
+    if (!moloch_packet_tcp_waiting(stream)) {
+        moloch_packet_tcp_free(session);
+        return;
+    }
+
+    // Don't keep a big ring around after a deep hole is filled
+    for (which = 0; which < 2; which++) {
+        if (stream->dir[which].num == 0 && stream->dir[which].bufSize > MOLOCH_TCP_KEEP)
+            moloch_tcp_dir_free(&stream->dir[which], &threadCounters[session->thread].tcpBytes);
+    }
+}
 /******************************************************************************/
 LOCAL void moloch_packet_process_icmp(MolochSession_t * const UNUSED(session), MolochPacket_t * const packet)
 {
@@ -263,8 +715,12 @@ LOCAL void moloch_packet_process_udp(MolochSession_t * const session, MolochPack
             session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, packet->direction);
         }
     }
+
+    if (session->spiCheck)
+        moloch_packet_spi_check(session);
 }
 /******************************************************************************/
+/* Returns 1 if the stream kept the packet */
 SUPPRESS_ALIGNMENT
 LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacket_t * const packet)
 {
@@ -284,7 +740,7 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
     }
 
     if (len < 0)
-        return 1;
+        return 0;
 
     if (tcphdr->th_flags & TH_URG) {
         session->tcpFlagCnt[MOLOCH_TCPFLAG_URG]++;
@@ -307,15 +763,15 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
         session->haveTcpSession = 1;
         session->tcpSeq[packet->direction] = seq + 1;
         if (!session->tcp_next) {
-            DLL_PUSH_TAIL(tcp_, &tcpWriteQ[session->thread], session);
+            DLL_PUSH_TAIL(tcp_, &packetThreadState[session->thread].tcpWriteQ, session);
         }
-        return 1;
+        return 0;
     }
 
     if (tcphdr->th_flags & TH_RST) {
         session->tcpFlagCnt[MOLOCH_TCPFLAG_RST]++;
         if (moloch_packet_sequence_diff(seq, session->tcpSeq[packet->direction]) <= 0) {
-            return 1;
+            return 0;
         }
 
         session->tcpState[packet->direction] = MOLOCH_TCP_STATE_FIN_ACK;
@@ -335,7 +791,7 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
     }
 
     if (session->stopTCP)
-        return 1;
+        return 0;
 
     // If we've seen SYN but no SYN_ACK and no tcpSeq set, then just assume we've missed the syn-ack
     if (session->haveTcpSession && session->tcpFlagCnt[MOLOCH_TCPFLAG_SYN_ACK] == 0 && session->tcpSeq[packet->direction] == 0) {
@@ -343,15 +799,6 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
         session->tcpSeq[packet->direction] = seq;
     }
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
-
-    if (DLL_COUNT(td_, tcpData) > maxTcpOutOfOrderPackets) {
-        moloch_packet_tcp_free(session);
-        moloch_session_add_tag(session, "incomplete-tcp");
-        session->stopTCP = 1;
-        return 1;
-    }
-
     if (tcphdr->th_flags & (TH_ACK | TH_RST)) {
         int owhich = (packet->direction + 1) & 1;
         if (session->tcpState[owhich] == MOLOCH_TCP_STATE_FIN) {
@@ -361,11 +808,32 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
                 if (!session->closingQ) {
                     moloch_session_mark_for_close(session, SESSION_TCP);
                 }
-                return 1;
+                return 0;
             }
         }
     }
 
+    // Nothing needs the payload, just keep the data byte counts moving
+    if (session->spiDone) {
+        if (session->tcpStream)
+            moloch_packet_tcp_free(session);
+
+        if (len <= 0 || tcphdr->th_flags & TH_RST)
+            return 0;
+
+        const int which = packet->direction;
+        uint32_t  n = len;
+        if (session->haveTcpSession) {
+            if (!MOLOCH_SEQ_LT(session->tcpSeq[which], seq + len))
+                return 0;
+            n = MIN(seq + len - session->tcpSeq[which], (uint32_t)len);
+            session->tcpSeq[which] = seq + len;
+        }
+        session->databytes[which] += n;
+        session->totalDatabytes[which] += n;
+        return 0;
+    }
+
     if (tcphdr->th_flags & TH_ACK) {
         if (session->haveTcpSession &&  // Seen a SYN
             (session->ackedUnseenSegment & (1 << packet->direction)) == 0 &&  // Haven't already tagged
@@ -380,78 +848,288 @@ LOCAL int moloch_packet_process_tcp(MolochSession_t * const session, MolochPacke
 
     // Empty packet, drop from tcp processing
     if (len <= 0 || tcphdr->th_flags & TH_RST)
-        return 1;
+        return 0;
 
-    // This packet is before what we are processing
-    int64_t diff = moloch_packet_sequence_diff(session->tcpSeq[packet->direction], seq + len);
-    if (session->haveTcpSession && diff <= 0)
-        return 1;
+    const int which = packet->direction;
+    const uint8_t *data = packet->pkt + packet->payloadOffset + 4*tcphdr->th_off;
+    uint32_t start = seq;
+    if (session->haveTcpSession) {
+        // This packet is before what we are processing
+        if (!MOLOCH_SEQ_LT(session->tcpSeq[which], seq + len))
+            return 0;
+
+        // Retransmit that overlaps what has already been processed
+        if (MOLOCH_SEQ_LT(seq, session->tcpSeq[which])) {
+            data += session->tcpSeq[which] - seq;
+            len -= session->tcpSeq[which] - seq;
+            start = session->tcpSeq[which];
+        }
+    }
 
-    MolochTcpData_t *ftd, *td = MOLOCH_TYPE_ALLOC(MolochTcpData_t);
-    const uint32_t ack = ntohl(tcphdr->th_ack);
+    const uint32_t ack = (tcphdr->th_flags & TH_ACK) ? ntohl(tcphdr->th_ack) : session->tcpSeq[which ^ 1];
+    MolochTcpStream_t *stream = session->tcpStream;
 
-    td->packet = packet;
-    td->ack = ack;
-    td->seq = seq;
-    td->len = len;
-    td->dataOffset = packet->payloadOffset + 4*tcphdr->th_off;
+    // Without a SYN there is no seq to reassemble from, so only keep the first
+    // segment in case tcp_free can classify the session from a single PSH
+    if (!session->haveTcpSession) {
+        if (!stream || !moloch_packet_tcp_waiting(stream)) {
+            if (!moloch_packet_tcp_buffer(session, which, start, ack, data, len))
+                moloch_packet_tcp_free(session);
+        }
+        return 0;
+    }
+
+    // In order and not overlapping anything waiting, process straight from the packet
+    uint32_t first, firstAck;
+    if (start == session->tcpSeq[which] &&
+        (!stream || ((!moloch_packet_tcp_first(stream, which, &first, &firstAck) || !MOLOCH_SEQ_LT(first, start + len)) &&
+                     (!moloch_packet_tcp_first(stream, which ^ 1, &first, &firstAck) || !MOLOCH_SEQ_LT(first, ack))))) {
+        moloch_packet_tcp_deliver(session, data, len, which);
+        if (stream)
+            moloch_packet_tcp_drain(session);
+        return 0;
+    }
+
+    const int waiting = stream && moloch_packet_tcp_waiting(stream);
 
 #ifdef DEBUG_PACKET
-    LOG("dir: %d seq: %u ack: %u len: %d diff0: %ld", packet->direction, seq, ack, len, diff);
+    LOG("dir: %d seq: %u ack: %u len: %d buffered", which, start, ack, len);
 #endif
 
-    if (DLL_COUNT(td_, tcpData) == 0) {
-        DLL_PUSH_TAIL(td_, tcpData, td);
-    } else {
-        uint32_t sortA, sortB;
-        DLL_FOREACH_REVERSE(td_, tcpData, ftd) {
-            if (packet->direction == ftd->packet->direction) {
-                sortA = seq;
-                sortB = ftd->seq;
-            } else {
-                sortA = seq;
-                sortB = ftd->ack;
-            }
+    int held = 0;
+    if (!moloch_packet_tcp_hold(session, packet, which, start, ack, data, len, &held)) {
+        moloch_packet_tcp_incomplete(session);
+        return 0;
+    }
+    threadCounters[session->thread].tcpBuffered++;
 
-            diff = moloch_packet_sequence_diff(sortB, sortA);
-            if (diff == 0) {
-                if (packet->direction == ftd->packet->direction) {
-                    if (td->len > ftd->len) {
-                        DLL_ADD_AFTER(td_, tcpData, ftd, td);
-
-                        DLL_REMOVE(td_, tcpData, ftd);
-                        moloch_packet_free(ftd->packet);
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
-                        ftd = td;
-                    } else {
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
-                        return 1;
-                    }
-                    break;
-                } else if (moloch_packet_sequence_diff(ack, ftd->seq) < 0) {
-                    DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                    break;
-                }
-            } else if (diff > 0) {
-                DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                break;
-            }
+    if (waiting && (session->outOfOrder & (1 << which)) == 0) {
+        static const char *tags[2] = {"out-of-order-src", "out-of-order-dst"};
+        moloch_session_add_tag(session, tags[which]);
+        session->outOfOrder |= (1 << which);
+    }
+
+    moloch_packet_tcp_drain(session);
+    return held;
+}
+
+/******************************************************************************/
+LOCAL int moloch_packet_shunt_lock(MolochShunt_t *shunt)
+{
+    const uint32_t seq = __atomic_load_n(&shunt->seq, __ATOMIC_RELAXED);
+    if (seq & 1)
+        return 0;
+    if (!__sync_bool_compare_and_swap(&shunt->seq, seq, seq + 1))
+        return 0;
+
+    // Readers that saw the slot unlocked finish counting before we touch it
+    while (__atomic_load_n(&shunt->readers, __ATOMIC_SEQ_CST))
+        MOLOCH_CPU_RELAX();
+    return 1;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_shunt_unlock(MolochShunt_t *shunt)
+{
+    __atomic_add_fetch(&shunt->seq, 1, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+LOCAL int moloch_packet_shunt_match(MolochShunt_t *shunt, MolochSession_t *session)
+{
+    return shunt->expire &&
+           shunt->hash == session->h_hash &&
+           shunt->ses == session->ses &&
+           memcmp(shunt->sessionId, session->sessionId, session->sessionId[0]) == 0;
+}
+/******************************************************************************/
+// Must hold the slot
+LOCAL void moloch_packet_shunt_fold_locked(MolochSession_t *session, MolochShunt_t *shunt)
+{
+    int d;
+    for (d = 0; d < 2; d++) {
+        session->packets[d]   += __atomic_exchange_n(&shunt->packets[d], 0, __ATOMIC_RELAXED);
+        session->bytes[d]     += __atomic_exchange_n(&shunt->bytes[d], 0, __ATOMIC_RELAXED);
+        session->databytes[d] += __atomic_exchange_n(&shunt->databytes[d], 0, __ATOMIC_RELAXED);
+    }
+
+    if (shunt->lastSec > session->lastPacket.tv_sec) {
+        session->lastPacket.tv_sec = shunt->lastSec;
+        session->lastPacket.tv_usec = 0;
+    }
+}
+/******************************************************************************/
+/* Fold whatever the readers counted into the session, when releasing the
+ * readers stop dropping the flow.  Called before a session is saved.
+ */
+void moloch_packet_shunt_fold(MolochSession_t *session, int release)
+{
+    int i;
+    for (i = 0; i < MOLOCH_SHUNT_PROBE; i++) {
+        MolochShunt_t *shunt = &shunts[(session->h_hash + i) & shuntMask];
+        if (!moloch_packet_shunt_match(shunt, session))
+            continue;
+
+        while (!moloch_packet_shunt_lock(shunt))
+            MOLOCH_CPU_RELAX();
+
+        if (moloch_packet_shunt_match(shunt, session)) {
+            moloch_packet_shunt_fold_locked(session, shunt);
+            if (release)
+                shunt->expire = 0;
         }
+        moloch_packet_shunt_unlock(shunt);
+        break;
+    }
+
+    if (release)
+        session->shunted = 0;
+}
+/******************************************************************************/
+/* Readers don't touch the session, so before the wheel decides it is idle
+ * catch lastPacket up with the newest packet they counted.
+ */
+void moloch_packet_shunt_last(MolochSession_t *session)
+{
+    int i;
+    for (i = 0; i < MOLOCH_SHUNT_PROBE; i++) {
+        MolochShunt_t *shunt = &shunts[(session->h_hash + i) & shuntMask];
+        uint32_t       seq;
+
+        while ((seq = __atomic_load_n(&shunt->seq, __ATOMIC_ACQUIRE)) & 1)
+            MOLOCH_CPU_RELAX();
 
-        if ((void*)ftd == (void*)tcpData) {
-            DLL_PUSH_HEAD(td_, tcpData, td);
+        if (!moloch_packet_shunt_match(shunt, session))
+            continue;
+
+        const uint32_t lastSec = __atomic_load_n(&shunt->lastSec, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Slot changed hands while we looked, try again next wheel run
+        if (__atomic_load_n(&shunt->seq, __ATOMIC_RELAXED) != seq)
+            return;
+
+        if (lastSec > session->lastPacket.tv_sec) {
+            session->lastPacket.tv_sec = lastSec;
+            session->lastPacket.tv_usec = 0;
         }
+        return;
+    }
+}
+/******************************************************************************/
+/* Publish or renew the session so readers drop its packets until now +
+ * shuntTimeout, any counts already taken by the readers are folded in.
+ */
+LOCAL void moloch_packet_shunt_add(MolochSession_t *session, uint32_t now)
+{
+    MolochShunt_t *shunt = NULL;
 
-        if (session->haveTcpSession && (session->outOfOrder & (1 << packet->direction)) == 0) {
-            static const char *tags[2] = {"out-of-order-src", "out-of-order-dst"};
-            moloch_session_add_tag(session, tags[packet->direction]);
-            session->outOfOrder |= (1 << packet->direction);
+    int i;
+    for (i = 0; i < MOLOCH_SHUNT_PROBE; i++) {
+        MolochShunt_t *slot = &shunts[(session->h_hash + i) & shuntMask];
+        if (moloch_packet_shunt_match(slot, session)) {
+            shunt = slot;
+            break;
+        }
+        // Expired slots can be reused once nothing is waiting to be folded
+        if (!shunt && (slot->expire == 0 ||
+                       (slot->expire < now && (slot->packets[0] | slot->packets[1]) == 0))) {
+            shunt = slot;
         }
     }
 
-    return 0;
+    if (!shunt || !moloch_packet_shunt_lock(shunt)) {
+        threadCounters[session->thread].shuntFull++;
+        return;
+    }
+
+    if (moloch_packet_shunt_match(shunt, session)) {
+        moloch_packet_shunt_fold_locked(session, shunt);
+    } else if (shunt->expire == 0 ||
+               (shunt->expire < now && (shunt->packets[0] | shunt->packets[1]) == 0)) {
+        memcpy(shunt->sessionId, session->sessionId, session->sessionId[0]);
+        shunt->hash  = session->h_hash;
+        shunt->ses   = session->ses;
+        shunt->addr1 = session->addr1;
+        shunt->port1 = session->port1;
+        memset(shunt->packets, 0, sizeof(shunt->packets));
+        memset(shunt->bytes, 0, sizeof(shunt->bytes));
+        memset(shunt->databytes, 0, sizeof(shunt->databytes));
+    } else {
+        // Someone else took it
+        moloch_packet_shunt_unlock(shunt);
+        threadCounters[session->thread].shuntFull++;
+        return;
+    }
+
+    shunt->lastSec = now;
+    shunt->expire = now + shuntTimeout;
+    moloch_packet_shunt_unlock(shunt);
+    session->shunted = 1;
 }
+/******************************************************************************/
+/* Reader side, returns 1 if the packet belongs to a shunted flow and was
+ * counted.  Syn, fin and rst always go through so tcp state still works.
+ */
+SUPPRESS_ALIGNMENT
+LOCAL int moloch_packet_shunt_check(MolochPacket_t * const packet, const char * const sessionId)
+{
+    const uint8_t *l4 = packet->pkt + packet->payloadOffset;
+    uint32_t       databytes = 0;
+
+    switch (packet->ses) {
+    case SESSION_TCP: {
+        const struct tcphdr *tcphdr = (const struct tcphdr *)l4;
+        if (tcphdr->th_flags & (TH_SYN | TH_FIN | TH_RST))
+            return 0;
+        databytes = packet->payloadLen - 4*tcphdr->th_off;
+        break;
+    }
+    case SESSION_UDP:
+    case SESSION_SCTP:
+        databytes = packet->payloadLen - 8;
+        break;
+    }
 
+    int i;
+    for (i = 0; i < MOLOCH_SHUNT_PROBE; i++) {
+        MolochShunt_t *shunt = &shunts[(packet->hash + i) & shuntMask];
+
+        if (shunt->hash != packet->hash || shunt->expire == 0)
+            continue;
+
+        // Pairs with the lock, either it sees us or we see it locked
+        __atomic_add_fetch(&shunt->readers, 1, __ATOMIC_SEQ_CST);
+        const uint32_t seq = __atomic_load_n(&shunt->seq, __ATOMIC_SEQ_CST);
+
+        if ((seq & 1) ||
+            shunt->hash != packet->hash ||
+            shunt->expire < packet->ts.tv_sec ||
+            shunt->ses != packet->ses ||
+            memcmp(shunt->sessionId, sessionId, sessionId[0]) != 0) {
+            __atomic_sub_fetch(&shunt->readers, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        int dir;
+        if (packet->v6) {
+            const struct ip6_hdr *ip6 = (const struct ip6_hdr *)(packet->pkt + packet->ipOffset);
+            dir = memcmp(&ip6->ip6_src, &shunt->addr1, 16) != 0;
+        } else {
+            const struct ip *ip4 = (const struct ip *)(packet->pkt + packet->ipOffset);
+            dir = ip4->ip_src.s_addr != MOLOCH_V6_TO_V4(shunt->addr1);
+        }
+        if (!dir && packet->ses != SESSION_ICMP && packet->ses != SESSION_ESP)
+            dir = ntohs(*(const uint16_t *)l4) != shunt->port1;
+
+        __sync_add_and_fetch(&shunt->packets[dir], 1);
+        __sync_add_and_fetch(&shunt->bytes[dir], packet->pktlen);
+        __sync_add_and_fetch(&shunt->databytes[dir], databytes);
+        if (shunt->lastSec < packet->ts.tv_sec)
+            __atomic_store_n(&shunt->lastSec, packet->ts.tv_sec, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&shunt->readers, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
 /******************************************************************************/
 void moloch_packet_thread_wake(int thread)
 {
@@ -460,6 +1138,162 @@ void moloch_packet_thread_wake(int thread)
     MOLOCH_UNLOCK(packetQ[thread].lock);
 }
 /******************************************************************************/
+/* Move as many packets as will fit from the DLL onto the ring, producer only */
+LOCAL int moloch_packet_ring_push(MolochPacketRing_t *ring, MolochPacketHead_t *head)
+{
+    uint32_t tail  = ring->tail;
+    uint32_t avail = ring->mask + 1 - (tail - ring->headCache);
+
+    if (avail < DLL_COUNT(packet_, head)) {
+        ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        avail = ring->mask + 1 - (tail - ring->headCache);
+    }
+
+    int cnt = 0;
+    MolochPacket_t *packet;
+    while (avail > 0 && DLL_COUNT(packet_, head) > 0) {
+        DLL_POP_HEAD(packet_, head, packet);
+        ring->packets[tail & ring->mask] = packet;
+        tail++;
+        avail--;
+        cnt++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return cnt;
+}
+/******************************************************************************/
+/* Pop up to max packets from all the rings feeding a packet thread, consumer only */
+LOCAL int moloch_packet_ring_pop(int thread, MolochPacket_t **packets, int max)
+{
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+    int       cnt = 0;
+    int       r;
+
+    for (r = 0; r < rings && cnt < max; r++) {
+        int n = (packetQ[thread].nextRing + r) % rings;
+        MolochPacketRing_t *ring = __atomic_load_n(&packetQ[thread].rings[n], __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+
+        uint32_t head = ring->head;
+        if (head == ring->tailCache) {
+            ring->tailCache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if (head == ring->tailCache)
+                continue;
+        }
+
+        while (head != ring->tailCache && cnt < max) {
+            packets[cnt] = ring->packets[head & ring->mask];
+            head++;
+            cnt++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    // Start with a different ring next time so one busy reader can't starve the rest
+    if (rings > 0)
+        packetQ[thread].nextRing = (packetQ[thread].nextRing + 1) % rings;
+
+    return cnt;
+}
+/******************************************************************************/
+/* Number of packets waiting for a packet thread, safe from any thread */
+LOCAL uint32_t moloch_packet_ring_count(int thread)
+{
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+    uint32_t  count = 0;
+    int       r;
+
+    for (r = 0; r < rings; r++) {
+        MolochPacketRing_t *ring = __atomic_load_n(&packetQ[thread].rings[r], __ATOMIC_ACQUIRE);
+        if (!ring)
+            continue;
+        count += __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    return count + __atomic_load_n(&packetQ[thread].handoffQ.packet_count, __ATOMIC_RELAXED);
+}
+/******************************************************************************/
+// Runs on the packet thread that owns the bucket now
+LOCAL void moloch_packet_steer_handoff_cmd(MolochSession_t *session, gpointer uw1, gpointer UNUSED(uw2))
+{
+    MolochPacket_t *packet = uw1;
+    DLL_PUSH_TAIL(packet_, &packetQ[session->thread].handoffQ, packet);
+}
+/******************************************************************************/
+/* Called for packets whose session doesn't live on this thread yet.  Counts
+ * the new session in its bucket so the bucket can't move while it lives,
+ * or if the bucket isn't ours passes the packet to its owner.
+ * Returns 1 if the packet was handed off.
+ */
+LOCAL int moloch_packet_steer_claim(MolochPacket_t * const packet, int thread, int *claimed)
+{
+    uint64_t *bucket = &steerBuckets[packet->hash & steerMask];
+    uint64_t  v = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+
+    do {
+        if ((v >> MOLOCH_STEER_THREAD_SHIFT) != (uint64_t)thread) {
+            threadCounters[thread].steerHandoffs++;
+            moloch_session_add_cmd_thread(v >> MOLOCH_STEER_THREAD_SHIFT, packet, NULL, moloch_packet_steer_handoff_cmd);
+            return 1;
+        }
+        if ((v & MOLOCH_STEER_COUNT_MASK) == MOLOCH_STEER_COUNT_MASK) {
+            threadCounters[thread].steerUncounted++;
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(bucket, &v, v + 1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    *claimed = 1;
+    return 0;
+}
+/******************************************************************************/
+void moloch_packet_steer_release(MolochSession_t *session)
+{
+    __atomic_sub_fetch(&steerBuckets[session->h_hash & steerMask], 1, __ATOMIC_RELEASE);
+    session->steered = 0;
+}
+/******************************************************************************/
+/* Runs on main thread every second, smooths each packet thread's queue depth
+ * and moves buckets with no sessions or queued packets from the busiest
+ * thread to the least busy one.
+ */
+LOCAL gboolean moloch_packet_steer_gfunc(gpointer UNUSED(user_data))
+{
+    int    hot = 0, cold = 0;
+    double total = 0;
+
+    int t;
+    for (t = 0; t < config.packetThreads; t++) {
+        steerLoad[t] = (steerLoad[t] * 3 + moloch_packet_ring_count(t)) / 4;
+        total += steerLoad[t];
+        if (steerLoad[t] > steerLoad[hot])
+            hot = t;
+        if (steerLoad[t] < steerLoad[cold])
+            cold = t;
+    }
+
+    // Busiest thread compared to the average, 1.0 is balanced
+    const double avg = total / config.packetThreads;
+    steerImbalance = avg > 0 ? steerLoad[hot] / avg : 1.0;
+
+    if (hot == cold || steerLoad[hot] < steerThreshold || steerLoad[hot] < 2 * steerLoad[cold])
+        return TRUE;
+
+    const uint64_t from = (uint64_t)hot << MOLOCH_STEER_THREAD_SHIFT;
+    const uint64_t to = (uint64_t)cold << MOLOCH_STEER_THREAD_SHIFT;
+    uint32_t moved = 0;
+    uint32_t i;
+    for (i = 0; i <= steerMask && moved < steerMaxMoves; i++) {
+        uint64_t v = from;
+        if (__atomic_compare_exchange_n(&steerBuckets[(steerPos + i) & steerMask], &v, to, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            moved++;
+    }
+    steerPos = (steerPos + i) & steerMask;
+    steerMoves += moved;
+
+    return TRUE;
+}
+/******************************************************************************/
 /* Only called on main thread, we busy block until all packet threads are empty.
  * Should only be used by tests and at end
  */
@@ -471,104 +1305,163 @@ void moloch_packet_flush()
         flushed = !moloch_session_cmd_outstanding();
 
         for (t = 0; t < config.packetThreads; t++) {
-            MOLOCH_LOCK(packetQ[t].lock);
-            if (DLL_COUNT(packet_, &packetQ[t]) > 0) {
+            if (moloch_packet_ring_count(t) > 0) {
                 flushed = 0;
             }
-            MOLOCH_UNLOCK(packetQ[t].lock);
             usleep(10000);
         }
     }
 }
 /******************************************************************************/
+/* Nothing to do, sleep until a reader or session command wakes us up.
+ * The sleeping flag is set before the final ring check, and readers check the
+ * flag after publishing to the ring, so a wakeup can't be missed.
+ */
+LOCAL void moloch_packet_thread_sleep(int thread)
+{
+    MOLOCH_LOCK(packetQ[thread].lock);
+    packetQ[thread].sleeping = 1;
+    __sync_synchronize();
+    if (moloch_packet_ring_count(thread) == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        ts.tv_sec++;
+        MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
+    }
+    packetQ[thread].sleeping = 0;
+    MOLOCH_UNLOCK(packetQ[thread].lock);
+}
+/******************************************************************************/
 SUPPRESS_ALIGNMENT
 LOCAL void *moloch_packet_thread(void *threadp)
 {
     MolochPacket_t  *packet;
-    int thread = (long)threadp;
+    MolochPacket_t  *packets[MOLOCH_PACKET_BURST];
+    int              packetsPos = 0;
+    int              packetsCnt = 0;
+    int              thread = (long)threadp;
+    int              spinLimit = packetThreadSpin;
+    int              spins = 0;
+    int              slept = 0;
+    int              i;
+    struct timespec  burstStart, burstEnd;
+
+    moloch_thread_pin("packet", thread);
 
     while (1) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        inProgress[thread] = 0;
-        if (DLL_COUNT(packet_, &packetQ[thread]) == 0) {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
-            ts.tv_sec++;
-            MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
+        if (packetsPos == packetsCnt) {
+            if (packetBenchmark && packetsCnt > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &burstEnd);
+                threadCounters[thread].benchPackets += packetsCnt;
+                threadCounters[thread].benchNanos += (burstEnd.tv_sec - burstStart.tv_sec) * 1000000000LL + (burstEnd.tv_nsec - burstStart.tv_nsec);
+            }
+
+            if (DLL_COUNT(held_, &packetQ[thread].heldQ) > 0)
+                moloch_packet_tcp_copy_held(thread);
+
+            packetsPos = 0;
+            packetsCnt = 0;
+            while (packetsCnt < MOLOCH_PACKET_BURST && DLL_POP_HEAD(packet_, &packetQ[thread].handoffQ, packets[packetsCnt]))
+                packetsCnt++;
+            packetsCnt += moloch_packet_ring_pop(thread, packets + packetsCnt, MOLOCH_PACKET_BURST - packetsCnt);
+
+            if (packetsCnt == 0) {
+                threadCounters[thread].inProgress = 0;
+
+                if (spins < spinLimit) {
+                    spins++;
+                    MOLOCH_CPU_RELAX();
+                    continue;
+                }
+
+                // Commands can hand us packets, so look again before sleeping
+                moloch_session_process_commands(thread);
+                if (DLL_COUNT(packet_, &packetQ[thread].handoffQ) > 0)
+                    continue;
+
+                // Spinning didn't find work, spin less next time
+                moloch_packet_thread_sleep(thread);
+                spinLimit = spinLimit / 2;
+                spins = 0;
+                slept = 1;
+                continue;
+            }
+
+            // Spinning or a wakeup found work, spin longer next time
+            if ((spins > 0 || slept) && spinLimit < packetThreadSpin)
+                spinLimit = MIN(spinLimit * 2 + 1, packetThreadSpin);
+            spins = 0;
+            slept = 0;
+
+            if (packetBenchmark)
+                clock_gettime(CLOCK_MONOTONIC, &burstStart);
+
+            // Bookkeeping is per burst, a burst spans well under a second
+            threadCounters[thread].inProgress = 1;
+            // Handoff packets come first and can be older, go by the newest
+            time_t secs = packets[0]->ts.tv_sec;
+            for (i = 1; i < packetsCnt; i++) {
+                if (packets[i]->ts.tv_sec > secs)
+                    secs = packets[i]->ts.tv_sec;
+            }
+            packetThreadState[thread].lastPacketSecs = secs;
+            moloch_session_process_commands(thread);
+
+            if (packetPrefetch) {
+                for (i = 0; i < packetsCnt; i++) {
+                    __builtin_prefetch(packets[i]->pkt + packets[i]->ipOffset, 0, 3);
+                    moloch_session_prefetch(packets[i]->ses, thread, packets[i]->hash, 0);
+                }
+                for (i = 0; i < MIN(MOLOCH_PACKET_PREFETCH, packetsCnt); i++) {
+                    moloch_session_prefetch(packets[i]->ses, thread, packets[i]->hash, 1);
+                }
+            }
         }
-        inProgress[thread] = 1;
-        DLL_POP_HEAD(packet_, &packetQ[thread], packet);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
 
-        moloch_session_process_commands(thread);
+        packet = packets[packetsPos++];
+
+        if (packetPrefetch && packetsPos - 1 + MOLOCH_PACKET_PREFETCH < packetsCnt) {
+            MolochPacket_t *ahead = packets[packetsPos - 1 + MOLOCH_PACKET_PREFETCH];
+            moloch_session_prefetch(ahead->ses, thread, ahead->hash, 1);
+        }
 
-        if (!packet)
-            continue;
 #ifdef DEBUG_PACKET
         LOG("Processing %p %d", packet, packet->pktlen);
 #endif
 
-        lastPacketSecs[thread] = packet->ts.tv_sec;
-
         MolochSession_t     *session;
         struct ip           *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
         struct ip6_hdr      *ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
         struct tcphdr       *tcphdr = 0;
         struct udphdr       *udphdr = 0;
-        char                 sessionId[MOLOCH_SESSIONID_LEN];
 
+        // The reader already built the session id and hash
         switch (packet->protocol) {
         case IPPROTO_TCP:
             tcphdr = (struct tcphdr *)(packet->pkt + packet->payloadOffset);
-
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, tcphdr->th_sport,
-                                   ip6->ip6_dst.s6_addr, tcphdr->th_dport);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, tcphdr->th_sport,
-                                  ip4->ip_dst.s_addr, tcphdr->th_dport);
-            }
             break;
         case IPPROTO_UDP:
-            udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset);
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
-                                   ip6->ip6_dst.s6_addr, udphdr->uh_dport);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
-                                  ip4->ip_dst.s_addr, udphdr->uh_dport);
-            }
-            break;
-        case IPPROTO_ESP:
-        case IPPROTO_ICMP:
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
-                                   ip6->ip6_dst.s6_addr, 0);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, 0,
-                                  ip4->ip_dst.s_addr, 0);
-            }
-            break;
         case IPPROTO_SCTP:
             udphdr = (struct udphdr *)(packet->pkt + packet->payloadOffset); /* Not really udp, but port in same location */
-            if (packet->v6) {
-                moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, udphdr->uh_sport,
-                                   ip6->ip6_dst.s6_addr, udphdr->uh_dport);
-            } else {
-                moloch_session_id(sessionId, ip4->ip_src.s_addr, udphdr->uh_sport,
-                                  ip4->ip_dst.s_addr, udphdr->uh_dport);
-            }
-            break;
-        case IPPROTO_ICMPV6:
-            moloch_session_id6(sessionId, ip6->ip6_src.s6_addr, 0,
-                               ip6->ip6_dst.s6_addr, 0);
             break;
         }
 
+        int steerClaimed = 0;
+        if (packet->steered) {
+            if (!moloch_session_find_thread(packet->ses, thread, packet->hash, packet->sessionId) &&
+                moloch_packet_steer_claim(packet, thread, &steerClaimed))
+                continue;
+
+            // The session holds the bucket here from now on
+            moloch_packet_steer_done(packet);
+        }
+
         int isNew;
-        session = moloch_session_find_or_create(packet->ses, packet->hash, sessionId, &isNew); // Returns locked session
+        session = moloch_session_find_or_create(packet->ses, thread, packet->hash, packet->sessionId, &isNew); // Returns locked session
 
         if (isNew) {
+            session->steered = steerClaimed;
+
             session->saveTime = packet->ts.tv_sec + config.tcpSaveTimeout;
             session->firstPacket = packet->ts;
 
@@ -606,7 +1499,7 @@ LOCAL void *moloch_packet_thread(void *threadp)
                     session->port1 = ntohs(tcphdr->th_sport);
                     session->port2 = ntohs(tcphdr->th_dport);
                 }
-                if (moloch_http_is_moloch(session->h_hash, sessionId)) {
+                if (moloch_http_is_moloch(session->h_hash, packet->sessionId)) {
                     if (config.debug) {
                         char buf[1000];
                         LOG("Ignoring connection %s", moloch_session_id_string(session->sessionId, buf));
@@ -634,6 +1527,8 @@ LOCAL void *moloch_packet_thread(void *threadp)
             if (pluginsCbs & MOLOCH_PLUGIN_NEW)
                 moloch_plugins_cb_new(session);
         } else if (session->stopSPI) {
+            if (shuntMask)
+                moloch_packet_shunt_add(session, packet->ts.tv_sec);
             moloch_packet_free(packet);
             continue;
         }
@@ -694,6 +1589,12 @@ LOCAL void *moloch_packet_thread(void *threadp)
         if (session->stopSaving == 0 || packets < session->stopSaving) {
             moloch_writer_write(session, packet);
 
+            if (unlikely(!session->filePosArray)) {
+                session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 16);
+                session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 16);
+                session->fileNumArray = g_array_new(FALSE, FALSE, 4);
+            }
+
             int16_t len;
             if (session->lastFileNum != packet->writerFileNum) {
                 session->lastFileNum = packet->writerFileNum;
@@ -711,6 +1612,12 @@ LOCAL void *moloch_packet_thread(void *threadp)
             if (packets >= config.maxPackets || session->midSave) {
                 moloch_session_mid_save(session, packet->ts.tv_sec);
             }
+        } else if (shuntMask) {
+            // Nothing more is written, once nothing parses it either the readers can drop it
+            if (!session->spiDone && session->protocol != IPPROTO_ESP)
+                moloch_packet_spi_check(session);
+            if (session->spiDone || session->protocol == IPPROTO_ESP)
+                moloch_packet_shunt_add(session, packet->ts.tv_sec);
         }
 
         if (session->firstBytesLen[packet->direction] < 8 && session->packets[packet->direction] < 10) {
@@ -761,7 +1668,14 @@ LOCAL void *moloch_packet_thread(void *threadp)
         }
 
 
-        int freePacket = 1;
+        if (session->spiDone) {
+            threadCounters[thread].spiDonePackets++;
+            if (packet->ses == SESSION_TCP)
+                moloch_packet_process_tcp(session, packet);
+            moloch_packet_free(packet);
+            continue;
+        }
+
         switch(packet->ses) {
         case SESSION_ICMP:
             moloch_packet_process_icmp(session, packet);
@@ -770,14 +1684,13 @@ LOCAL void *moloch_packet_thread(void *threadp)
             moloch_packet_process_udp(session, packet);
             break;
         case SESSION_TCP:
-            freePacket = moloch_packet_process_tcp(session, packet);
-            moloch_packet_tcp_finish(session);
+            // Kept for reassembly, the stream frees it
+            if (moloch_packet_process_tcp(session, packet))
+                continue;
             break;
         }
 
-        if (freePacket) {
-            moloch_packet_free(packet);
-        }
+        moloch_packet_free(packet);
     }
 
     return NULL;
@@ -906,89 +1819,154 @@ LOCAL int moloch_packet_gre4(MolochPacketBatch_t * batch, MolochPacket_t * const
 
 }
 /******************************************************************************/
-void moloch_packet_frags_free(MolochFrags_t * const frags)
+LOCAL void moloch_packet_frags_free(MolochFragsShard_t * const shard, MolochFrags_t * const frags)
 {
     MolochPacket_t *packet;
 
     while (DLL_POP_HEAD(packet_, &frags->packets, packet)) {
         moloch_packet_free(packet);
     }
-    HASH_REMOVE(fragh_, fragsHash, frags);
-    DLL_REMOVE(fragl_, &fragsList, frags);
+    HASH_REMOVE(fragh_, shard->hash, frags);
+    DLL_REMOVE(fragl_, &shard->wheel[frags->wheelSlot], frags);
+    shard->count--;
+    shard->bytes -= frags->bytes;
     MOLOCH_TYPE_FREE(MolochFrags_t, frags);
 }
 /******************************************************************************/
+// Free every reassembly older than fragsTimeout
+LOCAL void moloch_packet_frags_expire(MolochFragsShard_t * const shard, uint32_t now)
+{
+    MolochFrags_t *frags;
+
+    if (now <= config.fragsTimeout)
+        return;
+
+    uint32_t end = (now - config.fragsTimeout) / fragsWheelGran;
+    if (shard->wheelPos == 0) {
+        shard->wheelPos = end;
+        return;
+    }
+
+    if (end > shard->wheelPos + MOLOCH_FRAGS_WHEEL)
+        shard->wheelPos = end - MOLOCH_FRAGS_WHEEL;
+
+    for (; shard->wheelPos < end; shard->wheelPos++) {
+        MolochFragsHead_t *slot = &shard->wheel[shard->wheelPos & (MOLOCH_FRAGS_WHEEL - 1)];
+        while ((frags = DLL_PEEK_HEAD(fragl_, slot))) {
+            shard->dropped++;
+            moloch_packet_frags_free(shard, frags);
+        }
+    }
+}
+/******************************************************************************/
+// Free the oldest reassembly in the shard
+LOCAL void moloch_packet_frags_evict(MolochFragsShard_t * const shard)
+{
+    int i;
+    for (i = 0; i < MOLOCH_FRAGS_WHEEL; i++) {
+        MolochFrags_t *frags = DLL_PEEK_HEAD(fragl_, &shard->wheel[(shard->wheelPos + i) & (MOLOCH_FRAGS_WHEEL - 1)]);
+        if (frags) {
+            shard->dropped++;
+            moloch_packet_frags_free(shard, frags);
+            return;
+        }
+    }
+}
+/******************************************************************************/
+// Byte offset of the fragment, sets more if more fragments follow
+SUPPRESS_ALIGNMENT
+LOCAL int moloch_packet_frag_off(const MolochPacket_t * const packet, int *more)
+{
+    if (packet->v6) {
+        const struct ip6_frag *frag = (struct ip6_frag *)(packet->pkt + packet->payloadOffset - sizeof(struct ip6_frag));
+        *more = (frag->ip6f_offlg & IP6F_MORE_FRAG) != 0;
+        return ntohs(frag->ip6f_offlg & IP6F_OFF_MASK);
+    }
+
+    const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    uint16_t ip_off = ntohs(ip4->ip_off);
+    *more = (ip_off & IP_MF) != 0;
+    return (ip_off & IP_OFFMASK) * 8;
+}
+/******************************************************************************/
 SUPPRESS_ALIGNMENT
-LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
+LOCAL gboolean moloch_packet_frags_process(MolochFragsShard_t * const shard, MolochPacket_t * const packet, const char *key, uint32_t h)
 {
     MolochPacket_t * fpacket;
     MolochFrags_t   *frags;
-    char             key[10];
+    int              more, fmore;
 
-    struct ip * const ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
-    memcpy(key, &ip4->ip_src.s_addr, 4);
-    memcpy(key+4, &ip4->ip_dst.s_addr, 4);
-    memcpy(key+8, &ip4->ip_id, 2);
+    // Make room before looking up, so the entry we find can't be evicted
+    while (shard->count > 0 && shard->bytes + packet->pktlen > fragsShardMaxBytes) {
+        moloch_packet_frags_evict(shard);
+    }
 
-    HASH_FIND(fragh_, fragsHash, key, frags);
+    HASH_FIND_HASH(fragh_, shard->hash, h, key, frags);
 
     if (!frags) {
+        if (shard->count >= fragsShardMax) {
+            moloch_packet_frags_evict(shard);
+        }
+
+        uint32_t pos = packet->ts.tv_sec / fragsWheelGran;
+        if (pos < shard->wheelPos)
+            pos = shard->wheelPos;
+        else if (pos >= shard->wheelPos + MOLOCH_FRAGS_WHEEL)
+            pos = shard->wheelPos + MOLOCH_FRAGS_WHEEL - 1;
+
         frags = MOLOCH_TYPE_ALLOC0(MolochFrags_t);
-        memcpy(frags->key, key, 10);
-        frags->secs = packet->ts.tv_sec;
-        HASH_ADD(fragh_, fragsHash, key, frags);
-        DLL_PUSH_TAIL(fragl_, &fragsList, frags);
+        memcpy(frags->key, key, MOLOCH_FRAGS_KEY_LEN);
+        frags->wheelSlot = pos & (MOLOCH_FRAGS_WHEEL - 1);
+        frags->bytes = packet->pktlen;
+        HASH_ADD_HASH(fragh_, shard->hash, h, key, frags);
+        DLL_PUSH_TAIL(fragl_, &shard->wheel[frags->wheelSlot], frags);
         DLL_INIT(packet_, &frags->packets);
         DLL_PUSH_TAIL(packet_, &frags->packets, packet);
+        shard->count++;
+        shard->bytes += packet->pktlen;
 
-        if (DLL_COUNT(fragl_, &fragsList) > config.maxFrags) {
-            droppedFrags++;
-            moloch_packet_frags_free(DLL_PEEK_HEAD(fragl_, &fragsList));
+        if (!moloch_packet_frag_off(packet, &more) && !more) {
+            // Not really a fragment
+            frags->haveNoFlags = 1;
+        } else {
+            return FALSE;
         }
-        return FALSE;
     } else {
-        DLL_MOVE_TAIL(fragl_, &fragsList, frags);
-    }
-
-    uint16_t          ip_off = ntohs(ip4->ip_off);
-    uint16_t          ip_flags = ip_off & ~IP_OFFMASK;
-    ip_off &= IP_OFFMASK;
+        frags->bytes += packet->pktlen;
+        shard->bytes += packet->pktlen;
 
+        int ip_off = moloch_packet_frag_off(packet, &more);
 
-    // we might be done once we receive the packets with no flags
-    if (ip_flags == 0) {
-        frags->haveNoFlags = 1;
-    }
+        // we might be done once we receive the packets with no flags
+        if (!more) {
+            frags->haveNoFlags = 1;
+        }
 
-    // Insert this packet in correct location sorted by offset
-    DLL_FOREACH_REVERSE(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (ip_off >= fip_off) {
-            DLL_ADD_AFTER(packet_, &frags->packets, fpacket, packet);
-            break;
+        // Insert this packet in correct location sorted by offset
+        DLL_FOREACH_REVERSE(packet_, &frags->packets, fpacket) {
+            if (ip_off >= moloch_packet_frag_off(fpacket, &fmore)) {
+                DLL_ADD_AFTER(packet_, &frags->packets, fpacket, packet);
+                break;
+            }
+        }
+        if ((void*)fpacket == (void*)&frags->packets) {
+            DLL_PUSH_HEAD(packet_, &frags->packets, packet);
         }
-    }
-    if ((void*)fpacket == (void*)&frags->packets) {
-        DLL_PUSH_HEAD(packet_, &frags->packets, packet);
-    }
 
-    // Don't bother checking until we get a packet with no flags
-    if (!frags->haveNoFlags) {
-        return FALSE;
+        // Don't bother checking until we get a packet with no flags
+        if (!frags->haveNoFlags) {
+            return FALSE;
+        }
     }
 
     int off = 0;
-    struct ip *fip4;
-
     int payloadLen = 0;
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (fip_off != off)
+        int fip_off = moloch_packet_frag_off(fpacket, &fmore);
+        if (fip_off > off)
             break;
-        off += fpacket->payloadLen/8;
-        payloadLen = MAX(payloadLen, fip_off*8 + fpacket->payloadLen);
+        off = MAX(off, fip_off + (fpacket->payloadLen & ~7));
+        payloadLen = MAX(payloadLen, fip_off + fpacket->payloadLen);
     }
     // We have a hole
     if ((void*)fpacket != (void*)&frags->packets) {
@@ -997,8 +1975,8 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
 
     // Packet is too large, hacker
     if (payloadLen + packet->payloadOffset >= MOLOCH_PACKET_MAX_LEN) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+        shard->dropped++;
+        moloch_packet_frags_free(shard, frags);
         return FALSE;
     }
 
@@ -1009,20 +1987,26 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
     // Copy packet header
     memcpy(pkt, packet->pkt, packet->payloadOffset);
 
-    // Fix header of new packet
-    fip4 = (struct ip*)(pkt + packet->ipOffset);
-    fip4->ip_len = htons(payloadLen + 4*ip4->ip_hl);
-    fip4->ip_off = 0;
+    // Fix header of new packet, v6 keeps an atomic fragment header
+    if (packet->v6) {
+        struct ip6_hdr *fip6 = (struct ip6_hdr *)(pkt + packet->ipOffset);
+        fip6->ip6_plen = htons(packet->payloadOffset - packet->ipOffset - sizeof(struct ip6_hdr) + payloadLen);
+        struct ip6_frag *frag = (struct ip6_frag *)(pkt + packet->payloadOffset - sizeof(struct ip6_frag));
+        frag->ip6f_offlg = 0;
+    } else {
+        struct ip *fip4 = (struct ip*)(pkt + packet->ipOffset);
+        fip4->ip_len = htons(payloadLen + 4*fip4->ip_hl);
+        fip4->ip_off = 0;
+    }
 
     // Copy payload
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
+        int fip_off = moloch_packet_frag_off(fpacket, &fmore);
 
-        if (packet->payloadOffset+(fip_off*8) + fpacket->payloadLen <= packet->pktlen)
-            memcpy(pkt+packet->payloadOffset+(fip_off*8), fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
+        if (packet->payloadOffset + fip_off + fpacket->payloadLen <= packet->pktlen)
+            memcpy(pkt+packet->payloadOffset+fip_off, fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
         else
-            LOG("WARNING - Not enough room for frag %d > %d", packet->payloadOffset+(fip_off*8) + fpacket->payloadLen, packet->pktlen);
+            LOG("WARNING - Not enough room for frag %d > %d", packet->payloadOffset + fip_off + fpacket->payloadLen, packet->pktlen);
     }
 
     // Set all the vars in the current packet to new defraged packet
@@ -1033,29 +2017,59 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
     packet->wasfrag = 1;
     packet->payloadLen = payloadLen;
     DLL_REMOVE(packet_, &frags->packets, packet); // Remove from list so we don't get freed in frags_free
-    moloch_packet_frags_free(frags);
+    moloch_packet_frags_free(shard, frags);
     return TRUE;
 }
 /******************************************************************************/
-LOCAL void moloch_packet_frags4(MolochPacketBatch_t *batch, MolochPacket_t * const packet)
+SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
+LOCAL uint32_t moloch_packet_frag_hash(const void *key)
 {
-    MolochFrags_t *frags;
-
-    // ALW - Should change frags_process to make the copy when needed
-    uint8_t *pkt = malloc(packet->pktlen);
-    memcpy(pkt, packet->pkt, packet->pktlen);
-    packet->pkt = pkt;
-    packet->copied = 1;
+    int i;
+    uint32_t n = 0;
+    for (i = 0; i < MOLOCH_FRAGS_KEY_LEN; i++) {
+        n = (n << 5) - n + ((char*)key)[i];
+    }
+    return n;
+}
+/******************************************************************************/
+LOCAL int moloch_packet_frag_cmp(const void *keyv, const void *elementv)
+{
+    MolochFrags_t *element = (MolochFrags_t *)elementv;
 
-    MOLOCH_LOCK(frags);
-    // Remove expired entries
-    while ((frags = DLL_PEEK_HEAD(fragl_, &fragsList)) && (frags->secs + config.fragsTimeout < packet->ts.tv_sec)) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+    return memcmp(keyv, element->key, MOLOCH_FRAGS_KEY_LEN) == 0;
+}
+/******************************************************************************/
+SUPPRESS_ALIGNMENT
+LOCAL void moloch_packet_frags(MolochPacketBatch_t *batch, MolochPacket_t * const packet)
+{
+    char key[MOLOCH_FRAGS_KEY_LEN];
+
+    memset(key, 0, sizeof(key));
+    if (packet->v6) {
+        const struct ip6_hdr *ip6 = (struct ip6_hdr *)(packet->pkt + packet->ipOffset);
+        const struct ip6_frag *frag = (struct ip6_frag *)(packet->pkt + packet->payloadOffset - sizeof(struct ip6_frag));
+        key[0] = 6;
+        memcpy(key+1, &ip6->ip6_src, 16);
+        memcpy(key+17, &ip6->ip6_dst, 16);
+        memcpy(key+33, &frag->ip6f_ident, 4);
+    } else {
+        const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+        key[0] = 4;
+        memcpy(key+1, &ip4->ip_src.s_addr, 4);
+        memcpy(key+5, &ip4->ip_dst.s_addr, 4);
+        memcpy(key+9, &ip4->ip_id, 2);
     }
 
-    gboolean process = moloch_packet_frags_process(packet);
-    MOLOCH_UNLOCK(frags);
+    uint32_t h = moloch_packet_frag_hash(key);
+    MolochFragsShard_t *shard = &fragsShards[(h >> 16) % numFragsShards];
+
+    // ALW - Should change frags_process to make the copy when needed
+    moloch_packet_copy(packet);
+
+    MOLOCH_LOCK(shard->lock);
+    moloch_packet_frags_expire(shard, packet->ts.tv_sec);
+    gboolean process = moloch_packet_frags_process(shard, packet, key, h);
+    MOLOCH_UNLOCK(shard->lock);
 
     if (process)
         moloch_packet_batch(batch, packet);
@@ -1063,7 +2077,13 @@ LOCAL void moloch_packet_frags4(MolochPacketBatch_t *batch, MolochPacket_t * con
 /******************************************************************************/
 int moloch_packet_frags_size()
 {
-    return DLL_COUNT(fragl_, &fragsList);
+    int count = 0;
+
+    int s;
+    for (s = 0; s < numFragsShards; s++) {
+        count += fragsShards[s].count;
+    }
+    return count;
 }
 /******************************************************************************/
 int moloch_packet_frags_outstanding()
@@ -1073,13 +2093,17 @@ int moloch_packet_frags_outstanding()
 /******************************************************************************/
 LOCAL void moloch_packet_log(int ses)
 {
+    uint64_t packetStats[MOLOCH_PACKET_MAX];
+    uint64_t totalPackets = moloch_packet_total_packets();
+    moloch_packet_stats(packetStats);
+
     MolochReaderStats_t stats;
     if (moloch_reader_stats(&stats)) {
         stats.dropped = 0;
         stats.total = totalPackets;
     }
 
-    LOG("packets: %" PRIu64 " current sessions: %u/%u oldest: %d - recv: %" PRIu64 " drop: %" PRIu64 " (%0.2f) queue: %d disk: %d packet: %d close: %d ns: %d frags: %d/%d pstats: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64,
+    LOG("packets: %" PRIu64 " current sessions: %u/%u oldest: %d - recv: %" PRIu64 " drop: %" PRIu64 " (%0.2f) queue: %d disk: %d packet: %d close: %d ns: %d frags: %d/%d spi done: %" PRIu64 " pstats: %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64,
       totalPackets,
       moloch_session_watch_count(ses),
       moloch_session_monitoring(),
@@ -1094,54 +2118,84 @@ LOCAL void moloch_packet_log(int ses)
       moloch_session_need_save_outstanding(),
       moloch_packet_frags_outstanding(),
       moloch_packet_frags_size(),
+      moloch_packet_spi_done_packets(),
       packetStats[MOLOCH_PACKET_SUCCESS],
       packetStats[MOLOCH_PACKET_IP_DROPPED],
       packetStats[MOLOCH_PACKET_OVERLOAD_DROPPED],
       packetStats[MOLOCH_PACKET_CORRUPT],
       packetStats[MOLOCH_PACKET_UNKNOWN],
-      packetStats[MOLOCH_PACKET_IPPORT_DROPPED]
+      packetStats[MOLOCH_PACKET_IPPORT_DROPPED],
+      packetStats[MOLOCH_PACKET_SHUNTED]
       );
 }
 /******************************************************************************/
+/* Log every logEveryXPackets packets summed across all the readers */
+LOCAL void moloch_packet_log_check(int ses)
+{
+    const uint64_t total = moloch_packet_total_packets();
+    const uint64_t next = __atomic_load_n(&nextLogPackets, __ATOMIC_RELAXED);
+
+    if (total >= next && __sync_bool_compare_and_swap(&nextLogPackets, next, next + config.logEveryXPackets))
+        moloch_packet_log(ses);
+}
+/******************************************************************************/
 LOCAL int moloch_packet_ip(MolochPacketBatch_t *batch, MolochPacket_t * const packet, const char * const sessionId)
 {
-    if (totalPackets == 0) {
+    MolochPacketReaderCounters_t *counters = &readerCounters[batch->ringNum];
+
+    if (unlikely(counters->totalPackets == 0) && !initialLogged && __sync_bool_compare_and_swap(&initialLogged, 0, 1)) {
         MolochReaderStats_t stats;
         if (!moloch_reader_stats(&stats)) {
             initialDropped = stats.dropped;
         }
         initialPacket = packet->ts;
         LOG("Initial Packet = %ld", initialPacket.tv_sec);
-        LOG("%" PRIu64 " Initial Dropped = %d", totalPackets, initialDropped);
+        LOG("%" PRIu64 " Initial Dropped = %d", moloch_packet_total_packets(), initialDropped);
     }
 
-    MOLOCH_THREAD_INCR(totalPackets);
-    if (totalPackets % config.logEveryXPackets == 0) {
-        moloch_packet_log(packet->ses);
+    counters->totalPackets++;
+    // Only look at the other readers' counters every so often
+    if ((counters->totalPackets & 0xff) == 0 || numRings == 1) {
+        moloch_packet_log_check(packet->ses);
     }
 
     packet->hash = moloch_session_hash(sessionId);
-    uint32_t thread = packet->hash % config.packetThreads;
+    counters->totalBytes += packet->pktlen;
 
-    totalBytes[thread] += packet->pktlen;
+    if (shuntMask && moloch_packet_shunt_check(packet, sessionId)) {
+        return MOLOCH_PACKET_SHUNTED;
+    }
+
+    uint32_t thread;
+    if (batch->threadCount) {
+        thread = batch->threadFirst + packet->hash % batch->threadCount;
+        packet->steered = 0;
+    } else if (steerBuckets) {
+        // Counted as queued until its packet thread takes it, moloch_packet_free undoes it on drops
+        thread = __atomic_fetch_add(&steerBuckets[packet->hash & steerMask], MOLOCH_STEER_QUEUED, __ATOMIC_ACQUIRE) >> MOLOCH_STEER_THREAD_SHIFT;
+        packet->steered = 1;
+    } else {
+        thread = packet->hash % config.packetThreads;
+        packet->steered = 0;
+    }
 
-    if (DLL_COUNT(packet_, &packetQ[thread]) >= config.maxPacketsInQueue) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        overloadDrops[thread]++;
-        if ((overloadDrops[thread] % 10000) == 1) {
-            LOG("WARNING - Packet Q %u is overflowing, total dropped %u, increase packetThreads or maxPacketsInQueue in %s", thread, overloadDrops[thread], config.configFile);
+    // Drop if the packet thread is too far behind or our ring to it would overflow
+    const uint32_t batched = DLL_COUNT(packet_, &batch->packetQ[thread]);
+    if (batch->queued[thread] + batched >= config.maxPacketsInQueue ||
+        batch->ringUsed[thread] + batched >= packetRingSize) {
+        const uint64_t drops = ++counters->overloadDrops;
+        if ((drops % 10000) == 1) {
+            LOG("WARNING - Packet Q %u is overflowing, reader dropped %" PRIu64 ", increase packetThreads or maxPacketsInQueue in %s", thread, drops, config.configFile);
         }
         packet->pkt = 0;
-        MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
+        if (packetQ[thread].sleeping)
+            moloch_packet_thread_wake(thread);
         return MOLOCH_PACKET_OVERLOAD_DROPPED;
     }
 
-    if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
+    // Packets that point into a reader block are only copied if tcp has to hold them
+    if (!packet->copied && !packet->block) {
+        moloch_packet_copy(packet);
     }
 
     DLL_PUSH_TAIL(packet_, &batch->packetQ[thread], packet);
@@ -1198,7 +2252,7 @@ LOCAL int moloch_packet_ip4(MolochPacketBatch_t *batch, MolochPacket_t * const p
     struct ip           *ip4 = (struct ip*)data;
     struct tcphdr       *tcphdr = 0;
     struct udphdr       *udphdr = 0;
-    char                 sessionId[MOLOCH_SESSIONID_LEN];
+    char                *sessionId = packet->sessionId;
 
     if (len < (int)sizeof(struct ip)) {
 #ifdef DEBUG_PACKET
@@ -1243,7 +2297,7 @@ LOCAL int moloch_packet_ip4(MolochPacketBatch_t *batch, MolochPacket_t * const p
 
 
     if ((ip_flags & IP_MF) || ip_off > 0) {
-        moloch_packet_frags4(batch, packet);
+        moloch_packet_frags(batch, packet);
         return MOLOCH_PACKET_SUCCESS;
     }
 
@@ -1261,13 +2315,13 @@ LOCAL int moloch_packet_ip4(MolochPacketBatch_t *batch, MolochPacket_t * const p
 
         tcphdr = (struct tcphdr *)((char*)ip4 + ip_hdr_len);
 
-        if (packetDrop4.drops[tcphdr->th_sport] &&
+        if (packetDrop4.ports[tcphdr->th_sport] &&
             moloch_drophash_should_drop(&packetDrop4, tcphdr->th_sport, &ip4->ip_src.s_addr, packet->ts.tv_sec)) {
 
             return MOLOCH_PACKET_IPPORT_DROPPED;
         }
 
-        if (packetDrop4.drops[tcphdr->th_dport] &&
+        if (packetDrop4.ports[tcphdr->th_dport] &&
             moloch_drophash_should_drop(&packetDrop4, tcphdr->th_dport, &ip4->ip_dst.s_addr, packet->ts.tv_sec)) {
 
             return MOLOCH_PACKET_IPPORT_DROPPED;
@@ -1350,7 +2404,7 @@ LOCAL int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const
     struct ip6_hdr      *ip6 = (struct ip6_hdr *)data;
     struct tcphdr       *tcphdr = 0;
     struct udphdr       *udphdr = 0;
-    char                 sessionId[MOLOCH_SESSIONID_LEN];
+    char                *sessionId = packet->sessionId;
 
     if (len < (int)sizeof(struct ip6_hdr)) {
         return MOLOCH_PACKET_CORRUPT;
@@ -1387,9 +2441,24 @@ LOCAL int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const
             nxt = data[ip_hdr_len];
             ip_hdr_len += ((data[ip_hdr_len+1] + 1) << 3);
             break;
-        case IPPROTO_FRAGMENT:
-            LOG("ERROR - Don't support ip6 fragements yet!");
-            return MOLOCH_PACKET_UNKNOWN;
+        case IPPROTO_FRAGMENT: {
+            if (len < ip_hdr_len + (int)sizeof(struct ip6_frag) || ip_len + (int)sizeof(struct ip6_hdr) < ip_hdr_len + (int)sizeof(struct ip6_frag)) {
+                return MOLOCH_PACKET_CORRUPT;
+            }
+
+            struct ip6_frag *frag = (struct ip6_frag *)(data + ip_hdr_len);
+            nxt = frag->ip6f_nxt;
+            ip_hdr_len += sizeof(struct ip6_frag);
+
+            // Atomic fragment, just skip the header
+            if ((frag->ip6f_offlg & (IP6F_OFF_MASK | IP6F_MORE_FRAG)) == 0)
+                break;
+
+            packet->payloadOffset = packet->ipOffset + ip_hdr_len;
+            packet->payloadLen = ip_len + sizeof(struct ip6_hdr) - ip_hdr_len;
+            moloch_packet_frags(batch, packet);
+            return MOLOCH_PACKET_SUCCESS;
+        }
         case IPPROTO_TCP:
             if (len < ip_hdr_len + (int)sizeof(struct tcphdr)) {
                 return MOLOCH_PACKET_CORRUPT;
@@ -1398,13 +2467,13 @@ LOCAL int moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const
             tcphdr = (struct tcphdr *)(data + ip_hdr_len);
 
 
-            if (packetDrop6.drops[tcphdr->th_sport] &&
+            if (packetDrop6.ports[tcphdr->th_sport] &&
                 moloch_drophash_should_drop(&packetDrop6, tcphdr->th_sport, &ip6->ip6_src, packet->ts.tv_sec)) {
 
                 return MOLOCH_PACKET_IPPORT_DROPPED;
             }
 
-            if (packetDrop6.drops[tcphdr->th_dport] &&
+            if (packetDrop6.ports[tcphdr->th_dport] &&
                 moloch_drophash_should_drop(&packetDrop6, tcphdr->th_dport, &ip6->ip6_dst, packet->ts.tv_sec)) {
 
                 return MOLOCH_PACKET_IPPORT_DROPPED;
@@ -1719,14 +2788,56 @@ LOCAL int moloch_packet_radiotap(MolochPacketBatch_t * batch, MolochPacket_t * c
     return MOLOCH_PACKET_UNKNOWN;
 }
 /******************************************************************************/
+/* Called once per reader thread, reserves the ring number this batch will use
+ * with every packet thread.  The rings themselves are created on first flush
+ * since some readers init before the packet threads do.
+ */
 void moloch_packet_batch_init(MolochPacketBatch_t *batch)
 {
     int t;
 
+    batch->ringNum = __sync_fetch_and_add(&numRings, 1);
+    if (batch->ringNum >= MOLOCH_PACKET_MAX_RINGS)
+        LOGEXIT("ERROR - Too many packet batches, max is %d", MOLOCH_PACKET_MAX_RINGS);
+
+    batch->packetQ = malloc(config.packetThreads * sizeof(MolochPacketHead_t));
+    batch->queued = malloc(config.packetThreads * sizeof(uint32_t));
+    batch->ringUsed = malloc(config.packetThreads * sizeof(uint32_t));
     for (t = 0; t < config.packetThreads; t++) {
         DLL_INIT(packet_, &batch->packetQ[t]);
+        batch->queued[t] = 0;
+        batch->ringUsed[t] = 0;
     }
     batch->count = 0;
+    batch->threadFirst = 0;
+    batch->threadCount = 0;
+}
+/******************************************************************************/
+/* Restrict a batch to the packet threads that belong to reader number reader
+ * out of numReaders.  Only safe when the readers themselves split traffic by
+ * flow, so every packet of a session arrives on the same reader.
+ */
+void moloch_packet_batch_affinity(MolochPacketBatch_t *batch, int reader, int numReaders)
+{
+    if (numReaders <= 1)
+        return;
+
+    if (config.packetThreads >= numReaders) {
+        batch->threadFirst = reader * config.packetThreads / numReaders;
+        batch->threadCount = (reader + 1) * config.packetThreads / numReaders - batch->threadFirst;
+    } else {
+        batch->threadFirst = reader % config.packetThreads;
+        batch->threadCount = 1;
+    }
+}
+/******************************************************************************/
+LOCAL MolochPacketRing_t *moloch_packet_ring_create(int thread, int ringNum)
+{
+    MolochPacketRing_t *ring = MOLOCH_TYPE_ALLOC0(MolochPacketRing_t);
+    ring->mask    = packetRingSize - 1;
+    ring->packets = MOLOCH_SIZE_ALLOC0("ring", packetRingSize * sizeof(MolochPacket_t *));
+    __atomic_store_n(&packetQ[thread].rings[ringNum], ring, __ATOMIC_RELEASE);
+    return ring;
 }
 /******************************************************************************/
 void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
@@ -1735,11 +2846,30 @@ void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
 
     for (t = 0; t < config.packetThreads; t++) {
         if (DLL_COUNT(packet_, &batch->packetQ[t]) > 0) {
-            MOLOCH_LOCK(packetQ[t].lock);
-            DLL_PUSH_TAIL_DLL(packet_, &packetQ[t], &batch->packetQ[t]);
-            MOLOCH_COND_SIGNAL(packetQ[t].lock);
-            MOLOCH_UNLOCK(packetQ[t].lock);
+            MolochPacketRing_t *ring = packetQ[t].rings[batch->ringNum];
+            if (unlikely(!ring))
+                ring = moloch_packet_ring_create(t, batch->ringNum);
+
+            moloch_packet_ring_push(ring, &batch->packetQ[t]);
+
+            // moloch_packet_ip keeps the batch within the room the ring had, so this
+            // shouldn't happen, but never block the reader on a slow packet thread
+            MolochPacket_t *packet;
+            while (DLL_POP_HEAD(packet_, &batch->packetQ[t], packet)) {
+                readerCounters[batch->ringNum].overloadDrops++;
+                readerCounters[batch->ringNum].packetStats[MOLOCH_PACKET_SUCCESS]--;
+                readerCounters[batch->ringNum].packetStats[MOLOCH_PACKET_OVERLOAD_DROPPED]++;
+                moloch_packet_free(packet);
+            }
+
+            __sync_synchronize();
+            if (packetQ[t].sleeping)
+                moloch_packet_thread_wake(t);
         }
+        batch->queued[t] = moloch_packet_ring_count(t);
+
+        MolochPacketRing_t *ring = packetQ[t].rings[batch->ringNum];
+        batch->ringUsed[t] = ring ? ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
     }
     batch->count = 0;
 }
@@ -1792,7 +2922,7 @@ void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const pac
         moloch_packet_save_unknown_packet(2, packet);
     }
 
-    MOLOCH_THREAD_INCR(packetStats[rc]);
+    readerCounters[batch->ringNum].packetStats[rc]++;
 
     if (rc) {
         moloch_packet_free(packet);
@@ -1805,32 +2935,17 @@ int moloch_packet_outstanding()
     int t;
 
     for (t = 0; t < config.packetThreads; t++) {
-        count += DLL_COUNT(packet_, &packetQ[t]);
-        count += inProgress[t];
+        count += moloch_packet_ring_count(t);
+        count += threadCounters[t].inProgress;
     }
     return count;
 }
 /******************************************************************************/
-SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
-LOCAL uint32_t moloch_packet_frag_hash(const void *key)
-{
-    int i;
-    uint32_t n = 0;
-    for (i = 0; i < 10; i++) {
-        n = (n << 5) - n + ((char*)key)[i];
-    }
-    return n;
-}
-/******************************************************************************/
-LOCAL int moloch_packet_frag_cmp(const void *keyv, const void *elementv)
-{
-    MolochFrags_t *element = (MolochFrags_t *)elementv;
-
-    return memcmp(keyv, element->key, 10) == 0;
-}
-/******************************************************************************/
 LOCAL gboolean moloch_packet_save_drophash(gpointer UNUSED(user_data))
 {
+    moloch_drophash_expire(&packetDrop4);
+    moloch_drophash_expire(&packetDrop6);
+
     if (packetDrop4.changed)
         moloch_drophash_save(&packetDrop4);
 
@@ -1970,22 +3085,103 @@ void moloch_packet_init()
         0,  MOLOCH_FIELD_FLAG_FAKE,
         (char *)NULL);
 
+    packetRingSize = moloch_config_int(NULL, "packetRingSize", 0x10000, 0x400, 0x1000000);
+    // Ring sizes must be a power of 2
+    packetRingSize--;
+    packetRingSize |= packetRingSize >> 1;
+    packetRingSize |= packetRingSize >> 2;
+    packetRingSize |= packetRingSize >> 4;
+    packetRingSize |= packetRingSize >> 8;
+    packetRingSize |= packetRingSize >> 16;
+    packetRingSize++;
+    packetThreadSpin = moloch_config_int(NULL, "packetThreadSpin", 1000, 0, 1000000);
+    nextLogPackets = config.logEveryXPackets;
+    packetPrefetch = moloch_config_boolean(NULL, "packetPrefetch", TRUE);
+    packetBenchmark = moloch_config_boolean(NULL, "packetBenchmark", FALSE);
+
+    shuntTimeout = moloch_config_int(NULL, "shuntTimeout", 10, 1, 60);
+    uint32_t shuntSize = moloch_config_int(NULL, "shuntTableSize", 0x10000, 0, 0x1000000);
+    if (shuntSize) {
+        // Table size must be a power of 2
+        shuntSize--;
+        shuntSize |= shuntSize >> 1;
+        shuntSize |= shuntSize >> 2;
+        shuntSize |= shuntSize >> 4;
+        shuntSize |= shuntSize >> 8;
+        shuntSize |= shuntSize >> 16;
+        shuntSize++;
+        if (posix_memalign((void **)&shunts, MOLOCH_CACHE_LINE, shuntSize * sizeof(MolochShunt_t)))
+            LOGEXIT("ERROR - Couldn't allocate shunt table");
+        memset(shunts, 0, shuntSize * sizeof(MolochShunt_t));
+        shuntMask = shuntSize - 1;
+    }
+
+    packetQ = moloch_thread_array_alloc(sizeof(MolochPacketQ_t));
+    threadCounters = moloch_thread_array_alloc(sizeof(MolochPacketThreadCounters_t));
+    packetThreadState = moloch_thread_array_alloc(sizeof(MolochPacketThreadState_t));
+
     int t;
+    uint32_t steerSize = moloch_config_int(NULL, "packetSteerBuckets", 0, 0, 0x100000);
+    if (steerSize && config.packetThreads > 1) {
+        // Table size must be a power of 2
+        steerSize--;
+        steerSize |= steerSize >> 1;
+        steerSize |= steerSize >> 2;
+        steerSize |= steerSize >> 4;
+        steerSize |= steerSize >> 8;
+        steerSize |= steerSize >> 16;
+        steerSize++;
+        steerMask = steerSize - 1;
+        steerThreshold = moloch_config_int(NULL, "packetSteerThreshold", 1000, 1, 0x1000000);
+        steerMaxMoves = moloch_config_int(NULL, "packetSteerMoves", 1024, 1, steerSize);
+        steerLoad = MOLOCH_SIZE_ALLOC0("steer", config.packetThreads * sizeof(double));
+        steerBuckets = MOLOCH_SIZE_ALLOC0("steer", steerSize * sizeof(uint64_t));
+        uint32_t b;
+        for (b = 0; b < steerSize; b++) {
+            steerBuckets[b] = (uint64_t)(b % config.packetThreads) << MOLOCH_STEER_THREAD_SHIFT;
+        }
+        g_timeout_add_seconds(1, moloch_packet_steer_gfunc, 0);
+    }
+
     for (t = 0; t < config.packetThreads; t++) {
-        char name[100];
-        DLL_INIT(packet_, &packetQ[t]);
+        DLL_INIT(packet_, &packetQ[t].handoffQ);
+        DLL_INIT(held_, &packetQ[t].heldQ);
+        DLL_INIT(tcp_, &packetThreadState[t].tcpWriteQ);
         MOLOCH_LOCK_INIT(packetQ[t].lock);
         MOLOCH_COND_INIT(packetQ[t].lock);
+    }
+
+    moloch_session_threads_init();
+
+    for (t = 0; t < config.packetThreads; t++) {
+        char name[100];
         snprintf(name, sizeof(name), "moloch-pkt%d", t);
         g_thread_new(name, &moloch_packet_thread, (gpointer)(long)t);
     }
 
-    HASH_INIT(fragh_, fragsHash, moloch_packet_frag_hash, moloch_packet_frag_cmp);
-    DLL_INIT(fragl_, &fragsList);
+    numFragsShards = moloch_config_int(NULL, "fragsShards", 16, 1, 256);
+    fragsShardMax = MAX(1, config.maxFrags / numFragsShards);
+    fragsShardMaxBytes = (uint64_t)moloch_config_int(NULL, "maxFragsMemory", 512, 1, 0xffffff) * 1024 * 1024 / numFragsShards;
+    fragsWheelGran = (config.fragsTimeout + MOLOCH_FRAGS_WHEEL/2 - 1) / (MOLOCH_FRAGS_WHEEL/2);
+
+    if (posix_memalign((void **)&fragsShards, MOLOCH_CACHE_LINE, numFragsShards * sizeof(MolochFragsShard_t)))
+        LOGEXIT("ERROR - Couldn't allocate fragsShards");
+    memset(fragsShards, 0, numFragsShards * sizeof(MolochFragsShard_t));
+
+    int s;
+    for (s = 0; s < numFragsShards; s++) {
+        HASH_INIT(fragh_, fragsShards[s].hash, moloch_packet_frag_hash, moloch_packet_frag_cmp);
+        for (t = 0; t < MOLOCH_FRAGS_WHEEL; t++) {
+            DLL_INIT(fragl_, &fragsShards[s].wheel[t]);
+        }
+        MOLOCH_LOCK_INIT(fragsShards[s].lock);
+    }
 
     moloch_add_can_quit(moloch_packet_outstanding, "packet outstanding");
     moloch_add_can_quit(moloch_packet_frags_outstanding, "packet frags outstanding");
     maxTcpOutOfOrderPackets = moloch_config_int(NULL, "maxTcpOutOfOrderPackets", 256, 64, 10000);
+    maxTcpOutOfOrderBytes = moloch_config_int(NULL, "maxTcpOutOfOrderBytes", 1024*1024, 64*1024, 0x10000000);
+    maxTcpReassemblyThreadBytes = (uint64_t)moloch_config_int(NULL, "maxTcpReassemblyMemory", 1024, 16, 0xffffff) * 1024 * 1024 / config.packetThreads;
 }
 /******************************************************************************/
 uint64_t moloch_packet_dropped_packets()
@@ -1999,33 +3195,108 @@ uint64_t moloch_packet_dropped_packets()
 /******************************************************************************/
 uint64_t moloch_packet_dropped_frags()
 {
-    return droppedFrags;
+    uint64_t count = 0;
+
+    int s;
+    for (s = 0; s < numFragsShards; s++) {
+        count += fragsShards[s].dropped;
+    }
+    return count;
 }
 /******************************************************************************/
 uint64_t moloch_packet_dropped_overload()
 {
     uint64_t count = 0;
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
 
-    int t;
-
-    for (t = 0; t < config.packetThreads; t++) {
-        count += overloadDrops[t];
+    int r;
+    for (r = 0; r < rings; r++) {
+        count += readerCounters[r].overloadDrops;
     }
     return count;
 }
 /******************************************************************************/
 uint64_t moloch_packet_total_bytes()
+{
+    uint64_t count = 0;
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+
+    int r;
+    for (r = 0; r < rings; r++) {
+        count += readerCounters[r].totalBytes;
+    }
+    return count;
+}
+/******************************************************************************/
+uint64_t moloch_packet_total_packets()
+{
+    uint64_t count = 0;
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+
+    int r;
+    for (r = 0; r < rings; r++) {
+        count += readerCounters[r].totalPackets;
+    }
+    return count;
+}
+/******************************************************************************/
+uint64_t moloch_packet_spi_done_packets()
 {
     uint64_t count = 0;
 
     int t;
+    for (t = 0; t < config.packetThreads; t++) {
+        count += threadCounters[t].spiDonePackets;
+    }
+    return count;
+}
+/******************************************************************************/
+uint64_t moloch_packet_shunted_packets()
+{
+    uint64_t count = 0;
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+
+    int r;
+    for (r = 0; r < rings; r++) {
+        count += readerCounters[r].packetStats[MOLOCH_PACKET_SHUNTED];
+    }
+    return count;
+}
+/******************************************************************************/
+double moloch_packet_steer_imbalance()
+{
+    return steerImbalance;
+}
+/******************************************************************************/
+uint64_t moloch_packet_steer_moves()
+{
+    return steerMoves;
+}
+/******************************************************************************/
+uint64_t moloch_packet_steer_handoffs()
+{
+    uint64_t count = 0;
 
+    int t;
     for (t = 0; t < config.packetThreads; t++) {
-        count += totalBytes[t];
+        count += threadCounters[t].steerHandoffs;
     }
     return count;
 }
 /******************************************************************************/
+LOCAL void moloch_packet_stats(uint64_t *packetStats)
+{
+    const int rings = __atomic_load_n(&numRings, __ATOMIC_ACQUIRE);
+
+    int i, r;
+    for (i = 0; i < MOLOCH_PACKET_MAX; i++) {
+        packetStats[i] = 0;
+        for (r = 0; r < rings; r++) {
+            packetStats[i] += readerCounters[r].packetStats[i];
+        }
+    }
+}
+/******************************************************************************/
 void moloch_packet_add_packet_ip(char *ipstr, int mode)
 {
     patricia_node_t *node;
@@ -2083,6 +3354,22 @@ void moloch_packet_exit()
         ipTree6 = 0;
     }
     moloch_packet_log(SESSION_TCP);
+
+    if (packetBenchmark) {
+        int t;
+        for (t = 0; t < config.packetThreads; t++) {
+            LOG("packet thread %d: %" PRIu64 " packets %.1f ns/packet prefetch %s tcp buffered: %" PRIu64 " incomplete: %" PRIu64 " shunt full: %" PRIu64 " steer handoffs: %" PRIu64 " uncounted: %" PRIu64, t,
+                threadCounters[t].benchPackets,
+                threadCounters[t].benchPackets ? (double)threadCounters[t].benchNanos / threadCounters[t].benchPackets : 0.0,
+                packetPrefetch ? "on" : "off",
+                threadCounters[t].tcpBuffered,
+                threadCounters[t].tcpIncomplete,
+                threadCounters[t].shuntFull,
+                threadCounters[t].steerHandoffs,
+                threadCounters[t].steerUncounted);
+        }
+    }
+
     if (unknownPacketFile[0])
         fclose(unknownPacketFile[0]);
     if (unknownPacketFile[1])
@@ -27,7 +27,7 @@
 extern MolochConfig_t        config;
 LOCAL  gchar                 classTag[100];
 
-LOCAL  magic_t               cookie[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  magic_t              *cookie;
 
 extern unsigned char         moloch_char_to_hexstr[256][3];
 
@@ -582,6 +582,7 @@ void moloch_parsers_init()
 
     if (magicMode == MOLOCH_MAGICMODE_LIBMAGIC || magicMode == MOLOCH_MAGICMODE_BOTH) {
         int t;
+        cookie = g_new0(magic_t, config.packetThreads);
         for (t = 0; t < config.packetThreads; t++) {
             cookie[t] = magic_open(flags);
             if (!cookie[t]) {
@@ -781,6 +782,9 @@ void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func,
     session->parserInfo[session->parserNum].parserSaveFunc = sfunc;
 
     session->parserNum++;
+
+    // Something wants the payload again
+    session->spiDone = 0;
 }
 /******************************************************************************/
 void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
@@ -796,11 +800,21 @@ void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
             session->parserInfo[i].parserSaveFunc = 0;
             session->parserInfo[i].parserFunc = 0;
             session->parserInfo[i].uw = 0;
+            session->spiCheck = 1;
             break;
         }
     }
 }
 /******************************************************************************/
+/* Called by a parser that knows nothing more will be learned from the rest
+ * of the session, the packet thread stops reassembling and dispatching payload
+ * and only keeps counting and writing packets.
+ */
+void  moloch_parsers_spi_done(MolochSession_t *session)
+{
+    session->spiDone = 1;
+}
+/******************************************************************************/
 typedef struct moloch_classify_t
 {
     const char          *name;
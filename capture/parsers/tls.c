@@ -32,7 +32,7 @@ typedef struct {
 
 extern unsigned char    moloch_char_to_hexstr[256][3];
 
-LOCAL GChecksum *checksums[MOLOCH_MAX_PACKET_THREADS];
+LOCAL GChecksum **checksums;
 
 /******************************************************************************/
 LOCAL void tls_certinfo_process(MolochCertInfo_t *ci, BSB *bsb)
@@ -831,6 +831,7 @@ void moloch_parser_init()
     moloch_parsers_classifier_register_tcp("tls", NULL, 0, (unsigned char*)"\x16\x03", 2, tls_classify);
 
     int t;
+    checksums = g_new0(GChecksum *, config.packetThreads);
     for (t = 0; t < config.packetThreads; t++) {
         checksums[t] = g_checksum_new(G_CHECKSUM_SHA1);
     }
@@ -0,0 +1,500 @@
+/******************************************************************************/
+/* reader-afxdp.c  -- Reader using AF_XDP sockets
+ *
+ * Copyright 2012-2017 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Ideas from
+ * https://www.kernel.org/doc/Documentation/networking/af_xdp.rst
+ * linux samples/bpf/xdpsock_user.c
+ *
+ * Each interface queue gets its own AF_XDP socket, UMEM and thread.  A tiny
+ * XDP program redirects each queue to its socket, it is attached with a bpf
+ * link so it goes away when capture exits.  Packets point into the UMEM and
+ * the frames go back on the fill ring once moloch is done with them.
+ */
+
+#include "moloch.h"
+#include "molochconfig.h"
+extern MolochConfig_t        config;
+
+#if !defined(__linux) || !defined(HAVE_LINUX_IF_XDP_H)
+void reader_afxdp_init(char *UNUSED(name))
+{
+    LOGEXIT("afxdp not supported");
+}
+#else
+
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <poll.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define MOLOCH_AFXDP_MAX_QUEUES 32
+#define MOLOCH_AFXDP_BURST      64
+
+typedef struct {
+    uint32_t            *producer;
+    uint32_t            *consumer;
+    uint32_t            *flags;
+    void                *ring;
+    void                *map;
+    size_t               mapLen;
+    uint32_t             mask;
+    uint32_t             size;
+} MolochXdpRing_t;
+
+/* Packets from one receive call, given back to the fill ring once done */
+typedef struct {
+    MolochPacketBlock_t  block;
+    uint64_t             addrs[MOLOCH_AFXDP_BURST];
+    int                  num;
+} MolochXdpBurst_t;
+
+typedef struct {
+    int                  fd;
+    int                  interface;  // index into config.interface
+    int                  queue;
+    uint8_t             *umem;
+    MolochXdpRing_t      rx;
+    MolochXdpRing_t      fill;
+    MolochXdpRing_t      comp;
+    MolochXdpBurst_t    *bursts;
+    int                  numBursts;
+    uint64_t             packets;
+} MolochXdpSocket_t;
+
+LOCAL MolochXdpSocket_t *xsks;
+LOCAL int                numXsks;
+
+LOCAL int                progFds[MAX_INTERFACES];
+LOCAL int                mapFds[MAX_INTERFACES];
+LOCAL int                linkFds[MAX_INTERFACES];
+LOCAL int                linkNative[MAX_INTERFACES];
+
+LOCAL int                numQueues;
+LOCAL uint32_t           numFrames;
+LOCAL uint32_t           frameSize;
+LOCAL int                skbMode;
+LOCAL int                needWakeup;
+
+LOCAL MolochReaderStats_t gStats;
+LOCAL MOLOCH_LOCK_DEFINE(gStats);
+
+/******************************************************************************/
+LOCAL int reader_afxdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+/******************************************************************************/
+int reader_afxdp_stats(MolochReaderStats_t *stats)
+{
+    MOLOCH_LOCK(gStats);
+
+    int i;
+
+    // The kernel counters are totals, not deltas like tpacketv3
+    gStats.total = 0;
+    gStats.dropped = 0;
+    for (i = 0; i < numXsks; i++) {
+        struct xdp_statistics xstats;
+        socklen_t len = sizeof(xstats);
+        memset(&xstats, 0, sizeof(xstats));
+        getsockopt(xsks[i].fd, SOL_XDP, XDP_STATISTICS, &xstats, &len);
+
+        gStats.dropped += xstats.rx_dropped;
+        gStats.total += xsks[i].packets + xstats.rx_dropped;
+    }
+    *stats = gStats;
+    MOLOCH_UNLOCK(gStats);
+    return 0;
+}
+/******************************************************************************/
+/* Nothing to do, the reader thread refills the frames when it sees refs is 0 */
+LOCAL void reader_afxdp_block_free(MolochPacketBlock_t *UNUSED(block))
+{
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_refill(MolochXdpSocket_t *xsk, MolochXdpBurst_t *burst)
+{
+    uint32_t prod = *xsk->fill.producer;
+    uint64_t *ring = xsk->fill.ring;
+    int i;
+
+    // Fill ring is as big as the umem so there is always room
+    for (i = 0; i < burst->num; i++) {
+        ring[(prod + i) & xsk->fill.mask] = burst->addrs[i] & ~((uint64_t)frameSize - 1);
+    }
+    __atomic_store_n(xsk->fill.producer, prod + burst->num, __ATOMIC_RELEASE);
+    burst->num = 0;
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_wakeup(MolochXdpSocket_t *xsk)
+{
+#ifdef XDP_RING_NEED_WAKEUP
+    if (needWakeup && (*xsk->fill.flags & XDP_RING_NEED_WAKEUP)) {
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+#else
+    (void)xsk;
+#endif
+}
+/******************************************************************************/
+/* Give back the frames of every burst the packet threads are done with, so the
+ * kernel never runs dry while we wait on a slot that is still in use.
+ */
+LOCAL void reader_afxdp_refill_all(MolochXdpSocket_t *xsk)
+{
+    int b, refilled = 0;
+
+    for (b = 0; b < xsk->numBursts; b++) {
+        MolochXdpBurst_t *burst = &xsk->bursts[b];
+        if (burst->num > 0 && __atomic_load_n(&burst->block.refs, __ATOMIC_ACQUIRE) == 0) {
+            reader_afxdp_refill(xsk, burst);
+            refilled = 1;
+        }
+    }
+
+    if (refilled)
+        reader_afxdp_wakeup(xsk);
+}
+/******************************************************************************/
+LOCAL void *reader_afxdp_thread(gpointer xskv)
+{
+    MolochXdpSocket_t *xsk = &xsks[(long)xskv];
+    struct xdp_desc   *descs = xsk->rx.ring;
+    struct pollfd      pfd;
+    int                pos = 0;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = xsk->fd;
+    pfd.events = POLLIN;
+
+    moloch_thread_pin("reader", (long)xskv);
+
+    MolochPacketBatch_t batch;
+    moloch_packet_batch_init(&batch);
+
+    while (!config.quitting) {
+        MolochXdpBurst_t *burst = &xsk->bursts[pos];
+
+        // Packets from the last time around are still using the frames
+        if (__atomic_load_n(&burst->block.refs, __ATOMIC_ACQUIRE) > 0) {
+            reader_afxdp_refill_all(xsk);
+            usleep(100);
+            continue;
+        }
+
+        if (burst->num > 0) {
+            reader_afxdp_refill(xsk, burst);
+            reader_afxdp_wakeup(xsk);
+        }
+
+        uint32_t cons = *xsk->rx.consumer;
+        uint32_t num = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - cons;
+        if (num == 0) {
+            reader_afxdp_refill_all(xsk);
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        if (num > MOLOCH_AFXDP_BURST)
+            num = MOLOCH_AFXDP_BURST;
+
+        // No timestamps from AF_XDP, one clock read for the whole burst
+        struct timeval ts;
+        gettimeofday(&ts, NULL);
+
+        // A reference for each packet plus one for us while we are still adding packets
+        burst->block.refs = num + 1;
+        burst->num = num;
+
+        uint32_t i;
+        for (i = 0; i < num; i++) {
+            struct xdp_desc *desc = &descs[(cons + i) & xsk->rx.mask];
+            burst->addrs[i] = desc->addr;
+
+            MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+            packet->pkt           = xsk->umem + desc->addr;
+            packet->pktlen        = desc->len;
+            packet->ts            = ts;
+            packet->readerPos     = xsk->interface;
+            packet->block         = &burst->block;
+
+            moloch_packet_batch(&batch, packet);
+        }
+        __atomic_store_n(xsk->rx.consumer, cons + num, __ATOMIC_RELEASE);
+        xsk->packets += num;
+
+        moloch_packet_batch_flush(&batch);
+        moloch_packet_block_release(&burst->block);
+
+        pos = (pos + 1) % xsk->numBursts;
+    }
+    return NULL;
+}
+/******************************************************************************/
+void reader_afxdp_start() {
+    int i;
+    char name[100];
+    for (i = 0; i < numXsks; i++) {
+        snprintf(name, sizeof(name), "moloch-xdp%d-%d", xsks[i].interface, xsks[i].queue);
+        g_thread_new(name, &reader_afxdp_thread, (gpointer)(long)i);
+    }
+}
+/******************************************************************************/
+void reader_afxdp_stop()
+{
+    int i;
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        if (linkFds[i] > 0)
+            close(linkFds[i]);
+    }
+    for (i = 0; i < numXsks; i++) {
+        close(xsks[i].fd);
+    }
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_ring_map(MolochXdpSocket_t *xsk, MolochXdpRing_t *ring, struct xdp_ring_offset *off, uint32_t size, size_t entrySize, off_t pgoff)
+{
+    ring->mapLen = off->desc + size * entrySize;
+    ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+    if (ring->map == MAP_FAILED)
+        LOGEXIT("ERROR - Couldn't mmap afxdp ring on %s: %s", config.interface[xsk->interface], strerror(errno));
+
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags    = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->ring     = (uint8_t *)ring->map + off->desc;
+    ring->size     = size;
+    ring->mask     = size - 1;
+}
+/******************************************************************************/
+/* Load the redirect program and xskmap for interface i and attach it */
+LOCAL void reader_afxdp_prog(int i)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(int);
+    attr.value_size  = sizeof(int);
+    attr.max_entries = numQueues;
+    mapFds[i] = reader_afxdp_bpf(BPF_MAP_CREATE, &attr);
+    if (mapFds[i] < 0)
+        LOGEXIT("ERROR - Couldn't create afxdp xskmap for %s: %s", config.interface[i], strerror(errno));
+
+    // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+    struct bpf_insn insns[] = {
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD, .imm = mapFds[i] },
+        { .code = 0 },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT }
+    };
+
+    char log[4096];
+    log[0] = 0;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (uint64_t)(long)insns;
+    attr.insn_cnt  = sizeof(insns)/sizeof(insns[0]);
+    attr.license   = (uint64_t)(long)"Apache-2.0";
+    attr.log_buf   = (uint64_t)(long)log;
+    attr.log_size  = sizeof(log);
+    attr.log_level = 1;
+    progFds[i] = reader_afxdp_bpf(BPF_PROG_LOAD, &attr);
+    if (progFds[i] < 0)
+        LOGEXIT("ERROR - Couldn't load afxdp program for %s: %s\n%s", config.interface[i], strerror(errno), log);
+
+    int ifindex = if_nametoindex(config.interface[i]);
+
+    // Try native driver mode first unless told otherwise
+    if (!skbMode) {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd        = progFds[i];
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type    = BPF_XDP;
+        attr.link_create.flags          = XDP_FLAGS_DRV_MODE;
+        linkFds[i] = reader_afxdp_bpf(BPF_LINK_CREATE, &attr);
+        if (linkFds[i] >= 0) {
+            linkNative[i] = 1;
+            return;
+        }
+        LOG("WARNING - %s doesn't support native XDP (%s), using generic mode", config.interface[i], strerror(errno));
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = progFds[i];
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = XDP_FLAGS_SKB_MODE;
+    linkFds[i] = reader_afxdp_bpf(BPF_LINK_CREATE, &attr);
+    if (linkFds[i] < 0)
+        LOGEXIT("ERROR - Couldn't attach afxdp program to %s, need a 5.9 or later kernel: %s", config.interface[i], strerror(errno));
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_open(int x, int native)
+{
+    MolochXdpSocket_t *xsk = &xsks[x];
+    const int i = xsk->interface;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0)
+        LOGEXIT("ERROR - Couldn't create AF_XDP socket, might need a newer kernel: %s", strerror(errno));
+
+    xsk->umem = mmap(NULL, (size_t)numFrames * frameSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED)
+        LOGEXIT("ERROR - Couldn't allocate afxdp umem of %u frames: %s", numFrames, strerror(errno));
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(long)xsk->umem;
+    reg.len = (uint64_t)numFrames * frameSize;
+    reg.chunk_size = frameSize;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+        LOGEXIT("ERROR - Couldn't register afxdp umem: %s", strerror(errno));
+
+    // Receive only, so the completion ring just needs to exist
+    uint32_t compSize = 64;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &numFrames, sizeof(numFrames)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &compSize, sizeof(compSize)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &numFrames, sizeof(numFrames)) < 0)
+        LOGEXIT("ERROR - Couldn't size afxdp rings: %s", strerror(errno));
+
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        LOGEXIT("ERROR - Couldn't get afxdp ring offsets: %s", strerror(errno));
+
+    reader_afxdp_ring_map(xsk, &xsk->rx, &off.rx, numFrames, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    reader_afxdp_ring_map(xsk, &xsk->fill, &off.fr, numFrames, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+    reader_afxdp_ring_map(xsk, &xsk->comp, &off.cr, compSize, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+
+    // Hand every frame to the kernel
+    uint64_t *ring = xsk->fill.ring;
+    uint32_t f;
+    for (f = 0; f < numFrames; f++) {
+        ring[f] = (uint64_t)f * frameSize;
+    }
+    __atomic_store_n(xsk->fill.producer, numFrames, __ATOMIC_RELEASE);
+
+    // One slot per full burst of frames, so we wrap around to old slots before the kernel can run out
+    xsk->numBursts = numFrames / MOLOCH_AFXDP_BURST;
+    xsk->bursts = calloc(xsk->numBursts, sizeof(MolochXdpBurst_t));
+    int b;
+    for (b = 0; b < xsk->numBursts; b++) {
+        xsk->bursts[b].block.freeFunc = reader_afxdp_block_free;
+    }
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_ifindex  = if_nametoindex(config.interface[i]);
+    sxdp.sxdp_queue_id = xsk->queue;
+
+    uint16_t wakeup = 0;
+#ifdef XDP_USE_NEED_WAKEUP
+    if (needWakeup)
+        wakeup = XDP_USE_NEED_WAKEUP;
+#endif
+
+    // Zero copy needs driver support, copy mode works everywhere
+    int bound = 0;
+    if (native) {
+        sxdp.sxdp_flags = XDP_ZEROCOPY | wakeup;
+        bound = bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0;
+    }
+    if (!bound) {
+        sxdp.sxdp_flags = XDP_COPY | wakeup;
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+            LOGEXIT("ERROR - Couldn't bind afxdp socket to %s queue %d: %s", config.interface[i], xsk->queue, strerror(errno));
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFds[i];
+    attr.key    = (uint64_t)(long)&xsk->queue;
+    attr.value  = (uint64_t)(long)&xsk->fd;
+    if (reader_afxdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        LOGEXIT("ERROR - Couldn't add afxdp socket to xskmap for %s: %s", config.interface[i], strerror(errno));
+
+    if (config.debug)
+        LOG("%s queue %d using %s copy mode", config.interface[i], xsk->queue, bound ? "zero" : "kernel");
+}
+/******************************************************************************/
+void reader_afxdp_init(char *UNUSED(name))
+{
+    int i, q;
+
+    numQueues  = moloch_config_int(NULL, "afxdpQueues", 1, 1, MOLOCH_AFXDP_MAX_QUEUES);
+    numFrames  = moloch_config_int(NULL, "afxdpNumFrames", 8192, 1024, 1 << 20);
+    frameSize  = moloch_config_int(NULL, "afxdpFrameSize", 4096, 2048, 4096);
+    needWakeup = moloch_config_boolean(NULL, "afxdpNeedWakeup", TRUE);
+
+    char *mode = moloch_config_str(NULL, "afxdpMode", "auto");
+    if (strcmp(mode, "skb") == 0) {
+        skbMode = 1;
+    } else if (strcmp(mode, "auto") != 0) {
+        LOGEXIT("afxdpMode must be auto or skb, not '%s'", mode);
+    }
+    g_free(mode);
+
+    if (numFrames & (numFrames - 1))
+        LOGEXIT("afxdpNumFrames %u must be a power of 2", numFrames);
+
+    if (frameSize & (frameSize - 1))
+        LOGEXIT("afxdpFrameSize %u must be a power of 2", frameSize);
+
+    if (config.bpf)
+        LOG("WARNING - bpf '%s' is ignored by the afxdp reader", config.bpf);
+
+    moloch_packet_set_linksnap(1, config.snapLen);
+
+    int numInterfaces;
+    for (numInterfaces = 0; numInterfaces < MAX_INTERFACES && config.interface[numInterfaces]; numInterfaces++);
+    xsks = calloc(numInterfaces * numQueues, sizeof(MolochXdpSocket_t));
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        reader_afxdp_prog(i);
+
+        for (q = 0; q < numQueues; q++) {
+            xsks[numXsks].interface = i;
+            xsks[numXsks].queue = q;
+            reader_afxdp_open(numXsks, linkNative[i]);
+            numXsks++;
+        }
+    }
+
+    if (i == MAX_INTERFACES) {
+        LOGEXIT("Only support up to %d interfaces", MAX_INTERFACES);
+    }
+
+    moloch_reader_start         = reader_afxdp_start;
+    moloch_reader_stop          = reader_afxdp_stop;
+    moloch_reader_stats         = reader_afxdp_stats;
+}
+#endif // HAVE_LINUX_IF_XDP_H
@@ -1,5 +1,7 @@
 /******************************************************************************/
-/* reader-libpcap-file.c  -- Reader using libpcap to a file
+/* reader-libpcap-file.c  -- Reader using libpcap to a file, or with
+ *                           pcapReadOfflineMethod=mmap-file reading
+ *                           pcap/pcapng files directly from a mapping
  *
  * Copyright 2012-2017 AOL Inc. All rights reserved.
  *
@@ -18,7 +20,9 @@
 #define _FILE_OFFSET_BITS 64
 #include "moloch.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "pcap.h"
 #include "molochconfig.h"
 
@@ -26,19 +30,67 @@ extern MolochPcapFileHdr_t   pcapFileHeader;
 
 extern MolochConfig_t        config;
 
-LOCAL  pcap_t               *pcap;
-LOCAL  FILE                 *offlineFile = 0;
-
 extern void                 *esServer;
 LOCAL  MolochStringHead_t    monitorQ;
 
-LOCAL  char                  offlinePcapFilename[PATH_MAX+1];
-LOCAL  int                   pktsToRead;
-
-LOCAL void reader_libpcapfile_opened();
-
-LOCAL MolochPacketBatch_t   batch;
-LOCAL uint8_t               readerPos;
+/* A mapped input file for the mmap-file method.  Packets point straight
+ * into the mapping, which is unmapped when the last packet is freed.
+ */
+#define MOLOCH_MMAP_MAX_INTERFACES 32
+
+typedef struct {
+    MolochPacketBlock_t  block;
+    uint8_t             *base;
+    uint64_t             size;
+    uint64_t             pos;
+    struct timeval       lastTs;
+    uint32_t             linktype;
+    uint32_t             snaplen;
+    uint8_t              swapped;
+    uint8_t              nsec;
+    uint8_t              pcapng;
+    uint8_t              numInterfaces;
+    uint8_t              error;
+    const char          *filename;
+    struct {
+        uint32_t         linktype;
+        uint64_t         tsUnits;   // timestamp units per second
+    } interfaces[MOLOCH_MMAP_MAX_INTERFACES];
+} MolochMmapFile_t;
+
+/* One file being read.  The main loop uses fileReaders[0], with
+ * offlineReaderThreads each thread reads its own files.
+ */
+#define MOLOCH_MAX_FILE_READERS 16
+
+typedef struct {
+    MolochPacketBatch_t  batch;
+    pcap_t              *pcap;
+    FILE                *offlineFile;
+    MolochMmapFile_t    *mfile;
+    struct bpf_program   bpf;
+    char                 filename[PATH_MAX+1];
+    int                  pktsToRead;
+    uint32_t             linktype;
+    uint8_t              readerPos;
+    uint64_t             packets;
+    uint64_t             bytes;
+    struct timeval       startTime;
+} MolochFileReader_t;
+
+LOCAL  gboolean              useMmap;
+LOCAL  MolochFileReader_t    fileReaders[MOLOCH_MAX_FILE_READERS];
+LOCAL  int                   numReaderThreads;
+LOCAL  int                   runningReaderThreads;
+LOCAL  uint64_t              totalFilePackets;
+LOCAL  uint8_t               readerPos;
+
+// With reader threads, protects picking files, readerPos and the link type
+LOCAL  MOLOCH_LOCK_DEFINE(files);
+LOCAL  MOLOCH_COND_DEFINE(files);
+LOCAL  int                   linktypeUsers;
+
+LOCAL void reader_libpcapfile_opened(MolochFileReader_t *ctx);
 extern char                *readerFileName[256];
 extern MolochFieldOps_t     readerFieldOps[256];
 
@@ -85,7 +137,9 @@ LOCAL void reader_libpcapfile_monitor_do(struct inotify_event *event)
 
     if (config.debug)
         LOG("Monitor enqueing %s", string->str);
+    MOLOCH_LOCK(files);
     DLL_PUSH_TAIL(s_, &monitorQ, string);
+    MOLOCH_UNLOCK(files);
     return;
 }
 /******************************************************************************/
@@ -175,45 +229,350 @@ LOCAL void reader_libpcapfile_init_monitor()
 }
 #endif
 /******************************************************************************/
-LOCAL int reader_libpcapfile_process(char *filename)
+#define MMAP_U16(f, x) ((f)->swapped ? __builtin_bswap16(x) : (x))
+#define MMAP_U32(f, x) ((f)->swapped ? __builtin_bswap32(x) : (x))
+
+#define MMAP_PCAPNG_SHB  0x0a0d0d0a
+#define MMAP_PCAPNG_IDB  0x00000001
+#define MMAP_PCAPNG_SPB  0x00000003
+#define MMAP_PCAPNG_EPB  0x00000006
+
+/******************************************************************************/
+LOCAL void reader_libpcapfile_mmap_free(MolochPacketBlock_t *block)
+{
+    MolochMmapFile_t *file = block->uw;
+
+    munmap(file->base, file->size);
+    MOLOCH_TYPE_FREE(MolochMmapFile_t, file);
+}
+/******************************************************************************/
+/* Parse a pcapng section header at the current position */
+LOCAL int reader_libpcapfile_mmap_shb(MolochMmapFile_t *file)
+{
+    if (file->pos + 28 > file->size)
+        return 1;
+
+    uint32_t bom = *(uint32_t *)(file->base + file->pos + 8);
+    if (bom == 0x1a2b3c4d)
+        file->swapped = 0;
+    else if (bom == 0x4d3c2b1a)
+        file->swapped = 1;
+    else
+        return 1;
+
+    // Interface ids are per section
+    file->numInterfaces = 0;
+    return 0;
+}
+/******************************************************************************/
+/* Parse a pcapng interface description block, only if_tsresol matters */
+LOCAL void reader_libpcapfile_mmap_idb(MolochMmapFile_t *file, uint8_t *data, uint32_t len)
+{
+    if (file->numInterfaces >= MOLOCH_MMAP_MAX_INTERFACES || len < 20)
+        return;
+
+    int i = file->numInterfaces++;
+    file->interfaces[i].linktype = MMAP_U16(file, *(uint16_t *)(data + 8));
+    file->interfaces[i].tsUnits  = 1000000;
+
+    if (i == 0) {
+        file->linktype = file->interfaces[0].linktype;
+        file->snaplen  = MMAP_U32(file, *(uint32_t *)(data + 12));
+    } else if (file->interfaces[i].linktype != file->linktype) {
+        LOG("WARNING - %s interface %d has link type %u instead of %u, its packets will be skipped",
+            file->filename, i, file->interfaces[i].linktype, file->linktype);
+    }
+
+    // Options run from after the fixed fields to before the trailing length
+    uint8_t *opt = data + 16;
+    uint8_t *end = data + len - 4;
+    while (opt + 4 <= end) {
+        uint16_t code = MMAP_U16(file, *(uint16_t *)opt);
+        uint16_t olen = MMAP_U16(file, *(uint16_t *)(opt + 2));
+        if (code == 0 || opt + 4 + olen > end)
+            break;
+        if (code == 9 && olen >= 1) { // if_tsresol
+            uint8_t  res = opt[4];
+            uint64_t units = 1;
+            int      n;
+            for (n = 0; n < (res & 0x7f) && units < 1000000000000000000ULL; n++)
+                units *= (res & 0x80) ? 2 : 10;
+            file->interfaces[i].tsUnits = units;
+        }
+        opt += 4 + ((olen + 3) & ~3);
+    }
+}
+/******************************************************************************/
+LOCAL MolochMmapFile_t *reader_libpcapfile_mmap_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOG("Couldn't open '%s' error '%s'", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || sb.st_size < 24) {
+        LOG("Couldn't process '%s' error 'file too short'", filename);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG("Couldn't mmap '%s' error '%s'", filename, strerror(errno));
+        return NULL;
+    }
+    madvise(base, sb.st_size, MADV_SEQUENTIAL);
+
+    MolochMmapFile_t *file = MOLOCH_TYPE_ALLOC0(MolochMmapFile_t);
+    file->base = base;
+    file->size = sb.st_size;
+    file->block.freeFunc = reader_libpcapfile_mmap_free;
+    file->block.uw = file;
+    file->block.refs = 1;
+    file->filename = filename;
+
+    MolochPcapFileHdr_t *hdr = (MolochPcapFileHdr_t *)base;
+    switch (hdr->magic) {
+    case 0xa1b2c3d4:
+        break;
+    case 0xa1b23c4d:
+        file->nsec = 1;
+        break;
+    case 0xd4c3b2a1:
+        file->swapped = 1;
+        break;
+    case 0x4d3cb2a1:
+        file->swapped = 1;
+        file->nsec = 1;
+        break;
+    case MMAP_PCAPNG_SHB:
+        file->pcapng = 1;
+        if (reader_libpcapfile_mmap_shb(file) == 0)
+            break;
+        // fall through
+    default:
+        LOG("Couldn't process '%s' error 'unknown file format'", filename);
+        munmap(base, sb.st_size);
+        MOLOCH_TYPE_FREE(MolochMmapFile_t, file);
+        return NULL;
+    }
+
+    if (!file->pcapng) {
+        file->linktype = MMAP_U32(file, hdr->linktype);
+        file->snaplen  = MMAP_U32(file, hdr->snaplen);
+        file->pos      = 24;
+        return file;
+    }
+
+    // Need the first interface for the link type
+    while (file->pos + 12 <= file->size && file->numInterfaces == 0) {
+        uint32_t type = MMAP_U32(file, *(uint32_t *)(base + file->pos));
+        uint32_t len  = MMAP_U32(file, *(uint32_t *)(base + file->pos + 4));
+        if (len < 12 || (len & 3) || file->pos + len > file->size)
+            break;
+        if (type == MMAP_PCAPNG_IDB)
+            reader_libpcapfile_mmap_idb(file, base + file->pos, len);
+        file->pos += len;
+    }
+
+    if (file->numInterfaces == 0) {
+        LOG("Couldn't process '%s' error 'no pcapng interface block'", filename);
+        munmap(base, sb.st_size);
+        MOLOCH_TYPE_FREE(MolochMmapFile_t, file);
+        return NULL;
+    }
+
+    return file;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_mmap_packet(MolochFileReader_t *ctx, MolochMmapFile_t *file, uint8_t *data, uint32_t caplen, uint32_t len, uint64_t filePos)
+{
+    if (unlikely(caplen != len)) {
+        if (!config.readTruncatedPackets) {
+            LOGEXIT("ERROR - Moloch requires full packet captures caplen: %d pktlen: %d. "
+                "If using tcpdump use the \"-s0\" option, or set readTruncatedPackets in ini file",
+                caplen, len);
+        }
+    }
+
+    if (ctx->bpf.bf_insns && !bpf_filter(ctx->bpf.bf_insns, data, len, caplen))
+        return;
+
+    MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+    packet->pkt           = data;
+    packet->pktlen        = caplen;
+    packet->ts            = file->lastTs;
+    packet->readerFilePos = filePos;
+    packet->readerPos     = ctx->readerPos;
+    packet->block         = &file->block;
+    __sync_add_and_fetch(&file->block.refs, 1);
+    ctx->packets++;
+    ctx->bytes += caplen;
+    moloch_packet_batch(&ctx->batch, packet);
+}
+/******************************************************************************/
+/* Walk up to max records, returns the number walked or 0 at the end.  Skipped
+ * and filtered records don't show up in ctx->packets.
+ */
+LOCAL int reader_libpcapfile_mmap_dispatch(MolochFileReader_t *ctx, MolochMmapFile_t *file, int max)
+{
+    int      n;
+    uint8_t *base = file->base;
+
+    for (n = 0; n < max; n++) {
+        if (!file->pcapng) {
+            if (file->pos + 16 > file->size)
+                break;
+
+            struct moloch_pcap_sf_pkthdr *h = (struct moloch_pcap_sf_pkthdr *)(base + file->pos);
+            uint32_t caplen = MMAP_U32(file, h->caplen);
+            uint32_t len    = MMAP_U32(file, h->pktlen);
+
+            if (file->pos + 16 + caplen > file->size) {
+                LOG("WARNING - %s has a bad or truncated record at %" PRIu64, file->filename, file->pos);
+                file->pos = file->size;
+                file->error = 1;
+                break;
+            }
+
+            // Skip records too big for us like the pcapng blocks below
+            if (caplen > 0xffff) {
+                if (config.debug)
+                    LOG("Skipping %u byte record in %s at %" PRIu64, caplen, file->filename, file->pos);
+                file->pos += 16 + caplen;
+                continue;
+            }
+
+            file->lastTs.tv_sec  = MMAP_U32(file, (uint32_t)h->ts.tv_sec);
+            file->lastTs.tv_usec = MMAP_U32(file, (uint32_t)h->ts.tv_usec);
+            if (file->nsec)
+                file->lastTs.tv_usec /= 1000;
+
+            reader_libpcapfile_mmap_packet(ctx, file, base + file->pos + 16, caplen, len, file->pos);
+            file->pos += 16 + caplen;
+            continue;
+        }
+
+        if (file->pos + 12 > file->size)
+            break;
+
+        uint8_t *data = base + file->pos;
+        uint32_t type = *(uint32_t *)data;
+
+        // A new section may change byte order
+        if (type == MMAP_PCAPNG_SHB && reader_libpcapfile_mmap_shb(file) != 0) {
+            LOG("WARNING - %s has a bad section header at %" PRIu64, file->filename, file->pos);
+            file->pos = file->size;
+            file->error = 1;
+            break;
+        }
+        type = MMAP_U32(file, type);
+
+        uint32_t blen = MMAP_U32(file, *(uint32_t *)(data + 4));
+        if (blen < 12 || (blen & 3) || file->pos + blen > file->size) {
+            LOG("WARNING - %s has a bad or truncated block at %" PRIu64, file->filename, file->pos);
+            file->pos = file->size;
+            file->error = 1;
+            break;
+        }
+
+        switch (type) {
+        case MMAP_PCAPNG_IDB:
+            reader_libpcapfile_mmap_idb(file, data, blen);
+            break;
+        case MMAP_PCAPNG_EPB: {
+            if (blen < 32)
+                break;
+            uint32_t id     = MMAP_U32(file, *(uint32_t *)(data + 8));
+            uint64_t ts     = ((uint64_t)MMAP_U32(file, *(uint32_t *)(data + 12)) << 32) |
+                              MMAP_U32(file, *(uint32_t *)(data + 16));
+            uint32_t caplen = MMAP_U32(file, *(uint32_t *)(data + 20));
+            uint32_t len    = MMAP_U32(file, *(uint32_t *)(data + 24));
+
+            if (id >= file->numInterfaces || file->interfaces[id].linktype != file->linktype ||
+                caplen > blen - 32 || caplen > 0xffff)
+                break;
+
+            const uint64_t units = file->interfaces[id].tsUnits;
+            file->lastTs.tv_sec  = ts / units;
+            file->lastTs.tv_usec = (ts % units) * 1000000 / units;
+
+            reader_libpcapfile_mmap_packet(ctx, file, data + 28, caplen, len, file->pos);
+            break;
+        }
+        case MMAP_PCAPNG_SPB: {
+            // No timestamp, so reuse the last one seen
+            if (blen < 16 || file->numInterfaces == 0)
+                break;
+            uint32_t len    = MMAP_U32(file, *(uint32_t *)(data + 8));
+            uint32_t caplen = MIN(len, blen - 16);
+            if (caplen > 0xffff)
+                break;
+
+            reader_libpcapfile_mmap_packet(ctx, file, data + 12, caplen, len, file->pos);
+            break;
+        }
+        }
+        file->pos += blen;
+    }
+
+    if (n == 0 && file->error)
+        return -1;
+    return n;
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_process(MolochFileReader_t *ctx, char *filename)
 {
     char         errbuf[1024];
 
-    if (!realpath(filename, offlinePcapFilename)) {
+    if (!realpath(filename, ctx->filename)) {
         LOG("ERROR - pcap open failed - Couldn't realpath file: '%s' with %d", filename, errno);
         return 1;
     }
 
-    if (config.pcapSkip && moloch_db_file_exists(offlinePcapFilename, NULL)) {
+    if (config.pcapSkip && moloch_db_file_exists(ctx->filename, NULL)) {
         if (config.debug)
             LOG("Skipping %s", filename);
         return 1;
     }
 
-    if (config.pcapReprocess && !moloch_db_file_exists(offlinePcapFilename, NULL)) {
+    if (config.pcapReprocess && !moloch_db_file_exists(ctx->filename, NULL)) {
         LOG("Can't reprocess %s", filename);
         return 1;
     }
 
     errbuf[0] = 0;
     LOG ("Processing %s", filename);
-    pktsToRead = config.pktsToRead;
-    pcap = pcap_open_offline(filename, errbuf);
+    ctx->pktsToRead = config.pktsToRead;
 
-    if (!pcap) {
+    if (useMmap) {
+        ctx->mfile = reader_libpcapfile_mmap_open(ctx->filename);
+        if (!ctx->mfile)
+            return 1;
+        reader_libpcapfile_opened(ctx);
+        return 0;
+    }
+
+    ctx->pcap = pcap_open_offline(filename, errbuf);
+
+    if (!ctx->pcap) {
         LOG("Couldn't process '%s' error '%s'", filename, errbuf);
         return 1;
     }
 
-    reader_libpcapfile_opened();
+    reader_libpcapfile_opened(ctx);
     return 0;
 }
 /******************************************************************************/
-LOCAL int reader_libpcapfile_next()
+LOCAL int reader_libpcapfile_next(MolochFileReader_t *ctx)
 {
     gchar       *fullfilename;
 
-    pcap = 0;
+    ctx->pcap = 0;
+    ctx->mfile = 0;
 
     if (config.pcapReadFiles) {
         static int pcapFilePos = 0;
@@ -225,8 +584,8 @@ LOCAL int reader_libpcapfile_next()
         }
         pcapFilePos++;
 
-        if (reader_libpcapfile_process(fullfilename)) {
-            return reader_libpcapfile_next();
+        if (reader_libpcapfile_process(ctx, fullfilename)) {
+            return reader_libpcapfile_next(ctx);
         }
 
         return 1;
@@ -250,20 +609,20 @@ filesDone:
             pcapFileListsPos++;
             if (!file) {
                 LOG("ERROR - Couldn't open %s", config.pcapFileLists[pcapFileListsPos - 1]);
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next(ctx);
             }
         }
 
         if (feof(file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next(ctx);
         }
 
         if (!fgets(line, sizeof(line), file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next(ctx);
         }
 
         int lineLen = strlen(line);
@@ -273,10 +632,10 @@ filesDone:
 
         g_strstrip(line);
         if (!line[0] || line[0] == '#')
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next(ctx);
 
-        if (reader_libpcapfile_process(line)) {
-            return reader_libpcapfile_next();
+        if (reader_libpcapfile_process(ctx, line)) {
+            return reader_libpcapfile_next(ctx);
         }
 
         return 1;
@@ -330,7 +689,7 @@ fileListsDone:
                     continue;
                 pcapBase[pcapGDirLevel+1] = fullfilename;
                 pcapGDirLevel++;
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next(ctx);
             }
 
             if (!g_regex_match(config.offlineRegex, filename, 0, NULL)) {
@@ -338,7 +697,7 @@ fileListsDone:
                 continue;
             }
 
-            if (reader_libpcapfile_process(fullfilename)) {
+            if (reader_libpcapfile_process(ctx, fullfilename)) {
                 g_free(fullfilename);
                 continue;
             }
@@ -352,11 +711,11 @@ fileListsDone:
         if (pcapGDirLevel > 0) {
             g_free(pcapBase[pcapGDirLevel]);
             pcapGDirLevel--;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next(ctx);
         } else {
             pcapDirPos++;
             pcapGDirLevel = -1;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next(ctx);
         }
 
     }
@@ -368,7 +727,7 @@ dirsDone:
         fullfilename = string->str;
         MOLOCH_TYPE_FREE(MolochString_t, string);
 
-        if (reader_libpcapfile_process(fullfilename)) {
+        if (reader_libpcapfile_process(ctx, fullfilename)) {
             g_free(fullfilename);
             continue;
         }
@@ -384,7 +743,7 @@ LOCAL gboolean reader_libpcapfile_monitor_gfunc (gpointer UNUSED(user_data))
     if (DLL_COUNT(s_, &monitorQ) == 0)
         return TRUE;
 
-    if (reader_libpcapfile_next()) {
+    if (reader_libpcapfile_next(&fileReaders[0])) {
         return FALSE;
     }
 
@@ -394,13 +753,19 @@ LOCAL gboolean reader_libpcapfile_monitor_gfunc (gpointer UNUSED(user_data))
 LOCAL int reader_libpcapfile_stats(MolochReaderStats_t *stats)
 {
     struct pcap_stat ps;
-    if (!pcap) {
+    if (useMmap || numReaderThreads > 0) {
+        stats->dropped = 0;
+        stats->total = totalFilePackets;
+        return 0;
+    }
+
+    if (!fileReaders[0].pcap) {
         stats->dropped = 0;
         stats->total = 0;
         return 1;
     }
 
-    int rc = pcap_stats (pcap, &ps);
+    int rc = pcap_stats (fileReaders[0].pcap, &ps);
     if (rc)
         return rc;
     stats->dropped = ps.ps_drop;
@@ -408,8 +773,9 @@ LOCAL int reader_libpcapfile_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+LOCAL void reader_libpcapfile_pcap_cb(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
 {
+    MolochFileReader_t *ctx = (MolochFileReader_t *)user;
     MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
 
     if (unlikely(h->caplen != h->len)) {
@@ -425,12 +791,15 @@ LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pk
 
     packet->pkt           = (u_char *)bytes;
     packet->ts            = h->ts;
-    packet->readerFilePos = ftell(offlineFile) - 16 - h->len;
-    packet->readerPos     = readerPos;
-    moloch_packet_batch(&batch, packet);
+    packet->readerFilePos = ftell(ctx->offlineFile) - 16 - h->len;
+    packet->readerPos     = ctx->readerPos;
+    ctx->packets++;
+    ctx->bytes += h->caplen;
+    moloch_packet_batch(&ctx->batch, packet);
 }
 /******************************************************************************/
-LOCAL gboolean reader_libpcapfile_read()
+/* Should readers wait before reading more */
+LOCAL gboolean reader_libpcapfile_paused()
 {
     // pause reading if too many waiting disk operations
     if (moloch_writer_queue_length() > 10) {
@@ -438,7 +807,7 @@ LOCAL gboolean reader_libpcapfile_read()
     }
 
     // pause reading if too many waiting ES operations
-    if (moloch_http_queue_length(esServer) > 50) {
+    if (moloch_http_is_backlogged(esServer)) {
         return TRUE;
     }
 
@@ -447,31 +816,87 @@ LOCAL gboolean reader_libpcapfile_read()
         return TRUE;
     }
 
+    return FALSE;
+}
+/******************************************************************************/
+/* Read the next chunk of packets, <= 0 when the file is done */
+LOCAL int reader_libpcapfile_dispatch(MolochFileReader_t *ctx)
+{
+    uint64_t packets = ctx->packets;
     int r;
-    if (pktsToRead > 0) {
-        r = pcap_dispatch(pcap, MIN(pktsToRead, 5000), reader_libpcapfile_pcap_cb, NULL);
+
+    if (ctx->mfile) {
+        r = reader_libpcapfile_mmap_dispatch(ctx, ctx->mfile, ctx->pktsToRead > 0 ? MIN(ctx->pktsToRead, 5000) : 5000);
+
+        if (r > 0 && ctx->pktsToRead > 0) {
+            ctx->pktsToRead -= ctx->packets - packets;
+            if (ctx->pktsToRead == 0)
+                r = 0;
+        }
+    } else if (ctx->pktsToRead > 0) {
+        r = pcap_dispatch(ctx->pcap, MIN(ctx->pktsToRead, 5000), reader_libpcapfile_pcap_cb, (u_char *)ctx);
 
         if (r > 0)
-            pktsToRead -= r;
+            ctx->pktsToRead -= r;
 
-        if (pktsToRead == 0)
+        if (ctx->pktsToRead == 0)
             r = 0;
     } else {
-        r = pcap_dispatch(pcap, 5000, reader_libpcapfile_pcap_cb, NULL);
+        r = pcap_dispatch(ctx->pcap, 5000, reader_libpcapfile_pcap_cb, (u_char *)ctx);
     }
-    moloch_packet_batch_flush(&batch);
+    moloch_packet_batch_flush(&ctx->batch);
+    MOLOCH_THREAD_INCR_NUM(totalFilePackets, ctx->packets - packets);
+
+    return r;
+}
+/******************************************************************************/
+/* Done with the current file, r is the last dispatch result */
+LOCAL void reader_libpcapfile_close(MolochFileReader_t *ctx, int r)
+{
+    if (config.pcapDelete && r == 0) {
+        if (config.debug)
+            LOG("Deleting %s", ctx->filename);
+        int rc = unlink(ctx->filename);
+        if (rc != 0)
+            LOG("Failed to delete file %s %s (%d)", ctx->filename, strerror(errno), errno);
+    }
+
+    if (ctx->mfile)
+        moloch_packet_block_release(&ctx->mfile->block);
+    else
+        pcap_close(ctx->pcap);
+    ctx->mfile = 0;
+    ctx->pcap = 0;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double secs = (now.tv_sec - ctx->startTime.tv_sec) + (now.tv_usec - ctx->startTime.tv_usec)/1000000.0;
+    if (secs < 0.001)
+        secs = 0.001;
+    LOG("Finished %s %" PRIu64 " packets %" PRIu64 " bytes in %.1fs, %.0f packets/s %.1f Mbps",
+        ctx->filename, ctx->packets, ctx->bytes, secs, ctx->packets/secs, ctx->bytes*8/secs/1000000.0);
+
+    if (numReaderThreads > 0) {
+        MOLOCH_LOCK(files);
+        linktypeUsers--;
+        MOLOCH_COND_BROADCAST(files);
+        MOLOCH_UNLOCK(files);
+    }
+}
+/******************************************************************************/
+LOCAL gboolean reader_libpcapfile_read(gpointer ctxV)
+{
+    MolochFileReader_t *ctx = ctxV;
+
+    if (reader_libpcapfile_paused())
+        return TRUE;
+
+    int r = reader_libpcapfile_dispatch(ctx);
 
     // Some kind of failure, move to the next file or quit
     if (r <= 0) {
-        if (config.pcapDelete && r == 0) {
-            if (config.debug)
-                LOG("Deleting %s", offlinePcapFilename);
-            int rc = unlink(offlinePcapFilename);
-            if (rc != 0)
-                LOG("Failed to delete file %s %s (%d)", offlinePcapFilename, strerror(errno), errno);
-        }
-        pcap_close(pcap);
-        if (reader_libpcapfile_next()) {
+        reader_libpcapfile_close(ctx, r);
+        if (reader_libpcapfile_next(ctx)) {
             return FALSE;
         }
 
@@ -485,39 +910,125 @@ LOCAL gboolean reader_libpcapfile_read()
     return TRUE;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_opened()
+LOCAL int reader_libpcapfile_read_fd(gint UNUSED(fd), GIOCondition UNUSED(cond), gpointer ctxV)
+{
+    return reader_libpcapfile_read(ctxV);
+}
+/******************************************************************************/
+/* offlineReaderThreads - each thread picks the next file under the files
+ * lock and reads it to the end on its own.
+ */
+LOCAL void *reader_libpcapfile_thread(gpointer ctxV)
+{
+    MolochFileReader_t *ctx = ctxV;
+
+    moloch_thread_pin("reader", ctx - fileReaders);
+
+    while (!config.quitting) {
+        MOLOCH_LOCK(files);
+        int opened = reader_libpcapfile_next(ctx);
+        MOLOCH_UNLOCK(files);
+
+        if (!opened) {
+            if (config.pcapMonitor) {
+                usleep(100000);
+                continue;
+            }
+            break;
+        }
+
+        int r;
+        while (1) {
+            if (reader_libpcapfile_paused()) {
+                usleep(1000);
+                continue;
+            }
+            r = reader_libpcapfile_dispatch(ctx);
+            if (r <= 0)
+                break;
+        }
+        reader_libpcapfile_close(ctx, r);
+    }
+
+    if (__sync_sub_and_fetch(&runningReaderThreads, 1) == 0 && !config.quitting)
+        moloch_quit();
+
+    return NULL;
+}
+/******************************************************************************/
+/* Called with the files lock held when using reader threads */
+LOCAL void reader_libpcapfile_opened(MolochFileReader_t *ctx)
 {
     int dlt_to_linktype(int dlt);
+    int linktype_to_dlt(int linktype);
+    int snaplen;
 
     if (config.flushBetween)
         moloch_session_flush();
 
-    moloch_packet_set_linksnap(dlt_to_linktype(pcap_datalink(pcap)) | pcap_datalink_ext(pcap), pcap_snapshot(pcap));
+    if (ctx->mfile) {
+        ctx->linktype = ctx->mfile->linktype;
+        snaplen = ctx->mfile->snaplen;
+    } else {
+        ctx->linktype = dlt_to_linktype(pcap_datalink(ctx->pcap)) | pcap_datalink_ext(ctx->pcap);
+        snaplen = pcap_snapshot(ctx->pcap);
+        ctx->offlineFile = pcap_file(ctx->pcap);
+    }
 
-    offlineFile = pcap_file(pcap);
+    if (numReaderThreads > 0) {
+        // Packets are decoded using the global link type, so wait for readers of other link types to finish
+        while (linktypeUsers > 0 && pcapFileHeader.linktype != ctx->linktype)
+            MOLOCH_COND_WAIT(files);
+        if (linktypeUsers == 0 || pcapFileHeader.linktype != ctx->linktype)
+            moloch_packet_set_linksnap(ctx->linktype, snaplen);
+        linktypeUsers++;
+    } else {
+        moloch_packet_set_linksnap(ctx->linktype, snaplen);
+    }
 
-    if (config.bpf && pcapFileHeader.linktype != 239) {
+    if (ctx->mfile) {
+        if (ctx->bpf.bf_insns)
+            pcap_freecode(&ctx->bpf);
+
+        // No filtering of NFLOG files, same as the libpcap path
+        if (config.bpf && ctx->linktype != 239) {
+            // The file header has a LINKTYPE_ value, pcap_open_dead wants the DLT_ value
+            pcap_t *dpcap = pcap_open_dead(linktype_to_dlt(ctx->linktype & 0xffff), snaplen ? snaplen : 0xffff);
+
+            if (pcap_compile(dpcap, &ctx->bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+                LOGEXIT("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(dpcap));
+            }
+            pcap_close(dpcap);
+        }
+    } else if (config.bpf && ctx->linktype != 239) {
         struct bpf_program   bpf;
 
-        if (pcap_compile(pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
-            LOGEXIT("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
+        if (pcap_compile(ctx->pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            LOGEXIT("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(ctx->pcap));
         }
 
-	if (pcap_setfilter(pcap, &bpf) == -1) {
-            LOGEXIT("ERROR - Couldn't set filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
+	if (pcap_setfilter(ctx->pcap, &bpf) == -1) {
+            LOGEXIT("ERROR - Couldn't set filter: '%s' with %s", config.bpf, pcap_geterr(ctx->pcap));
         }
     }
 
     readerPos++;
+    ctx->readerPos = readerPos;
     if (readerFileName[readerPos])
         moloch_free_later(readerFileName[readerPos], g_free);
-    readerFileName[readerPos] = g_strdup(offlinePcapFilename);
+    readerFileName[readerPos] = g_strdup(ctx->filename);
 
-    int fd = pcap_fileno(pcap);
-    if (fd == -1) {
-        g_timeout_add(0, reader_libpcapfile_read, NULL);
-    } else {
-        moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
+    ctx->packets = 0;
+    ctx->bytes = 0;
+    gettimeofday(&ctx->startTime, NULL);
+
+    if (numReaderThreads == 0) {
+        int fd = ctx->mfile ? -1 : pcap_fileno(ctx->pcap);
+        if (fd == -1) {
+            g_timeout_add(0, reader_libpcapfile_read, ctx);
+        } else {
+            moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read_fd, ctx);
+        }
     }
 
     if (filenameOpsNum > 0) {
@@ -532,12 +1043,12 @@ LOCAL void reader_libpcapfile_opened()
         int i;
         for (i = 0; i < filenameOpsNum; i++) {
             GMatchInfo *match_info = 0;
-            g_regex_match(filenameOps[i].regex, offlinePcapFilename, 0, &match_info);
+            g_regex_match(filenameOps[i].regex, ctx->filename, 0, &match_info);
             if (g_match_info_matches(match_info)) {
                 GError *error = 0;
                 char *expand = g_match_info_expand_references(match_info, filenameOps[i].expand, &error);
                 if (error) {
-                    LOG("Error expanding '%s' with '%s' - %s", offlinePcapFilename, filenameOps[i].expand, error->message);
+                    LOG("Error expanding '%s' with '%s' - %s", ctx->filename, filenameOps[i].expand, error->message);
                     g_error_free(error);
                 }
                 if (expand) {
@@ -603,8 +1114,19 @@ LOCAL void reader_libpcapfile_start() {
     g_strfreev(filenameOpsStr);
 
     // Now actually start
-    reader_libpcapfile_next();
-    if (!pcap) {
+    if (numReaderThreads > 0) {
+        runningReaderThreads = numReaderThreads;
+        for (i = 0; i < numReaderThreads; i++) {
+            char name[100];
+            if (i > 0)
+                moloch_packet_batch_init(&fileReaders[i].batch);
+            snprintf(name, sizeof(name), "moloch-file%d", i);
+            g_thread_new(name, &reader_libpcapfile_thread, &fileReaders[i]);
+        }
+        return;
+    }
+
+    if (!reader_libpcapfile_next(&fileReaders[0])) {
         if (config.pcapMonitor) {
             g_timeout_add(100, reader_libpcapfile_monitor_gfunc, 0);
         } else {
@@ -613,14 +1135,22 @@ LOCAL void reader_libpcapfile_start() {
     }
 }
 /******************************************************************************/
-void reader_libpcapfile_init(char *UNUSED(name))
+void reader_libpcapfile_init(char *name)
 {
+    useMmap = strcmp(name, "mmap-file") == 0;
+
     moloch_reader_start         = reader_libpcapfile_start;
     moloch_reader_stats         = reader_libpcapfile_stats;
 
     if (config.pcapMonitor)
         reader_libpcapfile_init_monitor();
 
+    numReaderThreads = moloch_config_int(NULL, "offlineReaderThreads", 0, 0, MOLOCH_MAX_FILE_READERS);
+    if (numReaderThreads > 0 && config.flushBetween) {
+        LOG("WARNING - flushBetween reads one file at a time, ignoring offlineReaderThreads");
+        numReaderThreads = 0;
+    }
+
     DLL_INIT(s_, &monitorQ);
-    moloch_packet_batch_init(&batch);
+    moloch_packet_batch_init(&fileReaders[0].batch);
 }
@@ -71,6 +71,8 @@ LOCAL void *reader_libpcap_thread(gpointer posv)
     if (config.debug)
         LOG("THREAD %p", (gpointer)pthread_self());
 
+    moloch_thread_pin("reader", pos);
+
     MolochPacketBatch_t   batch;
     moloch_packet_batch_init(&batch);
     batch.readerPos = pos;
@@ -51,18 +51,27 @@ void reader_tpacketv3_init(char *UNUSED(name))
 
 #else
 
+#define MOLOCH_TPACKETV3_MAX_THREADS 6
+
 typedef struct {
     int                  fd;
     struct tpacket_req3  req;
     uint8_t             *map;
     struct iovec        *rd;
+    MolochPacketBlock_t *blocks;
     int                  nextPos;
+    int                  interface;  // index into config.interface
+    int                  member;     // fanout group member number
     MOLOCH_LOCK_EXTERN(lock);
 } MolochTPacketV3_t;
 
-LOCAL MolochTPacketV3_t infos[MAX_INTERFACES];
+LOCAL MolochTPacketV3_t *infos;
+LOCAL int numInfos;
 
 LOCAL int numThreads;
+LOCAL int zeroCopy;
+LOCAL int fanoutType = -1;
+LOCAL int readerThreadNum;
 
 extern MolochPcapFileHdr_t   pcapFileHeader;
 LOCAL struct bpf_program     bpf;
@@ -78,7 +87,7 @@ int reader_tpacketv3_stats(MolochReaderStats_t *stats)
     int i;
 
     struct tpacket_stats_v3 tpstats;
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+    for (i = 0; i < numInfos; i++) {
         socklen_t len = sizeof(tpstats);
         getsockopt(infos[i].fd, SOL_PACKET, PACKET_STATISTICS, &tpstats, &len);
 
@@ -90,6 +99,15 @@ int reader_tpacketv3_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
+/* Last packet pointing into the block is done, give it back to the kernel */
+LOCAL void reader_tpacketv3_block_free(MolochPacketBlock_t *block)
+{
+    struct tpacket_block_desc *tbd = block->uw;
+
+    __sync_synchronize();
+    tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+}
+/******************************************************************************/
 LOCAL void *reader_tpacketv3_thread(gpointer infov)
 {
     long info = (long)infov;
@@ -101,15 +119,31 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
     pfd.events = POLLIN | POLLERR;
     pfd.revents = 0;
 
+    // Several threads can share an info, so number them as they start
+    moloch_thread_pin("reader", __sync_fetch_and_add(&readerThreadNum, 1));
+
     MolochPacketBatch_t batch;
     moloch_packet_batch_init(&batch);
 
+    // The kernel hash is symmetric and the same on every interface, so each
+    // fanout member can own its own slice of the packet threads
+    if (fanoutType == PACKET_FANOUT_HASH)
+        moloch_packet_batch_affinity(&batch, infos[info].member, numThreads);
+
+    const int readerPos = infos[info].interface;
+
     while (!config.quitting) {
         if (pos == -1) {
-            MOLOCH_LOCK(infos[info].lock);
-            pos = infos[info].nextPos;
-            infos[info].nextPos = (infos[info].nextPos + 1) % infos[info].req.tp_block_nr;
-            MOLOCH_UNLOCK(infos[info].lock);
+            if (fanoutType == -1) {
+                MOLOCH_LOCK(infos[info].lock);
+                pos = infos[info].nextPos;
+                infos[info].nextPos = (infos[info].nextPos + 1) % infos[info].req.tp_block_nr;
+                MOLOCH_UNLOCK(infos[info].lock);
+            } else {
+                // Only this thread reads this ring
+                pos = infos[info].nextPos;
+                infos[info].nextPos = (infos[info].nextPos + 1) % infos[info].req.tp_block_nr;
+            }
         }
 
         struct tpacket_block_desc *tbd = infos[info].rd[pos].iov_base;
@@ -129,6 +163,13 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
             LOG("Stats pos:%d info:%ld status:%x waiting:%d total cnt:%d total waiting:%d", pos, info, tbd->hdr.bh1.block_status, tbd->hdr.bh1.num_pkts, cnt, waiting);
         }
 
+        // Packets from the last time around are still using the block
+        MolochPacketBlock_t *block = &infos[info].blocks[pos];
+        if (zeroCopy && block->refs > 0) {
+            usleep(100);
+            continue;
+        }
+
         // Wait until the block is owned by moloch
         if ((tbd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
             poll(&pfd, 1, -1);
@@ -140,6 +181,10 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         th = (struct tpacket3_hdr *) ((uint8_t *) tbd + tbd->hdr.bh1.offset_to_first_pkt);
         uint16_t p;
 
+        // A reference for each packet plus one for us while we are still adding packets
+        if (zeroCopy)
+            block->refs = tbd->hdr.bh1.num_pkts + 1;
+
         for (p = 0; p < tbd->hdr.bh1.num_pkts; p++) {
             if (unlikely(th->tp_snaplen != th->tp_len)) {
                 LOGEXIT("ERROR - Moloch requires full packet captures caplen: %d pktlen: %d\n"
@@ -152,7 +197,9 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
             packet->pktlen        = th->tp_len;
             packet->ts.tv_sec     = th->tp_sec;
             packet->ts.tv_usec    = th->tp_nsec/1000;
-            packet->readerPos     = info;
+            packet->readerPos     = readerPos;
+            if (zeroCopy)
+                packet->block     = block;
 
             if ((th->tp_status & TP_STATUS_VLAN_VALID) && th->hv1.tp_vlan_tci) {
                 packet->vlan = th->hv1.tp_vlan_tci & 0xfff;
@@ -164,7 +211,10 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         }
         moloch_packet_batch_flush(&batch);
 
-        tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        if (zeroCopy)
+            moloch_packet_block_release(block);
+        else
+            tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
         pos = -1;
     }
     return NULL;
@@ -173,9 +223,14 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
 void reader_tpacketv3_start() {
     int i, t;
     char name[100];
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
-        for (t = 0; t < numThreads; t++) {
-            snprintf(name, sizeof(name), "moloch-af3%d-%d", i, t);
+    for (i = 0; i < numInfos; i++) {
+        if (fanoutType == -1) {
+            for (t = 0; t < numThreads; t++) {
+                snprintf(name, sizeof(name), "moloch-af3%d-%d", infos[i].interface, t);
+                g_thread_new(name, &reader_tpacketv3_thread, (gpointer)(long)i);
+            }
+        } else {
+            snprintf(name, sizeof(name), "moloch-af3%d-%d", infos[i].interface, infos[i].member);
             g_thread_new(name, &reader_tpacketv3_thread, (gpointer)(long)i);
         }
     }
@@ -184,16 +239,108 @@ void reader_tpacketv3_start() {
 void reader_tpacketv3_stop()
 {
     int i;
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+    for (i = 0; i < numInfos; i++) {
         close(infos[i].fd);
     }
 }
 /******************************************************************************/
+/* Create the socket and ring for one infos entry, if fanoutGroup is set join
+ * that fanout group once bound.
+ */
+LOCAL void reader_tpacketv3_open(int info, int blocksize, int blocknr, int fanoutGroup)
+{
+    const int i = infos[info].interface;
+
+    MOLOCH_LOCK_INIT(infos[info].lock);
+
+    int ifindex = if_nametoindex(config.interface[i]);
+
+    infos[info].fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+    int version = TPACKET_V3;
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        LOGEXIT("Error setting TPACKET_V3, might need a newer kernel: %s", strerror(errno));
+
+
+    memset(&infos[info].req, 0, sizeof(infos[info].req));
+    infos[info].req.tp_block_size = blocksize;
+    infos[info].req.tp_block_nr = blocknr;
+    infos[info].req.tp_frame_size = config.snapLen;
+    infos[info].req.tp_frame_nr = (blocksize * infos[info].req.tp_block_nr) / infos[info].req.tp_frame_size;
+    infos[info].req.tp_retire_blk_tov = 60;
+    infos[info].req.tp_feature_req_word = 0;
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_RX_RING, &infos[info].req, sizeof(infos[info].req)) < 0)
+        LOGEXIT("Error setting PACKET_RX_RING: %s", strerror(errno));
+
+    struct packet_mreq      mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type    = PACKET_MR_PROMISC;
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        LOGEXIT("Error setting PROMISC: %s", strerror(errno));
+
+    if (config.bpf) {
+        struct sock_fprog       fcode;
+        fcode.len = bpf.bf_len;
+        fcode.filter = (struct sock_filter *)bpf.bf_insns;
+        if (setsockopt(infos[info].fd, SOL_SOCKET, SO_ATTACH_FILTER, &fcode, sizeof(fcode)) < 0)
+            LOGEXIT("Error setting SO_ATTACH_FILTER: %s", strerror(errno));
+    }
+
+    infos[info].map = mmap64(NULL, infos[info].req.tp_block_size * infos[info].req.tp_block_nr,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, infos[info].fd, 0);
+    if (unlikely(infos[info].map == MAP_FAILED)) {
+        LOGEXIT("ERROR - MMap64 failure in reader_tpacketv3_init, %d: %s",errno, strerror(errno));
+    }
+    infos[info].rd = malloc(infos[info].req.tp_block_nr * sizeof(struct iovec));
+
+    uint16_t j;
+    for (j = 0; j < infos[info].req.tp_block_nr; j++) {
+        infos[info].rd[j].iov_base = infos[info].map + (j * infos[info].req.tp_block_size);
+        infos[info].rd[j].iov_len = infos[info].req.tp_block_size;
+    }
+
+    infos[info].blocks = calloc(infos[info].req.tp_block_nr, sizeof(MolochPacketBlock_t));
+    for (j = 0; j < infos[info].req.tp_block_nr; j++) {
+        infos[info].blocks[j].freeFunc = reader_tpacketv3_block_free;
+        infos[info].blocks[j].uw       = infos[info].rd[j].iov_base;
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = PF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex = ifindex;
+
+    if (bind(infos[info].fd, (struct sockaddr *) &ll, sizeof(ll)) < 0)
+        LOGEXIT("Error binding %s: %s", config.interface[i], strerror(errno));
+
+    if (fanoutType != -1) {
+        // Defrag so all fragments of a packet hash to the same member
+        int fanoutArg = (fanoutGroup & 0xffff) | ((fanoutType | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_FANOUT, &fanoutArg, sizeof(fanoutArg)) < 0)
+            LOGEXIT("Error setting PACKET_FANOUT on %s, might need a newer kernel: %s", config.interface[i], strerror(errno));
+    }
+}
+/******************************************************************************/
 void reader_tpacketv3_init(char *UNUSED(name))
 {
-    int i;
+    int i, t;
     int blocksize = moloch_config_int(NULL, "tpacketv3BlockSize", 1<<21, 1<<16, 1U<<31);
-    numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, 6);
+    numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, MOLOCH_TPACKETV3_MAX_THREADS);
+    zeroCopy = moloch_config_boolean(NULL, "tpacketv3ZeroCopy", FALSE);
+
+    char *fanout = moloch_config_str(NULL, "tpacketv3Fanout", "none");
+    if (strcmp(fanout, "hash") == 0) {
+        fanoutType = PACKET_FANOUT_HASH;
+    } else if (strcmp(fanout, "qm") == 0) {
+        fanoutType = PACKET_FANOUT_QM;
+    } else if (strcmp(fanout, "none") != 0) {
+        LOGEXIT("tpacketv3Fanout must be none, hash or qm, not '%s'", fanout);
+    }
+    g_free(fanout);
+
+    int fanoutGroup = moloch_config_int(NULL, "tpacketv3FanoutGroup", getpid() & 0xffff, 0, 0xffff);
 
     if (blocksize % getpagesize() != 0) {
         LOGEXIT("block size %d not divisible by pagesize %d", blocksize, getpagesize());
@@ -214,70 +361,36 @@ void reader_tpacketv3_init(char *UNUSED(name))
     }
 
 
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
-        MOLOCH_LOCK_INIT(infos[i].lock);
-
-        int ifindex = if_nametoindex(config.interface[i]);
-
-        infos[i].fd = socket(AF_PACKET, SOCK_RAW, 0);
-
-        int version = TPACKET_V3;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
-            LOGEXIT("Error setting TPACKET_V3, might need a newer kernel: %s", strerror(errno));
-
-
-        memset(&infos[i].req, 0, sizeof(infos[i].req));
-        infos[i].req.tp_block_size = blocksize;
-        infos[i].req.tp_block_nr = numThreads*64;
-        infos[i].req.tp_frame_size = config.snapLen;
-        infos[i].req.tp_frame_nr = (blocksize * infos[i].req.tp_block_nr) / infos[i].req.tp_frame_size;
-        infos[i].req.tp_retire_blk_tov = 60;
-        infos[i].req.tp_feature_req_word = 0;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_RX_RING, &infos[i].req, sizeof(infos[i].req)) < 0)
-            LOGEXIT("Error setting PACKET_RX_RING: %s", strerror(errno));
-
-        struct packet_mreq      mreq;
-        memset(&mreq, 0, sizeof(mreq));
-        mreq.mr_ifindex = ifindex;
-        mreq.mr_type    = PACKET_MR_PROMISC;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
-            LOGEXIT("Error setting PROMISC: %s", strerror(errno));
-
-        if (config.bpf) {
-            struct sock_fprog       fcode;
-            fcode.len = bpf.bf_len;
-            fcode.filter = (struct sock_filter *)bpf.bf_insns;
-            if (setsockopt(infos[i].fd, SOL_SOCKET, SO_ATTACH_FILTER, &fcode, sizeof(fcode)) < 0)
-                LOGEXIT("Error setting SO_ATTACH_FILTER: %s", strerror(errno));
-        }
-
-        infos[i].map = mmap64(NULL, infos[i].req.tp_block_size * infos[i].req.tp_block_nr,
-                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, infos[i].fd, 0);
-        if (unlikely(infos[i].map == MAP_FAILED)) {
-            LOGEXIT("ERROR - MMap64 failure in reader_tpacketv3_init, %d: %s",errno, strerror(errno));
-        }
-        infos[i].rd = malloc(infos[i].req.tp_block_nr * sizeof(struct iovec));
+    int numInterfaces;
+    for (numInterfaces = 0; numInterfaces < MAX_INTERFACES && config.interface[numInterfaces]; numInterfaces++);
+    infos = calloc(numInterfaces * numThreads, sizeof(MolochTPacketV3_t));
 
-        uint16_t j;
-        for (j = 0; j < infos[i].req.tp_block_nr; j++) {
-            infos[i].rd[j].iov_base = infos[i].map + (j * infos[i].req.tp_block_size);
-            infos[i].rd[j].iov_len = infos[i].req.tp_block_size;
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        if (fanoutType == -1) {
+            // All threads share one ring per interface
+            infos[numInfos].interface = i;
+            infos[numInfos].member = 0;
+            reader_tpacketv3_open(numInfos, blocksize, numThreads*64, 0);
+            numInfos++;
+        } else {
+            // Each thread gets its own ring, the kernel splits the interface between them
+            for (t = 0; t < numThreads; t++) {
+                infos[numInfos].interface = i;
+                infos[numInfos].member = t;
+                reader_tpacketv3_open(numInfos, blocksize, 64, fanoutGroup + i);
+                numInfos++;
+            }
         }
-
-        struct sockaddr_ll ll;
-        memset(&ll, 0, sizeof(ll));
-        ll.sll_family = PF_PACKET;
-        ll.sll_protocol = htons(ETH_P_ALL);
-        ll.sll_ifindex = ifindex;
-
-        if (bind(infos[i].fd, (struct sockaddr *) &ll, sizeof(ll)) < 0)
-            LOGEXIT("Error binding %s: %s", config.interface[i], strerror(errno));
     }
 
     if (i == MAX_INTERFACES) {
         LOGEXIT("Only support up to %d interfaces", MAX_INTERFACES);
     }
 
+    if (fanoutType != -1) {
+        LOG("tpacketv3 using %s fanout groups starting at %d, %d sockets per interface", fanoutType == PACKET_FANOUT_HASH ? "hash" : "qm", fanoutGroup, numThreads);
+    }
+
     moloch_reader_start         = reader_tpacketv3_start;
     moloch_reader_stop          = reader_tpacketv3_stop;
     moloch_reader_stats         = reader_tpacketv3_stats;
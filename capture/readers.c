@@ -25,6 +25,7 @@ LOCAL  MolochStringHashStd_t readersHash;
 void reader_libpcapfile_init(char*);
 void reader_libpcap_init(char*);
 void reader_tpacketv3_init(char*);
+void reader_afxdp_init(char*);
 
 MolochReaderStart  moloch_reader_start;
 MolochReaderStats  moloch_reader_stats;
@@ -57,8 +58,10 @@ void moloch_readers_init()
 {
     HASH_INIT(s_, readersHash, moloch_string_hash, moloch_string_cmp);
     moloch_readers_add("libpcap-file", reader_libpcapfile_init);
+    moloch_readers_add("mmap-file", reader_libpcapfile_init);
     moloch_readers_add("libpcap", reader_libpcap_init);
     moloch_readers_add("tpacketv3", reader_tpacketv3_init);
+    moloch_readers_add("afxdp", reader_afxdp_init);
 
     char **interfaceOps;
     interfaceOps = moloch_config_raw_str_list(NULL, "interfaceOps", "");
@@ -684,6 +684,10 @@ LOCAL void moloch_rules_check_rule_fields(MolochSession_t *session, MolochRule_t
             case MOLOCH_FIELD_EXSPECIAL_PACKETS_DST:
                 good = g_hash_table_contains(rule->hash[p], (gpointer)(long)session->packets[1]);
                 break;
+            default:
+                // No fields have been set on the session yet
+                if (session->maxFields == 0)
+                    good = 0;
             }
             continue;
         }
@@ -17,24 +17,35 @@
 
 #include <arpa/inet.h>
 #include "moloch.h"
+#include "sessiontable.h"
 
 /******************************************************************************/
 extern MolochConfig_t        config;
 extern uint32_t              pluginsCbs;
-extern time_t                lastPacketSecs[MOLOCH_MAX_PACKET_THREADS];
+extern MolochPacketThreadState_t *packetThreadState;
 
 /******************************************************************************/
 
 LOCAL int                   protocolField;
 
-LOCAL MolochSessionHead_t   closingQ[MOLOCH_MAX_PACKET_THREADS];
-MolochSessionHead_t         tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
+LOCAL MolochSessionHead_t  *closingQ;
 
-typedef HASHP_VAR(h_, MolochSessionHash_t, MolochSessionHead_t);
+// All per packet thread state is sized from config.packetThreads at init
+LOCAL MolochSessionHead_t (*sessionsQ)[SESSION_MAX];
 
-LOCAL MolochSessionHead_t   sessionsQ[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
-LOCAL MolochSessionHash_t   sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
-LOCAL int needSave[MOLOCH_MAX_PACKET_THREADS];
+// Sessions are filed by the second they expire, expiries past the end of the
+// wheel wrap around and are just refiled when reached
+#define MOLOCH_WHEEL_SIZE 1024
+LOCAL MolochSessionHead_t (*wheel)[MOLOCH_WHEEL_SIZE];
+LOCAL MolochSessionHash_t (*sessions)[SESSION_MAX];
+
+typedef struct {
+    uint32_t              wheelPos;
+    uint32_t              timeoutLag;
+    int                   needSave;
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochSessionThreadState_t;
+
+LOCAL MolochSessionThreadState_t *threadState;
 
 typedef struct molochsescmd {
     struct molochsescmd *cmd_next, *cmd_prev;
@@ -50,9 +61,22 @@ typedef struct {
     struct molochsescmd *cmd_next, *cmd_prev;
     int                  cmd_count;
     MOLOCH_LOCK_EXTERN(lock);
-} MolochSesCmdHead_t;
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochSesCmdHead_t;
+
+LOCAL MolochSesCmdHead_t  *sessionCmds;
+LOCAL MolochSession_t     *fakeSessions;
+
+// Per thread slab of sessions, only the owning packet thread allocs.  Detached
+// sessions are freed by the db serializer threads onto returnList.
+#define MOLOCH_SESSION_SLAB 256
+typedef struct {
+    MolochSession_t     *freeList;       // Linked by q_next
+    MolochSession_t     *returnList;     // Linked by q_next, uses lock
+    uint64_t             memory;         // Slabs plus field arrays in use
+    MOLOCH_LOCK_EXTERN(lock);
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochSessionSlab_t;
 
-LOCAL MolochSesCmdHead_t   sessionCmds[MOLOCH_MAX_PACKET_THREADS];
+LOCAL MolochSessionSlab_t *sessionSlab;
 
 
 /******************************************************************************/
@@ -115,13 +139,52 @@ char *moloch_session_id_string (char *sessionId, char *buf)
     return moloch_sprint_hex_string(buf, (uint8_t *)sessionId, sessionId[0]);
 }
 #ifndef NEWHASH
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+/******************************************************************************/
+/* Session ids are always 13 (ip4) or 37 (ip6) bytes, so use fixed width
+ * crc32c instructions when the cpu has them.
+ */
+__attribute__((target("sse4.2")))
+LOCAL uint32_t moloch_session_hash_crc32c(const uint8_t *key)
+{
+    uint64_t h = 0xffffffff;
+    uint64_t w;
+    uint32_t v;
+
+    if (key[0] == 13) {
+        memcpy(&w, key + 1, 8);
+        h = _mm_crc32_u64(h, w);
+        memcpy(&v, key + 9, 4);
+        h = _mm_crc32_u32(h, v);
+    } else {
+        memcpy(&w, key + 1, 8);
+        h = _mm_crc32_u64(h, w);
+        memcpy(&w, key + 9, 8);
+        h = _mm_crc32_u64(h, w);
+        memcpy(&w, key + 17, 8);
+        h = _mm_crc32_u64(h, w);
+        memcpy(&w, key + 25, 8);
+        h = _mm_crc32_u64(h, w);
+        memcpy(&v, key + 33, 4);
+        h = _mm_crc32_u32(h, v);
+    }
+    return h;
+}
+#define MOLOCH_HAVE_CRC32C 1
+#endif
 /******************************************************************************/
 /* https://github.com/aappleby/smhasher/blob/master/src/MurmurHash1.cpp
- * MurmurHash based
+ * MurmurHash based, used when crc32c isn't available
  */
 SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
 uint32_t moloch_session_hash(const void *key)
 {
+#ifdef MOLOCH_HAVE_CRC32C
+    if (likely(__builtin_cpu_supports("sse4.2")))
+        return moloch_session_hash_crc32c(key);
+#endif
+
     uint32_t *p = (uint32_t *)key;
     uint32_t *end = (uint32_t *)((unsigned char *)key + ((unsigned char *)key)[0] - 4);
     uint32_t h = ((uint8_t *)key)[((uint8_t *)key)[0]-1];  // There is one extra byte at the end
@@ -157,9 +220,35 @@ uint32_t moloch_session_hash(const void *key)
 /******************************************************************************/
 int moloch_session_cmp(const void *keyv, const void *elementv)
 {
-    MolochSession_t *session = (MolochSession_t *)elementv;
+    return moloch_session_id_cmp(keyv, (MolochSession_t *)elementv);
+}
+/******************************************************************************/
+LOCAL int sessionTableDebug;
+
+/******************************************************************************/
+/* Prefetch for the packet thread burst loop.  Stage 0 pulls in the first probe
+ * group's ctrl bytes and slot pointers, stage 1 is issued a few packets later
+ * once those have arrived and pulls in the sessions whose tag matches.
+ */
+void moloch_session_prefetch(int ses, int thread, uint32_t hash, int stage)
+{
+    const MolochSessionTable_t *table = &sessions[thread][ses].cur;
+    const MolochSessionGroup_t *group = &table->groups[MOLOCH_SES_FIRST(table, hash)];
 
-    return memcmp(keyv, session->sessionId, MIN(((uint8_t *)keyv)[0], session->sessionId[0])) == 0;
+    if (stage == 0) {
+        __builtin_prefetch((const char *)group, 0, 3);
+        __builtin_prefetch((const char *)group + 64, 0, 3);
+        __builtin_prefetch((const char *)group + sizeof(MolochSessionGroup_t) - 1, 0, 3);
+        return;
+    }
+
+    uint32_t mask = moloch_session_group_match(group->ctrl, MOLOCH_SES_TAG(hash));
+    while (mask) {
+        const char *session = (char *)group->slots[__builtin_ctz(mask)];
+        __builtin_prefetch(session, 1, 3);
+        __builtin_prefetch(session + 64, 1, 3);
+        mask &= mask - 1;
+    }
 }
 /******************************************************************************/
 void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd sesCmd, gpointer uw1, gpointer uw2, MolochCmd_func func)
@@ -178,8 +267,6 @@ void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd sesCmd, gpoin
 /******************************************************************************/
 void moloch_session_add_cmd_thread(int thread, gpointer uw1, gpointer uw2, MolochCmd_func func)
 {
-    static MolochSession_t fakeSessions[MOLOCH_MAX_PACKET_THREADS];
-
     fakeSessions[thread].thread = thread;
 
     MolochSesCmd_t *cmd = MOLOCH_TYPE_ALLOC(MolochSesCmd_t);
@@ -213,6 +300,37 @@ void moloch_session_add_tag(MolochSession_t *session, const char *tag) {
     moloch_field_string_add(config.tagsStringField, session, tag, -1, TRUE);
 }
 /******************************************************************************/
+/* The earliest second the session needs looking at.  lastPacket changes
+ * aren't refiled, the session is just refiled when its old time is reached.
+ */
+LOCAL inline uint32_t moloch_session_expire_time(MolochSession_t *session)
+{
+    if (session->closingQ)
+        return session->saveTime;
+
+    uint32_t expire = session->lastPacket.tv_sec + config.timeouts[session->ses];
+    if (session->tcp_next && session->saveTime < expire)
+        expire = session->saveTime;
+    return expire;
+}
+/******************************************************************************/
+LOCAL void moloch_session_wheel_add(MolochSession_t *session, uint32_t expire)
+{
+    const int thread = session->thread;
+
+    if (expire < threadState[thread].wheelPos)
+        expire = threadState[thread].wheelPos;
+
+    session->wheelSlot = expire & (MOLOCH_WHEEL_SIZE - 1);
+    DLL_PUSH_TAIL(w_, &wheel[thread][session->wheelSlot], session);
+}
+/******************************************************************************/
+LOCAL void moloch_session_wheel_remove(MolochSession_t *session)
+{
+    if (session->w_next)
+        DLL_REMOVE(w_, &wheel[session->thread][session->wheelSlot], session);
+}
+/******************************************************************************/
 void moloch_session_mark_for_close (MolochSession_t *session, int ses)
 {
     session->closingQ = 1;
@@ -220,23 +338,112 @@ void moloch_session_mark_for_close (MolochSession_t *session, int ses)
     DLL_REMOVE(q_, &sessionsQ[session->thread][ses], session);
     DLL_PUSH_TAIL(q_, &closingQ[session->thread], session);
 
+    moloch_session_wheel_remove(session);
+    moloch_session_wheel_add(session, session->saveTime);
+
     if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
+        DLL_REMOVE(tcp_, &packetThreadState[session->thread].tcpWriteQ, session);
     }
 }
 /******************************************************************************/
-LOCAL void moloch_session_free (MolochSession_t *session)
+LOCAL MolochSession_t *moloch_session_alloc(int thread)
 {
-    if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
+#ifdef MOLOCH_USE_MALLOC
+    return MOLOCH_TYPE_ALLOC0(MolochSession_t);
+#else
+    MolochSessionSlab_t *slab = &sessionSlab[thread];
+
+    if (unlikely(!slab->freeList && slab->returnList)) {
+        MOLOCH_LOCK(slab->lock);
+        slab->freeList = slab->returnList;
+        slab->returnList = 0;
+        MOLOCH_UNLOCK(slab->lock);
     }
 
-    g_array_free(session->filePosArray, TRUE);
-    g_array_free(session->fileLenArray, TRUE);
-    g_array_free(session->fileNumArray, TRUE);
+    if (unlikely(!slab->freeList)) {
+        MolochSession_t *sessions;
+        if (posix_memalign((void **)&sessions, 64, sizeof(MolochSession_t) * MOLOCH_SESSION_SLAB))
+            LOGEXIT("ERROR - Couldn't allocate session slab");
+        MOLOCH_THREAD_INCR_NUM(slab->memory, sizeof(MolochSession_t) * MOLOCH_SESSION_SLAB);
 
-    if (session->rootId && session->rootId != (void *)1L)
-        g_free(session->rootId);
+        int i;
+        for (i = MOLOCH_SESSION_SLAB - 1; i >= 0; i--) {
+            sessions[i].q_next = slab->freeList;
+            slab->freeList = &sessions[i];
+        }
+    }
+
+    MolochSession_t *session = slab->freeList;
+    slab->freeList = session->q_next;
+    memset(session, 0, sizeof(MolochSession_t));
+    return session;
+#endif
+}
+/******************************************************************************/
+LOCAL void moloch_session_dealloc(MolochSession_t *session)
+{
+#ifdef MOLOCH_USE_MALLOC
+    MOLOCH_TYPE_FREE(MolochSession_t, session);
+#else
+    MolochSessionSlab_t *slab = &sessionSlab[session->thread];
+
+    // Slabs are kept for reuse by the thread and never given back
+    if (session->detached) {
+        MOLOCH_LOCK(slab->lock);
+        session->q_next = slab->returnList;
+        slab->returnList = session;
+        MOLOCH_UNLOCK(slab->lock);
+    } else {
+        session->q_next = slab->freeList;
+        slab->freeList = session;
+    }
+#endif
+}
+/******************************************************************************/
+/* Field arrays are only allocated when the first field is set, until then
+ * sessions point at a shared empty array with maxFields of 0.
+ */
+LOCAL MolochField_t *sessionNoFields[MOLOCH_FIELDS_MAX];
+
+gboolean moloch_session_alloc_fields(MolochSession_t *session, int pos)
+{
+    if (session->maxFields == 0) {
+        session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*config.maxField);
+        session->maxFields = config.maxField;
+        MOLOCH_THREAD_INCR_NUM(sessionSlab[session->thread].memory, sizeof(MolochField_t *)*session->maxFields);
+    }
+    return pos < session->maxFields;
+}
+/******************************************************************************/
+void moloch_session_free_fields(MolochSession_t *session)
+{
+    if (session->maxFields == 0)
+        return;
+
+    __sync_sub_and_fetch(&sessionSlab[session->thread].memory, sizeof(MolochField_t *)*session->maxFields);
+    MOLOCH_SIZE_FREE(fields, session->fields);
+    session->fields = sessionNoFields;
+    session->maxFields = 0;
+}
+/******************************************************************************/
+/* Approximate memory used per session for the stats */
+uint64_t moloch_session_memory()
+{
+    uint64_t memory = 0;
+    int      t;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        memory += sessionSlab[t].memory;
+    }
+    return memory;
+}
+/******************************************************************************/
+/* Free everything that has to be freed on the packet thread */
+LOCAL void moloch_session_free_thread_data (MolochSession_t *session)
+{
+    if (session->tcp_next) {
+        DLL_REMOVE(tcp_, &packetThreadState[session->thread].tcpWriteQ, session);
+    }
 
     if (session->parserInfo) {
         int i;
@@ -245,23 +452,57 @@ LOCAL void moloch_session_free (MolochSession_t *session)
                 session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
         }
         free(session->parserInfo);
+        session->parserInfo = 0;
+        session->parserNum = 0;
     }
 
-    if (session->pluginData)
+    if (session->pluginData) {
         MOLOCH_SIZE_FREE(pluginData, session->pluginData);
-    moloch_field_free(session);
+        session->pluginData = 0;
+    }
 
     moloch_packet_tcp_free(session);
+}
+/******************************************************************************/
+/* What is left after detaching is only used for creating the db record, so
+ * the session can then be saved and freed by any thread.
+ */
+void moloch_session_detach (MolochSession_t *session)
+{
+    moloch_session_free_thread_data(session);
+    session->detached = 1;
+}
+/******************************************************************************/
+void moloch_session_free (MolochSession_t *session)
+{
+    if (!session->detached)
+        moloch_session_free_thread_data(session);
 
-    MOLOCH_TYPE_FREE(MolochSession_t, session);
+    if (session->steered)
+        moloch_packet_steer_release(session);
+
+    if (session->filePosArray) {
+        g_array_free(session->filePosArray, TRUE);
+        g_array_free(session->fileLenArray, TRUE);
+        g_array_free(session->fileNumArray, TRUE);
+    }
+
+    if (session->rootId && session->rootId != (void *)1L)
+        g_free(session->rootId);
+
+    moloch_field_free(session);
+
+    moloch_session_dealloc(session);
 }
 /******************************************************************************/
 LOCAL void moloch_session_save(MolochSession_t *session)
 {
-    if (session->h_next) {
-        HASH_REMOVE(h_, sessions[session->thread][session->ses], session);
+    if (session->inHash) {
+        moloch_session_hash_remove(&sessions[session->thread][session->ses], session);
     }
 
+    moloch_session_wheel_remove(session);
+
     if (session->closingQ) {
         DLL_REMOVE(q_, &closingQ[session->thread], session);
     } else
@@ -269,6 +510,9 @@ LOCAL void moloch_session_save(MolochSession_t *session)
 
     moloch_packet_tcp_free(session);
 
+    if (session->shunted)
+        moloch_packet_shunt_fold(session, TRUE);
+
     if (session->parserInfo) {
         int i;
         for (i = 0; i < session->parserNum; i++) {
@@ -283,21 +527,23 @@ LOCAL void moloch_session_save(MolochSession_t *session)
     moloch_rules_run_before_save(session, 1);
 
     if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
+        DLL_REMOVE(tcp_, &packetThreadState[session->thread].tcpWriteQ, session);
     }
 
     if (session->outstandingQueries > 0) {
         session->needSave = 1;
-        needSave[session->thread]++;
+        threadState[session->thread].needSave++;
         return;
     }
 
     moloch_db_save_session(session, TRUE);
-    moloch_session_free(session);
 }
 /******************************************************************************/
 void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
 {
+    if (session->shunted)
+        moloch_packet_shunt_fold(session, FALSE);
+
     if (session->parserInfo) {
         int i;
         for (i = 0; i < session->parserNum; i++) {
@@ -316,13 +562,15 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
     }
 
     moloch_db_save_session(session, FALSE);
-    g_array_set_size(session->filePosArray, 0);
-    g_array_set_size(session->fileLenArray, 0);
-    g_array_set_size(session->fileNumArray, 0);
+    if (session->filePosArray) {
+        g_array_set_size(session->filePosArray, 0);
+        g_array_set_size(session->fileLenArray, 0);
+        g_array_set_size(session->fileNumArray, 0);
+    }
     session->lastFileNum = 0;
 
     if (session->tcp_next) {
-        DLL_MOVE_TAIL(tcp_, &tcpWriteQ[session->thread], session);
+        DLL_MOVE_TAIL(tcp_, &packetThreadState[session->thread].tcpWriteQ, session);
     }
 
     // Don't change change saveTime if already closing
@@ -344,10 +592,9 @@ gboolean moloch_session_decr_outstanding(MolochSession_t *session)
 {
     session->outstandingQueries--;
     if (session->needSave && session->outstandingQueries == 0) {
-        needSave[session->thread]--;
+        threadState[session->thread].needSave--;
         session->needSave = 0; /* Stop endless loop if plugins add tags */
         moloch_db_save_session(session, TRUE);
-        moloch_session_free(session);
         return FALSE;
     }
 
@@ -381,7 +628,7 @@ int moloch_session_need_save_outstanding()
     int count = 0;
     int t;
     for (t = 0; t < config.packetThreads; t++) {
-        count += needSave[t];
+        count += threadState[t].needSave;
     }
     return count;
 }
@@ -393,12 +640,27 @@ MolochSession_t *moloch_session_find(int ses, char *sessionId)
     uint32_t hash = moloch_session_hash(sessionId);
     int      thread = hash % config.packetThreads;
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
-    return session;
+    session = moloch_session_hash_find(&sessions[thread][ses], hash, sessionId);
+    if (session)
+        return session;
+
+    // Readers with packet thread affinity may have placed it on another thread
+    for (thread = 0; thread < config.packetThreads; thread++) {
+        session = moloch_session_hash_find(&sessions[thread][ses], hash, sessionId);
+        if (session)
+            return session;
+    }
+    return NULL;
+}
+/******************************************************************************/
+// Only looks in one packet thread's table, only that thread should call
+MolochSession_t *moloch_session_find_thread(int ses, int thread, uint32_t hash, char *sessionId)
+{
+    return moloch_session_hash_find(&sessions[thread][ses], hash, sessionId);
 }
 /******************************************************************************/
 // Should only be used by packet, lots of side effects
-MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, char *sessionId, int *isNew)
+MolochSession_t *moloch_session_find_or_create(int ses, int thread, uint32_t hash, char *sessionId, int *isNew)
 {
     MolochSession_t *session;
 
@@ -406,9 +668,7 @@ MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, char *ses
         hash = moloch_session_hash(sessionId);
     }
 
-    int      thread = hash % config.packetThreads;
-
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session = moloch_session_hash_find(&sessions[thread][ses], hash, sessionId);
 
     if (session) {
         if (!session->closingQ) {
@@ -419,26 +679,27 @@ MolochSession_t *moloch_session_find_or_create(int ses, uint32_t hash, char *ses
     }
     *isNew = 1;
 
-    session = MOLOCH_TYPE_ALLOC0(MolochSession_t);
+    session = moloch_session_alloc(thread);
     session->ses = ses;
 
     memcpy(session->sessionId, sessionId, sessionId[0]);
 
-    HASH_ADD_HASH(h_, sessions[thread][ses], hash, sessionId, session);
-    DLL_PUSH_TAIL(q_, &sessionsQ[thread][ses], session);
-
-    if (HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash) > 10) {
-        char buf[100];
-        LOG("Large number of chains: %s %u %u %d %u", moloch_session_id_string(sessionId, buf), hash, hash % sessions[thread][ses].size, thread, HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash));
+    session->h_hash = hash;
+    if (moloch_session_hash_add(&sessions[thread][ses], session) && sessionTableDebug) {
+        LOG("Grew session table %d/%d to %u slots with %u sessions", thread, ses,
+            (sessions[thread][ses].cur.groupMask + 1) * MOLOCH_SES_GROUP, moloch_session_hash_count(&sessions[thread][ses]));
     }
+    DLL_PUSH_TAIL(q_, &sessionsQ[thread][ses], session);
 
-    session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 100);
-    session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 100);
-    session->fileNumArray = g_array_new(FALSE, FALSE, 4);
-    session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*config.maxField);
-    session->maxFields = config.maxField;
+    // File arrays and fields are allocated on first use
+    session->fields = sessionNoFields;
     session->thread = thread;
-    DLL_INIT(td_, &session->tcpData);
+
+    // Packet sets lastPacket and saveTime after, so guess and let it refile
+    uint32_t expire = config.timeouts[ses];
+    if (ses == SESSION_TCP && config.tcpSaveTimeout < expire)
+        expire = config.tcpSaveTimeout;
+    moloch_session_wheel_add(session, packetThreadState[thread].lastPacketSecs + expire);
     if (config.numPlugins > 0)
         session->pluginData = MOLOCH_SIZE_ALLOC0(pluginData, sizeof(void *)*config.numPlugins);
 
@@ -451,13 +712,70 @@ uint32_t moloch_session_monitoring()
     int      t, s;
 
     for (t = 0; t < config.packetThreads; t++) {
-        for (s = 0; s < config.packetThreads; s++) {
-            count += HASH_COUNT(h_, sessions[t][s]);
+        for (s = 0; s < SESSION_MAX; s++) {
+            count += moloch_session_hash_count(&sessions[t][s]);
         }
     }
     return count;
 }
 /******************************************************************************/
+/* Handle every wheel slot up to the current packet time, each session is
+ * either expired, mid saved, or refiled at its new expire time.
+ */
+LOCAL void moloch_session_wheel_run(int thread)
+{
+    const uint32_t now = packetThreadState[thread].lastPacketSecs;
+
+    if (threadState[thread].wheelPos == 0)
+        threadState[thread].wheelPos = now;
+
+    // Big jump in packet time, only need to look at each slot once
+    uint32_t end = now;
+    if (end > threadState[thread].wheelPos + MOLOCH_WHEEL_SIZE)
+        end = threadState[thread].wheelPos + MOLOCH_WHEEL_SIZE;
+
+    uint32_t lag = 0;
+    for (; threadState[thread].wheelPos < end; threadState[thread].wheelPos++) {
+        MolochSessionHead_t *slot = &wheel[thread][threadState[thread].wheelPos & (MOLOCH_WHEEL_SIZE - 1)];
+        MolochSession_t     *session;
+
+        // Refiled sessions can land back in this slot, so only look at what is there now
+        int num = DLL_COUNT(w_, slot);
+        while (num-- > 0 && DLL_POP_HEAD(w_, slot, session)) {
+            if (session->closingQ) {
+                if (session->saveTime < now) {
+                    lag = MAX(lag, now - session->saveTime);
+                    moloch_session_save(session);
+                    continue;
+                }
+            } else {
+                if (session->shunted)
+                    moloch_packet_shunt_last(session);
+
+                uint32_t idle = session->lastPacket.tv_sec + config.timeouts[session->ses];
+                if (idle < now) {
+                    lag = MAX(lag, now - idle);
+                    moloch_session_save(session);
+                    continue;
+                }
+
+                // TCP Sessions Open Long Time
+                if (session->tcp_next && session->saveTime < now) {
+                    moloch_session_mid_save(session, now);
+                }
+            }
+            if (!session->w_next)
+                moloch_session_wheel_add(session, moloch_session_expire_time(session));
+        }
+    }
+
+    if (threadState[thread].wheelPos < now)
+        threadState[thread].wheelPos = now;
+
+    if (lag)
+        threadState[thread].timeoutLag = lag;
+}
+/******************************************************************************/
 void moloch_session_process_commands(int thread)
 {
     // Commands
@@ -480,41 +798,13 @@ void moloch_session_process_commands(int thread)
         MOLOCH_TYPE_FREE(MolochSesCmd_t, cmd);
     }
 
-    // Closing Q
-    for (count = 0; count < 10; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(q_, &closingQ[thread]);
+    moloch_session_wheel_run(thread);
 
-        if (session && session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_save(session);
-        } else {
-            break;
-        }
-    }
-
-    // Sessions Idle Long Time
+    // Too many sessions, drop the least recently used
     int ses;
     for (ses = 0; ses < SESSION_MAX; ses++) {
-        for (count = 0; count < 10; count++) {
-            MolochSession_t *session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]);
-
-            if (session && (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses] ||
-                            ((uint64_t)session->lastPacket.tv_sec + config.timeouts[ses] < (uint64_t)lastPacketSecs[thread]))) {
-
-                moloch_session_save(session);
-            } else {
-                break;
-            }
-        }
-    }
-
-    // TCP Sessions Open Long Time
-    for (count = 0; count < 50; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(tcp_, &tcpWriteQ[thread]);
-
-        if (session && (uint64_t)session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_mid_save(session, lastPacketSecs[thread]);
-        } else {
-            break;
+        while (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses]) {
+            moloch_session_save(DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]));
         }
     }
 }
@@ -531,6 +821,18 @@ int moloch_session_watch_count(int ses)
     return count;
 }
 
+/******************************************************************************/
+/* How many seconds past their timeout the last expired sessions were closed */
+uint32_t moloch_session_timeout_lag()
+{
+    uint32_t lag = 0;
+    int      t;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        lag = MAX(lag, threadState[t].timeoutLag);
+    }
+    return lag;
+}
 /******************************************************************************/
 int moloch_session_idle_seconds(int ses)
 {
@@ -543,7 +845,7 @@ int moloch_session_idle_seconds(int ses)
         if (!session)
             continue;
 
-        tmp = lastPacketSecs[t] - (session->lastPacket.tv_sec + config.timeouts[ses]);
+        tmp = packetThreadState[t].lastPacketSecs - (session->lastPacket.tv_sec + config.timeouts[ses]);
         if (tmp > idle)
             idle = tmp;
     }
@@ -551,47 +853,50 @@ int moloch_session_idle_seconds(int ses)
 }
 
 /******************************************************************************/
-LOCAL uint32_t moloch_get_prime(uint32_t v)
+/* Called by moloch_packet_init before the packet threads start, since they
+ * process session commands right away.
+ */
+void moloch_session_threads_init()
 {
-    static uint32_t primes[] = {10007, 49999, 99991, 199799, 400009, 500009, 732209, 1092757, 1299827, 1500007, 1987411, 2999999, 5000011, 8000009, 11000027, 15485863, 0};
-
-    int p;
-    for (p = 0; primes[p]; p++) {
-        if (primes[p] > v)
-            return primes[p];
-    }
-    return primes[p-1];
-}
-/******************************************************************************/
-void moloch_session_init()
-{
-    protocolField = moloch_field_define("general", "termfield",
-        "protocols", "Protocols", "protocol",
-        "Protocols set for session",
-        MOLOCH_FIELD_TYPE_STR_HASH,  MOLOCH_FIELD_FLAG_CNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
-        (char *)NULL);
-
-    int primes[SESSION_MAX];
-    int s;
-    for (s = 0; s < SESSION_MAX; s++) {
-        primes[s] = moloch_get_prime(config.maxStreams[s]);
-    }
+    closingQ     = moloch_thread_array_alloc(sizeof(MolochSessionHead_t));
+    sessionsQ    = moloch_thread_array_alloc(sizeof(*sessionsQ));
+    wheel        = moloch_thread_array_alloc(sizeof(*wheel));
+    sessions     = moloch_thread_array_alloc(sizeof(*sessions));
+    threadState  = moloch_thread_array_alloc(sizeof(MolochSessionThreadState_t));
+    sessionCmds  = moloch_thread_array_alloc(sizeof(MolochSesCmdHead_t));
+    sessionSlab  = moloch_thread_array_alloc(sizeof(MolochSessionSlab_t));
+    fakeSessions = moloch_thread_array_alloc(sizeof(MolochSession_t));
 
     if (config.debug)
-        LOG("session hash size %d %d %d %d %d", primes[SESSION_ICMP], primes[SESSION_UDP], primes[SESSION_TCP], primes[SESSION_SCTP], primes[SESSION_ESP]);
+        LOG("session hash size %d %d %d %d %d", config.maxStreams[SESSION_ICMP], config.maxStreams[SESSION_UDP], config.maxStreams[SESSION_TCP], config.maxStreams[SESSION_SCTP], config.maxStreams[SESSION_ESP]);
 
-    int t;
+    int t, s;
     for (t = 0; t < config.packetThreads; t++) {
         for (s = 0; s < SESSION_MAX; s++) {
-            HASHP_INIT(h_, sessions[t][s], primes[s], moloch_session_hash, moloch_session_cmp);
+            moloch_session_hash_init(&sessions[t][s], config.maxStreams[s], moloch_thread_node("packet", t));
             DLL_INIT(q_, &sessionsQ[t][s]);
         }
 
-        DLL_INIT(tcp_, &tcpWriteQ[t]);
+        for (s = 0; s < MOLOCH_WHEEL_SIZE; s++) {
+            DLL_INIT(w_, &wheel[t][s]);
+        }
+        MOLOCH_LOCK_INIT(sessionSlab[t].lock);
+
         DLL_INIT(q_, &closingQ[t]);
         DLL_INIT(cmd_, &sessionCmds[t]);
         MOLOCH_LOCK_INIT(sessionCmds[t].lock);
     }
+}
+/******************************************************************************/
+void moloch_session_init()
+{
+    protocolField = moloch_field_define("general", "termfield",
+        "protocols", "Protocols", "protocol",
+        "Protocols set for session",
+        MOLOCH_FIELD_TYPE_STR_HASH,  MOLOCH_FIELD_FLAG_CNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
+        (char *)NULL);
+
+    sessionTableDebug = moloch_config_boolean(NULL, "sessionTableDebug", FALSE);
 
     moloch_add_can_quit(moloch_session_cmd_outstanding, "session commands outstanding");
     moloch_add_can_quit(moloch_session_close_outstanding, "session close outstanding");
@@ -604,9 +909,19 @@ LOCAL void moloch_session_flush_close(MolochSession_t *session, gpointer UNUSED(
     int i;
 
     for (i = 0; i < SESSION_MAX; i++) {
-        HASH_FORALL_POP_HEAD(h_, sessions[thread][i], session,
-            moloch_session_save(session);
-        );
+        MolochSessionHash_t *hash = &sessions[thread][i];
+        if (hash->old.groups)
+            moloch_session_hash_migrate(hash, hash->old.groupMask + 1);
+
+        uint32_t g, slot;
+        for (g = 0; g <= hash->cur.groupMask; g++) {
+            MolochSessionGroup_t *group = &hash->cur.groups[g];
+            for (slot = 0; slot < MOLOCH_SES_GROUP; slot++) {
+                if (!MOLOCH_SES_FULL(group->ctrl[slot]))
+                    continue;
+                moloch_session_save(group->slots[slot]);
+            }
+        }
     }
 }
 /******************************************************************************/
@@ -0,0 +1,289 @@
+/* sessiontable.h  -- Open addressing session table
+ *
+ * Only used by session.c, kept separate so it can be benchmarked on its own.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SESSIONTABLE_HEADER
+#define _SESSIONTABLE_HEADER
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MOLOCH_SES_GROUP        16
+
+typedef struct {
+    uint8_t               ctrl[MOLOCH_SES_GROUP];
+    MolochSession_t      *slots[MOLOCH_SES_GROUP];
+} MolochSessionGroup_t;
+
+typedef struct {
+    MolochSessionGroup_t *groups;
+    uint32_t              groupMask;
+    uint32_t              shift;
+    uint32_t              count;     // Live sessions
+    uint32_t              used;      // Live and deleted slots
+    int                   node;      // numa node to allocate from, -1 any
+    uint8_t               gen;       // Sessions in this table have h_gen set to this
+} MolochSessionTable_t;
+
+typedef struct {
+    MolochSessionTable_t  cur;
+    MolochSessionTable_t  old;       // Being migrated into cur when groups set
+    uint32_t              migratePos;
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochSessionHash_t;
+
+/******************************************************************************/
+/* Open addressing session table.  Slots are grouped by 16, each group has 1
+ * byte control values for its slots (7 bits of the hash, empty, or deleted)
+ * right before the slot pointers, so a probe is one spot in memory plus the
+ * session it is going to compare.  Sessions remember their slot so removing
+ * doesn't probe.  Empty is 0 so a new table needs no clearing and its pages
+ * are only faulted in as they are used.  When the table gets full a new one
+ * is allocated and the old one is migrated a few groups at a time on each
+ * insert, lookups check both while that is happening.
+ */
+#define MOLOCH_SES_EMPTY        0x00
+#define MOLOCH_SES_DELETED      0x01
+#define MOLOCH_SES_FULL(c)      ((c) & 0x80)
+#define MOLOCH_SES_MIGRATE      2
+
+/******************************************************************************/
+LOCAL void moloch_session_table_alloc(MolochSessionTable_t *table, uint32_t size)
+{
+    uint32_t slots = MOLOCH_SES_GROUP;
+    while (slots < size)
+        slots <<= 1;
+
+    // mmap memory is already zero, which is empty
+    const uint32_t groups = slots/MOLOCH_SES_GROUP;
+    table->groups = moloch_numa_alloc(groups * sizeof(MolochSessionGroup_t), table->node);
+    table->groupMask = groups - 1;
+    table->shift = 32 - __builtin_ctz(slots/MOLOCH_SES_GROUP);
+    table->count = 0;
+    table->used = 0;
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_free(MolochSessionTable_t *table)
+{
+    moloch_numa_free(table->groups, (table->groupMask + 1) * sizeof(MolochSessionGroup_t));
+    table->groups = 0;
+}
+/******************************************************************************/
+LOCAL inline int moloch_session_id_cmp(const char *key, const MolochSession_t *session)
+{
+    if (key[0] != session->sessionId[0])
+        return 0;
+
+    // Fixed sizes so the compiler can inline the compares
+    if (key[0] == 13)
+        return memcmp(key + 1, session->sessionId + 1, 12) == 0;
+    return memcmp(key + 1, session->sessionId + 1, 36) == 0;
+}
+/******************************************************************************/
+// The low bits of the hash pick the packet thread, so use the high bits for the group
+#define MOLOCH_SES_TAG(h)               (0x80 | (((h) >> 24) & 0x7f))
+#define MOLOCH_SES_FIRST(table, h)      ((table)->shift == 32 ? 0 : ((h) * 0x9e3779b1U) >> (table)->shift)
+
+/******************************************************************************/
+/* Return bit mask of slots in group with ctrl equal to c */
+LOCAL inline uint32_t moloch_session_group_match(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    int      i;
+    for (i = 0; i < MOLOCH_SES_GROUP; i++) {
+        if (ctrl[i] == c)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+/******************************************************************************/
+/* Return bit mask of slots in group that are empty or deleted */
+LOCAL inline uint32_t moloch_session_group_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    // Only full slots have the high bit set
+    return ~_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl)) & 0xffff;
+#else
+    uint32_t mask = 0;
+    int      i;
+    for (i = 0; i < MOLOCH_SES_GROUP; i++) {
+        if (!MOLOCH_SES_FULL(ctrl[i]))
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+/******************************************************************************/
+LOCAL MolochSession_t *moloch_session_table_lookup(MolochSessionTable_t *table, uint32_t hash, const char *sessionId)
+{
+    const uint8_t tag = MOLOCH_SES_TAG(hash);
+    uint32_t      g = MOLOCH_SES_FIRST(table, hash);
+    uint32_t      i;
+
+    for (i = 1; i <= table->groupMask + 1; i++) {
+        const MolochSessionGroup_t *group = &table->groups[g];
+        uint32_t                    mask = moloch_session_group_match(group->ctrl, tag);
+
+        while (mask) {
+            MolochSession_t *session = group->slots[__builtin_ctz(mask)];
+            if (session->h_hash == hash && moloch_session_id_cmp(sessionId, session))
+                return session;
+            mask &= mask - 1;
+        }
+
+        if (moloch_session_group_match(group->ctrl, MOLOCH_SES_EMPTY))
+            return NULL;
+
+        g = (g + i) & table->groupMask;
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Caller makes sure there is room */
+LOCAL void moloch_session_table_insert(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    uint32_t g = MOLOCH_SES_FIRST(table, session->h_hash);
+    uint32_t i;
+
+    for (i = 1; ; i++) {
+        MolochSessionGroup_t *group = &table->groups[g];
+        const uint32_t        mask = moloch_session_group_free(group->ctrl);
+
+        if (mask) {
+            const uint32_t slot = __builtin_ctz(mask);
+            if (group->ctrl[slot] == MOLOCH_SES_EMPTY)
+                table->used++;
+            group->ctrl[slot] = MOLOCH_SES_TAG(session->h_hash);
+            group->slots[slot] = session;
+            session->h_slot = g * MOLOCH_SES_GROUP + slot;
+            session->h_gen = table->gen;
+            table->count++;
+            return;
+        }
+
+        g = (g + i) & table->groupMask;
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_remove(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    MolochSessionGroup_t *group = &table->groups[session->h_slot / MOLOCH_SES_GROUP];
+    const uint32_t        slot = session->h_slot % MOLOCH_SES_GROUP;
+
+    // If the group still has an empty slot no probe went past it
+    if (moloch_session_group_match(group->ctrl, MOLOCH_SES_EMPTY)) {
+        group->ctrl[slot] = MOLOCH_SES_EMPTY;
+        table->used--;
+    } else {
+        group->ctrl[slot] = MOLOCH_SES_DELETED;
+    }
+    table->count--;
+}
+/******************************************************************************/
+/* Move up to num groups from the old table into the current one */
+LOCAL void moloch_session_hash_migrate(MolochSessionHash_t *hash, uint32_t num)
+{
+    MolochSessionTable_t *old = &hash->old;
+
+    for (; num > 0 && hash->migratePos <= old->groupMask; num--, hash->migratePos++) {
+        MolochSessionGroup_t *group = &old->groups[hash->migratePos];
+        int                   i;
+
+        for (i = 0; i < MOLOCH_SES_GROUP; i++) {
+            if (!MOLOCH_SES_FULL(group->ctrl[i]))
+                continue;
+            moloch_session_table_insert(&hash->cur, group->slots[i]);
+            group->ctrl[i] = MOLOCH_SES_DELETED;
+            old->count--;
+        }
+    }
+
+    if (hash->migratePos > old->groupMask) {
+        moloch_session_table_free(old);
+    }
+}
+/******************************************************************************/
+/* Start a new table when the current one is 7/8 used.  If it is mostly
+ * deleted slots keep the same size, otherwise double.  Returns 1 if it did.
+ */
+LOCAL int moloch_session_hash_grow(MolochSessionHash_t *hash)
+{
+    MolochSessionTable_t *cur = &hash->cur;
+    uint32_t slots = (cur->groupMask + 1) * MOLOCH_SES_GROUP;
+
+    if (likely(cur->used + 1 <= slots - slots/8))
+        return 0;
+
+    // Migrating a few groups per insert finishes well before this, but only
+    // ever have two tables
+    if (hash->old.groups)
+        moloch_session_hash_migrate(hash, hash->old.groupMask + 1);
+
+    if (cur->count >= slots/2)
+        slots *= 2;
+
+    hash->old = *cur;
+    hash->migratePos = 0;
+    moloch_session_table_alloc(cur, slots);
+    cur->gen = !hash->old.gen;
+    return 1;
+}
+/******************************************************************************/
+LOCAL void moloch_session_hash_init(MolochSessionHash_t *hash, uint32_t size, int node)
+{
+    memset(hash, 0, sizeof(*hash));
+    hash->cur.node = node;
+    moloch_session_table_alloc(&hash->cur, size + size/7);
+}
+/******************************************************************************/
+LOCAL inline MolochSession_t *moloch_session_hash_find(MolochSessionHash_t *hash, uint32_t h, const char *sessionId)
+{
+    MolochSession_t *session = moloch_session_table_lookup(&hash->cur, h, sessionId);
+    if (!session && unlikely(hash->old.groups != 0))
+        session = moloch_session_table_lookup(&hash->old, h, sessionId);
+    return session;
+}
+/******************************************************************************/
+/* Returns 1 if the table started growing */
+LOCAL int moloch_session_hash_add(MolochSessionHash_t *hash, MolochSession_t *session)
+{
+    const int grew = moloch_session_hash_grow(hash);
+    moloch_session_table_insert(&hash->cur, session);
+    session->inHash = 1;
+
+    if (unlikely(hash->old.groups != 0))
+        moloch_session_hash_migrate(hash, MOLOCH_SES_MIGRATE);
+
+    return grew;
+}
+/******************************************************************************/
+LOCAL void moloch_session_hash_remove(MolochSessionHash_t *hash, MolochSession_t *session)
+{
+    moloch_session_table_remove(session->h_gen == hash->cur.gen ? &hash->cur : &hash->old, session);
+    session->inHash = 0;
+}
+/******************************************************************************/
+LOCAL inline uint32_t moloch_session_hash_count(MolochSessionHash_t *hash)
+{
+    return hash->cur.count + (hash->old.groups ? hash->old.count : 0);
+}
+
+#endif
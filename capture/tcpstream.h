@@ -0,0 +1,302 @@
+/* tcpstream.h  -- Per direction tcp reassembly buffers
+ *
+ * Only used by packet.c, kept separate so it can be benchmarked on its own.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TCPSTREAM_HEADER
+#define _TCPSTREAM_HEADER
+
+/* Out of order tcp data is copied into a per direction ring buffer so the
+ * packet can be freed right away, byte seq lives at buf[seq & (bufSize - 1)].
+ * Each direction keeps the disjoint [start, end) seq ranges it holds in a
+ * treap, along with the ack of the segment each range came from, so the two
+ * directions are still handed to the parsers in the order they were sent.
+ * Nodes live in a per direction pool and point at each other by index, 0 is
+ * none.
+ */
+typedef struct {
+    uint32_t              start;
+    uint32_t              end;
+    uint32_t              ack;
+    uint32_t              prio;
+    uint32_t              left;
+    uint32_t              right;     // Next free node when on the free list
+} MolochTcpRange_t;
+
+typedef struct {
+    uint8_t              *buf;
+    MolochTcpRange_t     *ranges;    // Node pool, ranges[0] isn't used
+    uint32_t              bufSize;   // Power of 2
+    uint32_t              root;
+    uint32_t              first;     // Lowest range
+    uint32_t              last;      // Highest range
+    uint32_t              freeList;
+    uint32_t              used;      // Pool nodes ever handed out
+    uint32_t              size;      // Pool nodes allocated
+    uint32_t              num;       // Ranges in the tree
+    uint32_t              prioSeed;
+} MolochTcpDir_t;
+
+#define MOLOCH_SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+
+/* packet.c holds the lowest few waiting segments as packets instead of
+ * copying them, and frees an empty ring once it has grown past KEEP. */
+#define MOLOCH_TCP_HELD      16
+#define MOLOCH_TCP_KEEP      (64 * 1024)
+
+/******************************************************************************/
+/* Everything in a starts before everything in b */
+LOCAL uint32_t moloch_tcp_range_merge(MolochTcpRange_t *r, uint32_t a, uint32_t b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (r[a].prio > r[b].prio) {
+        r[a].right = moloch_tcp_range_merge(r, r[a].right, b);
+        return a;
+    }
+    r[b].left = moloch_tcp_range_merge(r, a, r[b].left);
+    return b;
+}
+/******************************************************************************/
+/* Split t into the ranges that start before seq and the rest */
+LOCAL void moloch_tcp_range_split(MolochTcpRange_t *r, uint32_t t, uint32_t seq, uint32_t *lo, uint32_t *hi)
+{
+    if (!t) {
+        *lo = *hi = 0;
+        return;
+    }
+
+    if (MOLOCH_SEQ_LT(r[t].start, seq)) {
+        *lo = t;
+        moloch_tcp_range_split(r, r[t].right, seq, &r[t].right, hi);
+    } else {
+        *hi = t;
+        moloch_tcp_range_split(r, r[t].left, seq, lo, &r[t].left);
+    }
+}
+/******************************************************************************/
+LOCAL uint32_t moloch_tcp_range_remove_first(MolochTcpRange_t *r, uint32_t t)
+{
+    if (!r[t].left)
+        return r[t].right;
+    r[t].left = moloch_tcp_range_remove_first(r, r[t].left);
+    return t;
+}
+/******************************************************************************/
+/* First range that ends after seq, 0 if none */
+LOCAL inline uint32_t moloch_tcp_dir_after(const MolochTcpDir_t *dir, uint32_t seq)
+{
+    uint32_t t = dir->root, found = 0;
+    while (t) {
+        if (MOLOCH_SEQ_LT(seq, dir->ranges[t].end)) {
+            found = t;
+            t = dir->ranges[t].left;
+        } else {
+            t = dir->ranges[t].right;
+        }
+    }
+    return found;
+}
+/******************************************************************************/
+/* Last range that starts before seq, 0 if none */
+LOCAL inline uint32_t moloch_tcp_dir_before(const MolochTcpDir_t *dir, uint32_t seq)
+{
+    uint32_t t = dir->root, found = 0;
+    while (t) {
+        if (MOLOCH_SEQ_LT(dir->ranges[t].start, seq)) {
+            found = t;
+            t = dir->ranges[t].right;
+        } else {
+            t = dir->ranges[t].left;
+        }
+    }
+    return found;
+}
+/******************************************************************************/
+LOCAL void moloch_tcp_dir_insert(MolochTcpDir_t *dir, uint32_t start, uint32_t end, uint32_t ack)
+{
+    uint32_t n = dir->freeList;
+    if (n) {
+        dir->freeList = dir->ranges[n].right;
+    } else {
+        if (dir->used == dir->size) {
+            dir->size = dir->size ? dir->size * 2 : 8;
+            dir->ranges = realloc(dir->ranges, dir->size * sizeof(MolochTcpRange_t));
+            if (!dir->used)
+                dir->used = 1;
+        }
+        n = dir->used++;
+    }
+
+    MolochTcpRange_t *r = dir->ranges;
+    r[n].start = start;
+    r[n].end = end;
+    r[n].ack = ack;
+    r[n].left = r[n].right = 0;
+    dir->prioSeed = dir->prioSeed * 1664525 + 1013904223;
+    r[n].prio = dir->prioSeed;
+
+    uint32_t lo, hi;
+    moloch_tcp_range_split(r, dir->root, start, &lo, &hi);
+    dir->root = moloch_tcp_range_merge(r, moloch_tcp_range_merge(r, lo, n), hi);
+
+    if (!dir->num || MOLOCH_SEQ_LT(start, r[dir->first].start))
+        dir->first = n;
+    if (!dir->num || MOLOCH_SEQ_LT(r[dir->last].start, start))
+        dir->last = n;
+    dir->num++;
+}
+/******************************************************************************/
+/* Remove the first range, the caller copies it out first if it needs it */
+LOCAL void moloch_tcp_dir_pop(MolochTcpDir_t *dir)
+{
+    MolochTcpRange_t *r = dir->ranges;
+    const uint32_t    n = dir->first;
+
+    dir->root = moloch_tcp_range_remove_first(r, dir->root);
+    r[n].right = dir->freeList;
+    dir->freeList = n;
+    dir->num--;
+
+    uint32_t t = dir->root;
+    while (t && r[t].left)
+        t = r[t].left;
+    dir->first = t;
+    if (!dir->num)
+        dir->last = 0;
+}
+/******************************************************************************/
+/* Drop anything before next, which has already been delivered */
+LOCAL void moloch_tcp_dir_trim(MolochTcpDir_t *dir, uint32_t next)
+{
+    while (dir->num && !MOLOCH_SEQ_LT(next, dir->ranges[dir->first].end))
+        moloch_tcp_dir_pop(dir);
+
+    if (dir->num && MOLOCH_SEQ_LT(dir->ranges[dir->first].start, next))
+        dir->ranges[dir->first].start = next;
+}
+/******************************************************************************/
+LOCAL inline void moloch_tcp_dir_copy(MolochTcpDir_t *dir, uint32_t seq, const uint8_t *data, uint32_t len)
+{
+    const uint32_t pos = seq & (dir->bufSize - 1);
+    const uint32_t n = MIN(len, dir->bufSize - pos);
+
+    memcpy(dir->buf + pos, data, n);
+    if (n < len)
+        memcpy(dir->buf, data + n, len - n);
+}
+/******************************************************************************/
+/* The held data at seq, len is cut short where the ring wraps */
+LOCAL inline const uint8_t *moloch_tcp_dir_data(const MolochTcpDir_t *dir, uint32_t seq, uint32_t *len)
+{
+    const uint32_t pos = seq & (dir->bufSize - 1);
+
+    if (*len > dir->bufSize - pos)
+        *len = dir->bufSize - pos;
+    return dir->buf + pos;
+}
+/******************************************************************************/
+/* Copy the parts of [seq, seq+len) not already held into the ring, which
+ * also has to cover from lo.  Returns 0 if that would span more than maxSpan
+ * bytes or grow *bytes past maxBytes.
+ */
+LOCAL int moloch_tcp_dir_add(MolochTcpDir_t *dir, uint32_t lo, uint32_t seq, uint32_t ack, const uint8_t *data, uint32_t len,
+                             uint32_t maxSpan, uint64_t *bytes, uint64_t maxBytes)
+{
+    const uint32_t end = seq + len;
+
+    // The window the buffer has to cover after this segment is added
+    if (dir->num && MOLOCH_SEQ_LT(dir->ranges[dir->first].start, lo))
+        lo = dir->ranges[dir->first].start;
+    if (MOLOCH_SEQ_LT(seq, lo))
+        lo = seq;
+    uint32_t hi = end;
+    if (dir->num && MOLOCH_SEQ_LT(hi, dir->ranges[dir->last].end))
+        hi = dir->ranges[dir->last].end;
+
+    if (hi - lo > maxSpan)
+        return 0;
+
+    if (hi - lo > dir->bufSize) {
+        uint32_t size = dir->bufSize ? dir->bufSize : 4096;
+        while (size < hi - lo)
+            size <<= 1;
+
+        if (*bytes + size - dir->bufSize > maxBytes)
+            return 0;
+
+        // Move what is held to where it goes in the bigger ring
+        uint8_t *buf = malloc(size);
+        if (dir->num) {
+            uint32_t       cur = dir->ranges[dir->first].start;
+            const uint32_t to = dir->ranges[dir->last].end;
+            while (cur != to) {
+                const uint32_t from = cur & (dir->bufSize - 1);
+                const uint32_t pos = cur & (size - 1);
+                uint32_t       n = to - cur;
+                n = MIN(n, dir->bufSize - from);
+                n = MIN(n, size - pos);
+                memcpy(buf + pos, dir->buf + from, n);
+                cur += n;
+            }
+        }
+        free(dir->buf);
+        *bytes += size - dir->bufSize;
+        dir->buf = buf;
+        dir->bufSize = size;
+    }
+
+    // Fill the gaps between the ranges we already have, first copy wins.  Most
+    // segments land past everything held, which doesn't need a search.
+    uint32_t i = 0;
+    if (dir->num && MOLOCH_SEQ_LT(seq, dir->ranges[dir->last].end))
+        i = moloch_tcp_dir_after(dir, seq);
+    uint32_t cur = seq;
+    while (MOLOCH_SEQ_LT(cur, end)) {
+        if (i && !MOLOCH_SEQ_LT(cur, dir->ranges[i].start)) {
+            cur = dir->ranges[i].end;
+            i = moloch_tcp_dir_after(dir, cur);
+            continue;
+        }
+
+        uint32_t pieceEnd = end;
+        if (i && MOLOCH_SEQ_LT(dir->ranges[i].start, end))
+            pieceEnd = dir->ranges[i].start;
+
+        moloch_tcp_dir_copy(dir, cur, data + (cur - seq), pieceEnd - cur);
+
+        // Nothing ends after cur means the last range is the one before it
+        const uint32_t prev = i ? moloch_tcp_dir_before(dir, cur) : dir->last;
+        if (prev && dir->ranges[prev].end == cur && dir->ranges[prev].ack == ack)
+            dir->ranges[prev].end = pieceEnd;
+        else
+            moloch_tcp_dir_insert(dir, cur, pieceEnd, ack);
+        cur = pieceEnd;
+    }
+    return 1;
+}
+/******************************************************************************/
+/* Give back the ring and nodes, the direction starts over empty */
+LOCAL void moloch_tcp_dir_free(MolochTcpDir_t *dir, uint64_t *bytes)
+{
+    *bytes -= dir->bufSize;
+    free(dir->buf);
+    free(dir->ranges);
+    memset(dir, 0, sizeof(*dir));
+}
+#endif
@@ -207,6 +207,8 @@ LOCAL void *writer_disk_output_thread(void *UNUSED(arg))
     if (config.debug)
         LOG("THREAD %p", (gpointer)pthread_self());
 
+    moloch_thread_pin("writer", 0);
+
     MolochDiskOutput_t *out;
     int outputFd = 0;
 
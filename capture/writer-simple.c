@@ -65,8 +65,14 @@ LOCAL  MOLOCH_COND_DEFINE(simpleQ);
 
 enum MolochSimpleMode { MOLOCH_SIMPLE_NORMAL, MOLOCH_SIMPLE_XOR2048, MOLOCH_SIMPLE_AES256CTR};
 
-LOCAL MolochSimple_t        *currentInfo[MOLOCH_MAX_PACKET_THREADS];
-LOCAL MolochSimpleHead_t     freeList[MOLOCH_MAX_PACKET_THREADS];
+// Per packet thread, one cache line apart
+typedef struct {
+    MolochSimple_t          *currentInfo;
+    MolochSimpleHead_t       freeList;
+    struct timeval           lastSave;
+} __attribute__((aligned(MOLOCH_CACHE_LINE))) MolochSimpleThread_t;
+
+LOCAL MolochSimpleThread_t  *simpleThreads;
 LOCAL uint32_t               pageSize;
 LOCAL enum MolochSimpleMode  simpleMode;
 LOCAL char                  *simpleKEKId;
@@ -75,7 +81,6 @@ LOCAL int                    simpleKEKLen;
 LOCAL uint8_t                simpleIV[EVP_MAX_IV_LENGTH];
 LOCAL const EVP_CIPHER      *cipher;
 LOCAL int                    openOptions;
-LOCAL struct timeval         lastSave[MOLOCH_MAX_PACKET_THREADS];
 
 /******************************************************************************/
 LOCAL uint32_t writer_simple_queue_length()
@@ -87,16 +92,13 @@ LOCAL MolochSimple_t *writer_simple_alloc(int thread, MolochSimple_t *previous)
 {
     MolochSimple_t *info;
 
-    MOLOCH_LOCK(freeList[thread].lock);
-    DLL_POP_HEAD(simple_, &freeList[thread], info);
-    MOLOCH_UNLOCK(freeList[thread].lock);
+    MOLOCH_LOCK(simpleThreads[thread].freeList.lock);
+    DLL_POP_HEAD(simple_, &simpleThreads[thread].freeList, info);
+    MOLOCH_UNLOCK(simpleThreads[thread].freeList.lock);
 
     if (!info) {
         info = MOLOCH_TYPE_ALLOC0(MolochSimple_t);
-        info->buf = mmap (0, config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-        if (unlikely(info->buf == MAP_FAILED)) {
-            LOGEXIT("ERROR - MMap failure in writer_simple_alloc, %d: %s", errno, strerror(errno));
-        }
+        info->buf = moloch_numa_alloc(config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN, moloch_thread_node("packet", thread));
         info->thread = thread;
     } else {
         info->bufpos = 0;
@@ -138,12 +140,12 @@ LOCAL void writer_simple_free(MolochSimple_t *info)
     }
     info->file = 0;
 
-    if (DLL_COUNT(simple_, &freeList[thread]) < 16) {
-        MOLOCH_LOCK(freeList[thread].lock);
-        DLL_PUSH_TAIL(simple_, &freeList[thread], info);
-        MOLOCH_UNLOCK(freeList[thread].lock);
+    if (DLL_COUNT(simple_, &simpleThreads[thread].freeList) < 16) {
+        MOLOCH_LOCK(simpleThreads[thread].freeList.lock);
+        DLL_PUSH_TAIL(simple_, &simpleThreads[thread].freeList, info);
+        MOLOCH_UNLOCK(simpleThreads[thread].freeList.lock);
     } else {
-        munmap(info->buf, config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN);
+        moloch_numa_free(info->buf, config.pcapWriteSize + MOLOCH_PACKET_MAX_LEN);
         MOLOCH_TYPE_FREE(MolochSimple_t, info);
     }
 }
@@ -151,7 +153,7 @@ LOCAL void writer_simple_free(MolochSimple_t *info)
 /******************************************************************************/
 LOCAL void writer_simple_process_buf(int thread, int closing)
 {
-    MolochSimple_t *info = currentInfo[thread];
+    MolochSimple_t *info = simpleThreads[thread].currentInfo;
 
     info->closing = closing;
     if (!closing) {
@@ -159,19 +161,19 @@ LOCAL void writer_simple_process_buf(int thread, int closing)
         int writeSize = (info->bufpos/pageSize) * pageSize;
 
         // Create next buffer
-        currentInfo[thread] = writer_simple_alloc(thread, info);
+        simpleThreads[thread].currentInfo = writer_simple_alloc(thread, info);
 
         // Copy what we aren't going to write to next buffer
-        memcpy(currentInfo[thread]->buf, info->buf + writeSize, info->bufpos - writeSize);
-        currentInfo[thread]->bufpos = info->bufpos - writeSize;
+        memcpy(simpleThreads[thread].currentInfo->buf, info->buf + writeSize, info->bufpos - writeSize);
+        simpleThreads[thread].currentInfo->bufpos = info->bufpos - writeSize;
 
         // Set what we are going to write
         info->bufpos = writeSize;
     } else {
-        currentInfo[thread] = NULL;
+        simpleThreads[thread].currentInfo = NULL;
     }
     MOLOCH_LOCK(simpleQ);
-    gettimeofday(&lastSave[thread], NULL);
+    gettimeofday(&simpleThreads[thread].lastSave, NULL);
     DLL_PUSH_TAIL(simple_, &simpleQ, info);
     if ((DLL_COUNT(simple_, &simpleQ) % 100) == 0) {
         LOG("WARNING - Disk Q of %d is too large, check the Moloch FAQ about testing disk speed", DLL_COUNT(simple_, &simpleQ));
@@ -202,11 +204,11 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
 {
     int thread = session->thread;
 
-    if (!currentInfo[thread]) {
+    if (!simpleThreads[thread].currentInfo) {
         char  dekhex[1024];
         char *name = 0;
 
-        MolochSimple_t *info = currentInfo[thread] = writer_simple_alloc(thread, NULL);
+        MolochSimple_t *info = simpleThreads[thread].currentInfo = writer_simple_alloc(thread, NULL);
         switch(simpleMode) {
         case MOLOCH_SIMPLE_NORMAL:
             name = moloch_db_create_file(packet->ts.tv_sec, NULL, 0, 0, &info->file->id);
@@ -243,19 +245,19 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
             LOGEXIT("Unknown simpleMode %d", simpleMode);
         }
 
-        currentInfo[thread]->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-        if (currentInfo[thread]->file->fd < 0) {
+        simpleThreads[thread].currentInfo->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (simpleThreads[thread].currentInfo->file->fd < 0) {
             LOGEXIT("ERROR - pcap open failed - Couldn't open file: '%s' with %s  (%d)", name, strerror(errno), errno);
         }
-        info->file->pos = currentInfo[thread]->bufpos = 24;
+        info->file->pos = simpleThreads[thread].currentInfo->bufpos = 24;
         memcpy(info->buf, &pcapFileHeader, 24);
         if (config.debug)
             LOG("opened %d %s %d", thread, name, info->file->fd);
         g_free(name);
     }
 
-    packet->writerFileNum = currentInfo[thread]->file->id;
-    packet->writerFilePos = currentInfo[thread]->file->pos;
+    packet->writerFileNum = simpleThreads[thread].currentInfo->file->id;
+    packet->writerFilePos = simpleThreads[thread].currentInfo->file->pos;
 
     struct moloch_pcap_sf_pkthdr hdr;
 
@@ -264,15 +266,15 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
     hdr.caplen     = packet->pktlen;
     hdr.pktlen     = packet->pktlen;
 
-    memcpy(currentInfo[thread]->buf+currentInfo[thread]->bufpos, &hdr, 16);
-    currentInfo[thread]->bufpos += 16;
-    memcpy(currentInfo[thread]->buf+currentInfo[thread]->bufpos, packet->pkt, packet->pktlen);
-    currentInfo[thread]->bufpos += packet->pktlen;
-    currentInfo[thread]->file->pos += 16 + packet->pktlen;
+    memcpy(simpleThreads[thread].currentInfo->buf+simpleThreads[thread].currentInfo->bufpos, &hdr, 16);
+    simpleThreads[thread].currentInfo->bufpos += 16;
+    memcpy(simpleThreads[thread].currentInfo->buf+simpleThreads[thread].currentInfo->bufpos, packet->pkt, packet->pktlen);
+    simpleThreads[thread].currentInfo->bufpos += packet->pktlen;
+    simpleThreads[thread].currentInfo->file->pos += 16 + packet->pktlen;
 
-    if (currentInfo[thread]->bufpos > config.pcapWriteSize) {
+    if (simpleThreads[thread].currentInfo->bufpos > config.pcapWriteSize) {
         writer_simple_process_buf(thread, 0);
-    } else if (currentInfo[thread]->file->pos >= config.maxFileSizeB) {
+    } else if (simpleThreads[thread].currentInfo->file->pos >= config.maxFileSizeB) {
         writer_simple_process_buf(thread, 1);
     }
 }
@@ -284,6 +286,8 @@ LOCAL void *writer_simple_thread(void *UNUSED(arg))
     if (config.debug)
         LOG("THREAD %p", (gpointer)pthread_self());
 
+    moloch_thread_pin("writer", 0);
+
     while (1) {
         MOLOCH_LOCK(simpleQ);
         while (DLL_COUNT(simple_, &simpleQ) == 0) {
@@ -344,7 +348,7 @@ LOCAL void writer_simple_exit()
     int thread;
 
     for (thread = 0; thread < config.packetThreads; thread++) {
-        if (currentInfo[thread]) {
+        if (simpleThreads[thread].currentInfo) {
             writer_simple_process_buf(thread, 1);
         }
     }
@@ -362,13 +366,13 @@ LOCAL void writer_simple_check(MolochSession_t *session, void *UNUSED(uw1), void
     gettimeofday(&now, NULL);
 
     // No data or not enough bytes, reset the time
-    if (!currentInfo[session->thread] || currentInfo[session->thread]->bufpos < (uint32_t)pageSize) {
-        lastSave[session->thread] = now;
+    if (!simpleThreads[session->thread].currentInfo || simpleThreads[session->thread].currentInfo->bufpos < (uint32_t)pageSize) {
+        simpleThreads[session->thread].lastSave = now;
         return;
     }
 
     // Last add must be 10 seconds ago and have more then pageSize bytes
-    if (now.tv_sec - lastSave[session->thread].tv_sec < 10)
+    if (now.tv_sec - simpleThreads[session->thread].lastSave.tv_sec < 10)
         return;
 
     writer_simple_process_buf(session->thread, 0);
@@ -386,7 +390,7 @@ LOCAL gboolean writer_simple_check_gfunc (gpointer UNUSED(user_data))
     MOLOCH_LOCK(simpleQ);
     int thread;
     for (thread = 0; thread < config.packetThreads; thread++) {
-        if (now.tv_sec - lastSave[thread].tv_sec >= 10) {
+        if (now.tv_sec - simpleThreads[thread].lastSave.tv_sec >= 10) {
             moloch_session_add_cmd_thread(thread, NULL, NULL, writer_simple_check);
         }
     }
@@ -466,11 +470,13 @@ void writer_simple_init(char *name)
     struct timeval now;
     gettimeofday(&now, NULL);
 
+    simpleThreads = moloch_thread_array_alloc(sizeof(MolochSimpleThread_t));
+
     int thread;
     for (thread = 0; thread < config.packetThreads; thread++) {
-        lastSave[thread] = now;
-        DLL_INIT(simple_, &freeList[thread]);
-        MOLOCH_LOCK_INIT(freeList[thread].lock);
+        simpleThreads[thread].lastSave = now;
+        DLL_INIT(simple_, &simpleThreads[thread].freeList);
+        MOLOCH_LOCK_INIT(simpleThreads[thread].freeList.lock);
     }
 
     g_thread_new("moloch-simple", &writer_simple_thread, NULL);